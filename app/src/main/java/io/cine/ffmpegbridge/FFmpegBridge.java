@@ -10,6 +10,8 @@
 package io.cine.ffmpegbridge;
 
 import java.nio.ByteBuffer;
+import java.util.HashMap;
+import java.util.Map;
 
 import android.util.Log;
 
@@ -26,10 +28,10 @@ import android.util.Log;
  *
  * Methods of this class must be called in the following order:
  * 1. init
- * 2. setAudioCodecExtraData and setVideoCodecExtraData
+ * 2. setAudioCodecExtraData and setVideoCodecExtraData (and optionally probeBandwidth)
  * 3. writeHeader
  * 4. (repeat for each packet) writePacket
- * 5. finalize
+ * 5. finalizeSync (or finalizeAsync)
  */
 public class FFmpegBridge {
   static {
@@ -39,9 +41,200 @@ public class FFmpegBridge {
   public native void init(AVOptions jOpts);
   public native void setAudioCodecExtraData(byte[] jData, int jSize);
   public native void setVideoCodecExtraData(byte[] jData, int jSize);
-  public native void writeHeader();
-  public native void writePacket(ByteBuffer jData, int jSize, long jPts, int jIsVideo, int jIsVideoKeyframe);
-  public native void finalize();
+  public native int writeHeader();
+
+  /**
+   * Measures the connection for jDurationMs before anything is sent, with
+   * padding the server ignores, and fills in jResult, including a video bit
+   * rate to start the encoder at. The output is opened here and stays open
+   * for the stream. rtmp, and mpegts over tcp, only; returns a negative
+   * error code otherwise.
+   */
+  public native int probeBandwidth(int jDurationMs, ProbeResult jResult);
+
+  /**
+   * jData is only read (start codes are converted into a buffer of the
+   * bridge's own), so it can be a read-only MediaCodec output buffer.
+   * Returns one of the WRITE_* codes below; WRITE_DISCONNECTED once the
+   * session has been finalized. The stats getters leave jStats as it was
+   * then.
+   */
+  public native int writePacket(ByteBuffer jData, int jSize, long jPts, int jIsVideo, int jIsVideoKeyframe);
+  public native void getLatencyStats(LatencyStats jStats);
+  public native void getNalFilterStats(NalFilterStats jStats);
+  public native void getTimestampStats(TimestampStats jStats);
+  public native void getSegmentStats(SegmentStats jStats);
+  public native void getHlsStats(HlsStats jStats);
+
+  /**
+   * Saves the last AVOptions.dvrMs of the session to jPath (.mp4 or .flv)
+   * on a background thread, without holding up the live output. Returns 0
+   * once the save has started, or a negative error code (e.g. if an earlier
+   * save is still running); it's done when DvrStats.saving goes false.
+   */
+  public native int saveDvr(String jPath);
+  public native void getDvrStats(DvrStats jStats);
+  public native void getSendStats(SendStats jStats);
+  public native void getFailoverStats(FailoverStats jStats);
+  public native void getKeyframeStats(KeyframeStats jStats);
+
+  /**
+   * Receives in-memory HLS segments (see AVOptions.hlsListSize), on the
+   * thread calling writePacket or finalizeSync (for the last segment, on
+   * finalizeAsync's thread). data is a direct buffer over
+   * native memory that stays valid until the segment drops out of the
+   * playlist, hlsListSize segments later; copy it to keep it longer. In
+   * CMAF mode the init segment comes first, with index -1.
+   */
+  public interface HlsListener {
+    void onHlsSegment(int index, String name, long durationUs, ByteBuffer data, String playlist);
+  }
+
+  private HlsListener hlsListener;
+
+  public void setHlsListener(HlsListener listener) {
+    hlsListener = listener;
+  }
+
+  // called from the native side
+  private void onHlsSegment(int index, String name, long durationUs, ByteBuffer data, String playlist) {
+    if (hlsListener != null) {
+      hlsListener.onHlsSegment(index, name, durationUs, data, playlist);
+    }
+  }
+
+  /**
+   * Asked by the bridge for a keyframe whenever it would otherwise have to
+   * wait for the encoder's next scheduled one; reason is one of the
+   * KEYFRAME_FOR_* codes below. Called on a thread of the bridge's own,
+   * soon after writePacket returns (which never waits for it), and at most
+   * once every AVOptions.keyframeRequestMs. With MediaCodec, pass it on as
+   * PARAMETER_KEY_REQUEST_SYNC_FRAME through setParameters; see
+   * KeyframeStats.
+   */
+  public interface KeyframeListener {
+    void onKeyframeRequest(int reason);
+  }
+
+  private KeyframeListener keyframeListener;
+
+  public void setKeyframeListener(KeyframeListener listener) {
+    keyframeListener = listener;
+  }
+
+  // called from the native side
+  private void onKeyframeRequest(int reason) {
+    if (keyframeListener != null) {
+      keyframeListener.onKeyframeRequest(reason);
+    }
+  }
+
+  // why a keyframe was asked for: START when autoConfig is waiting for an
+  // IDR to write the header with, BACKPRESSURE when video was turned away
+  // with WRITE_WOULD_BLOCK and there's room again, FAILOVER while the
+  // ingest is down and the next one needs a keyframe to start with (or
+  // none can be reached, and the next keyframe tries them again)
+  public static final int KEYFRAME_FOR_START = 1;
+  public static final int KEYFRAME_FOR_BACKPRESSURE = 2;
+  public static final int KEYFRAME_FOR_FAILOVER = 3;
+
+  // what writePacket (and writeHeader) did with it: OK when it's muxed and
+  // out to the sink, QUEUED when it's muxed and waiting for the shared I/O
+  // threads (or for the first IDR, for the header). WOULD_BLOCK when it
+  // was turned away because the output is backed up (see
+  // AVOptions.writeQueueMs), DROPPED when it couldn't be used (e.g. before
+  // the header), and DISCONNECTED when the output has failed, and so will
+  // every packet after it (unless a backup url takes over). A producer can
+  // skip encoding or lower the bit rate on the spot; keyframes are asked
+  // for through the KeyframeListener.
+  public static final int WRITE_OK = 0;
+  public static final int WRITE_QUEUED = 1;
+  public static final int WRITE_WOULD_BLOCK = 2;
+  public static final int WRITE_DROPPED = 3;
+  public static final int WRITE_DISCONNECTED = 4;
+
+  // AVOptions.nalFilter flags, see NalFilterStats
+  public static final int NAL_FILTER_FILLER = 0x01;
+  public static final int NAL_FILTER_AUD = 0x02;
+  public static final int NAL_FILTER_SEI = 0x04;
+  public static final int NAL_FILTER_PARAM_SETS = 0x08;
+  public static final int NAL_FILTER_ALL = 0x0f;
+
+  /**
+   * Turns trace sections (init, avio_open, header, each packet stage and the
+   * trailer) on or off. They show up in systrace/Perfetto, and additionally
+   * in a Chrome trace JSON file if jJsonPath is non-null. Only has an effect
+   * if the native library was built with FFMPBR_TRACE=1.
+   */
+  public native void setTracing(boolean jEnabled, String jJsonPath);
+
+  /**
+   * Process-wide: sessions initialized after this call hand their output to
+   * a pool of jNumThreads shared event loop threads, instead of writing it
+   * on the thread that calls writePacket. 0 (the default) writes inline.
+   * Only tcp, udp and file outputs share the pool; an RTMP session gets an
+   * IO thread of its own, as its writes block.
+   */
+  public static native void setSharedIoThreads(int jNumThreads);
+
+  /**
+   * Process-wide: when a session publishing over RTMP ends cleanly, its
+   * connection is kept open for jGraceMs, and a session initialized in that
+   * time with the same outputUrl starts on it, skipping the DNS lookup and
+   * the TCP and RTMP handshakes. 0 (the default) closes connections as
+   * sessions end, and any kept ones right away.
+   */
+  public static native void setConnectionPoolGrace(int jGraceMs);
+  public static native void getConnectionPoolStats(ConnectionPoolStats jStats);
+
+  /**
+   * Writes out the trailer, closes the output and frees the session, on
+   * this thread. Returns 0, or the negative error code the output failed
+   * with; -22 (EINVAL) if there's no session, because it was never
+   * initialized or has already been finalized. Calls under way on other
+   * threads (e.g. a writePacket) are waited for first; called from inside
+   * one of them, such as onHlsSegment, it does nothing and returns -35
+   * (EDEADLK). Not named finalize(), which the garbage collector would call
+   * as well.
+   */
+  public native int finalizeSync();
+
+  /**
+   * finalizeSync() without holding up the calling thread (e.g. the UI thread
+   * in onDestroy) while the output drains: the trailer is written and
+   * everything closed on a background thread, and the FinalizeListener is
+   * told once it's done. Queued output gets jDeadlineMs to reach the
+   * server; with jCutOff, whatever is left then is dropped, otherwise
+   * finalizing carries on past the deadline. Nothing else may be called on
+   * this session afterwards, but a new one can be started straight away.
+   * Returns 0, or a negative error code if the background thread couldn't
+   * be started, in which case it all happened on this thread instead; -22
+   * (EINVAL) or -35 (EDEADLK), with nothing done, as for finalizeSync().
+   */
+  public native int finalizeAsync(int jDeadlineMs, boolean jCutOff);
+
+  /**
+   * Told when finalizeAsync is done, on its background thread. status is
+   * 0, or the negative error code the output failed with; cutOff is true
+   * if the deadline cut the output short, with unsentBytes of it never
+   * sent. durationUs is the time from the finalizeAsync call.
+   */
+  public interface FinalizeListener {
+    void onFinalized(int status, boolean cutOff, long unsentBytes, long durationUs);
+  }
+
+  private FinalizeListener finalizeListener;
+
+  public void setFinalizeListener(FinalizeListener listener) {
+    finalizeListener = listener;
+  }
+
+  // called from the native side
+  private void onFinalized(int status, boolean cutOff, long unsentBytes, long durationUs) {
+    if (finalizeListener != null) {
+      finalizeListener.onFinalized(status, cutOff, unsentBytes, durationUs);
+    }
+  }
 
   /**
    * Used to configure the muxer's options. Note the name of this class's
@@ -51,13 +244,360 @@ public class FFmpegBridge {
     public String outputFormatName = "flv";
     public String outputUrl = "test.flv";
 
+    // if set, every call into the bridge is recorded to this file, which can
+    // be replayed with the ffmpbr_replay tool (see jni/tools)
+    public String captureFile = null;
+
+    // if set, extradata, video dimensions and keyframe flags are taken from
+    // the packets themselves, so setAudio/VideoCodecExtraData and
+    // writeHeader become optional; pass MediaCodec's codec config buffers
+    // to writePacket like any other. Packets before the first IDR are
+    // dropped, and the header is written just ahead of it. H.264 only;
+    // ignored (with an error logged) for any other videoCodec.
+    public boolean autoConfig = false;
+
+    // NAL_FILTER_* flags for the H.264 units to strip before muxing
+    public int nalFilter = 0;
+
+    // "h264" or "hevc". HEVC into flv (files and rtmp) is packaged as
+    // Enhanced RTMP, which the ingest server has to support; autoConfig
+    // and nalFilter only apply to H.264.
+    public String videoCodec = "h264";
+
     public int videoHeight = 1280;
     public int videoWidth = 720;
     public int videoFps = 30;
     public int videoBitRate = 1500000;
 
+    // how many frames the encoder may reorder, i.e. the most consecutive
+    // B-frames it emits; 0 if B-frames are off. Decode timestamps are
+    // derived from the pts using this.
+    public int videoReorderDepth = 0;
+
+    // if set, both streams are rebased to start at 0 together, kept
+    // monotonic, and the video is de-jittered and slowly slewed to follow
+    // the audio when the two device clocks drift; see TimestampStats
+    public boolean normalizeTimestamps = false;
+
+    // for mp4 outputs: if > 0, the file is written as fragments (cut at
+    // every keyframe, and at least this often) instead of with a single
+    // index at the end, which keeps memory flat over long recordings,
+    // makes finalizing quick, and leaves a playable file if the app dies
+    public int mp4FragmentMs = 0;
+
+    // if > 0, a local recording is split into files of about this many ms,
+    // each starting at a keyframe, for uploading as they complete.
+    // outputUrl is then a pattern: "rec-%03d.mp4", or "rec.mp4" for
+    // rec-000.mp4, rec-001.mp4, ...; see SegmentStats
+    public int segmentMs = 0;
+
+    // with an outputUrl of "mem:<segment name pattern>" (e.g. "mem:seg-%d.ts")
+    // and outputFormatName "mpegts" or "mp4" (CMAF), the segmentMs segments
+    // are kept in memory instead and handed to the HlsListener, along with
+    // a live playlist of the last hlsListSize of them; see HlsStats
+    public int hlsListSize = 6;
+
+    // if > 0, about the last this many ms of packets are kept in memory
+    // alongside the live output, for saveDvr; memory use is fixed up front
+    // at twice that at the configured bit rates, see DvrStats
+    public int dvrMs = 0;
+
+    // options for the output's protocol and muxer, as given to the ffmpeg
+    // command line, e.g. "rw_timeout" or "movflags"; ones neither knows
+    // are logged
+    public Map<String, String> outputOptions = new HashMap<String, String>();
+
+    // transport tuning for rtmp and tcp outputs, 0 (-1 for tcpNoDelay) to
+    // leave the defaults. rtmpChunkSize is the outgoing chunk size (128 to
+    // 65536, default 128); bigger chunks mean fewer chunk headers on the
+    // wire. tcpNoDelay is 1 to disable Nagle, 0 to enable it (librtmp
+    // disables it by default). sendBufferSize is SO_SNDBUF, notSentLowat
+    // TCP_NOTSENT_LOWAT, in bytes.
+    public int rtmpChunkSize = 0;
+    public int tcpNoDelay = -1;
+    public int sendBufferSize = 0;
+    public int notSentLowat = 0;
+
+    // udp outputs (mpegts to a udp:// url) go out in 1316 byte datagrams
+    // of seven TS packets, and take sendBufferSize. udpDuplicateTables
+    // sends every PAT and PMT packet twice, in consecutive datagrams, so
+    // that losing one doesn't lose the tables; see SendStats
+    public boolean udpDuplicateTables = false;
+
+    // if > 0, the output is sent at no more than this percentage of
+    // videoBitRate + audioBitRate, with up to pacingBurstMs worth going out
+    // at once, so that keyframes are spread over time instead of flooding
+    // the link. Audio waits behind a keyframe being paced, so leave some
+    // headroom (150-200); see SendStats
+    public int pacingPercent = 0;
+    public int pacingBurstMs = 50;
+
+    // if > 0, writePacket never waits for the network: the output goes out
+    // on an I/O thread (see setSharedIoThreads; one is started if there
+    // are none), and while more than writeQueueMs worth of it is waiting,
+    // packets are turned away with WRITE_WOULD_BLOCK. After a video packet
+    // is, so is the rest of its GOP, until a keyframe gets through. With
+    // pacing, leave room for a keyframe being paced out
+    public int writeQueueMs = 0;
+
+    // the least time between two KeyframeListener requests; ones in between
+    // are only counted (see KeyframeStats), so that a long outage doesn't
+    // turn the stream into nothing but keyframes
+    public int keyframeRequestMs = 1000;
+
+    // if fileBlockKb > 0, a local file outputUrl (and every segment) is
+    // written from a thread of its own in blocks of that size, so that a
+    // slow flash write doesn't hold up writePacket; up to 8 blocks are
+    // buffered. filePreallocateMb reserves space that much at a time ahead
+    // of the writes, and fileSyncMs syncs the file to storage that often
+    // (0 for either to leave it to the system); see SendStats
+    public int fileBlockKb = 0;
+    public int filePreallocateMb = 64;
+    public int fileSyncMs = 2000;
+
+    // ingest urls to fall back on, in order, if outputUrl fails mid-stream:
+    // the bridge reconnects to the next one that works (with the same
+    // outputOptions and transport settings) and sends the header and the
+    // current GOP again, so the encoder keeps running. It reconnects on a
+    // thread of its own, so writePacket isn't held up; packets are dropped
+    // until it's done (and, if the GOP was too long to keep, until the next
+    // keyframe, which is asked for). If none can be reached, the urls are
+    // tried again at every keyframe. Live outputs only, not with segmentMs;
+    // see FailoverStats
+    public String[] backupUrls = new String[0];
+
     public int audioSampleRate = 44100;
     public int audioNumChannels = 1;
     public int audioBitRate = 128000;
   }
+
+  /**
+   * Capture-to-send latency of the packets written so far, filled in by
+   * getLatencyStats. Percentiles cover the most recent packets and measure
+   * the time from writePacket until the muxed bytes were handed to the
+   * socket. currentLagUs is the send time minus the packet's pts, which is
+   * only meaningful when pts comes from System.nanoTime() / 1000 (as it does
+   * for MediaCodec surface input).
+   */
+  static public class LatencyStats {
+    public long sentPackets;
+    public long droppedStamps;
+
+    public long p50Us;
+    public long p90Us;
+    public long p99Us;
+    public long maxUs;
+
+    public long currentLagUs;
+  }
+
+  /**
+   * What the NAL filter (AVOptions.nalFilter) has removed so far, filled in
+   * by getNalFilterStats. Filler and SEI are stripped for any format. Only
+   * SEI that players ignore is stripped: buffering period, picture timing
+   * and encoder version strings. AUDs and in-band SPS/PPS that repeat the
+   * extradata are only stripped for formats that carry the SPS/PPS out of
+   * band (flv, mp4, mkv).
+   */
+  static public class NalFilterStats {
+    public long videoBytes;
+    public long savedBytes;
+
+    public long fillerUnits;
+    public long audUnits;
+    public long seiUnits;
+    public long paramSetUnits;
+  }
+
+  /**
+   * What timestamp normalization (AVOptions.normalizeTimestamps) has done
+   * so far, filled in by getTimestampStats. driftUs is how far the video
+   * clock has drifted from the audio clock since the start (positive when
+   * the video clock runs fast), and correctionUs what is currently added to
+   * the video timestamps to cancel it; the correction follows the drift at
+   * no more than 2ms per second. videoJitterUs is the average adjustment
+   * made to smooth the video frame cadence, and resyncs counts the gaps
+   * too large to smooth over.
+   */
+  static public class TimestampStats {
+    public long driftUs;
+    public long correctionUs;
+    public long videoJitterUs;
+
+    public long monotonicFixes;
+    public long resyncs;
+  }
+
+  /**
+   * Segmented recording (AVOptions.segmentMs) so far, filled in by
+   * getSegmentStats. Segments are numbered from 0, and the first
+   * closedSegments of them are complete. The next segment is opened ahead
+   * of time on a background thread; lateRotations counts the times it
+   * wasn't ready yet, and the segment being recorded ran on to the next
+   * keyframe. rotation* is the time writePacket spent switching segments.
+   */
+  static public class SegmentStats {
+    public long segments;
+    public long closedSegments;
+    public long lateRotations;
+
+    public long rotationP50Us;
+    public long rotationP90Us;
+    public long rotationMaxUs;
+
+    public long maxOpenUs;
+    public long maxCloseUs;
+  }
+
+  /**
+   * In-memory HLS output (AVOptions.hlsListSize) so far, filled in by
+   * getHlsStats. bufferedBytes is the native memory held for segment
+   * buffers, which are reused once their segment leaves the playlist.
+   */
+  static public class HlsStats {
+    public long segments;
+    public long bytes;
+    public long maxSegmentBytes;
+
+    public long bufferedBytes;
+    public long maxBufferedBytes;
+  }
+
+  /**
+   * The instant replay buffer (AVOptions.dvrMs), filled in by getDvrStats.
+   * earlyDrops counts packets dropped before they were dvrMs old, which
+   * happens when the encoder runs well over the configured bit rates, and
+   * pinnedDrops ones that weren't kept because a long save was still
+   * holding on to the buffer. lastSave* describe the last completed save.
+   */
+  static public class DvrStats {
+    public long slabBytes;
+    public long bufferedBytes;
+    public long bufferedUs;
+
+    public long earlyDrops;
+    public long pinnedDrops;
+
+    public long saves;
+    public long failedSaves;
+    public boolean saving;
+
+    public long lastSaveMediaUs;
+    public long lastSaveBytes;
+    public long lastSaveUs;
+  }
+
+  /**
+   * How smoothly the output is going out, filled in by getSendStats. The
+   * send rate is measured over 100 ms windows, in bits per second. With
+   * pacing on, pacedWaits counts the times sending waited for the bucket,
+   * and maxBacklogBytes the most output that was queued when it did.
+   * retransmits (tcp and rtmp only) is the kernel's count of retransmitted
+   * segments on the connection. For udp, datagrams counts the datagrams
+   * sent, duplicateTables the PAT and PMT packets sent twice, and
+   * refusedDatagrams the ones the receiver's host turned away because
+   * nothing was listening. For files written in blocks (fileBlockKb),
+   * fileStalls counts the writes that waited for a block to come free, and
+   * the max times are the longest wait, block write and sync.
+   */
+  static public class SendStats {
+    public long bytes;
+    public long rateMean;
+    public long ratePeak;
+    public long rateStddev;
+
+    public long pacedWaits;
+    public long maxBacklogBytes;
+
+    public long retransmits;
+
+    public long datagrams;
+    public long duplicateTables;
+    public long refusedDatagrams;
+
+    public long fileBlocks;
+    public long filePreallocatedBytes;
+    public long fileStalls;
+    public long fileMaxStallUs;
+    public long fileMaxWriteUs;
+    public long fileSyncs;
+    public long fileMaxSyncUs;
+  }
+
+  /**
+   * What probeBandwidth measured. throughput is the acknowledged rate in
+   * bits per second, over the second half of the probe; capped means the
+   * probe's own cap (twice the configured bit rates) was what limited it,
+   * so the link may well be faster. recommendedBitRate is the video bit
+   * rate to start at: about 3/4 of the throughput less the audio, at most
+   * the configured video bit rate.
+   */
+  static public class ProbeResult {
+    public long bytesSent;
+    public long durationUs;
+
+    public long throughput;
+    public boolean capped;
+    public long rttUs;
+    public long rttVarUs;
+
+    public long recommendedBitRate;
+  }
+
+  /**
+   * Ingest failover (AVOptions.backupUrls), filled in by getFailoverStats.
+   * ingestIndex is the url in use: 0 for outputUrl, then the backups in
+   * order. down is true while none could be reached. lastFailureUs is when
+   * the last failure was noticed (System.nanoTime() / 1000), and
+   * lastFailoverUs how long it then took to get the header and the current
+   * GOP out on the next ingest.
+   */
+  static public class FailoverStats {
+    public int ingestIndex;
+    public boolean down;
+    public long droppedPackets;
+
+    public long failovers;
+    public long failedAttempts;
+    public long replayedPackets;
+
+    public long lastFailureUs;
+    public long lastFailoverUs;
+    public long maxFailoverUs;
+  }
+
+  /**
+   * Keyframe requests (KeyframeListener), filled in by getKeyframeStats.
+   * suppressed counts the ones held back for coming within
+   * AVOptions.keyframeRequestMs of the last. lastWaitUs is how long it took
+   * from the first request to a keyframe coming in, the last time.
+   */
+  static public class KeyframeStats {
+    public long requests;
+    public long suppressed;
+
+    public long lastWaitUs;
+    public long maxWaitUs;
+  }
+
+  /**
+   * The RTMP connection pool (setConnectionPoolGrace), filled in by
+   * getConnectionPoolStats. idle is the connections kept right now. kept
+   * and reused count sessions that left their connection behind and that
+   * started on one; missed, sessions that found none for their url. Kept
+   * connections end up expired (the grace period ran out), evicted (the
+   * pool was full) or failed (the server hung up, or wouldn't take the new
+   * stream).
+   */
+  static public class ConnectionPoolStats {
+    public int idle;
+
+    public long kept;
+    public long reused;
+    public long missed;
+
+    public long expired;
+    public long evicted;
+    public long failed;
+  }
 }
@@ -9,10 +9,85 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE := ffmpegbridge
-LOCAL_SRC_FILES := ffmpegbridge.c ffmpegbridge_context.c logdump.c
+LOCAL_SRC_FILES := ffmpegbridge.c ffmpegbridge_adts.c ffmpegbridge_capture.c ffmpegbridge_context.c ffmpegbridge_dispatch.c ffmpegbridge_dvr.c ffmpegbridge_file.c \
+  ffmpegbridge_flv.c ffmpegbridge_gop.c ffmpegbridge_hls.c ffmpegbridge_io.c ffmpegbridge_latency.c ffmpegbridge_loop.c ffmpegbridge_nal.c \
+  ffmpegbridge_pacer.c ffmpegbridge_pool.c ffmpegbridge_probe.c ffmpegbridge_reconnect.c ffmpegbridge_rtmp.c ffmpegbridge_segment.c ffmpegbridge_timestamp.c ffmpegbridge_trace.c ffmpegbridge_udp.c logdump.c
 LOCAL_CFLAGS := -I$(LOCAL_PATH)/include -I$(LOCAL_PATH)/../prebuilt/include
 LOCAL_LDLIBS += -llog
 LOCAL_LDLIBS += -L$(LOCAL_PATH)/../prebuilt/lib
 LOCAL_LDLIBS += -lcrypto -lssl -lrtmp-1 -lavcodec-55 -lavdevice-55 -lavfilter-4 -lavformat-55 -lavutil-52 -lswresample-0 -lswscale-2
 
+# ndk-build FFMPBR_TRACE=1 to compile in the systrace / JSON trace sections
+ifeq ($(FFMPBR_TRACE),1)
+LOCAL_CFLAGS += -DFFMPBR_ENABLE_TRACE
+LOCAL_LDLIBS += -ldl
+endif
+
+# the NEON start code scanner; armv7 devices are checked for NEON at runtime
+ifneq ($(filter armeabi-v7a arm64-v8a,$(TARGET_ARCH_ABI)),)
+LOCAL_CFLAGS += -DFFMPBR_HAVE_NEON
+LOCAL_SRC_FILES += ffmpegbridge_nal_neon.c.neon
+LOCAL_STATIC_LIBRARIES += cpufeatures
+endif
+
 include $(BUILD_SHARED_LIBRARY)
+
+# ndk-build FFMPBR_TOOLS=1 to also build the command line tools in tools/,
+# which are run on a device through adb shell
+ifeq ($(FFMPBR_TOOLS),1)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := ffmpbr_replay
+LOCAL_SRC_FILES := tools/ffmpbr_replay.c
+LOCAL_CFLAGS := -I$(LOCAL_PATH)/include -I$(LOCAL_PATH)/../prebuilt/include
+LOCAL_SHARED_LIBRARIES := ffmpegbridge
+LOCAL_LDLIBS += -L$(LOCAL_PATH)/../prebuilt/lib -lavcodec-55 -lavformat-55 -lavutil-52
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := ffmpbr_loadgen
+LOCAL_SRC_FILES := tools/ffmpbr_loadgen.c
+LOCAL_CFLAGS := -I$(LOCAL_PATH)/include -I$(LOCAL_PATH)/../prebuilt/include
+LOCAL_SHARED_LIBRARIES := ffmpegbridge
+LOCAL_LDLIBS += -L$(LOCAL_PATH)/../prebuilt/lib -lavcodec-55 -lavformat-55 -lavutil-52
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := ffmpbr_bench
+LOCAL_SRC_FILES := tools/ffmpbr_bench.c
+LOCAL_CFLAGS := -I$(LOCAL_PATH)/include -I$(LOCAL_PATH)/../prebuilt/include
+ifneq ($(filter armeabi-v7a arm64-v8a,$(TARGET_ARCH_ABI)),)
+LOCAL_CFLAGS += -DFFMPBR_HAVE_NEON
+endif
+LOCAL_SHARED_LIBRARIES := ffmpegbridge
+LOCAL_LDLIBS += -L$(LOCAL_PATH)/../prebuilt/lib -lavcodec-55 -lavformat-55 -lavutil-52
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := ffmpbr_stalltest
+LOCAL_SRC_FILES := tools/ffmpbr_stalltest.c
+LOCAL_CFLAGS := -I$(LOCAL_PATH)/include -I$(LOCAL_PATH)/../prebuilt/include
+LOCAL_SHARED_LIBRARIES := ffmpegbridge
+LOCAL_LDLIBS += -L$(LOCAL_PATH)/../prebuilt/lib -lavcodec-55 -lavformat-55 -lavutil-52
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := ffmpbr_tssim
+LOCAL_SRC_FILES := tools/ffmpbr_tssim.c
+LOCAL_CFLAGS := -I$(LOCAL_PATH)/include -I$(LOCAL_PATH)/../prebuilt/include
+LOCAL_SHARED_LIBRARIES := ffmpegbridge
+
+include $(BUILD_EXECUTABLE)
+
+endif
+
+$(call import-module,android/cpufeatures)
@@ -5,14 +5,261 @@
 // Copyright (c) 2014, cine.io. All rights reserved.
 //
 
+#include <errno.h>
 #include <jni.h>
+#include <pthread.h>
+#include <stdint.h>
 #include "ffmpegbridge.h"
 #include "ffmpegbridge_log.h"
 #include "ffmpegbridge_context.h"
+#include "ffmpegbridge_pool.h"
+#include "ffmpegbridge_trace.h"
 
 
-// our context object
+// our context object. The calls below all use it from whichever thread
+// the app makes them on, while finalize* hands it over to be freed: each
+// call takes a reference on the session for as long as it uses it, and
+// finalize* takes the session away from new calls, then waits for the
+// references to be given back. thread_calls counts the references the
+// calling thread holds, as finalizing from inside another call (e.g. from
+// onHlsSegment, during writePacket) would wait for itself.
 FFmpegBridgeContext* br_ctx;
+static pthread_mutex_t br_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t br_ctx_idle = PTHREAD_COND_INITIALIZER;
+static int br_ctx_users = 0;
+static pthread_once_t thread_calls_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_calls;
+
+// for calling back into the FFmpegBridge object: a global reference per
+// session, which its callbacks get as their opaque. jBridge is the current
+// session's, only ever touched on the thread calling init and finalize*.
+JavaVM *jvm;
+jobject jBridge;
+jmethodID jOnHlsSegmentId;
+jmethodID jOnKeyframeRequestId;
+jmethodID jOnFinalizedId;
+
+
+//
+// helper functions
+//
+
+void _create_thread_calls(void) {
+  pthread_key_create(&thread_calls, NULL);
+}
+
+int _get_thread_calls(void) {
+  pthread_once(&thread_calls_once, _create_thread_calls);
+  return (int)(intptr_t)pthread_getspecific(thread_calls);
+}
+
+// the current session, with a reference taken for the caller to give back
+// with _release_session(), or NULL if there isn't one
+FFmpegBridgeContext* _acquire_session(void) {
+  FFmpegBridgeContext *session;
+
+  pthread_mutex_lock(&br_ctx_lock);
+  session = br_ctx;
+  if (session) br_ctx_users++;
+  pthread_mutex_unlock(&br_ctx_lock);
+
+  if (session) pthread_setspecific(thread_calls, (void *)(intptr_t)(_get_thread_calls() + 1));
+  return session;
+}
+
+void _release_session(void) {
+  pthread_setspecific(thread_calls, (void *)(intptr_t)(_get_thread_calls() - 1));
+
+  pthread_mutex_lock(&br_ctx_lock);
+  if (--br_ctx_users == 0) pthread_cond_broadcast(&br_ctx_idle);
+  pthread_mutex_unlock(&br_ctx_lock);
+}
+
+// makes session the current one, once it's set up
+void _publish_session(FFmpegBridgeContext *session) {
+  pthread_mutex_lock(&br_ctx_lock);
+  br_ctx = session;
+  pthread_mutex_unlock(&br_ctx_lock);
+}
+
+// takes the current session away from the calls above for finalize*,
+// waiting for the ones under way to return. AVERROR(EINVAL) if there's no
+// session, or AVERROR(EDEADLK), with nothing taken, if the calling thread
+// is inside one of those calls itself.
+int _take_session(const char *caller, FFmpegBridgeContext **session) {
+  if (_get_thread_calls()) {
+    LOGE("ERROR: %s -- can't finalize from inside another bridge call (e.g. onHlsSegment)",
+      caller);
+    return AVERROR(EDEADLK);
+  }
+
+  pthread_mutex_lock(&br_ctx_lock);
+  *session = br_ctx;
+  br_ctx = NULL;
+  while (br_ctx_users) {
+    pthread_cond_wait(&br_ctx_idle, &br_ctx_lock);
+  }
+  pthread_mutex_unlock(&br_ctx_lock);
+
+  if (!*session) {
+    LOGE("ERROR: %s -- no session to finalize", caller);
+    return AVERROR(EINVAL);
+  }
+  return 0;
+}
+
+// a Map<String, String> of output options, see ffmpbr_set_output_option
+void _set_output_options(JNIEnv *env, FFmpegBridgeContext *session, jobject jOptions) {
+  jclass ClassMap = (*env)->FindClass(env, "java/util/Map");
+  jclass ClassSet = (*env)->FindClass(env, "java/util/Set");
+  jclass ClassEntry = (*env)->FindClass(env, "java/util/Map$Entry");
+  jmethodID jEntrySetId = (*env)->GetMethodID(env, ClassMap, "entrySet", "()Ljava/util/Set;");
+  jmethodID jToArrayId = (*env)->GetMethodID(env, ClassSet, "toArray", "()[Ljava/lang/Object;");
+  jmethodID jGetKeyId = (*env)->GetMethodID(env, ClassEntry, "getKey", "()Ljava/lang/Object;");
+  jmethodID jGetValueId = (*env)->GetMethodID(env, ClassEntry, "getValue", "()Ljava/lang/Object;");
+  jobject jEntrySet;
+  jobjectArray jEntries;
+  jsize i, count;
+
+  if (!jOptions) return;
+  jEntrySet = (*env)->CallObjectMethod(env, jOptions, jEntrySetId);
+  jEntries = (jobjectArray) (*env)->CallObjectMethod(env, jEntrySet, jToArrayId);
+  count = (*env)->GetArrayLength(env, jEntries);
+
+  for (i=0; i<count; ++i) {
+    jobject jEntry = (*env)->GetObjectArrayElement(env, jEntries, i);
+    jstring jKey = (jstring) (*env)->CallObjectMethod(env, jEntry, jGetKeyId);
+    jstring jValue = (jstring) (*env)->CallObjectMethod(env, jEntry, jGetValueId);
+
+    if (jKey && jValue) {
+      const char *key = (*env)->GetStringUTFChars(env, jKey, NULL);
+      const char *value = (*env)->GetStringUTFChars(env, jValue, NULL);
+      ffmpbr_set_output_option(session, key, value);
+      (*env)->ReleaseStringUTFChars(env, jKey, key);
+      (*env)->ReleaseStringUTFChars(env, jValue, value);
+    }
+    (*env)->DeleteLocalRef(env, jEntry);
+    if (jKey) (*env)->DeleteLocalRef(env, jKey);
+    if (jValue) (*env)->DeleteLocalRef(env, jValue);
+  }
+  (*env)->DeleteLocalRef(env, jEntries);
+  (*env)->DeleteLocalRef(env, jEntrySet);
+}
+
+// a String[] of backup ingest urls, see ffmpbr_set_backup_urls
+void _set_backup_urls(JNIEnv *env, FFmpegBridgeContext *session, jobjectArray jUrls) {
+  jstring jUrl[FFMPBR_MAX_INGEST_URLS];
+  const char *urls[FFMPBR_MAX_INGEST_URLS];
+  jsize i, count;
+
+  if (!jUrls) return;
+  count = FFMIN((*env)->GetArrayLength(env, jUrls), FFMPBR_MAX_INGEST_URLS);
+
+  for (i=0; i<count; ++i) {
+    jUrl[i] = (jstring) (*env)->GetObjectArrayElement(env, jUrls, i);
+    urls[i] = jUrl[i] ? (*env)->GetStringUTFChars(env, jUrl[i], NULL) : "";
+  }
+  ffmpbr_set_backup_urls(session, urls, count);
+  for (i=0; i<count; ++i) {
+    if (!jUrl[i]) continue;
+    (*env)->ReleaseStringUTFChars(env, jUrl[i], urls[i]);
+    (*env)->DeleteLocalRef(env, jUrl[i]);
+  }
+}
+
+// the calling thread's JNIEnv, attaching the thread first if it's one of
+// ours (*attached is then 1, and it has to be detached again), or NULL
+JNIEnv* _get_env(int *attached) {
+  JNIEnv *env;
+  jint rc;
+
+  *attached = 0;
+  rc = (*jvm)->GetEnv(jvm, (void **)&env, JNI_VERSION_1_6);
+  if (rc == JNI_EDETACHED) {
+    if ((*jvm)->AttachCurrentThread(jvm, &env, NULL) != JNI_OK) {
+      LOGE("ERROR: _get_env -- couldn't attach the thread");
+      return NULL;
+    }
+    *attached = 1;
+  } else if (rc != JNI_OK) {
+    LOGE("ERROR: _get_env -- no JNIEnv (%d)", (int)rc);
+    return NULL;
+  }
+  return env;
+}
+
+
+//
+// callbacks
+//
+
+// called from writePacket or finalizeSync, or from finalizeAsync's thread
+void _on_hls_segment(void *opaque, FFmpegBridgeHlsSegment *segment, const char *playlist) {
+  jobject jThis = opaque;
+  int attached;
+  JNIEnv *env = _get_env(&attached);
+
+  if (!env) return;
+
+  // the buffer stays valid until the segment leaves the playlist
+  jobject jData = (*env)->NewDirectByteBuffer(env, segment->data, segment->size);
+  jstring jName = (*env)->NewStringUTF(env, segment->name);
+  jstring jPlaylist = (*env)->NewStringUTF(env, playlist);
+
+  (*env)->CallVoidMethod(env, jThis, jOnHlsSegmentId, (jint)segment->index, jName,
+    (jlong)segment->duration_us, jData, jPlaylist);
+  if ((*env)->ExceptionCheck(env)) {
+    LOGE("ERROR: _on_hls_segment -- onHlsSegment threw");
+    (*env)->ExceptionDescribe(env);
+    (*env)->ExceptionClear(env);
+  }
+
+  (*env)->DeleteLocalRef(env, jData);
+  (*env)->DeleteLocalRef(env, jName);
+  (*env)->DeleteLocalRef(env, jPlaylist);
+  if (attached) (*jvm)->DetachCurrentThread(jvm);
+}
+
+// on the dispatch thread, which is attached for the call (and detached
+// again)
+void _on_keyframe_request(void *opaque, int reason) {
+  jobject jThis = opaque;
+  int attached;
+  JNIEnv *env = _get_env(&attached);
+
+  if (!env) return;
+
+  (*env)->CallVoidMethod(env, jThis, jOnKeyframeRequestId, (jint)reason);
+  if ((*env)->ExceptionCheck(env)) {
+    LOGE("ERROR: _on_keyframe_request -- onKeyframeRequest threw");
+    (*env)->ExceptionDescribe(env);
+    (*env)->ExceptionClear(env);
+  }
+
+  if (attached) (*jvm)->DetachCurrentThread(jvm);
+}
+
+// on finalizeAsync's thread, once the session is gone; opaque is the
+// session's global reference, which is let go of here
+void _on_finalized(void *opaque, const FFmpegBridgeFinalizeResult *result) {
+  jobject jThis = opaque;
+  int attached;
+  JNIEnv *env = _get_env(&attached);
+
+  if (!env) return;
+
+  (*env)->CallVoidMethod(env, jThis, jOnFinalizedId, (jint)result->status,
+    result->cut_off ? JNI_TRUE : JNI_FALSE, (jlong)result->unsent_bytes,
+    (jlong)result->duration_us);
+  if ((*env)->ExceptionCheck(env)) {
+    LOGE("ERROR: _on_finalized -- onFinalized threw");
+    (*env)->ExceptionDescribe(env);
+    (*env)->ExceptionClear(env);
+  }
+
+  (*env)->DeleteGlobalRef(env, jThis);
+  if (attached) (*jvm)->DetachCurrentThread(jvm);
+}
 
 
 //
@@ -25,6 +272,7 @@ JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_init
   const char *output_fmt_name, *output_url;
   int video_width, video_height, video_fps, video_bit_rate;
   int audio_sample_rate, audio_num_channels, audio_bit_rate;
+  FFmpegBridgeContext *session;
 
   LOGD("init");
 
@@ -33,6 +281,33 @@ JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_init
 
   jfieldID jOutputFormatName = (*env)->GetFieldID(env, ClassAVOptions, "outputFormatName", "Ljava/lang/String;");
   jfieldID jOutputUrl = (*env)->GetFieldID(env, ClassAVOptions, "outputUrl", "Ljava/lang/String;");
+  jfieldID jCaptureFile = (*env)->GetFieldID(env, ClassAVOptions, "captureFile", "Ljava/lang/String;");
+  jfieldID jVideoCodec = (*env)->GetFieldID(env, ClassAVOptions, "videoCodec", "Ljava/lang/String;");
+  jfieldID jAutoConfigId = (*env)->GetFieldID(env, ClassAVOptions, "autoConfig", "Z");
+  jfieldID jNalFilterId = (*env)->GetFieldID(env, ClassAVOptions, "nalFilter", "I");
+  jfieldID jVideoReorderDepthId = (*env)->GetFieldID(env, ClassAVOptions, "videoReorderDepth", "I");
+  jfieldID jNormalizeTimestampsId = (*env)->GetFieldID(env, ClassAVOptions, "normalizeTimestamps", "Z");
+  jfieldID jMp4FragmentMsId = (*env)->GetFieldID(env, ClassAVOptions, "mp4FragmentMs", "I");
+  jfieldID jSegmentMsId = (*env)->GetFieldID(env, ClassAVOptions, "segmentMs", "I");
+  jfieldID jHlsListSizeId = (*env)->GetFieldID(env, ClassAVOptions, "hlsListSize", "I");
+  jfieldID jDvrMsId = (*env)->GetFieldID(env, ClassAVOptions, "dvrMs", "I");
+  jfieldID jOutputOptionsId = (*env)->GetFieldID(env, ClassAVOptions, "outputOptions", "Ljava/util/Map;");
+  jfieldID jRtmpChunkSizeId = (*env)->GetFieldID(env, ClassAVOptions, "rtmpChunkSize", "I");
+  jfieldID jTcpNoDelayId = (*env)->GetFieldID(env, ClassAVOptions, "tcpNoDelay", "I");
+  jfieldID jSendBufferSizeId = (*env)->GetFieldID(env, ClassAVOptions, "sendBufferSize", "I");
+  jfieldID jNotSentLowatId = (*env)->GetFieldID(env, ClassAVOptions, "notSentLowat", "I");
+  jfieldID jUdpDuplicateTablesId = (*env)->GetFieldID(env, ClassAVOptions, "udpDuplicateTables",
+    "Z");
+  jfieldID jPacingPercentId = (*env)->GetFieldID(env, ClassAVOptions, "pacingPercent", "I");
+  jfieldID jPacingBurstMsId = (*env)->GetFieldID(env, ClassAVOptions, "pacingBurstMs", "I");
+  jfieldID jWriteQueueMsId = (*env)->GetFieldID(env, ClassAVOptions, "writeQueueMs", "I");
+  jfieldID jKeyframeRequestMsId = (*env)->GetFieldID(env, ClassAVOptions, "keyframeRequestMs",
+    "I");
+  jfieldID jFileBlockKbId = (*env)->GetFieldID(env, ClassAVOptions, "fileBlockKb", "I");
+  jfieldID jFilePreallocateMbId = (*env)->GetFieldID(env, ClassAVOptions, "filePreallocateMb", "I");
+  jfieldID jFileSyncMsId = (*env)->GetFieldID(env, ClassAVOptions, "fileSyncMs", "I");
+  jfieldID jBackupUrlsId = (*env)->GetFieldID(env, ClassAVOptions, "backupUrls",
+    "[Ljava/lang/String;");
 
   jfieldID jVideoHeightId = (*env)->GetFieldID(env, ClassAVOptions, "videoHeight", "I");
   jfieldID jVideoWidthId = (*env)->GetFieldID(env, ClassAVOptions, "videoWidth", "I");
@@ -59,23 +334,92 @@ JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_init
   audio_bit_rate = (*env)->GetIntField(env, jOpts, jAudioBitRateId);
 
   // initialize our context
-  br_ctx = ffmpbr_init(output_fmt_name, output_url,
+  session = ffmpbr_init(output_fmt_name, output_url,
     video_width, video_height, video_fps, video_bit_rate,
     audio_sample_rate, audio_num_channels, audio_bit_rate);
 
   (*env)->ReleaseStringUTFChars(env, outputFormatNameString, output_fmt_name);
   (*env)->ReleaseStringUTFChars(env, outputUrlString, output_url);
+
+  // (before anything else, as the rest may depend on the codec)
+  jstring videoCodecString = (jstring) (*env)->GetObjectField(env, jOpts, jVideoCodec);
+  if (videoCodecString) {
+    const char *video_codec = (*env)->GetStringUTFChars(env, videoCodecString, NULL);
+    ffmpbr_set_video_codec(session, video_codec);
+    (*env)->ReleaseStringUTFChars(env, videoCodecString, video_codec);
+  }
+
+  ffmpbr_set_auto_config(session, (*env)->GetBooleanField(env, jOpts, jAutoConfigId) == JNI_TRUE);
+  ffmpbr_set_nal_filter(session, (*env)->GetIntField(env, jOpts, jNalFilterId));
+  ffmpbr_set_video_reorder_depth(session, (*env)->GetIntField(env, jOpts, jVideoReorderDepthId));
+  ffmpbr_set_timestamp_normalization(session,
+    (*env)->GetBooleanField(env, jOpts, jNormalizeTimestampsId) == JNI_TRUE);
+  ffmpbr_set_mp4_fragmentation(session, (*env)->GetIntField(env, jOpts, jMp4FragmentMsId));
+
+  // (before segmenting, which opens the first segment)
+  _set_output_options(env, session, (*env)->GetObjectField(env, jOpts, jOutputOptionsId));
+  FFmpegBridgeTransport transport;
+  transport.rtmp_chunk_size = (*env)->GetIntField(env, jOpts, jRtmpChunkSizeId);
+  transport.tcp_nodelay = (*env)->GetIntField(env, jOpts, jTcpNoDelayId);
+  transport.send_buffer = (*env)->GetIntField(env, jOpts, jSendBufferSizeId);
+  transport.notsent_lowat = (*env)->GetIntField(env, jOpts, jNotSentLowatId);
+  transport.udp_duplicate_tables =
+    (*env)->GetBooleanField(env, jOpts, jUdpDuplicateTablesId) == JNI_TRUE;
+  ffmpbr_set_transport(session, &transport);
+  ffmpbr_set_pacing(session, (*env)->GetIntField(env, jOpts, jPacingPercentId),
+    (*env)->GetIntField(env, jOpts, jPacingBurstMsId));
+  ffmpbr_set_write_queue_limit(session, (*env)->GetIntField(env, jOpts, jWriteQueueMsId));
+  ffmpbr_set_file_output(session, (*env)->GetIntField(env, jOpts, jFileBlockKbId),
+    (*env)->GetIntField(env, jOpts, jFilePreallocateMbId),
+    (*env)->GetIntField(env, jOpts, jFileSyncMsId));
+
+  // for mem: output urls, segments go to onHlsSegment
+  (*env)->GetJavaVM(env, &jvm);
+  jBridge = (*env)->NewGlobalRef(env, jThis);
+  jOnHlsSegmentId = (*env)->GetMethodID(env, (*env)->GetObjectClass(env, jThis), "onHlsSegment",
+    "(ILjava/lang/String;JLjava/nio/ByteBuffer;Ljava/lang/String;)V");
+  ffmpbr_set_hls_callback(session, (*env)->GetIntField(env, jOpts, jHlsListSizeId),
+    _on_hls_segment, jBridge);
+
+  // and keyframe requests to onKeyframeRequest
+  jOnKeyframeRequestId = (*env)->GetMethodID(env, (*env)->GetObjectClass(env, jThis),
+    "onKeyframeRequest", "(I)V");
+  ffmpbr_set_keyframe_callback(session, (*env)->GetIntField(env, jOpts, jKeyframeRequestMsId),
+    _on_keyframe_request, jBridge);
+  jOnFinalizedId = (*env)->GetMethodID(env, (*env)->GetObjectClass(env, jThis), "onFinalized",
+    "(IZJJ)V");
+  ffmpbr_set_segmenting(session, (*env)->GetIntField(env, jOpts, jSegmentMsId));
+  _set_backup_urls(env, session, (jobjectArray) (*env)->GetObjectField(env, jOpts, jBackupUrlsId));
+  ffmpbr_set_dvr(session, (*env)->GetIntField(env, jOpts, jDvrMsId));
+
+  // optionally record the session for replay
+  jstring captureFileString = (jstring) (*env)->GetObjectField(env, jOpts, jCaptureFile);
+  if (captureFileString) {
+    const char *capture_file = (*env)->GetStringUTFChars(env, captureFileString, NULL);
+    ffmpbr_start_capture(session, capture_file);
+    (*env)->ReleaseStringUTFChars(env, captureFileString, capture_file);
+  }
+
+  // (only now can the other calls get at it)
+  _publish_session(session);
 }
 
 JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_setAudioCodecExtraData
 (JNIEnv *env, jobject self, jbyteArray jData, jint jSize) {
 
+  FFmpegBridgeContext *session = _acquire_session();
+
   LOGD("setAudioCodecExtraData");
 
+  if (!session) {
+    LOGE("ERROR: setAudioCodecExtraData -- no session");
+    return;
+  }
   jbyte* raw_bytes = (*env)->GetByteArrayElements(env, jData, NULL);
 
   // add the extra data to the video codec and write-out the header
-  ffmpbr_set_audio_codec_extradata(br_ctx, (int8_t *)raw_bytes, (int)jSize);
+  ffmpbr_set_audio_codec_extradata(session, (int8_t *)raw_bytes, (int)jSize);
+  _release_session();
 
   (*env)->ReleaseByteArrayElements(env, jData, raw_bytes, 0);
 }
@@ -83,41 +427,514 @@ JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_setAudioCodecExtra
 JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_setVideoCodecExtraData
 (JNIEnv *env, jobject self, jbyteArray jData, jint jSize) {
 
+  FFmpegBridgeContext *session = _acquire_session();
+
   LOGD("setVideoCodecExtraData");
 
+  if (!session) {
+    LOGE("ERROR: setVideoCodecExtraData -- no session");
+    return;
+  }
   jbyte *raw_bytes = (*env)->GetByteArrayElements(env, jData, NULL);
 
   // add the extra data to the video codec and write-out the header
-  ffmpbr_set_video_codec_extradata(br_ctx, (int8_t *)raw_bytes, (int)jSize);
+  ffmpbr_set_video_codec_extradata(session, (int8_t *)raw_bytes, (int)jSize);
+  _release_session();
 
   (*env)->ReleaseByteArrayElements(env, jData, raw_bytes, 0);
 }
 
-JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_writeHeader
+JNIEXPORT jint JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_writeHeader
   (JNIEnv *env, jobject self) {
 
+  FFmpegBridgeContext *session = _acquire_session();
+  int rc;
+
   LOGD("writeHeader");
 
-  ffmpbr_write_header(br_ctx);
+  if (!session) return FFMPBR_WRITE_DISCONNECTED;
+  rc = ffmpbr_write_header(session);
+  _release_session();
+  return (jint)rc;
 }
 
-JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_writePacket
+JNIEXPORT jint JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_writePacket
 (JNIEnv *env, jobject self, jobject jData, jint jSize, jlong jPts,
  jint jIsVideo, jint jIsVideoKeyframe) {
 
+  // stamp the packet before doing anything else with it
+  int64_t arrival_us = ffmpbr_now_us();
   uint8_t *data = (*env)->GetDirectBufferAddress(env, jData);
   int is_video = (((int)jIsVideo) == JNI_TRUE);
   int is_video_keyframe = (((int)jIsVideoKeyframe) == JNI_TRUE);
+  FFmpegBridgeContext *session = _acquire_session();
+  int rc;
+
+  // (finalized, or never initialized)
+  if (!session) return FFMPBR_WRITE_DISCONNECTED;
 
   // write the packet
-  ffmpbr_write_packet(br_ctx, data, (int)jSize, (long)jPts, is_video, is_video_keyframe);
+  rc = ffmpbr_write_packet(session, data, (int)jSize, (long)jPts, is_video,
+    is_video_keyframe, arrival_us);
+  _release_session();
+  return (jint)rc;
+}
+
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getLatencyStats
+(JNIEnv *env, jobject self, jobject jStats) {
+
+  FFmpegBridgeLatencyStats stats;
+  FFmpegBridgeContext *session;
+
+  // (nothing to report once finalized)
+  session = _acquire_session();
+  if (!session) return;
+  ffmpbr_get_latency_stats(session, &stats);
+  _release_session();
+
+  // set the java object fields
+  jclass ClassLatencyStats = (*env)->GetObjectClass(env, jStats);
+
+  jfieldID jSentPacketsId = (*env)->GetFieldID(env, ClassLatencyStats, "sentPackets", "J");
+  jfieldID jDroppedStampsId = (*env)->GetFieldID(env, ClassLatencyStats, "droppedStamps", "J");
+  jfieldID jP50UsId = (*env)->GetFieldID(env, ClassLatencyStats, "p50Us", "J");
+  jfieldID jP90UsId = (*env)->GetFieldID(env, ClassLatencyStats, "p90Us", "J");
+  jfieldID jP99UsId = (*env)->GetFieldID(env, ClassLatencyStats, "p99Us", "J");
+  jfieldID jMaxUsId = (*env)->GetFieldID(env, ClassLatencyStats, "maxUs", "J");
+  jfieldID jCurrentLagUsId = (*env)->GetFieldID(env, ClassLatencyStats, "currentLagUs", "J");
+
+  (*env)->SetLongField(env, jStats, jSentPacketsId, (jlong)stats.sent_packets);
+  (*env)->SetLongField(env, jStats, jDroppedStampsId, (jlong)stats.dropped_stamps);
+  (*env)->SetLongField(env, jStats, jP50UsId, (jlong)stats.p50_us);
+  (*env)->SetLongField(env, jStats, jP90UsId, (jlong)stats.p90_us);
+  (*env)->SetLongField(env, jStats, jP99UsId, (jlong)stats.p99_us);
+  (*env)->SetLongField(env, jStats, jMaxUsId, (jlong)stats.max_us);
+  (*env)->SetLongField(env, jStats, jCurrentLagUsId, (jlong)stats.current_lag_us);
+}
+
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getNalFilterStats
+(JNIEnv *env, jobject self, jobject jStats) {
+
+  FFmpegBridgeNalFilterStats stats;
+  FFmpegBridgeContext *session;
+
+  session = _acquire_session();
+  if (!session) return;
+  ffmpbr_get_nal_filter_stats(session, &stats);
+  _release_session();
+
+  // set the java object fields
+  jclass ClassNalFilterStats = (*env)->GetObjectClass(env, jStats);
+
+  jfieldID jVideoBytesId = (*env)->GetFieldID(env, ClassNalFilterStats, "videoBytes", "J");
+  jfieldID jSavedBytesId = (*env)->GetFieldID(env, ClassNalFilterStats, "savedBytes", "J");
+  jfieldID jFillerUnitsId = (*env)->GetFieldID(env, ClassNalFilterStats, "fillerUnits", "J");
+  jfieldID jAudUnitsId = (*env)->GetFieldID(env, ClassNalFilterStats, "audUnits", "J");
+  jfieldID jSeiUnitsId = (*env)->GetFieldID(env, ClassNalFilterStats, "seiUnits", "J");
+  jfieldID jParamSetUnitsId = (*env)->GetFieldID(env, ClassNalFilterStats, "paramSetUnits", "J");
+
+  (*env)->SetLongField(env, jStats, jVideoBytesId, (jlong)stats.video_bytes);
+  (*env)->SetLongField(env, jStats, jSavedBytesId, (jlong)stats.saved_bytes);
+  (*env)->SetLongField(env, jStats, jFillerUnitsId, (jlong)stats.filler_units);
+  (*env)->SetLongField(env, jStats, jAudUnitsId, (jlong)stats.aud_units);
+  (*env)->SetLongField(env, jStats, jSeiUnitsId, (jlong)stats.sei_units);
+  (*env)->SetLongField(env, jStats, jParamSetUnitsId, (jlong)stats.param_set_units);
+}
+
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getTimestampStats
+(JNIEnv *env, jobject self, jobject jStats) {
+
+  FFmpegBridgeTimestampStats stats;
+  FFmpegBridgeContext *session;
+
+  session = _acquire_session();
+  if (!session) return;
+  ffmpbr_get_timestamp_stats(session, &stats);
+  _release_session();
+
+  // set the java object fields
+  jclass ClassTimestampStats = (*env)->GetObjectClass(env, jStats);
+
+  jfieldID jDriftUsId = (*env)->GetFieldID(env, ClassTimestampStats, "driftUs", "J");
+  jfieldID jCorrectionUsId = (*env)->GetFieldID(env, ClassTimestampStats, "correctionUs", "J");
+  jfieldID jVideoJitterUsId = (*env)->GetFieldID(env, ClassTimestampStats, "videoJitterUs", "J");
+  jfieldID jMonotonicFixesId = (*env)->GetFieldID(env, ClassTimestampStats, "monotonicFixes", "J");
+  jfieldID jResyncsId = (*env)->GetFieldID(env, ClassTimestampStats, "resyncs", "J");
+
+  (*env)->SetLongField(env, jStats, jDriftUsId, (jlong)stats.drift_us);
+  (*env)->SetLongField(env, jStats, jCorrectionUsId, (jlong)stats.correction_us);
+  (*env)->SetLongField(env, jStats, jVideoJitterUsId, (jlong)stats.video_jitter_us);
+  (*env)->SetLongField(env, jStats, jMonotonicFixesId, (jlong)stats.monotonic_fixes);
+  (*env)->SetLongField(env, jStats, jResyncsId, (jlong)stats.resyncs);
+}
+
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getSegmentStats
+(JNIEnv *env, jobject self, jobject jStats) {
+
+  FFmpegBridgeSegmentStats stats;
+  FFmpegBridgeContext *session;
+
+  session = _acquire_session();
+  if (!session) return;
+  ffmpbr_get_segment_stats(session, &stats);
+  _release_session();
+
+  // set the java object fields
+  jclass ClassSegmentStats = (*env)->GetObjectClass(env, jStats);
+
+  jfieldID jSegmentsId = (*env)->GetFieldID(env, ClassSegmentStats, "segments", "J");
+  jfieldID jClosedSegmentsId = (*env)->GetFieldID(env, ClassSegmentStats, "closedSegments", "J");
+  jfieldID jLateRotationsId = (*env)->GetFieldID(env, ClassSegmentStats, "lateRotations", "J");
+  jfieldID jRotationP50UsId = (*env)->GetFieldID(env, ClassSegmentStats, "rotationP50Us", "J");
+  jfieldID jRotationP90UsId = (*env)->GetFieldID(env, ClassSegmentStats, "rotationP90Us", "J");
+  jfieldID jRotationMaxUsId = (*env)->GetFieldID(env, ClassSegmentStats, "rotationMaxUs", "J");
+  jfieldID jMaxOpenUsId = (*env)->GetFieldID(env, ClassSegmentStats, "maxOpenUs", "J");
+  jfieldID jMaxCloseUsId = (*env)->GetFieldID(env, ClassSegmentStats, "maxCloseUs", "J");
+
+  (*env)->SetLongField(env, jStats, jSegmentsId, (jlong)stats.segments);
+  (*env)->SetLongField(env, jStats, jClosedSegmentsId, (jlong)stats.closed_segments);
+  (*env)->SetLongField(env, jStats, jLateRotationsId, (jlong)stats.late_rotations);
+  (*env)->SetLongField(env, jStats, jRotationP50UsId, (jlong)stats.rotation_p50_us);
+  (*env)->SetLongField(env, jStats, jRotationP90UsId, (jlong)stats.rotation_p90_us);
+  (*env)->SetLongField(env, jStats, jRotationMaxUsId, (jlong)stats.rotation_max_us);
+  (*env)->SetLongField(env, jStats, jMaxOpenUsId, (jlong)stats.max_open_us);
+  (*env)->SetLongField(env, jStats, jMaxCloseUsId, (jlong)stats.max_close_us);
+}
+
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getHlsStats
+(JNIEnv *env, jobject self, jobject jStats) {
+
+  FFmpegBridgeHlsStats stats;
+  FFmpegBridgeContext *session;
+
+  session = _acquire_session();
+  if (!session) return;
+  ffmpbr_get_hls_stats(session, &stats);
+  _release_session();
+
+  // set the java object fields
+  jclass ClassHlsStats = (*env)->GetObjectClass(env, jStats);
+
+  jfieldID jSegmentsId = (*env)->GetFieldID(env, ClassHlsStats, "segments", "J");
+  jfieldID jBytesId = (*env)->GetFieldID(env, ClassHlsStats, "bytes", "J");
+  jfieldID jMaxSegmentBytesId = (*env)->GetFieldID(env, ClassHlsStats, "maxSegmentBytes", "J");
+  jfieldID jBufferedBytesId = (*env)->GetFieldID(env, ClassHlsStats, "bufferedBytes", "J");
+  jfieldID jMaxBufferedBytesId = (*env)->GetFieldID(env, ClassHlsStats, "maxBufferedBytes", "J");
+
+  (*env)->SetLongField(env, jStats, jSegmentsId, (jlong)stats.segments);
+  (*env)->SetLongField(env, jStats, jBytesId, (jlong)stats.bytes);
+  (*env)->SetLongField(env, jStats, jMaxSegmentBytesId, (jlong)stats.max_segment_bytes);
+  (*env)->SetLongField(env, jStats, jBufferedBytesId, (jlong)stats.buffered_bytes);
+  (*env)->SetLongField(env, jStats, jMaxBufferedBytesId, (jlong)stats.max_buffered_bytes);
 }
 
-JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_finalize
+JNIEXPORT jint JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_saveDvr
+(JNIEnv *env, jobject self, jstring jPath) {
+
+  const char *path = (*env)->GetStringUTFChars(env, jPath, NULL);
+  FFmpegBridgeContext *session;
+  int rc;
+
+  LOGD("saveDvr: %s", path);
+
+  session = _acquire_session();
+  if (session) {
+    rc = ffmpbr_save_dvr(session, path);
+    _release_session();
+  } else {
+    LOGE("ERROR: saveDvr -- no session");
+    rc = AVERROR(EINVAL);
+  }
+
+  (*env)->ReleaseStringUTFChars(env, jPath, path);
+  return rc;
+}
+
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getDvrStats
+(JNIEnv *env, jobject self, jobject jStats) {
+
+  FFmpegBridgeDvrStats stats;
+  FFmpegBridgeContext *session;
+
+  session = _acquire_session();
+  if (!session) return;
+  ffmpbr_get_dvr_stats(session, &stats);
+  _release_session();
+
+  // set the java object fields
+  jclass ClassDvrStats = (*env)->GetObjectClass(env, jStats);
+
+  jfieldID jSlabBytesId = (*env)->GetFieldID(env, ClassDvrStats, "slabBytes", "J");
+  jfieldID jBufferedBytesId = (*env)->GetFieldID(env, ClassDvrStats, "bufferedBytes", "J");
+  jfieldID jBufferedUsId = (*env)->GetFieldID(env, ClassDvrStats, "bufferedUs", "J");
+  jfieldID jEarlyDropsId = (*env)->GetFieldID(env, ClassDvrStats, "earlyDrops", "J");
+  jfieldID jPinnedDropsId = (*env)->GetFieldID(env, ClassDvrStats, "pinnedDrops", "J");
+  jfieldID jSavesId = (*env)->GetFieldID(env, ClassDvrStats, "saves", "J");
+  jfieldID jFailedSavesId = (*env)->GetFieldID(env, ClassDvrStats, "failedSaves", "J");
+  jfieldID jSavingId = (*env)->GetFieldID(env, ClassDvrStats, "saving", "Z");
+  jfieldID jLastSaveMediaUsId = (*env)->GetFieldID(env, ClassDvrStats, "lastSaveMediaUs", "J");
+  jfieldID jLastSaveBytesId = (*env)->GetFieldID(env, ClassDvrStats, "lastSaveBytes", "J");
+  jfieldID jLastSaveUsId = (*env)->GetFieldID(env, ClassDvrStats, "lastSaveUs", "J");
+
+  (*env)->SetLongField(env, jStats, jSlabBytesId, (jlong)stats.slab_bytes);
+  (*env)->SetLongField(env, jStats, jBufferedBytesId, (jlong)stats.buffered_bytes);
+  (*env)->SetLongField(env, jStats, jBufferedUsId, (jlong)stats.buffered_us);
+  (*env)->SetLongField(env, jStats, jEarlyDropsId, (jlong)stats.early_drops);
+  (*env)->SetLongField(env, jStats, jPinnedDropsId, (jlong)stats.pinned_drops);
+  (*env)->SetLongField(env, jStats, jSavesId, (jlong)stats.saves);
+  (*env)->SetLongField(env, jStats, jFailedSavesId, (jlong)stats.failed_saves);
+  (*env)->SetBooleanField(env, jStats, jSavingId, stats.saving ? JNI_TRUE : JNI_FALSE);
+  (*env)->SetLongField(env, jStats, jLastSaveMediaUsId, (jlong)stats.last_save_media_us);
+  (*env)->SetLongField(env, jStats, jLastSaveBytesId, (jlong)stats.last_save_bytes);
+  (*env)->SetLongField(env, jStats, jLastSaveUsId, (jlong)stats.last_save_us);
+}
+
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getSendStats
+(JNIEnv *env, jobject self, jobject jStats) {
+
+  FFmpegBridgeSendStats stats;
+  FFmpegBridgeContext *session;
+
+  session = _acquire_session();
+  if (!session) return;
+  ffmpbr_get_send_stats(session, &stats);
+  _release_session();
+
+  // set the java object fields
+  jclass ClassSendStats = (*env)->GetObjectClass(env, jStats);
+
+  jfieldID jBytesId = (*env)->GetFieldID(env, ClassSendStats, "bytes", "J");
+  jfieldID jRateMeanId = (*env)->GetFieldID(env, ClassSendStats, "rateMean", "J");
+  jfieldID jRatePeakId = (*env)->GetFieldID(env, ClassSendStats, "ratePeak", "J");
+  jfieldID jRateStddevId = (*env)->GetFieldID(env, ClassSendStats, "rateStddev", "J");
+  jfieldID jPacedWaitsId = (*env)->GetFieldID(env, ClassSendStats, "pacedWaits", "J");
+  jfieldID jMaxBacklogBytesId = (*env)->GetFieldID(env, ClassSendStats, "maxBacklogBytes", "J");
+  jfieldID jRetransmitsId = (*env)->GetFieldID(env, ClassSendStats, "retransmits", "J");
+  jfieldID jDatagramsId = (*env)->GetFieldID(env, ClassSendStats, "datagrams", "J");
+  jfieldID jDuplicateTablesId = (*env)->GetFieldID(env, ClassSendStats, "duplicateTables", "J");
+  jfieldID jRefusedDatagramsId = (*env)->GetFieldID(env, ClassSendStats, "refusedDatagrams", "J");
+  jfieldID jFileBlocksId = (*env)->GetFieldID(env, ClassSendStats, "fileBlocks", "J");
+  jfieldID jFilePreallocatedBytesId = (*env)->GetFieldID(env, ClassSendStats,
+    "filePreallocatedBytes", "J");
+  jfieldID jFileStallsId = (*env)->GetFieldID(env, ClassSendStats, "fileStalls", "J");
+  jfieldID jFileMaxStallUsId = (*env)->GetFieldID(env, ClassSendStats, "fileMaxStallUs", "J");
+  jfieldID jFileMaxWriteUsId = (*env)->GetFieldID(env, ClassSendStats, "fileMaxWriteUs", "J");
+  jfieldID jFileSyncsId = (*env)->GetFieldID(env, ClassSendStats, "fileSyncs", "J");
+  jfieldID jFileMaxSyncUsId = (*env)->GetFieldID(env, ClassSendStats, "fileMaxSyncUs", "J");
+
+  (*env)->SetLongField(env, jStats, jBytesId, (jlong)stats.bytes);
+  (*env)->SetLongField(env, jStats, jRateMeanId, (jlong)stats.rate_mean);
+  (*env)->SetLongField(env, jStats, jRatePeakId, (jlong)stats.rate_peak);
+  (*env)->SetLongField(env, jStats, jRateStddevId, (jlong)stats.rate_stddev);
+  (*env)->SetLongField(env, jStats, jPacedWaitsId, (jlong)stats.paced_waits);
+  (*env)->SetLongField(env, jStats, jMaxBacklogBytesId, (jlong)stats.max_backlog_bytes);
+  (*env)->SetLongField(env, jStats, jRetransmitsId, (jlong)stats.retransmits);
+  (*env)->SetLongField(env, jStats, jDatagramsId, (jlong)stats.datagrams);
+  (*env)->SetLongField(env, jStats, jDuplicateTablesId, (jlong)stats.duplicate_tables);
+  (*env)->SetLongField(env, jStats, jRefusedDatagramsId, (jlong)stats.refused_datagrams);
+  (*env)->SetLongField(env, jStats, jFileBlocksId, (jlong)stats.file_blocks);
+  (*env)->SetLongField(env, jStats, jFilePreallocatedBytesId, (jlong)stats.file_preallocated_bytes);
+  (*env)->SetLongField(env, jStats, jFileStallsId, (jlong)stats.file_stalls);
+  (*env)->SetLongField(env, jStats, jFileMaxStallUsId, (jlong)stats.file_max_stall_us);
+  (*env)->SetLongField(env, jStats, jFileMaxWriteUsId, (jlong)stats.file_max_write_us);
+  (*env)->SetLongField(env, jStats, jFileSyncsId, (jlong)stats.file_syncs);
+  (*env)->SetLongField(env, jStats, jFileMaxSyncUsId, (jlong)stats.file_max_sync_us);
+}
+
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getFailoverStats
+(JNIEnv *env, jobject self, jobject jStats) {
+
+  FFmpegBridgeFailoverStats stats;
+  FFmpegBridgeContext *session;
+
+  session = _acquire_session();
+  if (!session) return;
+  ffmpbr_get_failover_stats(session, &stats);
+  _release_session();
+
+  // set the java object fields
+  jclass ClassFailoverStats = (*env)->GetObjectClass(env, jStats);
+
+  jfieldID jIngestIndexId = (*env)->GetFieldID(env, ClassFailoverStats, "ingestIndex", "I");
+  jfieldID jDownId = (*env)->GetFieldID(env, ClassFailoverStats, "down", "Z");
+  jfieldID jDroppedPacketsId = (*env)->GetFieldID(env, ClassFailoverStats, "droppedPackets", "J");
+  jfieldID jFailoversId = (*env)->GetFieldID(env, ClassFailoverStats, "failovers", "J");
+  jfieldID jFailedAttemptsId = (*env)->GetFieldID(env, ClassFailoverStats, "failedAttempts", "J");
+  jfieldID jReplayedPacketsId = (*env)->GetFieldID(env, ClassFailoverStats, "replayedPackets",
+    "J");
+  jfieldID jLastFailureUsId = (*env)->GetFieldID(env, ClassFailoverStats, "lastFailureUs", "J");
+  jfieldID jLastFailoverUsId = (*env)->GetFieldID(env, ClassFailoverStats, "lastFailoverUs", "J");
+  jfieldID jMaxFailoverUsId = (*env)->GetFieldID(env, ClassFailoverStats, "maxFailoverUs", "J");
+
+  (*env)->SetIntField(env, jStats, jIngestIndexId, (jint)stats.ingest_index);
+  (*env)->SetBooleanField(env, jStats, jDownId, stats.down ? JNI_TRUE : JNI_FALSE);
+  (*env)->SetLongField(env, jStats, jDroppedPacketsId, (jlong)stats.dropped_packets);
+  (*env)->SetLongField(env, jStats, jFailoversId, (jlong)stats.failovers);
+  (*env)->SetLongField(env, jStats, jFailedAttemptsId, (jlong)stats.failed_attempts);
+  (*env)->SetLongField(env, jStats, jReplayedPacketsId, (jlong)stats.replayed_packets);
+  (*env)->SetLongField(env, jStats, jLastFailureUsId, (jlong)stats.last_failure_us);
+  (*env)->SetLongField(env, jStats, jLastFailoverUsId, (jlong)stats.last_failover_us);
+  (*env)->SetLongField(env, jStats, jMaxFailoverUsId, (jlong)stats.max_failover_us);
+}
+
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getKeyframeStats
+(JNIEnv *env, jobject self, jobject jStats) {
+
+  FFmpegBridgeKeyframeStats stats;
+  FFmpegBridgeContext *session;
+
+  session = _acquire_session();
+  if (!session) return;
+  ffmpbr_get_keyframe_stats(session, &stats);
+  _release_session();
+
+  // set the java object fields
+  jclass ClassKeyframeStats = (*env)->GetObjectClass(env, jStats);
+
+  jfieldID jRequestsId = (*env)->GetFieldID(env, ClassKeyframeStats, "requests", "J");
+  jfieldID jSuppressedId = (*env)->GetFieldID(env, ClassKeyframeStats, "suppressed", "J");
+  jfieldID jLastWaitUsId = (*env)->GetFieldID(env, ClassKeyframeStats, "lastWaitUs", "J");
+  jfieldID jMaxWaitUsId = (*env)->GetFieldID(env, ClassKeyframeStats, "maxWaitUs", "J");
+
+  (*env)->SetLongField(env, jStats, jRequestsId, (jlong)stats.requests);
+  (*env)->SetLongField(env, jStats, jSuppressedId, (jlong)stats.suppressed);
+  (*env)->SetLongField(env, jStats, jLastWaitUsId, (jlong)stats.last_wait_us);
+  (*env)->SetLongField(env, jStats, jMaxWaitUsId, (jlong)stats.max_wait_us);
+}
+
+JNIEXPORT jint JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_probeBandwidth
+(JNIEnv *env, jobject self, jint jDurationMs, jobject jResult) {
+
+  FFmpegBridgeProbeResult result;
+  FFmpegBridgeContext *session;
+  int rc;
+
+  LOGD("probeBandwidth: %d ms", (int)jDurationMs);
+
+  session = _acquire_session();
+  if (!session) {
+    LOGE("ERROR: probeBandwidth -- no session");
+    return AVERROR(EINVAL);
+  }
+  rc = ffmpbr_probe_bandwidth(session, (int)jDurationMs, &result);
+  _release_session();
+
+  // set the java object fields
+  jclass ClassProbeResult = (*env)->GetObjectClass(env, jResult);
+
+  jfieldID jBytesSentId = (*env)->GetFieldID(env, ClassProbeResult, "bytesSent", "J");
+  jfieldID jDurationUsId = (*env)->GetFieldID(env, ClassProbeResult, "durationUs", "J");
+  jfieldID jThroughputId = (*env)->GetFieldID(env, ClassProbeResult, "throughput", "J");
+  jfieldID jCappedId = (*env)->GetFieldID(env, ClassProbeResult, "capped", "Z");
+  jfieldID jRttUsId = (*env)->GetFieldID(env, ClassProbeResult, "rttUs", "J");
+  jfieldID jRttVarUsId = (*env)->GetFieldID(env, ClassProbeResult, "rttVarUs", "J");
+  jfieldID jRecommendedBitRateId = (*env)->GetFieldID(env, ClassProbeResult, "recommendedBitRate",
+    "J");
+
+  (*env)->SetLongField(env, jResult, jBytesSentId, (jlong)result.bytes_sent);
+  (*env)->SetLongField(env, jResult, jDurationUsId, (jlong)result.duration_us);
+  (*env)->SetLongField(env, jResult, jThroughputId, (jlong)result.throughput);
+  (*env)->SetBooleanField(env, jResult, jCappedId, result.capped ? JNI_TRUE : JNI_FALSE);
+  (*env)->SetLongField(env, jResult, jRttUsId, (jlong)result.rtt_us);
+  (*env)->SetLongField(env, jResult, jRttVarUsId, (jlong)result.rtt_var_us);
+  (*env)->SetLongField(env, jResult, jRecommendedBitRateId, (jlong)result.recommended_bit_rate);
+  return rc;
+}
+
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_setTracing
+(JNIEnv *env, jobject self, jboolean jEnabled, jstring jJsonPath) {
+
+  LOGD("setTracing");
+
+#ifdef FFMPBR_ENABLE_TRACE
+  const char *json_path = jJsonPath ? (*env)->GetStringUTFChars(env, jJsonPath, NULL) : NULL;
+
+  ffmpbr_trace_enable(jEnabled == JNI_TRUE, json_path);
+
+  if (json_path) (*env)->ReleaseStringUTFChars(env, jJsonPath, json_path);
+#else
+  LOGE("setTracing -- tracing was not compiled in, rebuild with FFMPBR_TRACE=1");
+#endif
+}
+
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_setSharedIoThreads
+(JNIEnv *env, jclass cls, jint jNumThreads) {
+
+  LOGD("setSharedIoThreads: %d", (int)jNumThreads);
+
+  ffmpbr_loop_set_threads((int)jNumThreads);
+}
+
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_setConnectionPoolGrace
+(JNIEnv *env, jclass cls, jint jGraceMs) {
+
+  LOGD("setConnectionPoolGrace: %d", (int)jGraceMs);
+
+  ffmpbr_pool_set_grace((int)jGraceMs);
+}
+
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getConnectionPoolStats
+(JNIEnv *env, jclass cls, jobject jStats) {
+
+  FFmpegBridgePoolStats stats;
+
+  ffmpbr_pool_get_stats(&stats);
+
+  // set the java object fields
+  jclass ClassPoolStats = (*env)->GetObjectClass(env, jStats);
+
+  jfieldID jIdleId = (*env)->GetFieldID(env, ClassPoolStats, "idle", "I");
+  jfieldID jKeptId = (*env)->GetFieldID(env, ClassPoolStats, "kept", "J");
+  jfieldID jReusedId = (*env)->GetFieldID(env, ClassPoolStats, "reused", "J");
+  jfieldID jMissedId = (*env)->GetFieldID(env, ClassPoolStats, "missed", "J");
+  jfieldID jExpiredId = (*env)->GetFieldID(env, ClassPoolStats, "expired", "J");
+  jfieldID jEvictedId = (*env)->GetFieldID(env, ClassPoolStats, "evicted", "J");
+  jfieldID jFailedId = (*env)->GetFieldID(env, ClassPoolStats, "failed", "J");
+
+  (*env)->SetIntField(env, jStats, jIdleId, (jint)stats.idle);
+  (*env)->SetLongField(env, jStats, jKeptId, (jlong)stats.kept);
+  (*env)->SetLongField(env, jStats, jReusedId, (jlong)stats.reused);
+  (*env)->SetLongField(env, jStats, jMissedId, (jlong)stats.missed);
+  (*env)->SetLongField(env, jStats, jExpiredId, (jlong)stats.expired);
+  (*env)->SetLongField(env, jStats, jEvictedId, (jlong)stats.evicted);
+  (*env)->SetLongField(env, jStats, jFailedId, (jlong)stats.failed);
+}
+
+JNIEXPORT jint JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_finalizeSync
 (JNIEnv *env, jobject self) {
 
-  LOGD("finalize");
+  FFmpegBridgeContext *finalizing;
+  jobject jThis = jBridge;
+  int rc;
+
+  LOGD("finalizeSync");
+
+  rc = _take_session("finalizeSync", &finalizing);
+  if (rc < 0) return rc;
+  jBridge = NULL;
+
+  // write out the trailer and clean up (handing over the last HLS segment)
+  rc = ffmpbr_finalize(finalizing);
+
+  if (jThis) (*env)->DeleteGlobalRef(env, jThis);
+  return rc;
+}
+
+JNIEXPORT jint JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_finalizeAsync
+(JNIEnv *env, jobject self, jint jDeadlineMs, jboolean jCutOff) {
+
+  FFmpegBridgeContext *finalizing;
+  jobject jThis = jBridge;
+  int rc;
+
+  LOGD("finalizeAsync: %d ms", (int)jDeadlineMs);
+
+  rc = _take_session("finalizeAsync", &finalizing);
+  if (rc < 0) return rc;
 
-  // write out the trailer and clean up
-  ffmpbr_finalize(br_ctx);
+  // the session is the finalize thread's from here on, and its reference
+  // goes to onFinalized
+  jBridge = NULL;
+  return ffmpbr_finalize_async(finalizing, jDeadlineMs, jCutOff == JNI_TRUE, _on_finalized,
+    jThis);
 }
@@ -0,0 +1,53 @@
+//
+// AAC ADTS header parsing.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include "libavutil/avutil.h"
+
+#include "ffmpegbridge_adts.h"
+
+static const int adts_sample_rates[] = {
+  96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+//
+//-- FFmpegBridgeAdts API
+//
+
+int ffmpbr_adts_parse(const uint8_t *data, int size, FFmpegBridgeAdts *adts) {
+  if (size < FFMPBR_ADTS_HEADER_SIZE) return AVERROR_INVALIDDATA;
+
+  // syncword, then layer must be 0
+  if (data[0] != 0xff || (data[1] & 0xf6) != 0xf0) return AVERROR_INVALIDDATA;
+
+  adts->header_size = (data[1] & 0x01) ? 7 : 9;
+  adts->object_type = (data[2] >> 6) + 1;
+  adts->sample_rate_index = (data[2] >> 2) & 0x0f;
+  adts->channel_config = ((data[2] & 0x01) << 2) | (data[3] >> 6);
+  adts->frame_length = ((data[3] & 0x03) << 11) | (data[4] << 3) | (data[5] >> 5);
+
+  if (adts->sample_rate_index >= sizeof(adts_sample_rates) / sizeof(adts_sample_rates[0]) ||
+    adts->frame_length < adts->header_size) {
+    return AVERROR_INVALIDDATA;
+  }
+  adts->sample_rate = adts_sample_rates[adts->sample_rate_index];
+
+  return 0;
+}
+
+void ffmpbr_adts_audio_specific_config(FFmpegBridgeAdts *adts, uint8_t config[2]) {
+  // 5 bits object type, 4 bits sample rate index, 4 bits channel config
+  config[0] = (adts->object_type << 3) | (adts->sample_rate_index >> 1);
+  config[1] = ((adts->sample_rate_index & 1) << 7) | (adts->channel_config << 3);
+}
+
+int ffmpbr_adts_sample_rate_index(int sample_rate) {
+  int i;
+
+  for (i = 0; i < sizeof(adts_sample_rates) / sizeof(adts_sample_rates[0]); ++i) {
+    if (adts_sample_rates[i] == sample_rate) return i;
+  }
+  return -1;
+}
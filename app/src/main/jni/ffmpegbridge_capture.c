@@ -0,0 +1,191 @@
+//
+// Session capture: an append-only binary record of everything that was fed
+// into the bridge, which can be replayed later to reproduce a session.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libavutil/avstring.h"
+#include "libavutil/common.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/mem.h"
+
+#include "ffmpegbridge_capture.h"
+#include "ffmpegbridge_log.h"
+
+// large enough that a capture costs roughly one write() per keyframe
+#define FFMPBR_CAPTURE_BUFFER_SIZE (256 * 1024)
+
+//
+//-- helper functions
+//
+
+void _capture_write_config(FFmpegBridgeCapture *cap, FFmpegBridgeCaptureConfig *config) {
+  uint8_t payload[FFMPBR_CAPTURE_CONFIG_FIELDS * 4 + sizeof(config->output_fmt_name)];
+  int name_size = strnlen(config->output_fmt_name, sizeof(config->output_fmt_name) - 1) + 1;
+
+  AV_WL32(payload + 0, config->video_width);
+  AV_WL32(payload + 4, config->video_height);
+  AV_WL32(payload + 8, config->video_fps);
+  AV_WL32(payload + 12, config->video_bit_rate);
+  AV_WL32(payload + 16, config->audio_sample_rate);
+  AV_WL32(payload + 20, config->audio_num_channels);
+  AV_WL32(payload + 24, config->audio_bit_rate);
+  memcpy(payload + FFMPBR_CAPTURE_CONFIG_FIELDS * 4, config->output_fmt_name, name_size);
+  payload[FFMPBR_CAPTURE_CONFIG_FIELDS * 4 + name_size - 1] = 0;
+
+  ffmpbr_capture_write(cap, FFMPBR_CAPTURE_CONFIG, 0, 0, 0, payload,
+    FFMPBR_CAPTURE_CONFIG_FIELDS * 4 + name_size);
+}
+
+
+//
+//-- FFmpegBridgeCapture API
+//
+
+FFmpegBridgeCapture* ffmpbr_capture_open(const char *path, FFmpegBridgeCaptureConfig *config) {
+  FFmpegBridgeCapture *cap;
+
+  cap = av_mallocz(sizeof(FFmpegBridgeCapture));
+  cap->file = fopen(path, "wb");
+  if (!cap->file) {
+    LOGE("ERROR: ffmpbr_capture_open -- could not open %s: %s", path, strerror(errno));
+    av_free(cap);
+    return NULL;
+  }
+  setvbuf(cap->file, NULL, _IOFBF, FFMPBR_CAPTURE_BUFFER_SIZE);
+
+  fwrite(FFMPBR_CAPTURE_MAGIC, 1, FFMPBR_CAPTURE_MAGIC_SIZE, cap->file);
+  cap->bytes_written = FFMPBR_CAPTURE_MAGIC_SIZE;
+  _capture_write_config(cap, config);
+
+  LOGI("Capturing session to %s", path);
+  return cap;
+}
+
+void ffmpbr_capture_write(FFmpegBridgeCapture *cap, int type, int flags, int64_t pts,
+  int64_t arrival_us, const uint8_t *data, int size) {
+  uint8_t header[FFMPBR_CAPTURE_RECORD_HEADER_SIZE];
+
+  header[0] = type;
+  header[1] = flags;
+  header[2] = header[3] = 0;
+  AV_WL32(header + 4, size);
+  AV_WL64(header + 8, pts);
+  AV_WL64(header + 16, arrival_us);
+
+  if (fwrite(header, 1, sizeof(header), cap->file) != sizeof(header) ||
+      (size && fwrite(data, 1, size, cap->file) != (size_t)size)) {
+    LOGE("ERROR: ffmpbr_capture_write -- %s", strerror(errno));
+    return;
+  }
+  cap->bytes_written += sizeof(header) + size;
+}
+
+void ffmpbr_capture_close(FFmpegBridgeCapture *cap) {
+  LOGI("Closing capture (%lld bytes)", (long long)cap->bytes_written);
+  fclose(cap->file);
+  av_free(cap);
+}
+
+int ffmpbr_capture_reader_open(FFmpegBridgeCaptureReader *reader, const char *path) {
+  struct stat st;
+
+  memset(reader, 0, sizeof(FFmpegBridgeCaptureReader));
+  reader->fd = open(path, O_RDONLY);
+  if (reader->fd < 0) {
+    return AVERROR(errno);
+  }
+  if (fstat(reader->fd, &st) < 0) {
+    close(reader->fd);
+    return AVERROR(errno);
+  }
+  reader->size = st.st_size;
+
+  if (reader->size < FFMPBR_CAPTURE_MAGIC_SIZE) {
+    close(reader->fd);
+    return AVERROR_INVALIDDATA;
+  }
+
+  reader->base = mmap(NULL, reader->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, reader->fd, 0);
+  if (reader->base == MAP_FAILED) {
+    close(reader->fd);
+    return AVERROR(errno);
+  }
+  if (memcmp(reader->base, FFMPBR_CAPTURE_MAGIC, FFMPBR_CAPTURE_MAGIC_SIZE)) {
+    ffmpbr_capture_reader_close(reader);
+    return AVERROR_INVALIDDATA;
+  }
+
+  reader->pos = FFMPBR_CAPTURE_MAGIC_SIZE;
+  return 0;
+}
+
+int ffmpbr_capture_read_config(FFmpegBridgeCaptureRecord *record,
+  FFmpegBridgeCaptureConfig *config) {
+  const int fields_size = FFMPBR_CAPTURE_CONFIG_FIELDS * 4;
+
+  if (record->type != FFMPBR_CAPTURE_CONFIG || record->size <= fields_size) {
+    return AVERROR_INVALIDDATA;
+  }
+
+  config->video_width = AV_RL32(record->data + 0);
+  config->video_height = AV_RL32(record->data + 4);
+  config->video_fps = AV_RL32(record->data + 8);
+  config->video_bit_rate = AV_RL32(record->data + 12);
+  config->audio_sample_rate = AV_RL32(record->data + 16);
+  config->audio_num_channels = AV_RL32(record->data + 20);
+  config->audio_bit_rate = AV_RL32(record->data + 24);
+  av_strlcpy(config->output_fmt_name, (const char *)record->data + fields_size,
+    FFMIN(sizeof(config->output_fmt_name), record->size - fields_size));
+  return 0;
+}
+
+int ffmpbr_capture_next(FFmpegBridgeCaptureReader *reader, FFmpegBridgeCaptureRecord *record) {
+  uint8_t *header;
+
+  if (reader->pos == reader->size) {
+    return 0;
+  }
+  if (reader->size - reader->pos < FFMPBR_CAPTURE_RECORD_HEADER_SIZE) {
+    return AVERROR_INVALIDDATA;
+  }
+
+  header = reader->base + reader->pos;
+  record->type = header[0];
+  record->flags = header[1];
+  record->size = AV_RL32(header + 4);
+  record->pts = AV_RL64(header + 8);
+  record->arrival_us = AV_RL64(header + 16);
+  record->data = header + FFMPBR_CAPTURE_RECORD_HEADER_SIZE;
+
+  // a capture cut short by the app being killed just ends early
+  if (reader->size - reader->pos - FFMPBR_CAPTURE_RECORD_HEADER_SIZE < record->size) {
+    return AVERROR_INVALIDDATA;
+  }
+
+  reader->pos += FFMPBR_CAPTURE_RECORD_HEADER_SIZE + record->size;
+  return 1;
+}
+
+void ffmpbr_capture_reader_rewind(FFmpegBridgeCaptureReader *reader) {
+  reader->pos = FFMPBR_CAPTURE_MAGIC_SIZE;
+}
+
+void ffmpbr_capture_reader_close(FFmpegBridgeCaptureReader *reader) {
+  if (reader->base && reader->base != MAP_FAILED) {
+    munmap(reader->base, reader->size);
+  }
+  if (reader->fd >= 0) {
+    close(reader->fd);
+  }
+  reader->base = NULL;
+  reader->fd = -1;
+}
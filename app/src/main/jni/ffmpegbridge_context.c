@@ -4,12 +4,34 @@
 // Copyright (c) 2014, cine.io. All rights reserved.
 //
 
+#include <pthread.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
+#include "libavutil/avstring.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/opt.h"
+
+#include "ffmpegbridge_adts.h"
 #include "ffmpegbridge_context.h"
 #include "ffmpegbridge_log.h"
+#include "ffmpegbridge_nal.h"
+#include "ffmpegbridge_trace.h"
 #include "logdump.h"
 
+// a finalize handed to a background thread, see ffmpbr_finalize_async
+typedef struct
+{
+  FFmpegBridgeContext *br_ctx;
+  int64_t start_us;
+  int64_t deadline_us;
+  int cut_off;
+  FFmpegBridgeFinalizeCallback callback;
+  void *opaque;
+} FFmpegBridgeFinalizeJob;
+
 //
 //-- helper functions
 //
@@ -144,18 +166,84 @@ void _add_audio_stream(FFmpegBridgeContext *br_ctx) {
   //c->time_base.den = c->sample_rate;
 }
 
-// open a file for writing
+// flush every packet through our AVIO layer, so that we know when each one
+// reaches the sink
+void _use_io(AVFormatContext *fmt_ctx, FFmpegBridgeIO *io) {
+  fmt_ctx->pb = io->pb;
+  fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO | AVFMT_FLAG_FLUSH_PACKETS;
+  fmt_ctx->flush_packets = 1;
+}
+
+// the first connection to the ingest: output_url, or with backup urls the
+// first of them that can be reached. The protocol takes its options out of
+// output_options as it goes, so the originals are kept for reconnecting
+// (the muxer gets what's left either way).
+FFmpegBridgeIO* _open_ingest(FFmpegBridgeContext *br_ctx, int *rc) {
+  FFmpegBridgeIO *io;
+  int i;
+
+  if (!br_ctx->ingest_url_count || br_ctx->segment) {
+    return ffmpbr_io_open(br_ctx->output_url, &br_ctx->latency, &br_ctx->transport,
+      &br_ctx->output_options, rc);
+  }
+
+  av_dict_copy(&br_ctx->ingest_options, br_ctx->output_options, 0);
+  for (i=0; i<br_ctx->ingest_url_count; ++i) {
+    if (i > 0) {
+      av_dict_free(&br_ctx->output_options);
+      av_dict_copy(&br_ctx->output_options, br_ctx->ingest_options, 0);
+    }
+    io = ffmpbr_io_open(br_ctx->ingest_urls[i], &br_ctx->latency, &br_ctx->transport,
+      &br_ctx->output_options, rc);
+    if (io) {
+      br_ctx->failover_stats.ingest_index = i;
+      return io;
+    }
+    LOGE("ERROR: _open_ingest -- couldn't open %s: %s", br_ctx->ingest_urls[i], av_err2str(*rc));
+    br_ctx->failover_stats.failed_attempts++;
+  }
+  return NULL;
+}
+
+// open a file for writing. Done along with the header, so that output
+// options and transport settings can still be set after ffmpbr_init.
 int _open_output_url(FFmpegBridgeContext *br_ctx){
   int rc;
-  if (!(br_ctx->output_fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+  if (av_strstart(br_ctx->output_url, FFMPBR_MEMORY_URL, NULL)) {
+    LOGI("Output stays in memory, see ffmpbr_set_hls_callback");
+    return 0;
+  } else if (!(br_ctx->output_fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
     LOGI("Opening output file for writing at path %s", br_ctx->output_url);
-    return avio_open(&br_ctx->output_fmt_ctx->pb, br_ctx->output_url, AVIO_FLAG_WRITE);
+    FFMPBR_TRACE_BEGIN(avio_open, "avio_open");
+    br_ctx->io = _open_ingest(br_ctx, &rc);
+    FFMPBR_TRACE_END(avio_open, "avio_open");
+    if (!br_ctx->io) {
+      return rc;
+    }
+
+    _use_io(br_ctx->output_fmt_ctx, br_ctx->io);
+    return 0;
   } else {
     LOGD("This format does not require a file.");
     return 0;
   }
 }
 
+// muxers that carry H.264 length prefixed (AVCC). Given Annex-B extradata
+// they convert every packet themselves, into a freshly allocated copy; given
+// avcC extradata they take packets as they are.
+int _wants_avcc(AVOutputFormat *fmt) {
+  static const char *names[] = {
+    "flv", "f4v", "mp4", "mov", "ipod", "ismv", "3gp", "3g2", "psp", "matroska", NULL
+  };
+  int i;
+
+  for (i = 0; names[i]; ++i) {
+    if (!strcmp(fmt->name, names[i])) return 1;
+  }
+  return 0;
+}
+
 uint8_t* _filter_packet(FFmpegBridgeContext *br_ctx, AVStream *st, AVPacket *packet) {
   int rc = 0;
   uint8_t *filtered_data;
@@ -196,27 +284,989 @@ void _rescale_packet(FFmpegBridgeContext *br_ctx, AVStream *st, AVPacket *packet
   packet->dts = av_rescale_q(packet->dts, *(br_ctx->device_time_base), st->time_base);
 }
 
-void _write_packet(FFmpegBridgeContext *br_ctx, AVPacket *packet) {
+// the interleaver may hold packets back, so ask each stream how many of its
+// packets have actually been muxed
+void _track_muxed_packets(FFmpegBridgeContext *br_ctx) {
+  int i;
+  int64_t mux_offset, sent, last_send_us;
+
+  if (!br_ctx->io) return;
+
+  // (counting the packets of earlier segments as well)
+  mux_offset = ffmpbr_io_mux_offset(br_ctx->io);
+  for (i=0; i<br_ctx->output_fmt_ctx->nb_streams; ++i) {
+    ffmpbr_latency_muxed(&br_ctx->latency, i,
+      br_ctx->segment_frames_base[i] + br_ctx->output_fmt_ctx->streams[i]->nb_frames, mux_offset);
+  }
+
+  // inline, the bytes were flushed to the sink before the muxer returned;
+  // with the shared event loop, some of them may already have been sent
+  sent = ffmpbr_io_sent(br_ctx->io, &last_send_us);
+  ffmpbr_latency_sent(&br_ctx->latency, sent, last_send_us);
+}
+
+// our flv muxer takes the place of libavformat's, which would have set the
+// streams up in milliseconds as well
+int _write_flv_header(FFmpegBridgeContext *br_ctx) {
+  int i;
+
+  for (i=0; i<br_ctx->output_fmt_ctx->nb_streams; ++i) {
+    br_ctx->output_fmt_ctx->streams[i]->time_base = (AVRational){ 1, 1000 };
+  }
+  return ffmpbr_flv_write_header(&br_ctx->flv, br_ctx->io->pb, br_ctx->video_stream->codec,
+    br_ctx->audio_stream->codec, br_ctx->video_fps);
+}
+
+int _write_flv_packet(FFmpegBridgeContext *br_ctx, AVPacket *packet) {
+  int rc;
+
+  if (packet->stream_index == br_ctx->video_stream_index) {
+    rc = ffmpbr_flv_write_video(&br_ctx->flv, packet->data, packet->size, packet->dts,
+      packet->pts, packet->flags & AV_PKT_FLAG_KEY);
+  } else {
+    rc = ffmpbr_flv_write_audio(&br_ctx->flv, packet->data, packet->size, packet->pts);
+  }
+
+  // (counted as libavformat would, for _track_muxed_packets)
+  if (rc >= 0) br_ctx->output_fmt_ctx->streams[packet->stream_index]->nb_frames++;
+  return rc;
+}
+
+int _write_packet(FFmpegBridgeContext *br_ctx, AVPacket *packet) {
   int rc;
 
   LOGD("writing frame to stream %d: (pts=%lld, size=%d)",
     packet->stream_index, packet->pts, packet->size);
 
-  rc = av_interleaved_write_frame(br_ctx->output_fmt_ctx, packet);
+  if (br_ctx->enhanced_flv) {
+    rc = _write_flv_packet(br_ctx, packet);
+  } else {
+    rc = av_interleaved_write_frame(br_ctx->output_fmt_ctx, packet);
+  }
   if (rc < 0){
     LOGE("ERROR: _write_packet stream (stream %d) -- %s",
       packet->stream_index, av_err2str(rc));
   }
+
+  _track_muxed_packets(br_ctx);
+  return rc;
+}
+
+// what became of a packet that went into the muxer
+int _written_status(FFmpegBridgeContext *br_ctx) {
+  if (!br_ctx->io) return FFMPBR_WRITE_OK;
+  if (ffmpbr_io_failed(br_ctx->io) < 0) return FFMPBR_WRITE_DISCONNECTED;
+  return ffmpbr_io_queued(br_ctx->io) > 0 ? FFMPBR_WRITE_QUEUED : FFMPBR_WRITE_OK;
+}
+
+// a keyframe would help, for reason -- it's asked for once the packet is
+// written (see _request_keyframe)
+void _want_keyframe(FFmpegBridgeContext *br_ctx, int reason) {
+  if (!br_ctx->keyframe_callback || br_ctx->keyframe_reason) return;
+  br_ctx->keyframe_reason = reason;
+}
+
+// at the end of a write -- ask for the keyframe wanted (on the dispatch
+// thread), unless the last request was too recent
+void _request_keyframe(FFmpegBridgeContext *br_ctx) {
+  int reason = br_ctx->keyframe_reason;
+  int64_t now;
+
+  if (!reason) return;
+  br_ctx->keyframe_reason = 0;
+
+  now = ffmpbr_now_us();
+  if (br_ctx->keyframe_requested_us &&
+    now - br_ctx->keyframe_requested_us < br_ctx->keyframe_interval_us) {
+    br_ctx->keyframe_stats.suppressed++;
+    return;
+  }
+  if (ffmpbr_dispatch_post(br_ctx->keyframe_dispatch, br_ctx, br_ctx->keyframe_callback,
+    br_ctx->keyframe_opaque, reason) < 0) {
+    br_ctx->keyframe_stats.suppressed++;
+    return;
+  }
+  br_ctx->keyframe_requested_us = now;
+  if (!br_ctx->keyframe_wanted_us) br_ctx->keyframe_wanted_us = now;
+  br_ctx->keyframe_stats.requests++;
+}
+
+// a video keyframe came in -- if one was asked for, that's how long it took
+void _keyframe_arrived(FFmpegBridgeContext *br_ctx) {
+  FFmpegBridgeKeyframeStats *stats = &br_ctx->keyframe_stats;
+
+  if (!br_ctx->keyframe_wanted_us) return;
+  stats->last_wait_us = ffmpbr_now_us() - br_ctx->keyframe_wanted_us;
+  if (stats->last_wait_us > stats->max_wait_us) stats->max_wait_us = stats->last_wait_us;
+  br_ctx->keyframe_wanted_us = 0;
+}
+
+// the FFMPBR_WRITE_* status of a packet that shouldn't go into the muxer
+// at all, or 0 (see ffmpbr_set_write_queue_limit)
+int _check_output(FFmpegBridgeContext *br_ctx, int is_video, int is_video_keyframe) {
+  // (the header couldn't be written, so there's nothing to mux into)
+  if (!br_ctx->header_written) return FFMPBR_WRITE_DROPPED;
+  if (!br_ctx->io) return 0;
+
+  // (with backup urls, packets carry on into the GOP cache, and the next
+  // keyframe tries the ingests again)
+  if (!br_ctx->gop && ffmpbr_io_failed(br_ctx->io) < 0) return FFMPBR_WRITE_DISCONNECTED;
+  if (br_ctx->transport.queue_limit <= 0) return 0;
+
+  // a video packet turned away takes the ones that refer to it along, until
+  // a keyframe, which is asked for as soon as one would fit
+  if (is_video && br_ctx->video_blocked && !is_video_keyframe) {
+    if (ffmpbr_io_queued(br_ctx->io) <= br_ctx->transport.queue_limit) {
+      _want_keyframe(br_ctx, FFMPBR_KEYFRAME_FOR_BACKPRESSURE);
+    }
+    return FFMPBR_WRITE_WOULD_BLOCK;
+  }
+  if (ffmpbr_io_queued(br_ctx->io) > br_ctx->transport.queue_limit) {
+    if (is_video) br_ctx->video_blocked = 1;
+    return FFMPBR_WRITE_WOULD_BLOCK;
+  }
+  if (is_video) br_ctx->video_blocked = 0;
+  return 0;
+}
+
+// keep a copy of an SPS or PPS
+void _remember_unit(uint8_t **unit, int *unit_size, FFmpegBridgeNal *nal) {
+  if (*unit && *unit_size == nal->size && !memcmp(*unit, nal->data, nal->size)) return;
+
+  av_free(*unit);
+  *unit = av_malloc(nal->size);
+  *unit_size = nal->size;
+  memcpy(*unit, nal->data, nal->size);
+}
+
+void _set_audio_extradata(FFmpegBridgeContext *br_ctx, const uint8_t *extradata, int extradata_size) {
+  // this will automatically be freed by avformat_free_context() during ffmpbr_finalize()
+  br_ctx->audio_stream->codec->extradata = av_malloc(extradata_size);
+  br_ctx->audio_stream->codec->extradata_size = extradata_size;
+  memcpy(br_ctx->audio_stream->codec->extradata, extradata, extradata_size);
+
+  _log_codec_attributes(br_ctx->audio_stream->codec);
+}
+
+void _set_video_extradata(FFmpegBridgeContext *br_ctx, const uint8_t *extradata, int extradata_size) {
+  FFmpegBridgeNal nals[FFMPBR_NAL_MAX_UNITS];
+  int num_nals, i;
+
+  // remember the parameter sets, so that in-band copies can be dropped
+  if (br_ctx->video_codec_id == CODEC_ID_H264 && ffmpbr_nal_is_annexb(extradata, extradata_size)) {
+    num_nals = ffmpbr_nal_split((uint8_t *)extradata, extradata_size, nals, FFMPBR_NAL_MAX_UNITS);
+    for (i=0; i<num_nals; ++i) {
+      if (FFMPBR_NAL_TYPE(&nals[i]) == FFMPBR_NAL_SPS && !br_ctx->video_param_sets.sps) {
+        _remember_unit(&br_ctx->video_param_sets.sps, &br_ctx->video_param_sets.sps_size, &nals[i]);
+      } else if (FFMPBR_NAL_TYPE(&nals[i]) == FFMPBR_NAL_PPS && !br_ctx->video_param_sets.pps) {
+        _remember_unit(&br_ctx->video_param_sets.pps, &br_ctx->video_param_sets.pps_size, &nals[i]);
+      }
+    }
+  }
+
+  // this will automatically be freed by avformat_free_context() during ffmpbr_finalize()
+  if (br_ctx->video_codec_id == CODEC_ID_H264 &&
+    _wants_avcc(br_ctx->output_fmt_ctx->oformat) &&
+    ffmpbr_nal_is_annexb(extradata, extradata_size) &&
+    ffmpbr_nal_build_avcc_extradata((uint8_t *)extradata, extradata_size,
+      &br_ctx->video_stream->codec->extradata, &br_ctx->video_stream->codec->extradata_size) == 0) {
+    LOGI("Converted video extradata to avcC, packets will be converted to match");
+    br_ctx->video_avcc = 1;
+  } else if (br_ctx->enhanced_flv &&
+    ffmpbr_nal_is_annexb(extradata, extradata_size) &&
+    ffmpbr_nal_build_hvcc_extradata((uint8_t *)extradata, extradata_size,
+      &br_ctx->video_stream->codec->extradata, &br_ctx->video_stream->codec->extradata_size) == 0) {
+    LOGI("Converted video extradata to hvcC, packets will be converted to match");
+    br_ctx->video_avcc = 1;
+  } else {
+    br_ctx->video_stream->codec->extradata = av_malloc(extradata_size);
+    br_ctx->video_stream->codec->extradata_size = extradata_size;
+    memcpy(br_ctx->video_stream->codec->extradata, extradata, extradata_size);
+  }
+
+  _log_codec_attributes(br_ctx->video_stream->codec);
+}
+
+// muxers built on libavformat's mov muxer (mp4, mov, ismv, ...) all take
+// movflags
+int _is_mov_family(AVOutputFormat *fmt) {
+  return fmt->priv_class &&
+    av_opt_find((void *)&fmt->priv_class, "movflags", NULL, 0, AV_OPT_SEARCH_FAKE_OBJ) != NULL;
+}
+
+// the muxer options for avformat_write_header
+void _mux_options(FFmpegBridgeContext *br_ctx, AVFormatContext *fmt_ctx, AVDictionary **opts) {
+  char value[32];
+
+  if (br_ctx->hls && br_ctx->hls->cmaf) {
+    // a moof at every keyframe, with its data offsets relative to itself,
+    // so that the segments can be served on their own
+    av_dict_set(opts, "movflags", "frag_keyframe+empty_moov+omit_tfhd_offset", 0);
+  } else if (br_ctx->mp4_fragment_ms > 0 && _is_mov_family(fmt_ctx->oformat)) {
+    // an empty moov up front, then a moof/mdat pair at every keyframe, or
+    // once a fragment gets this long
+    av_dict_set(opts, "movflags", "frag_keyframe+empty_moov", 0);
+    snprintf(value, sizeof(value), "%lld", br_ctx->mp4_fragment_ms * 1000LL);
+    av_dict_set(opts, "frag_duration", value, 0);
+    LOGI("Writing fragmented mp4, %d ms fragments", br_ctx->mp4_fragment_ms);
+  } else if (!strcmp(fmt_ctx->oformat->name, "mpegts") &&
+    av_strstart(br_ctx->output_url, "udp:", NULL)) {
+    // every audio frame in a PES of its own, rather than held back until
+    // there are a few KB of them
+    av_dict_set(opts, "pes_payload_size", "0", 0);
+  }
+
+  // whatever the avio layer didn't take, over ours
+  av_dict_copy(opts, br_ctx->output_options, 0);
+}
+
+int _write_mux_header(FFmpegBridgeContext *br_ctx, AVFormatContext *fmt_ctx) {
+  AVDictionary *opts = NULL;
+  AVDictionaryEntry *unused = NULL;
+  int rc;
+
+  _mux_options(br_ctx, fmt_ctx, &opts);
+  rc = avformat_write_header(fmt_ctx, &opts);
+  while ((unused = av_dict_get(opts, "", unused, AV_DICT_IGNORE_SUFFIX))) {
+    LOGE("ERROR: _write_mux_header -- %s muxer ignored option %s", fmt_ctx->oformat->name,
+      unused->key);
+  }
+  av_dict_free(&opts);
+  return rc;
+}
+
+// the path of a local file url, or NULL
+const char* _local_path(const char *url) {
+  av_strstart(url, "file:", &url);
+  return strstr(url, "://") ? NULL : url;
+}
+
+// regular local files only -- the rest (urls, devices) are left alone
+void _remove_output(const char *url) {
+  const char *path = _local_path(url);
+  struct stat st;
+
+  if (path && stat(path, &st) == 0 && S_ISREG(st.st_mode)) unlink(path);
+}
+
+// the segment thread's side of segmented recording, see ffmpegbridge_segment.h
+int _open_segment(void *opaque, FFmpegBridgeSegment *segment) {
+  FFmpegBridgeContext *br_ctx = opaque;
+  AVFormatContext *fmt_ctx = NULL;
+  AVStream *st;
+  int rc, i;
+
+  ffmpbr_segment_url(segment->url, sizeof(segment->url), br_ctx->output_url, segment->index);
+  rc = avformat_alloc_output_context2(&fmt_ctx, NULL, br_ctx->output_fmt_name, segment->url);
+  if (rc < 0) return rc;
+  fmt_ctx->start_time_realtime = 0;
+
+  for (i=0; i<FFMPBR_LATENCY_MAX_STREAMS && br_ctx->segment_codecs[i]; ++i) {
+    st = avformat_new_stream(fmt_ctx, NULL);
+    if (!st || avcodec_copy_context(st->codec, br_ctx->segment_codecs[i]) < 0) {
+      avformat_free_context(fmt_ctx);
+      return AVERROR(ENOMEM);
+    }
+    st->id = i;
+    st->codec->codec_tag = 0;
+  }
+
+  segment->io = ffmpbr_io_open(segment->url, NULL, &br_ctx->transport, NULL, &rc);
+  if (!segment->io) {
+    avformat_free_context(fmt_ctx);
+    return rc;
+  }
+  _use_io(fmt_ctx, segment->io);
+  segment->fmt_ctx = fmt_ctx;
+
+  rc = _write_mux_header(br_ctx, fmt_ctx);
+  if (rc < 0) {
+    ffmpbr_io_close(segment->io);
+    fmt_ctx->pb = NULL;
+    avformat_free_context(fmt_ctx);
+    _remove_output(segment->url);
+  }
+  return rc;
+}
+
+void _close_segment(void *opaque, FFmpegBridgeSegment *segment, int used) {
+  int rc;
+
+  if (used) {
+    rc = av_write_trailer(segment->fmt_ctx);
+    if (rc < 0) {
+      LOGE("ERROR: _close_segment -- trailer of %s: %s", segment->url, av_err2str(rc));
+    }
+  }
+  ffmpbr_io_close(segment->io);
+  segment->fmt_ctx->pb = NULL;
+  avformat_free_context(segment->fmt_ctx);
+  if (!used) {
+    _remove_output(segment->url);
+  }
+}
+
+// once the header is written, the streams are configured for good
+void _start_segmenting(FFmpegBridgeContext *br_ctx) {
+  int i;
+
+  for (i=0; i<br_ctx->output_fmt_ctx->nb_streams && i<FFMPBR_LATENCY_MAX_STREAMS; ++i) {
+    br_ctx->segment_codecs[i] = avcodec_alloc_context3(NULL);
+    avcodec_copy_context(br_ctx->segment_codecs[i], br_ctx->output_fmt_ctx->streams[i]->codec);
+  }
+  br_ctx->segment->fmt_ctx = br_ctx->output_fmt_ctx;
+  br_ctx->segment->io = br_ctx->io;
+  br_ctx->segment->start_pts = AV_NOPTS_VALUE;
+
+  if (ffmpbr_segmenter_start(&br_ctx->segmenter, br_ctx->segment_ms, br_ctx->segment->index,
+    _open_segment, _close_segment, br_ctx) < 0) {
+    LOGE("ERROR: _start_segmenting -- recording to %s only", br_ctx->segment->url);
+  }
+}
+
+// at a keyframe -- move on to the next segment if this one is long enough,
+// and it's open yet. Whatever the interleaver is still holding goes into
+// the old segment, and packet counts and byte offsets carry on across, so
+// that latency tracking doesn't notice.
+void _rotate_segment(FFmpegBridgeContext *br_ctx, int64_t pts, int64_t dts) {
+  FFmpegBridgeSegment *current = br_ctx->segment, *next;
+  int64_t t;
+  int i;
+
+  if (current->start_pts == AV_NOPTS_VALUE) {
+    current->start_pts = pts;
+    return;
+  }
+  if (!ffmpbr_segmenter_due(&br_ctx->segmenter, current->start_pts, pts)) return;
+
+  t = ffmpbr_now_us();
+  next = ffmpbr_segmenter_take(&br_ctx->segmenter);
+  if (!next) {
+    LOGI("Segment %d isn't open yet, staying on %s", current->index + 1, current->url);
+    return;
+  }
+
+  FFMPBR_TRACE_BEGIN(rotate_segment, "rotate_segment");
+  av_interleaved_write_frame(current->fmt_ctx, NULL);
+  _track_muxed_packets(br_ctx);
+  for (i=0; i<current->fmt_ctx->nb_streams && i<FFMPBR_LATENCY_MAX_STREAMS; ++i) {
+    br_ctx->segment_frames_base[i] += current->fmt_ctx->streams[i]->nb_frames;
+  }
+  ffmpbr_io_handoff(current->io, next->io);
+
+  next->start_pts = pts;
+  next->ts_offset = dts;
+  br_ctx->segment = next;
+  br_ctx->output_fmt_ctx = next->fmt_ctx;
+  br_ctx->io = next->io;
+  br_ctx->video_stream = next->fmt_ctx->streams[br_ctx->video_stream_index];
+  br_ctx->audio_stream = next->fmt_ctx->streams[br_ctx->audio_stream_index];
+  FFMPBR_TRACE_END(rotate_segment, "rotate_segment");
+
+  ffmpbr_segmenter_retire(&br_ctx->segmenter, current, ffmpbr_now_us() - t);
+  LOGI("Rotated from %s to %s", current->url, next->url);
+}
+
+// once the stream is under way with backup urls, keep a copy of the GOP so
+// far to start the next ingest with
+void _start_failover(FFmpegBridgeContext *br_ctx) {
+  int64_t bit_rate = (int64_t)br_ctx->video_bit_rate + br_ctx->audio_bit_rate;
+
+  if (br_ctx->segment || br_ctx->hls || !br_ctx->io) {
+    LOGE("ERROR: _start_failover -- backup urls only apply to a live output, ignoring them");
+    return;
+  }
+  br_ctx->reconnect = ffmpbr_reconnect_start(br_ctx->ingest_urls, br_ctx->ingest_url_count,
+    br_ctx->ingest_options, &br_ctx->transport);
+  if (!br_ctx->reconnect) {
+    LOGE("ERROR: _start_failover -- carrying on without the backup urls");
+    return;
+  }
+  br_ctx->gop = av_malloc(sizeof(FFmpegBridgeGop));
+  ffmpbr_gop_init(br_ctx->gop, bit_rate / 8 * FFMPBR_GOP_CACHE_SECONDS);
+}
+
+// sends the GOP cache out on a new ingest. Its packets were counted as
+// muxed (muxed, per stream) on the old one, so the count picks up from
+// there, and latency tracking carries on with the packets after them.
+int _replay_gop(FFmpegBridgeContext *br_ctx, const int64_t *muxed) {
+  FFmpegBridgeGop *gop = br_ctx->gop;
+  FFmpegBridgeGopPacket *cached;
+  AVPacket packet;
+  int64_t counts[FFMPBR_LATENCY_MAX_STREAMS] = { 0 };
+  int rc = 0, i;
+
+  for (i=0; i<gop->count; ++i) {
+    counts[gop->packets[i].stream_index]++;
+  }
+  for (i=0; i<FFMPBR_LATENCY_MAX_STREAMS; ++i) {
+    br_ctx->segment_frames_base[i] = muxed[i] - counts[i];
+  }
+
+  for (i=0; i<gop->count && rc >= 0; ++i) {
+    cached = &gop->packets[i];
+    av_init_packet(&packet);
+    packet.stream_index = cached->stream_index;
+    packet.data = gop->data + cached->offset;
+    packet.size = cached->size;
+    packet.pts = cached->pts;
+    packet.dts = cached->dts;
+    if (cached->keyframe) packet.flags |= AV_PKT_FLAG_KEY;
+    _rescale_packet(br_ctx, br_ctx->output_fmt_ctx->streams[packet.stream_index], &packet);
+    rc = _write_packet(br_ctx, &packet);
+  }
+  if (rc >= 0) rc = ffmpbr_io_failed(br_ctx->io);
+  if (rc >= 0) br_ctx->failover_stats.replayed_packets += gop->count;
+  return rc;
+}
+
+// a fresh muxer on the same streams (so with the same extradata) in place
+// of the current one, on io (a new connection to url), then the header and
+// the GOP cache. The old output is closed either way; whatever it was
+// still holding is lost, but it's all in the GOP cache.
+int _switch_ingest(FFmpegBridgeContext *br_ctx, FFmpegBridgeIO *io, const char *url,
+  const int64_t *muxed) {
+  AVFormatContext *fmt_ctx = NULL, *old_fmt_ctx = br_ctx->output_fmt_ctx;
+  FFmpegBridgeIO *old_io = br_ctx->io;
+  AVStream *st;
+  int rc, i;
+
+  rc = avformat_alloc_output_context2(&fmt_ctx, NULL, br_ctx->output_fmt_name, url);
+  if (rc < 0) {
+    ffmpbr_io_close(io);
+    return rc;
+  }
+  fmt_ctx->start_time_realtime = 0;
+
+  for (i=0; i<old_fmt_ctx->nb_streams; ++i) {
+    st = avformat_new_stream(fmt_ctx, NULL);
+    if (!st || avcodec_copy_context(st->codec, old_fmt_ctx->streams[i]->codec) < 0) {
+      avformat_free_context(fmt_ctx);
+      ffmpbr_io_close(io);
+      return AVERROR(ENOMEM);
+    }
+    st->id = i;
+    st->codec->codec_tag = 0;
+  }
+  _use_io(fmt_ctx, io);
+
+  // the new connection carries on from the old one's byte offsets, and
+  // takes over reporting to the latency tracker
+  ffmpbr_io_handoff(old_io, io);
+  br_ctx->output_fmt_ctx = fmt_ctx;
+  br_ctx->io = io;
+  br_ctx->video_stream = fmt_ctx->streams[br_ctx->video_stream_index];
+  br_ctx->audio_stream = fmt_ctx->streams[br_ctx->audio_stream_index];
+
+  // (draining the interleaver into the dead output frees what it held)
+  if (!br_ctx->enhanced_flv) av_interleaved_write_frame(old_fmt_ctx, NULL);
+  ffmpbr_io_close(old_io);
+  old_fmt_ctx->pb = NULL;
+  avformat_free_context(old_fmt_ctx);
+
+  FFMPBR_TRACE_BEGIN(write_header, "write_header");
+  if (br_ctx->enhanced_flv) {
+    rc = _write_flv_header(br_ctx);
+  } else {
+    rc = _write_mux_header(br_ctx, fmt_ctx);
+  }
+  FFMPBR_TRACE_END(write_header, "write_header");
+  if (rc < 0) return rc;
+  return _replay_gop(br_ctx, muxed);
+}
+
+// the ingest failed (with rc) -- the reconnect thread looks for the next
+// url that takes a connection, wrapping around so that the one that failed
+// is tried last, while packets carry on into the GOP cache
+void _ingest_failed(FFmpegBridgeContext *br_ctx, int rc) {
+  FFmpegBridgeFailoverStats *stats = &br_ctx->failover_stats;
+
+  LOGE("ERROR: _ingest_failed -- ingest %s failed: %s", br_ctx->ingest_urls[stats->ingest_index],
+    av_err2str(rc));
+  stats->last_failure_us = ffmpbr_now_us();
+  stats->down = 1;
+  ffmpbr_reconnect_request(br_ctx->reconnect, stats->ingest_index);
+}
+
+// while the ingest is down, with a keyframe in the GOP cache -- swap in the
+// connection the reconnect thread made, if it's made one yet. If the header
+// or the GOP cache can't be sent on it either, the packets in the cache are
+// counted as sent, and the thread moves on to the next url.
+void _fail_over(FFmpegBridgeContext *br_ctx) {
+  FFmpegBridgeFailoverStats *stats = &br_ctx->failover_stats;
+  int64_t muxed[FFMPBR_LATENCY_MAX_STREAMS] = { 0 };
+  FFmpegBridgeIO *io;
+  int rc, i, index;
+
+  io = ffmpbr_reconnect_take(br_ctx->reconnect, &index);
+  if (!io) return;
+
+  FFMPBR_TRACE_BEGIN(fail_over, "fail_over");
+  for (i=0; i<br_ctx->output_fmt_ctx->nb_streams && i<FFMPBR_LATENCY_MAX_STREAMS; ++i) {
+    muxed[i] = br_ctx->segment_frames_base[i] + br_ctx->output_fmt_ctx->streams[i]->nb_frames;
+  }
+  rc = _switch_ingest(br_ctx, io, br_ctx->ingest_urls[index], muxed);
+  FFMPBR_TRACE_END(fail_over, "fail_over");
+  stats->ingest_index = index;
+
+  if (rc < 0) {
+    LOGE("ERROR: _fail_over -- couldn't switch to %s: %s", br_ctx->ingest_urls[index],
+      av_err2str(rc));
+    stats->failed_attempts++;
+    for (i=0; i<br_ctx->output_fmt_ctx->nb_streams && i<FFMPBR_LATENCY_MAX_STREAMS; ++i) {
+      br_ctx->segment_frames_base[i] = muxed[i] - br_ctx->output_fmt_ctx->streams[i]->nb_frames;
+    }
+    ffmpbr_reconnect_request(br_ctx->reconnect, index);
+    return;
+  }
+
+  stats->down = 0;
+  stats->failovers++;
+  stats->last_failover_us = ffmpbr_now_us() - stats->last_failure_us;
+  if (stats->last_failover_us > stats->max_failover_us) {
+    stats->max_failover_us = stats->last_failover_us;
+  }
+  LOGI("Failed over to %s in %lld ms, %d packets sent again", br_ctx->ingest_urls[index],
+    stats->last_failover_us / 1000, br_ctx->gop->count);
+}
+
+// with backup urls -- write the packet, and fail over if the ingest went
+// down. While it's down, packets are dropped (but counted as muxed, so that
+// latency tracking stays in step) until there's a new connection, and a
+// keyframe in the GOP cache to start it with. A cache that overflowed (or
+// a failure before the first keyframe) leaves it waiting for the next
+// keyframe, which is asked for; so does a round of attempts that reached
+// none of the urls, as the next keyframe starts another.
+void _write_ingest_packet(FFmpegBridgeContext *br_ctx, AVPacket *packet, int is_video_keyframe) {
+  FFmpegBridgeFailoverStats *stats = &br_ctx->failover_stats;
+  int rc;
+
+  if (!stats->down) {
+    rc = _write_packet(br_ctx, packet);
+    if (rc < 0) {
+      // (it didn't get muxed, but it's in the GOP cache)
+      br_ctx->segment_frames_base[packet->stream_index]++;
+    } else {
+      rc = ffmpbr_io_failed(br_ctx->io);
+    }
+    if (rc < 0) {
+      _ingest_failed(br_ctx, rc);
+    }
+    return;
+  }
+
+  br_ctx->segment_frames_base[packet->stream_index]++;
+  if (is_video_keyframe) {
+    ffmpbr_reconnect_request(br_ctx->reconnect, stats->ingest_index);
+  }
+  if (br_ctx->gop->valid) {
+    _fail_over(br_ctx);
+  }
+  if (stats->down) {
+    stats->dropped_packets++;
+    _track_muxed_packets(br_ctx);
+    if (!br_ctx->gop->valid || ffmpbr_reconnect_gave_up(br_ctx->reconnect)) {
+      _want_keyframe(br_ctx, FFMPBR_KEYFRAME_FOR_FAILOVER);
+    }
+  }
+}
+
+// in-memory output -- start collecting segments into hls
+void _start_hls(FFmpegBridgeContext *br_ctx, int segment_ms) {
+  AVFormatContext *fmt_ctx = br_ctx->output_fmt_ctx;
+  int cmaf = _is_mov_family(fmt_ctx->oformat);
+
+  if (!br_ctx->hls_callback || br_ctx->header_written || br_ctx->hls ||
+    (!cmaf && strcmp(fmt_ctx->oformat->name, "mpegts"))) {
+    LOGE("ERROR: _start_hls -- needs mpegts or mp4, and a callback set before the header");
+    return;
+  }
+
+  br_ctx->hls = av_mallocz(sizeof(FFmpegBridgeHls));
+  if (ffmpbr_hls_init(br_ctx->hls, cmaf, segment_ms, br_ctx->hls_list_size,
+    1000000 / FFMAX(br_ctx->video_fps, 1), br_ctx->output_url + strlen(FFMPBR_MEMORY_URL),
+    br_ctx->hls_callback, br_ctx->hls_opaque) < 0) {
+    LOGE("ERROR: _start_hls -- out of memory");
+    av_freep(&br_ctx->hls);
+    return;
+  }
+  fmt_ctx->pb = br_ctx->hls->pb;
+  fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO | AVFMT_FLAG_FLUSH_PACKETS;
+  fmt_ctx->flush_packets = 1;
+}
+
+// at a keyframe that starts a new segment -- get everything before it out
+// of the interleaver and the muxer (for mp4, that's the fragment so far),
+// and cut there
+void _cut_hls_segment(FFmpegBridgeContext *br_ctx, int64_t pts) {
+  AVFormatContext *fmt_ctx = br_ctx->output_fmt_ctx;
+
+  FFMPBR_TRACE_BEGIN(cut_hls_segment, "cut_hls_segment");
+  av_interleaved_write_frame(fmt_ctx, NULL);
+  av_write_frame(fmt_ctx, NULL);
+  ffmpbr_hls_cut(br_ctx->hls, pts);
+
+  // every MPEG-TS segment starts with its own PAT and PMT
+  if (!br_ctx->hls->cmaf) {
+    av_opt_set(fmt_ctx->priv_data, "mpegts_flags", "+resend_headers", 0);
+  }
+  FFMPBR_TRACE_END(cut_hls_segment, "cut_hls_segment");
+}
+
+int _write_header(FFmpegBridgeContext *br_ctx) {
+  int rc;
+
+  if (!br_ctx->io && !br_ctx->output_fmt_ctx->pb) {
+    LOGD("opening output url ...");
+    rc = _open_output_url(br_ctx);
+    if (rc < 0) {
+      LOGE("ERROR: _write_header -- couldn't open %s: %s", br_ctx->output_url, av_err2str(rc));
+      return rc;
+    }
+  }
+  if (!br_ctx->output_fmt_ctx->pb && !(br_ctx->output_fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+    LOGE("ERROR: _write_header -- there's no output to write to");
+    return AVERROR(EINVAL);
+  }
+
+  LOGI("Writing header ...");
+  FFMPBR_TRACE_BEGIN(write_header, "write_header");
+  if (br_ctx->enhanced_flv) {
+    rc = _write_flv_header(br_ctx);
+  } else {
+    rc = _write_mux_header(br_ctx, br_ctx->output_fmt_ctx);
+  }
+  FFMPBR_TRACE_END(write_header, "write_header");
+  if (rc < 0) {
+    LOGE("Error writing header: %s", av_err2str(rc));
+    return rc;
+  }
+  br_ctx->header_written = 1;
+  if (br_ctx->segment) {
+    _start_segmenting(br_ctx);
+  }
+  if (br_ctx->hls) {
+    ffmpbr_hls_header_written(br_ctx->hls);
+  }
+  if (br_ctx->ingest_url_count) {
+    _start_failover(br_ctx);
+  }
+
+  // (only now that the reorder depth and frame rate are settled)
+  ffmpbr_timestamps_init(&br_ctx->timestamps, br_ctx->video_dts.depth == 0,
+    br_ctx->video_dts.frame_duration, br_ctx->video_dts.depth * br_ctx->video_dts.frame_duration);
+  return 0;
+}
+
+// fill in whatever configuration Java didn't provide, and write the header
+int _auto_start(FFmpegBridgeContext *br_ctx) {
+  AVCodecContext *c = br_ctx->video_stream->codec;
+  FFmpegBridgeSps sps;
+  FFmpegBridgeAdts adts;
+  uint8_t *extradata;
+  int size;
+
+  if (!c->extradata_size) {
+    if (!br_ctx->auto_sps || !br_ctx->auto_pps) {
+      LOGE("ERROR: _auto_start -- IDR before any SPS and PPS, waiting for the next one");
+      return AVERROR(EAGAIN);
+    }
+
+    if (ffmpbr_nal_parse_sps(br_ctx->auto_sps, br_ctx->auto_sps_size, &sps) == 0) {
+      LOGI("Video from the bitstream: %dx%d, profile %d, level %d",
+        sps.width, sps.height, sps.profile_idc, sps.level_idc);
+      c->width = br_ctx->video_width = sps.width;
+      c->height = br_ctx->video_height = sps.height;
+    } else {
+      LOGE("ERROR: _auto_start -- could not parse the SPS, keeping %dx%d", c->width, c->height);
+    }
+
+    // Annex-B, just as MediaCodec's codec config buffer would have been
+    size = 8 + br_ctx->auto_sps_size + br_ctx->auto_pps_size;
+    extradata = av_malloc(size);
+    AV_WB32(extradata, 1);
+    memcpy(extradata + 4, br_ctx->auto_sps, br_ctx->auto_sps_size);
+    AV_WB32(extradata + 4 + br_ctx->auto_sps_size, 1);
+    memcpy(extradata + 8 + br_ctx->auto_sps_size, br_ctx->auto_pps, br_ctx->auto_pps_size);
+    _set_video_extradata(br_ctx, extradata, size);
+    av_free(extradata);
+  }
+
+  if (!br_ctx->audio_stream->codec->extradata_size) {
+    if (!br_ctx->auto_audio_config_size) {
+      // no audio yet -- rather than hold the video back, assume AAC LC as
+      // configured
+      LOGI("No audio config seen yet, assuming AAC LC at %d Hz, %d channels",
+        br_ctx->audio_sample_rate, br_ctx->audio_num_channels);
+      adts.object_type = 2;
+      adts.sample_rate_index = ffmpbr_adts_sample_rate_index(br_ctx->audio_sample_rate);
+      adts.channel_config = br_ctx->audio_num_channels;
+      if (adts.sample_rate_index < 0) {
+        LOGE("ERROR: _auto_start -- unsupported AAC sample rate %d", br_ctx->audio_sample_rate);
+        adts.sample_rate_index = 4;
+      }
+      ffmpbr_adts_audio_specific_config(&adts, br_ctx->auto_audio_config);
+      br_ctx->auto_audio_config_size = 2;
+    }
+    _set_audio_extradata(br_ctx, br_ctx->auto_audio_config, br_ctx->auto_audio_config_size);
+  }
+
+  return _write_header(br_ctx);
+}
+
+// returns AVERROR(EAGAIN) for packets that come before the header
+int _auto_config_video(FFmpegBridgeContext *br_ctx, FFmpegBridgeNal *nals, int num_nals,
+  int *is_keyframe) {
+  int has_idr = 0, has_slice = 0, i;
+
+  for (i=0; i<num_nals; ++i) {
+    switch (FFMPBR_NAL_TYPE(&nals[i])) {
+    case FFMPBR_NAL_SLICE:
+      has_slice = 1;
+      break;
+    case FFMPBR_NAL_SPS:
+      _remember_unit(&br_ctx->auto_sps, &br_ctx->auto_sps_size, &nals[i]);
+      break;
+    case FFMPBR_NAL_PPS:
+      _remember_unit(&br_ctx->auto_pps, &br_ctx->auto_pps_size, &nals[i]);
+      break;
+    case FFMPBR_NAL_IDR:
+      has_idr = 1;
+      break;
+    }
+  }
+  if (has_idr) *is_keyframe = 1;
+
+  if (br_ctx->header_written) return 0;
+  if (!has_idr || _auto_start(br_ctx) < 0) {
+    // (the encoder is mid-GOP, rather than just starting out with its
+    // codec config)
+    if (has_slice || has_idr) _want_keyframe(br_ctx, FFMPBR_KEYFRAME_FOR_START);
+    br_ctx->auto_dropped_packets++;
+    return AVERROR(EAGAIN);
+  }
+  return 0;
+}
+
+// returns AVERROR(EAGAIN) for packets that come before the header
+int _auto_config_audio(FFmpegBridgeContext *br_ctx, const uint8_t *data, int data_size) {
+  AVCodecContext *c = br_ctx->audio_stream->codec;
+  FFmpegBridgeAdts adts;
+
+  if (br_ctx->header_written) return 0;
+
+  if (ffmpbr_adts_parse(data, data_size, &adts) == 0) {
+    ffmpbr_adts_audio_specific_config(&adts, br_ctx->auto_audio_config);
+    br_ctx->auto_audio_config_size = 2;
+    c->sample_rate = br_ctx->audio_sample_rate = adts.sample_rate;
+    if (adts.channel_config) {
+      c->channels = br_ctx->audio_num_channels = adts.channel_config;
+    }
+  } else if (data_size >= 2 && data_size <= sizeof(br_ctx->auto_audio_config)) {
+    // MediaCodec's first output buffer (BUFFER_FLAG_CODEC_CONFIG) is the
+    // AudioSpecificConfig itself
+    memcpy(br_ctx->auto_audio_config, data, data_size);
+    br_ctx->auto_audio_config_size = data_size;
+  }
+
+  br_ctx->auto_dropped_packets++;
+  return AVERROR(EAGAIN);
+}
+
+// a packet rewritten into video_scratch (see _prepare_video_packet) is
+// what goes on to the muxer
+int _use_scratch(FFmpegBridgeContext *br_ctx, int rc, uint8_t **data, int *data_size) {
+  if (rc < 0) return rc;
+  *data = br_ctx->video_scratch;
+  *data_size = rc;
+  return 0;
+}
+
+// HEVC packets only need converting to match hvcC extradata; auto config
+// and the NAL filter are H.264 only
+int _prepare_hevc_packet(FFmpegBridgeContext *br_ctx, uint8_t **data, int *data_size) {
+  int rc;
+
+  if (!br_ctx->video_avcc) return 0;
+
+  FFMPBR_TRACE_BEGIN(annexb_to_avcc, "annexb_to_avcc");
+  rc = ffmpbr_nal_annexb_to_avcc(*data, *data_size, &br_ctx->video_scratch,
+    &br_ctx->video_scratch_size);
+  FFMPBR_TRACE_END(annexb_to_avcc, "annexb_to_avcc");
+  return _use_scratch(br_ctx, rc, data, data_size);
+}
+
+// returns <0 if the packet should be dropped. *data is left alone, or
+// pointed at video_scratch if the packet had to be rewritten.
+int _prepare_video_packet(FFmpegBridgeContext *br_ctx, uint8_t **data, int *data_size,
+  int *is_keyframe) {
+  FFmpegBridgeNal nals[FFMPBR_NAL_MAX_UNITS];
+  int num_nals, num_kept, flags, rc;
+
+  if (!br_ctx->auto_config && !br_ctx->video_avcc && !br_ctx->nal_filter) return 0;
+  if (!ffmpbr_nal_is_annexb(*data, *data_size)) return 0;
+  if (br_ctx->video_codec_id == AV_CODEC_ID_HEVC) {
+    return _prepare_hevc_packet(br_ctx, data, data_size);
+  }
+  if (br_ctx->video_codec_id != CODEC_ID_H264) return 0;
+
+  num_nals = ffmpbr_nal_split(*data, *data_size, nals, FFMPBR_NAL_MAX_UNITS);
+  if (num_nals < 0) {
+    LOGE("ERROR: _prepare_video_packet -- more than %d NAL units in one packet",
+      FFMPBR_NAL_MAX_UNITS);
+    return AVERROR_INVALIDDATA;
+  }
+
+  if (br_ctx->auto_config) {
+    rc = _auto_config_video(br_ctx, nals, num_nals, is_keyframe);
+    if (rc < 0) return rc;
+  }
+
+  num_kept = num_nals;
+  if (br_ctx->nal_filter) {
+    // without out of band parameter sets, MPEG-TS needs them in-band, and
+    // its muxer would put back (by copying the packet) any AUD we took out
+    flags = br_ctx->nal_filter;
+    if (!br_ctx->video_avcc) {
+      flags &= ~(FFMPBR_NAL_FILTER_AUD | FFMPBR_NAL_FILTER_PARAM_SETS);
+    }
+    num_kept = ffmpbr_nal_filter(nals, num_nals, flags, &br_ctx->video_param_sets,
+      &br_ctx->nal_filter_stats);
+    if (!num_kept) return AVERROR(EAGAIN);
+  }
+
+  // hand the muxer AVCC to match the extradata
+  if (br_ctx->video_avcc) {
+    FFMPBR_TRACE_BEGIN(annexb_to_avcc, "annexb_to_avcc");
+    rc = ffmpbr_nal_write_avcc(nals, num_kept, &br_ctx->video_scratch,
+      &br_ctx->video_scratch_size);
+    FFMPBR_TRACE_END(annexb_to_avcc, "annexb_to_avcc");
+    return _use_scratch(br_ctx, rc, data, data_size);
+  }
+  if (num_kept != num_nals) {
+    rc = ffmpbr_nal_write_annexb(nals, num_kept, &br_ctx->video_scratch,
+      &br_ctx->video_scratch_size);
+    return _use_scratch(br_ctx, rc, data, data_size);
+  }
+
+  return 0;
 }
 
 void _write_trailer(FFmpegBridgeContext *br_ctx){
   LOGI("Writing trailer ...");
-  int rc = av_write_trailer(br_ctx->output_fmt_ctx);
+  FFMPBR_TRACE_BEGIN(write_trailer, "write_trailer");
+  int rc = br_ctx->enhanced_flv ? ffmpbr_flv_write_trailer(&br_ctx->flv) :
+    av_write_trailer(br_ctx->output_fmt_ctx);
+  FFMPBR_TRACE_END(write_trailer, "write_trailer");
   if (rc < 0) {
     LOGE("Error writing trailer: %s", av_err2str(rc));
   }
 }
 
+// everything ffmpbr_finalize does, filling in what became of the output
+void _finalize(FFmpegBridgeContext *br_ctx, FFmpegBridgeFinalizeResult *result) {
+  int64_t last_send_us;
+  int i;
+
+  // no more keyframe requests, and none left running once the caller
+  // lets go of their opaque
+  if (br_ctx->keyframe_dispatch) {
+    ffmpbr_dispatch_forget(br_ctx->keyframe_dispatch, br_ctx);
+    ffmpbr_dispatch_release(br_ctx->keyframe_dispatch);
+  }
+
+  // finish closing earlier segments; the current one is closed below
+  ffmpbr_segmenter_stop(&br_ctx->segmenter);
+
+  // write the file trailer
+  if (br_ctx->header_written) {
+    _write_trailer(br_ctx);
+  } else {
+    LOGE("ERROR: ffmpbr_finalize -- the header was never written (%lld packets dropped waiting)",
+      br_ctx->auto_dropped_packets);
+  }
+
+  // hand over the last segment
+  if (br_ctx->hls) {
+    if (br_ctx->header_written) ffmpbr_hls_finish(br_ctx->hls);
+    ffmpbr_hls_free(br_ctx->hls);
+    av_free(br_ctx->hls);
+    br_ctx->output_fmt_ctx->pb = NULL;
+  }
+
+  // close the output file, once everything has gone out
+  if (br_ctx->io) {
+    result->status = ffmpbr_io_drain(br_ctx->io);
+    result->unsent_bytes = ffmpbr_io_mux_offset(br_ctx->io) -
+      ffmpbr_io_sent(br_ctx->io, &last_send_us);
+    ffmpbr_io_close(br_ctx->io);
+    br_ctx->output_fmt_ctx->pb = NULL;
+  }
+
+  // clean up memory
+  if (br_ctx->capture) ffmpbr_capture_close(br_ctx->capture);
+  av_free(br_ctx->video_scratch);
+  if (br_ctx->auto_sps) av_free(br_ctx->auto_sps);
+  if (br_ctx->auto_pps) av_free(br_ctx->auto_pps);
+  if (br_ctx->video_param_sets.sps) av_free(br_ctx->video_param_sets.sps);
+  if (br_ctx->video_param_sets.pps) av_free(br_ctx->video_param_sets.pps);
+  if (br_ctx->device_time_base) av_free(br_ctx->device_time_base);
+  if (br_ctx->output_fmt_name) av_free(br_ctx->output_fmt_name);
+  if (br_ctx->output_url) av_free(br_ctx->output_url);
+  av_dict_free(&br_ctx->output_options);
+  av_dict_free(&br_ctx->ingest_options);
+  for (i=0; i<br_ctx->ingest_url_count; ++i) {
+    av_free(br_ctx->ingest_urls[i]);
+  }
+  if (br_ctx->reconnect) ffmpbr_reconnect_stop(br_ctx->reconnect);
+  if (br_ctx->gop) {
+    ffmpbr_gop_free(br_ctx->gop);
+    av_free(br_ctx->gop);
+  }
+  if (br_ctx->output_fmt_ctx) avformat_free_context(br_ctx->output_fmt_ctx);
+  if (br_ctx->segment) av_free(br_ctx->segment);
+  if (br_ctx->dvr) {
+    // (after waiting for a save in progress)
+    ffmpbr_dvr_free(br_ctx->dvr);
+    av_free(br_ctx->dvr);
+  }
+  for (i=0; i<FFMPBR_LATENCY_MAX_STREAMS; ++i) {
+    avcodec_free_context(&br_ctx->segment_codecs[i]);
+  }
+  ffmpbr_latency_destroy(&br_ctx->latency);
+  av_free(br_ctx);
+}
+
+// on the finalize thread (or the caller's, if it couldn't be started)
+void _run_finalize_job(FFmpegBridgeFinalizeJob *job) {
+  FFmpegBridgeFinalizeResult result;
+  int64_t now;
+
+  memset(&result, 0, sizeof(FFmpegBridgeFinalizeResult));
+  if (job->cut_off && job->br_ctx->io) {
+    ffmpbr_io_set_deadline(job->br_ctx->io, job->deadline_us);
+  }
+  _finalize(job->br_ctx, &result);
+
+  now = ffmpbr_now_us();
+  result.duration_us = now - job->start_us;
+  result.late = now > job->deadline_us;
+  result.cut_off = job->cut_off && result.status == AVERROR(ETIMEDOUT);
+  LOGI("Finalized in %lld ms%s, %lld bytes unsent", result.duration_us / 1000,
+    result.cut_off ? " (cut off at the deadline)" : result.late ? " (past the deadline)" : "",
+    result.unsent_bytes);
+
+  if (job->callback) {
+    job->callback(job->opaque, &result);
+  }
+  av_free(job);
+}
+
+void* _finalize_thread(void *arg) {
+  _run_finalize_job(arg);
+  return NULL;
+}
+
 
 //
 //-- FFmpegBridgeContext API
@@ -233,10 +1283,12 @@ FFmpegBridgeContext* ffmpbr_init(
   int audio_num_channels,
   int audio_bit_rate) {
 
-  int rc;
+  FFMPBR_TRACE_BEGIN(init, "init");
 
   // allocate the memory
-  FFmpegBridgeContext *br_ctx = av_malloc(sizeof(FFmpegBridgeContext));
+  FFmpegBridgeContext *br_ctx = av_mallocz(sizeof(FFmpegBridgeContext));
+  ffmpbr_latency_init(&br_ctx->latency);
+  br_ctx->transport.tcp_nodelay = -1;
 
   // defaults -- likely not overridden
   br_ctx->video_codec_id = CODEC_ID_H264;
@@ -268,57 +1320,384 @@ FFmpegBridgeContext* ffmpbr_init(
   // set up the streams
   LOGD("adding video stream ...");
   _add_video_stream(br_ctx);
+  ffmpbr_set_video_reorder_depth(br_ctx, 0);
   LOGD("adding audio stream ...");
   _add_audio_stream(br_ctx);
 
-  LOGD("opening output url ...");
-  rc = _open_output_url(br_ctx);
-  if (rc < 0){
-    LOGE("ERROR: ffmpbr_prepare_stream error -- %s", av_err2str(rc));
-  }
-
   LOGD("logging (dumping) output_fmt_ctx log ...");
   avDumpFormat(br_ctx->output_fmt_ctx, 0, output_url, 1);
 
+  FFMPBR_TRACE_END(init, "init");
   return br_ctx;
 }
 
+int ffmpbr_start_capture(FFmpegBridgeContext *br_ctx, const char *capture_path) {
+  FFmpegBridgeCaptureConfig config;
+
+  av_strlcpy(config.output_fmt_name, br_ctx->output_fmt_name, sizeof(config.output_fmt_name));
+  config.video_width = br_ctx->video_width;
+  config.video_height = br_ctx->video_height;
+  config.video_fps = br_ctx->video_fps;
+  config.video_bit_rate = br_ctx->video_bit_rate;
+  config.audio_sample_rate = br_ctx->audio_sample_rate;
+  config.audio_num_channels = br_ctx->audio_num_channels;
+  config.audio_bit_rate = br_ctx->audio_bit_rate;
+
+  br_ctx->capture = ffmpbr_capture_open(capture_path, &config);
+  return br_ctx->capture ? 0 : -1;
+}
+
+void ffmpbr_set_video_codec(FFmpegBridgeContext *br_ctx, const char *codec_name) {
+  enum AVCodecID codec_id;
+
+  if (!strcmp(codec_name, "h264")) {
+    codec_id = CODEC_ID_H264;
+  } else if (!strcmp(codec_name, "hevc") || !strcmp(codec_name, "h265")) {
+    codec_id = AV_CODEC_ID_HEVC;
+  } else {
+    LOGE("ERROR: ffmpbr_set_video_codec -- unsupported codec %s, keeping codec %d",
+      codec_name, br_ctx->video_codec_id);
+    return;
+  }
+
+  br_ctx->video_codec_id = codec_id;
+  br_ctx->video_stream->codec->codec_id = codec_id;
+  br_ctx->video_stream->codec->codec_tag = 0;
+  if (br_ctx->auto_config && codec_id != CODEC_ID_H264) {
+    LOGE("ERROR: ffmpbr_set_video_codec -- auto config is H.264 only, turning it off");
+    br_ctx->auto_config = 0;
+  }
+
+  br_ctx->enhanced_flv = !strcmp(br_ctx->output_fmt_ctx->oformat->name, "flv") &&
+    ffmpbr_flv_needs_enhanced(codec_id);
+  if (br_ctx->enhanced_flv) {
+    LOGI("Muxing %s into flv as Enhanced RTMP", codec_name);
+  }
+}
+
+void ffmpbr_set_auto_config(FFmpegBridgeContext *br_ctx, int enabled) {
+  // (the header would wait forever for an IDR that's never looked for)
+  if (enabled && br_ctx->video_codec_id != CODEC_ID_H264) {
+    LOGE("ERROR: ffmpbr_set_auto_config -- auto config is H.264 only, ignoring");
+    return;
+  }
+  br_ctx->auto_config = enabled;
+}
+
+void ffmpbr_set_video_reorder_depth(FFmpegBridgeContext *br_ctx, int depth) {
+  ffmpbr_dts_init(&br_ctx->video_dts, depth, 1000000 / FFMAX(br_ctx->video_fps, 1));
+
+  // tells the mp4 muxer to expect composition offsets
+  br_ctx->video_stream->codec->has_b_frames = br_ctx->video_dts.depth;
+}
+
+void ffmpbr_set_timestamp_normalization(FFmpegBridgeContext *br_ctx, int enabled) {
+  br_ctx->normalize_timestamps = enabled;
+}
+
+void ffmpbr_set_nal_filter(FFmpegBridgeContext *br_ctx, int flags) {
+  br_ctx->nal_filter = flags;
+}
+
+void ffmpbr_set_mp4_fragmentation(FFmpegBridgeContext *br_ctx, int fragment_ms) {
+  br_ctx->mp4_fragment_ms = FFMAX(fragment_ms, 0);
+  if (fragment_ms > 0 && !_is_mov_family(br_ctx->output_fmt_ctx->oformat)) {
+    LOGE("ERROR: ffmpbr_set_mp4_fragmentation -- %s isn't an mp4 format, ignoring",
+      br_ctx->output_fmt_ctx->oformat->name);
+  }
+}
+
+void ffmpbr_set_segmenting(FFmpegBridgeContext *br_ctx, int segment_ms) {
+  FFmpegBridgeSegment *segment;
+  int rc;
+
+  if (segment_ms <= 0) return;
+  if (av_strstart(br_ctx->output_url, FFMPBR_MEMORY_URL, NULL)) {
+    _start_hls(br_ctx, segment_ms);
+    return;
+  }
+  if (!_local_path(br_ctx->output_url) || br_ctx->enhanced_flv ||
+    br_ctx->header_written || br_ctx->segment) {
+    LOGE("ERROR: ffmpbr_set_segmenting -- can't segment this output, recording to %s only",
+      br_ctx->output_url);
+    return;
+  }
+
+  // the output url is only a pattern now, the first segment's file is
+  // the output
+  segment = av_mallocz(sizeof(FFmpegBridgeSegment));
+  ffmpbr_segment_url(segment->url, sizeof(segment->url), br_ctx->output_url, 0);
+
+  br_ctx->io = ffmpbr_io_open(segment->url, &br_ctx->latency, &br_ctx->transport,
+    &br_ctx->output_options, &rc);
+  if (!br_ctx->io) {
+    LOGE("ERROR: ffmpbr_set_segmenting -- couldn't open %s: %s", segment->url, av_err2str(rc));
+    av_free(segment);
+    return;
+  }
+  _use_io(br_ctx->output_fmt_ctx, br_ctx->io);
+  br_ctx->segment = segment;
+  br_ctx->segment_ms = segment_ms;
+}
+
+void ffmpbr_set_dvr(FFmpegBridgeContext *br_ctx, int duration_ms) {
+  if (duration_ms <= 0 || br_ctx->dvr) return;
+
+  br_ctx->dvr = av_malloc(sizeof(FFmpegBridgeDvr));
+  if (!br_ctx->dvr || ffmpbr_dvr_init(br_ctx->dvr, duration_ms,
+    (int64_t)br_ctx->video_bit_rate + br_ctx->audio_bit_rate,
+    br_ctx->video_fps + br_ctx->audio_sample_rate / 1024 + 1) < 0) {
+    LOGE("ERROR: ffmpbr_set_dvr -- couldn't set aside memory for %d ms", duration_ms);
+    av_freep(&br_ctx->dvr);
+  }
+}
+
+int ffmpbr_save_dvr(FFmpegBridgeContext *br_ctx, const char *path) {
+  AVCodecContext *codecs[FFMPBR_DVR_MAX_STREAMS];
+  int i;
+
+  if (!br_ctx->dvr) {
+    LOGE("ERROR: ffmpbr_save_dvr -- not keeping anything, see ffmpbr_set_dvr");
+    return AVERROR(EINVAL);
+  }
+  for (i=0; i<br_ctx->output_fmt_ctx->nb_streams && i<FFMPBR_DVR_MAX_STREAMS; ++i) {
+    codecs[i] = br_ctx->output_fmt_ctx->streams[i]->codec;
+  }
+  return ffmpbr_dvr_save(br_ctx->dvr, path, codecs, i);
+}
+
+void ffmpbr_set_hls_callback(FFmpegBridgeContext *br_ctx, int list_size,
+  FFmpegBridgeHlsCallback callback, void *opaque) {
+  br_ctx->hls_list_size = list_size;
+  br_ctx->hls_callback = callback;
+  br_ctx->hls_opaque = opaque;
+}
+
+void ffmpbr_set_output_option(FFmpegBridgeContext *br_ctx, const char *key, const char *value) {
+  if (br_ctx->io || br_ctx->header_written) {
+    LOGE("ERROR: ffmpbr_set_output_option -- the output is already open, ignoring %s", key);
+    return;
+  }
+  av_dict_set(&br_ctx->output_options, key, value, 0);
+}
+
+void ffmpbr_set_transport(FFmpegBridgeContext *br_ctx, const FFmpegBridgeTransport *transport) {
+  if (br_ctx->io || br_ctx->header_written) {
+    LOGE("ERROR: ffmpbr_set_transport -- the output is already open, ignoring");
+    return;
+  }
+  br_ctx->transport.rtmp_chunk_size = transport->rtmp_chunk_size;
+  br_ctx->transport.tcp_nodelay = transport->tcp_nodelay;
+  br_ctx->transport.send_buffer = transport->send_buffer;
+  br_ctx->transport.notsent_lowat = transport->notsent_lowat;
+  br_ctx->transport.udp_duplicate_tables = transport->udp_duplicate_tables;
+}
+
+void ffmpbr_set_pacing(FFmpegBridgeContext *br_ctx, int rate_percent, int burst_ms) {
+  int64_t bit_rate = ((int64_t)br_ctx->video_bit_rate + br_ctx->audio_bit_rate) * rate_percent / 100;
+
+  if (br_ctx->io || br_ctx->header_written) {
+    LOGE("ERROR: ffmpbr_set_pacing -- the output is already open, ignoring");
+    return;
+  }
+  if (rate_percent > 0 && rate_percent < 100) {
+    LOGE("ERROR: ffmpbr_set_pacing -- pacing at %d%% of the stream's bit rate would fall behind, "
+      "using 100%%", rate_percent);
+    bit_rate = (int64_t)br_ctx->video_bit_rate + br_ctx->audio_bit_rate;
+  }
+  br_ctx->transport.pace_bit_rate = rate_percent > 0 ? bit_rate : 0;
+  br_ctx->transport.pace_burst = bit_rate / 8 * FFMAX(burst_ms, 0) / 1000;
+  if (rate_percent > 0) {
+    LOGI("Pacing the output at %lld kbit/s, %d byte bursts", bit_rate / 1000,
+      br_ctx->transport.pace_burst);
+  }
+}
+
+void ffmpbr_set_write_queue_limit(FFmpegBridgeContext *br_ctx, int limit_ms) {
+  int64_t bit_rate = (int64_t)br_ctx->video_bit_rate + br_ctx->audio_bit_rate;
+
+  if (br_ctx->io || br_ctx->header_written) {
+    LOGE("ERROR: ffmpbr_set_write_queue_limit -- the output is already open, ignoring");
+    return;
+  }
+  br_ctx->transport.queue_limit = bit_rate / 8 * FFMAX(limit_ms, 0) / 1000;
+  if (limit_ms > 0) {
+    LOGI("Turning packets away while more than %lld bytes (%d ms) are queued",
+      br_ctx->transport.queue_limit, limit_ms);
+  }
+}
+
+void ffmpbr_set_file_output(FFmpegBridgeContext *br_ctx, int block_kb, int preallocate_mb,
+  int sync_ms) {
+  if (br_ctx->io || br_ctx->header_written) {
+    LOGE("ERROR: ffmpbr_set_file_output -- the output is already open, ignoring");
+    return;
+  }
+  br_ctx->transport.file_block_size = FFMAX(block_kb, 0) * 1024;
+  br_ctx->transport.file_extent_size = (int64_t)FFMAX(preallocate_mb, 0) * 1024 * 1024;
+  br_ctx->transport.file_sync_interval_us = (int64_t)FFMAX(sync_ms, 0) * 1000;
+  if (block_kb > 0) {
+    LOGI("Writing files in %d KB blocks, preallocating %d MB, syncing every %d ms", block_kb,
+      preallocate_mb, sync_ms);
+  }
+}
+
+void ffmpbr_set_keyframe_callback(FFmpegBridgeContext *br_ctx, int min_interval_ms,
+  FFmpegBridgeKeyframeCallback callback, void *opaque) {
+  br_ctx->keyframe_interval_us = (int64_t)FFMAX(min_interval_ms, 0) * 1000;
+  br_ctx->keyframe_callback = callback;
+  br_ctx->keyframe_opaque = opaque;
+  if (callback && !br_ctx->keyframe_dispatch) {
+    br_ctx->keyframe_dispatch = ffmpbr_dispatch_acquire();
+  }
+}
+
+void ffmpbr_set_backup_urls(FFmpegBridgeContext *br_ctx, const char **urls, int count) {
+  int i;
+
+  if (br_ctx->io || br_ctx->header_written) {
+    LOGE("ERROR: ffmpbr_set_backup_urls -- the output is already open, ignoring");
+    return;
+  }
+  if (count >= FFMPBR_MAX_INGEST_URLS) {
+    LOGE("ERROR: ffmpbr_set_backup_urls -- %d backup urls, using the first %d", count,
+      FFMPBR_MAX_INGEST_URLS - 1);
+    count = FFMPBR_MAX_INGEST_URLS - 1;
+  }
+
+  for (i=0; i<br_ctx->ingest_url_count; ++i) {
+    av_freep(&br_ctx->ingest_urls[i]);
+  }
+  br_ctx->ingest_url_count = 0;
+  if (count <= 0) return;
+
+  br_ctx->ingest_urls[0] = av_strdup(br_ctx->output_url);
+  for (i=0; i<count; ++i) {
+    br_ctx->ingest_urls[i + 1] = av_strdup(urls[i]);
+  }
+  br_ctx->ingest_url_count = count + 1;
+}
+
+int ffmpbr_probe_bandwidth(FFmpegBridgeContext *br_ctx, int duration_ms,
+  FFmpegBridgeProbeResult *result) {
+  int64_t bit_rate = (int64_t)br_ctx->video_bit_rate + br_ctx->audio_bit_rate;
+  int rc;
+
+  memset(result, 0, sizeof(FFmpegBridgeProbeResult));
+  if (br_ctx->header_written) {
+    LOGE("ERROR: ffmpbr_probe_bandwidth -- the stream has already started");
+    return AVERROR(EINVAL);
+  }
+
+  // padding needs a socket of our own to go through, and to measure
+  if (!br_ctx->io) {
+    br_ctx->transport.own_socket = 1;
+    rc = _open_output_url(br_ctx);
+    if (rc < 0) {
+      LOGE("ERROR: ffmpbr_probe_bandwidth -- couldn't open %s: %s", br_ctx->output_url,
+        av_err2str(rc));
+      return rc;
+    }
+  }
+  if (!br_ctx->io) {
+    return AVERROR(ENOSYS);
+  }
+
+  // twice the stream's bit rate is headroom enough to tell
+  rc = ffmpbr_io_probe(br_ctx->io, !strcmp(br_ctx->output_fmt_ctx->oformat->name, "mpegts"),
+    duration_ms, bit_rate * 2, result);
+  if (rc < 0) {
+    LOGE("ERROR: ffmpbr_probe_bandwidth -- %s", av_err2str(rc));
+    return rc;
+  }
+
+  result->recommended_bit_rate = av_clip64(result->throughput * 3 / 4 - br_ctx->audio_bit_rate,
+    0, br_ctx->video_bit_rate);
+  LOGI("Recommended video bit rate: %lld kbit/s", result->recommended_bit_rate / 1000);
+  return 0;
+}
+
 void ffmpbr_set_audio_codec_extradata(FFmpegBridgeContext *br_ctx, const int8_t *codec_extradata,
   int codec_extradata_size) {
 
-  // this will automatically be freed by avformat_free_context() during ffmpbr_finalize()
-  br_ctx->audio_stream->codec->extradata = av_malloc(codec_extradata_size);
-  br_ctx->audio_stream->codec->extradata_size = codec_extradata_size;
-  memcpy(br_ctx->audio_stream->codec->extradata, codec_extradata, codec_extradata_size);
+  if (br_ctx->capture) {
+    ffmpbr_capture_write(br_ctx->capture, FFMPBR_CAPTURE_AUDIO_EXTRADATA, 0, 0, ffmpbr_now_us(),
+      (const uint8_t *)codec_extradata, codec_extradata_size);
+  }
 
-  _log_codec_attributes(br_ctx->audio_stream->codec);
+  _set_audio_extradata(br_ctx, (const uint8_t *)codec_extradata, codec_extradata_size);
 }
 
 void ffmpbr_set_video_codec_extradata(FFmpegBridgeContext *br_ctx, const int8_t *codec_extradata,
   int codec_extradata_size) {
 
-  // this will automatically be freed by avformat_free_context() during ffmpbr_finalize()
-  br_ctx->video_stream->codec->extradata = av_malloc(codec_extradata_size);
-  br_ctx->video_stream->codec->extradata_size = codec_extradata_size;
-  memcpy(br_ctx->video_stream->codec->extradata, codec_extradata, codec_extradata_size);
+  if (br_ctx->capture) {
+    ffmpbr_capture_write(br_ctx->capture, FFMPBR_CAPTURE_VIDEO_EXTRADATA, 0, 0, ffmpbr_now_us(),
+      (const uint8_t *)codec_extradata, codec_extradata_size);
+  }
 
-  _log_codec_attributes(br_ctx->video_stream->codec);
+  _set_video_extradata(br_ctx, (const uint8_t *)codec_extradata, codec_extradata_size);
 }
 
-void ffmpbr_write_header(FFmpegBridgeContext *br_ctx) {
-  LOGI("Writing header ...");
-  int rc = avformat_write_header(br_ctx->output_fmt_ctx, NULL);
-  if (rc < 0) {
-    LOGE("Error writing header: %s", av_err2str(rc));
+int ffmpbr_write_header(FFmpegBridgeContext *br_ctx) {
+  if (br_ctx->capture) {
+    ffmpbr_capture_write(br_ctx->capture, FFMPBR_CAPTURE_HEADER, 0, 0, ffmpbr_now_us(), NULL, 0);
   }
+
+  if (br_ctx->auto_config && (!br_ctx->video_stream->codec->extradata_size ||
+    !br_ctx->audio_stream->codec->extradata_size)) {
+    LOGI("No extradata yet, the header will be written at the first IDR");
+    return FFMPBR_WRITE_QUEUED;
+  }
+  if (_write_header(br_ctx) < 0) return FFMPBR_WRITE_DISCONNECTED;
+  return _written_status(br_ctx);
 }
 
-void ffmpbr_write_packet(FFmpegBridgeContext *br_ctx, uint8_t *data, int data_size, long pts,
-    int is_video, int is_video_keyframe) {
+int ffmpbr_write_packet(FFmpegBridgeContext *br_ctx, uint8_t *data, int data_size, long pts,
+    int is_video, int is_video_keyframe, int64_t arrival_us) {
   AVPacket *packet;
   AVStream *st;
   AVCodecContext *c;
   uint8_t *filtered_data = NULL, *keyframe_data = NULL;
+  int64_t mux_pts = pts, ts_offset;
+  int rc = 0, status;
+
+  FFMPBR_TRACE_BEGIN(write_packet, is_video ? "write_video_packet" : "write_audio_packet");
+
+  // record the packet exactly as it was handed to us
+  if (br_ctx->capture) {
+    int capture_flags = 0;
+    if (is_video) capture_flags |= FFMPBR_CAPTURE_FLAG_VIDEO;
+    if (is_video_keyframe) capture_flags |= FFMPBR_CAPTURE_FLAG_KEYFRAME;
+    ffmpbr_capture_write(br_ctx->capture, FFMPBR_CAPTURE_PACKET, capture_flags,
+      pts, arrival_us, data, data_size);
+  }
+
+  if (is_video) {
+    rc = _prepare_video_packet(br_ctx, &data, &data_size, &is_video_keyframe);
+  } else if (br_ctx->auto_config) {
+    rc = _auto_config_audio(br_ctx, data, data_size);
+  }
+  if (rc < 0) {
+    // (EAGAIN -- nothing to write yet, or nothing left after filtering)
+    if (rc != AVERROR(EAGAIN)) {
+      LOGE("ERROR: ffmpbr_write_packet dropping a packet -- %s", av_err2str(rc));
+    }
+    FFMPBR_TRACE_END(write_packet, is_video ? "write_video_packet" : "write_audio_packet");
+    _request_keyframe(br_ctx);
+    return FFMPBR_WRITE_DROPPED;
+  }
+  if (is_video && is_video_keyframe) {
+    _keyframe_arrived(br_ctx);
+  }
+
+  // don't bother muxing for an output that's gone, or backed up
+  status = _check_output(br_ctx, is_video, is_video_keyframe);
+  if (status) {
+    FFMPBR_TRACE_END(write_packet, is_video ? "write_video_packet" : "write_audio_packet");
+    _request_keyframe(br_ctx);
+    return status;
+  }
 
   packet = av_malloc(sizeof(AVPacket));
   if (!packet) {
@@ -335,19 +1714,62 @@ void ffmpbr_write_packet(FFmpegBridgeContext *br_ctx, uint8_t *data, int data_si
     packet->stream_index = br_ctx->audio_stream_index;
   }
   packet->size = data_size;
-  packet->pts = packet->dts = pts;
+  if (br_ctx->normalize_timestamps) {
+    mux_pts = ffmpbr_timestamps_next(&br_ctx->timestamps,
+      is_video ? FFMPBR_TS_VIDEO : FFMPBR_TS_AUDIO, pts, arrival_us);
+  }
+  packet->pts = mux_pts;
+  packet->dts = is_video ? ffmpbr_dts_next(&br_ctx->video_dts, mux_pts) : mux_pts;
   packet->data = data;
+  if (br_ctx->hls && is_video &&
+    ffmpbr_hls_video_packet(br_ctx->hls, packet->pts, is_video_keyframe)) {
+    _cut_hls_segment(br_ctx, packet->pts);
+  }
+  if (br_ctx->segment) {
+    if (is_video && is_video_keyframe && br_ctx->segmenter.started) {
+      _rotate_segment(br_ctx, packet->pts, packet->dts);
+    }
+    packet->pts -= br_ctx->segment->ts_offset;
+    packet->dts -= br_ctx->segment->ts_offset;
+  }
   st = br_ctx->output_fmt_ctx->streams[packet->stream_index];
   c = st->codec;
 
+  // start tracking the packet while pts is still in device time
+  ffmpbr_latency_arrived(&br_ctx->latency, packet->stream_index, arrival_us, pts);
+
   // filter the packet (if necessary)
+  FFMPBR_TRACE_BEGIN(filter_packet, "filter_packet");
   filtered_data = _filter_packet(br_ctx, st, packet);
+  FFMPBR_TRACE_END(filter_packet, "filter_packet");
+
+  // keep a copy for instant replay, in session time
+  if (br_ctx->dvr) {
+    ts_offset = br_ctx->segment ? br_ctx->segment->ts_offset : 0;
+    ffmpbr_dvr_record(br_ctx->dvr, packet->stream_index, packet->data, packet->size,
+      packet->pts + ts_offset, packet->dts + ts_offset, packet->flags & AV_PKT_FLAG_KEY);
+  }
+
+  // keep the GOP so far, to start another ingest with
+  if (br_ctx->gop) {
+    ffmpbr_gop_add(br_ctx->gop, packet->stream_index, packet->data, packet->size, packet->pts,
+      packet->dts, is_video && is_video_keyframe);
+  }
 
   // rescale the timing information for the packet
   _rescale_packet(br_ctx, st, packet);
 
   // write the frame
-  _write_packet(br_ctx, packet);
+  FFMPBR_TRACE_BEGIN(mux_packet, "mux_packet");
+  if (br_ctx->gop) {
+    _write_ingest_packet(br_ctx, packet, is_video && is_video_keyframe);
+    status = br_ctx->failover_stats.down ? FFMPBR_WRITE_DISCONNECTED : _written_status(br_ctx);
+  } else {
+    rc = _write_packet(br_ctx, packet);
+    status = _written_status(br_ctx);
+    if (rc < 0 && status != FFMPBR_WRITE_DISCONNECTED) status = FFMPBR_WRITE_DROPPED;
+  }
+  FFMPBR_TRACE_END(mux_packet, "mux_packet");
 
   // clean up
   if (filtered_data) {
@@ -357,21 +1779,102 @@ void ffmpbr_write_packet(FFmpegBridgeContext *br_ctx, uint8_t *data, int data_si
     av_free(keyframe_data);
   }
   av_free_packet(packet);
+
+  FFMPBR_TRACE_END(write_packet, is_video ? "write_video_packet" : "write_audio_packet");
+
+  // (only now that the packet is out of the way)
+  _request_keyframe(br_ctx);
+  return status;
 }
 
-void ffmpbr_finalize(FFmpegBridgeContext *br_ctx) {
-  // write the file trailer
-  _write_trailer(br_ctx);
+void ffmpbr_get_latency_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeLatencyStats *stats) {
+  ffmpbr_latency_get_stats(&br_ctx->latency, stats);
+}
+
+void ffmpbr_get_nal_filter_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeNalFilterStats *stats) {
+  *stats = br_ctx->nal_filter_stats;
+}
+
+void ffmpbr_get_timestamp_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeTimestampStats *stats) {
+  ffmpbr_timestamps_get_stats(&br_ctx->timestamps, stats);
+}
+
+void ffmpbr_get_segment_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeSegmentStats *stats) {
+  ffmpbr_segmenter_get_stats(&br_ctx->segmenter, stats);
+}
+
+void ffmpbr_get_hls_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeHlsStats *stats) {
+  if (br_ctx->hls) {
+    ffmpbr_hls_get_stats(br_ctx->hls, stats);
+  } else {
+    memset(stats, 0, sizeof(FFmpegBridgeHlsStats));
+  }
+}
 
-  // close the output file
-  if (!(br_ctx->output_fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
-    avio_close(br_ctx->output_fmt_ctx->pb);
+void ffmpbr_get_send_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeSendStats *stats) {
+  if (br_ctx->io) {
+    ffmpbr_io_get_send_stats(br_ctx->io, stats);
+  } else {
+    memset(stats, 0, sizeof(FFmpegBridgeSendStats));
   }
+}
 
-  // clean up memory
-  if (br_ctx->device_time_base) av_free(br_ctx->device_time_base);
-  if (br_ctx->output_fmt_name) av_free(br_ctx->output_fmt_name);
-  if (br_ctx->output_url) av_free(br_ctx->output_url);
-  if (br_ctx->output_fmt_ctx) avformat_free_context(br_ctx->output_fmt_ctx);
-  av_free(br_ctx);
+void ffmpbr_get_failover_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeFailoverStats *stats) {
+  *stats = br_ctx->failover_stats;
+  if (br_ctx->reconnect) {
+    stats->failed_attempts += ffmpbr_reconnect_failed_attempts(br_ctx->reconnect);
+  }
+}
+
+void ffmpbr_get_keyframe_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeKeyframeStats *stats) {
+  *stats = br_ctx->keyframe_stats;
+}
+
+void ffmpbr_get_dvr_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeDvrStats *stats) {
+  if (br_ctx->dvr) {
+    ffmpbr_dvr_get_stats(br_ctx->dvr, stats);
+  } else {
+    memset(stats, 0, sizeof(FFmpegBridgeDvrStats));
+  }
+}
+
+int ffmpbr_finalize(FFmpegBridgeContext *br_ctx) {
+  FFmpegBridgeFinalizeResult result;
+
+  if (!br_ctx) {
+    LOGE("ERROR: ffmpbr_finalize -- no context (never initialized, or already finalized)");
+    return AVERROR(EINVAL);
+  }
+  memset(&result, 0, sizeof(FFmpegBridgeFinalizeResult));
+  _finalize(br_ctx, &result);
+  return result.status;
+}
+
+int ffmpbr_finalize_async(FFmpegBridgeContext *br_ctx, int deadline_ms, int cut_off,
+  FFmpegBridgeFinalizeCallback callback, void *opaque) {
+  FFmpegBridgeFinalizeJob *job;
+  pthread_t thread;
+  int rc;
+
+  if (!br_ctx) {
+    LOGE("ERROR: ffmpbr_finalize_async -- no context (never initialized, or already finalized)");
+    return AVERROR(EINVAL);
+  }
+
+  job = av_malloc(sizeof(FFmpegBridgeFinalizeJob));
+  job->br_ctx = br_ctx;
+  job->start_us = ffmpbr_now_us();
+  job->deadline_us = job->start_us + (int64_t)FFMAX(deadline_ms, 0) * 1000;
+  job->cut_off = cut_off;
+  job->callback = callback;
+  job->opaque = opaque;
+
+  rc = pthread_create(&thread, NULL, _finalize_thread, job);
+  if (rc) {
+    LOGE("ERROR: ffmpbr_finalize_async -- couldn't start the finalize thread: %d", rc);
+    _run_finalize_job(job);
+    return AVERROR(rc);
+  }
+  pthread_detach(thread);
+  return 0;
 }
@@ -0,0 +1,172 @@
+//
+// The shared dispatch thread, see ffmpegbridge_dispatch.h.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <errno.h>
+#include <string.h>
+
+#include "libavutil/error.h"
+#include "libavutil/mem.h"
+
+#include "ffmpegbridge_dispatch.h"
+#include "ffmpegbridge_log.h"
+#include "ffmpegbridge_trace.h"
+
+static pthread_mutex_t shared_dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+static FFmpegBridgeDispatch *shared_dispatch = NULL;
+
+//
+//-- helper functions
+//
+
+void _dispatch_free(FFmpegBridgeDispatch *dispatch) {
+  pthread_mutex_destroy(&dispatch->lock);
+  pthread_cond_destroy(&dispatch->wake);
+  pthread_cond_destroy(&dispatch->done);
+  av_free(dispatch);
+}
+
+void* _dispatch_run(void *arg) {
+  FFmpegBridgeDispatch *dispatch = arg;
+  FFmpegBridgeDispatchCall call;
+  int detached;
+
+  pthread_mutex_lock(&dispatch->lock);
+  while (1) {
+    while (!dispatch->count && !dispatch->stopping) {
+      pthread_cond_wait(&dispatch->wake, &dispatch->lock);
+    }
+    if (!dispatch->count) break;
+
+    call = dispatch->calls[dispatch->head];
+    dispatch->head = (dispatch->head + 1) % FFMPBR_DISPATCH_QUEUE_SIZE;
+    dispatch->count--;
+    if (!call.owner) continue;
+
+    dispatch->running = call.owner;
+    pthread_mutex_unlock(&dispatch->lock);
+
+    FFMPBR_TRACE_BEGIN(dispatch, "dispatch");
+    call.func(call.opaque, call.arg);
+    FFMPBR_TRACE_END(dispatch, "dispatch");
+
+    pthread_mutex_lock(&dispatch->lock);
+    dispatch->running = NULL;
+    pthread_cond_broadcast(&dispatch->done);
+  }
+  detached = dispatch->detached;
+  pthread_mutex_unlock(&dispatch->lock);
+
+  // (stopped from one of its own calls, see _dispatch_stop)
+  if (detached) _dispatch_free(dispatch);
+  return NULL;
+}
+
+FFmpegBridgeDispatch* _dispatch_start(void) {
+  FFmpegBridgeDispatch *dispatch;
+
+  LOGI("Starting the dispatch thread");
+
+  dispatch = av_mallocz(sizeof(FFmpegBridgeDispatch));
+  pthread_mutex_init(&dispatch->lock, NULL);
+  pthread_cond_init(&dispatch->wake, NULL);
+  pthread_cond_init(&dispatch->done, NULL);
+  pthread_create(&dispatch->thread, NULL, _dispatch_run, dispatch);
+
+  return dispatch;
+}
+
+void _dispatch_stop(FFmpegBridgeDispatch *dispatch) {
+  int self = pthread_equal(pthread_self(), dispatch->thread);
+
+  LOGI("Stopping the dispatch thread");
+
+  // (every owner has forgotten its calls by now, so none are left to run).
+  // A call that finalizes the last session stops the thread it's running
+  // on, which can't wait for itself: the thread is left to free
+  // everything once the call returns.
+  pthread_mutex_lock(&dispatch->lock);
+  dispatch->stopping = 1;
+  dispatch->detached = self;
+  pthread_cond_signal(&dispatch->wake);
+  pthread_mutex_unlock(&dispatch->lock);
+  if (self) {
+    pthread_detach(dispatch->thread);
+    return;
+  }
+  pthread_join(dispatch->thread, NULL);
+  _dispatch_free(dispatch);
+}
+
+
+//
+//-- FFmpegBridgeDispatch API
+//
+
+FFmpegBridgeDispatch* ffmpbr_dispatch_acquire(void) {
+  FFmpegBridgeDispatch *dispatch;
+
+  pthread_mutex_lock(&shared_dispatch_lock);
+  if (!shared_dispatch) {
+    shared_dispatch = _dispatch_start();
+  }
+  shared_dispatch->refs++;
+  dispatch = shared_dispatch;
+  pthread_mutex_unlock(&shared_dispatch_lock);
+
+  return dispatch;
+}
+
+void ffmpbr_dispatch_release(FFmpegBridgeDispatch *dispatch) {
+  pthread_mutex_lock(&shared_dispatch_lock);
+  if (--dispatch->refs == 0) {
+    _dispatch_stop(dispatch);
+    if (dispatch == shared_dispatch) shared_dispatch = NULL;
+  }
+  pthread_mutex_unlock(&shared_dispatch_lock);
+}
+
+int ffmpbr_dispatch_post(FFmpegBridgeDispatch *dispatch, void *owner,
+  FFmpegBridgeDispatchFunc func, void *opaque, int arg) {
+  FFmpegBridgeDispatchCall *call;
+
+  pthread_mutex_lock(&dispatch->lock);
+  if (dispatch->count == FFMPBR_DISPATCH_QUEUE_SIZE) {
+    pthread_mutex_unlock(&dispatch->lock);
+    LOGE("ERROR: ffmpbr_dispatch_post -- %d calls already waiting, dropping this one",
+      FFMPBR_DISPATCH_QUEUE_SIZE);
+    return AVERROR(EAGAIN);
+  }
+
+  call = &dispatch->calls[(dispatch->head + dispatch->count) % FFMPBR_DISPATCH_QUEUE_SIZE];
+  call->owner = owner;
+  call->func = func;
+  call->opaque = opaque;
+  call->arg = arg;
+  dispatch->count++;
+  pthread_cond_signal(&dispatch->wake);
+  pthread_mutex_unlock(&dispatch->lock);
+
+  return 0;
+}
+
+void ffmpbr_dispatch_forget(FFmpegBridgeDispatch *dispatch, void *owner) {
+  int i;
+
+  pthread_mutex_lock(&dispatch->lock);
+  for (i = 0; i < dispatch->count; ++i) {
+    FFmpegBridgeDispatchCall *call =
+      &dispatch->calls[(dispatch->head + i) % FFMPBR_DISPATCH_QUEUE_SIZE];
+    if (call->owner == owner) call->owner = NULL;
+  }
+
+  // (a call may finalize its own session, which mustn't wait for itself)
+  if (!pthread_equal(pthread_self(), dispatch->thread)) {
+    while (dispatch->running == owner) {
+      pthread_cond_wait(&dispatch->done, &dispatch->lock);
+    }
+  }
+  pthread_mutex_unlock(&dispatch->lock);
+}
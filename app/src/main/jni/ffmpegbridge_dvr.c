@@ -0,0 +1,349 @@
+//
+// Instant replay, see ffmpegbridge_dvr.h.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libavutil/mem.h"
+
+#include "ffmpegbridge_dvr.h"
+#include "ffmpegbridge_latency.h"
+#include "ffmpegbridge_log.h"
+
+// the slab holds this many times duration_ms at the configured bit rate
+#define FFMPBR_DVR_HEADROOM 2
+
+#define FFMPBR_DVR_NOT_PINNED INT64_MAX
+
+//
+//-- helper functions
+//
+
+FFmpegBridgeDvrPacket* _dvr_packet(FFmpegBridgeDvr *dvr, int64_t seq) {
+  return &dvr->packets[seq % dvr->max_packets];
+}
+
+int64_t _dvr_key(FFmpegBridgeDvr *dvr, int i) {
+  return dvr->keys[(dvr->key_first + i) % dvr->max_packets];
+}
+
+void _dvr_drop_oldest(FFmpegBridgeDvr *dvr) {
+  if (dvr->key_count && _dvr_key(dvr, 0) == dvr->first_seq) {
+    dvr->key_first = (dvr->key_first + 1) % dvr->max_packets;
+    dvr->key_count--;
+  }
+  dvr->buffered_bytes -= _dvr_packet(dvr, dvr->first_seq)->size;
+  dvr->first_seq++;
+  if (dvr->first_seq == dvr->next_seq) dvr->head = 0;
+}
+
+// drops the oldest GOP, or as much of it as isn't pinned
+void _dvr_drop_gop(FFmpegBridgeDvr *dvr) {
+  do {
+    _dvr_drop_oldest(dvr);
+  } while (dvr->first_seq < dvr->next_seq && dvr->first_seq < dvr->pin_seq &&
+    !_dvr_packet(dvr, dvr->first_seq)->keyframe);
+}
+
+// where a packet of size would go, if there's room for it. The data in use
+// runs from the oldest packet up to head, possibly wrapping around; head
+// only ever meets the oldest packet when the ring is empty.
+int _dvr_fits(FFmpegBridgeDvr *dvr, int size, int *offset) {
+  int tail;
+
+  if (dvr->first_seq == dvr->next_seq) {
+    *offset = 0;
+    return size <= dvr->slab_size;
+  }
+
+  tail = _dvr_packet(dvr, dvr->first_seq)->offset;
+  if (dvr->head > tail) {
+    if (dvr->head + size <= dvr->slab_size) {
+      *offset = dvr->head;
+      return 1;
+    }
+    *offset = 0;
+    return size < tail;
+  }
+  *offset = dvr->head;
+  return dvr->head + size < tail;
+}
+
+void* _dvr_save_thread(void *arg) {
+  FFmpegBridgeDvr *dvr = arg;
+  AVFormatContext *fmt_ctx = dvr->save_fmt_ctx;
+  FFmpegBridgeDvrPacket *p;
+  AVStream *st;
+  AVPacket pkt;
+  int64_t seq, base = INT64_MAX, first_pts = INT64_MAX, last_pts = INT64_MIN, bytes = 0;
+  int64_t start_us = ffmpbr_now_us();
+  int header_written = 0, rc;
+
+  // (only the packets we're yet to write are pinned, so only they can be
+  // read without the lock)
+  pthread_mutex_lock(&dvr->lock);
+  for (seq = dvr->pin_seq; seq < dvr->save_end_seq; ++seq) {
+    p = _dvr_packet(dvr, seq);
+    if (p->dts < base) base = p->dts;
+    if (p->pts < first_pts) first_pts = p->pts;
+    if (p->pts > last_pts) last_pts = p->pts;
+  }
+  seq = dvr->pin_seq;
+  pthread_mutex_unlock(&dvr->lock);
+
+  rc = avio_open(&fmt_ctx->pb, dvr->save_path, AVIO_FLAG_WRITE);
+  if (rc >= 0) rc = avformat_write_header(fmt_ctx, NULL);
+  if (rc >= 0) header_written = 1;
+
+  for (; rc >= 0 && seq < dvr->save_end_seq; ++seq) {
+    p = _dvr_packet(dvr, seq);
+    st = fmt_ctx->streams[p->stream_index];
+
+    av_init_packet(&pkt);
+    pkt.data = dvr->slab + p->offset;
+    pkt.size = p->size;
+    pkt.stream_index = p->stream_index;
+    pkt.flags = p->keyframe ? AV_PKT_FLAG_KEY : 0;
+    pkt.pts = av_rescale_q(p->pts - base, AV_TIME_BASE_Q, st->time_base);
+    pkt.dts = av_rescale_q(p->dts - base, AV_TIME_BASE_Q, st->time_base);
+
+    // (the interleaver copies what it holds on to, so the packet can be
+    // unpinned straight away)
+    rc = av_interleaved_write_frame(fmt_ctx, &pkt);
+
+    pthread_mutex_lock(&dvr->lock);
+    dvr->pin_seq = seq + 1;
+    pthread_mutex_unlock(&dvr->lock);
+  }
+
+  if (rc < 0) {
+    LOGE("ERROR: _dvr_save_thread -- couldn't save %s: %s", dvr->save_path, av_err2str(rc));
+  }
+  if (header_written) {
+    int trailer_rc = av_write_trailer(fmt_ctx);
+    if (rc >= 0) rc = trailer_rc;
+  }
+  if (fmt_ctx->pb) {
+    bytes = avio_tell(fmt_ctx->pb);
+    avio_close(fmt_ctx->pb);
+  }
+  avformat_free_context(fmt_ctx);
+  dvr->save_fmt_ctx = NULL;
+
+  pthread_mutex_lock(&dvr->lock);
+  dvr->pin_seq = FFMPBR_DVR_NOT_PINNED;
+  dvr->stats.saving = 0;
+  if (rc < 0) {
+    dvr->stats.failed_saves++;
+  } else {
+    dvr->stats.saves++;
+    dvr->stats.last_save_media_us = last_pts - first_pts;
+    dvr->stats.last_save_bytes = bytes;
+    dvr->stats.last_save_us = ffmpbr_now_us() - start_us;
+    LOGI("Saved %lld ms of replay to %s (%lld bytes) in %lld ms",
+      dvr->stats.last_save_media_us / 1000, dvr->save_path, bytes,
+      dvr->stats.last_save_us / 1000);
+  }
+  pthread_mutex_unlock(&dvr->lock);
+  return NULL;
+}
+
+void _dvr_join_save(FFmpegBridgeDvr *dvr) {
+  if (dvr->save_started) {
+    pthread_join(dvr->save_thread, NULL);
+    dvr->save_started = 0;
+  }
+}
+
+
+//
+//-- FFmpegBridgeDvr API
+//
+
+int ffmpbr_dvr_init(FFmpegBridgeDvr *dvr, int duration_ms, int64_t bit_rate, int max_packet_rate) {
+  int64_t slab_size = bit_rate / 8 * duration_ms / 1000 * FFMPBR_DVR_HEADROOM;
+
+  memset(dvr, 0, sizeof(FFmpegBridgeDvr));
+  if (slab_size > INT32_MAX / 2) {
+    LOGE("ERROR: ffmpbr_dvr_init -- %d ms at %lld bps is too much to keep in memory",
+      duration_ms, bit_rate);
+    return AVERROR(EINVAL);
+  }
+
+  dvr->duration_us = duration_ms * 1000LL;
+  dvr->slab_size = (int)slab_size;
+  dvr->max_packets = (int)((int64_t)max_packet_rate * duration_ms / 1000 * FFMPBR_DVR_HEADROOM) + 64;
+  dvr->slab = av_malloc(dvr->slab_size);
+  dvr->packets = av_malloc(dvr->max_packets * sizeof(FFmpegBridgeDvrPacket));
+  dvr->keys = av_malloc(dvr->max_packets * sizeof(int64_t));
+  if (!dvr->slab || !dvr->packets || !dvr->keys) {
+    av_freep(&dvr->slab);
+    av_freep(&dvr->packets);
+    av_freep(&dvr->keys);
+    return AVERROR(ENOMEM);
+  }
+
+  // the ring starts at the first keyframe
+  dvr->resync = 1;
+  dvr->pin_seq = FFMPBR_DVR_NOT_PINNED;
+  pthread_mutex_init(&dvr->lock, NULL);
+  LOGI("Keeping %d ms for replay in %d KB (%d packets)", duration_ms, dvr->slab_size / 1024,
+    dvr->max_packets);
+  return 0;
+}
+
+void ffmpbr_dvr_record(FFmpegBridgeDvr *dvr, int stream_index, const uint8_t *data, int size,
+  int64_t pts, int64_t dts, int keyframe) {
+  FFmpegBridgeDvrPacket *p;
+  int64_t key;
+  int offset;
+
+  if (size <= 0 || stream_index >= FFMPBR_DVR_MAX_STREAMS) return;
+
+  pthread_mutex_lock(&dvr->lock);
+
+  // start over at a keyframe, once nothing's pinned
+  if (dvr->resync) {
+    if (!keyframe || dvr->pin_seq != FFMPBR_DVR_NOT_PINNED) {
+      if (dvr->pin_seq != FFMPBR_DVR_NOT_PINNED) dvr->stats.pinned_drops++;
+      pthread_mutex_unlock(&dvr->lock);
+      return;
+    }
+    while (dvr->first_seq < dvr->next_seq) _dvr_drop_oldest(dvr);
+    dvr->resync = 0;
+  }
+
+  // a whole GOP goes once the next one is old enough to cover the duration
+  while (dvr->key_count >= 2 && (key = _dvr_key(dvr, 1)) <= dvr->pin_seq &&
+    pts - _dvr_packet(dvr, key)->pts >= dvr->duration_us) {
+    while (dvr->first_seq < key) _dvr_drop_oldest(dvr);
+  }
+
+  // and younger ones when there's no room (more often than not, the bit
+  // rate is well over what was configured)
+  while (!_dvr_fits(dvr, size, &offset) || dvr->next_seq - dvr->first_seq >= dvr->max_packets) {
+    if (dvr->first_seq == dvr->next_seq || dvr->first_seq >= dvr->pin_seq) {
+      if (dvr->first_seq == dvr->next_seq) {
+        LOGE("ERROR: ffmpbr_dvr_record -- a %d byte packet doesn't fit in the slab", size);
+        dvr->stats.early_drops++;
+      } else {
+        dvr->stats.pinned_drops++;
+      }
+      dvr->resync = 1;
+      pthread_mutex_unlock(&dvr->lock);
+      return;
+    }
+    if (pts - _dvr_packet(dvr, dvr->first_seq)->pts < dvr->duration_us) {
+      dvr->stats.early_drops++;
+    }
+    _dvr_drop_gop(dvr);
+  }
+
+  memcpy(dvr->slab + offset, data, size);
+  p = _dvr_packet(dvr, dvr->next_seq);
+  p->offset = offset;
+  p->size = size;
+  p->pts = pts;
+  p->dts = dts;
+  p->stream_index = stream_index;
+  p->keyframe = keyframe;
+  if (keyframe) {
+    dvr->keys[(dvr->key_first + dvr->key_count) % dvr->max_packets] = dvr->next_seq;
+    dvr->key_count++;
+  }
+  dvr->head = offset + size;
+  dvr->buffered_bytes += size;
+  dvr->next_seq++;
+
+  pthread_mutex_unlock(&dvr->lock);
+}
+
+int ffmpbr_dvr_save(FFmpegBridgeDvr *dvr, const char *path, AVCodecContext **codecs,
+  int nb_streams) {
+  AVFormatContext *fmt_ctx = NULL;
+  AVStream *st;
+  int saving, i, rc;
+
+  pthread_mutex_lock(&dvr->lock);
+  saving = dvr->stats.saving;
+  pthread_mutex_unlock(&dvr->lock);
+  if (saving) {
+    LOGE("ERROR: ffmpbr_dvr_save -- still saving %s", dvr->save_path);
+    return AVERROR(EBUSY);
+  }
+  _dvr_join_save(dvr);
+
+  rc = avformat_alloc_output_context2(&fmt_ctx, NULL, NULL, path);
+  if (rc < 0) {
+    LOGE("ERROR: ffmpbr_dvr_save -- no format for %s: %s", path, av_err2str(rc));
+    return rc;
+  }
+  for (i=0; i<nb_streams && i<FFMPBR_DVR_MAX_STREAMS; ++i) {
+    st = avformat_new_stream(fmt_ctx, NULL);
+    if (!st || avcodec_copy_context(st->codec, codecs[i]) < 0) {
+      avformat_free_context(fmt_ctx);
+      return AVERROR(ENOMEM);
+    }
+    st->codec->codec_tag = 0;
+    if (fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+      st->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+    }
+  }
+
+  pthread_mutex_lock(&dvr->lock);
+  if (!dvr->key_count || dvr->resync) {
+    pthread_mutex_unlock(&dvr->lock);
+    LOGE("ERROR: ffmpbr_dvr_save -- nothing to save yet");
+    avformat_free_context(fmt_ctx);
+    return AVERROR(EAGAIN);
+  }
+  snprintf(dvr->save_path, sizeof(dvr->save_path), "%s", path);
+  dvr->save_fmt_ctx = fmt_ctx;
+  dvr->pin_seq = _dvr_key(dvr, 0);
+  dvr->save_end_seq = dvr->next_seq;
+  dvr->stats.saving = 1;
+  pthread_mutex_unlock(&dvr->lock);
+
+  rc = pthread_create(&dvr->save_thread, NULL, _dvr_save_thread, dvr);
+  if (rc) {
+    LOGE("ERROR: ffmpbr_dvr_save -- couldn't start the save thread: %d", rc);
+    pthread_mutex_lock(&dvr->lock);
+    dvr->pin_seq = FFMPBR_DVR_NOT_PINNED;
+    dvr->stats.saving = 0;
+    dvr->stats.failed_saves++;
+    pthread_mutex_unlock(&dvr->lock);
+    avformat_free_context(fmt_ctx);
+    dvr->save_fmt_ctx = NULL;
+    return AVERROR(rc);
+  }
+  dvr->save_started = 1;
+  return 0;
+}
+
+void ffmpbr_dvr_free(FFmpegBridgeDvr *dvr) {
+  if (!dvr->slab) return;
+
+  _dvr_join_save(dvr);
+  pthread_mutex_destroy(&dvr->lock);
+  av_freep(&dvr->slab);
+  av_freep(&dvr->packets);
+  av_freep(&dvr->keys);
+}
+
+void ffmpbr_dvr_get_stats(FFmpegBridgeDvr *dvr, FFmpegBridgeDvrStats *stats) {
+  memset(stats, 0, sizeof(FFmpegBridgeDvrStats));
+  if (!dvr->slab) return;
+
+  pthread_mutex_lock(&dvr->lock);
+  *stats = dvr->stats;
+  stats->slab_bytes = dvr->slab_size;
+  stats->buffered_bytes = dvr->buffered_bytes;
+  if (dvr->first_seq < dvr->next_seq) {
+    stats->buffered_us = _dvr_packet(dvr, dvr->next_seq - 1)->pts -
+      _dvr_packet(dvr, dvr->first_seq)->pts;
+  }
+  pthread_mutex_unlock(&dvr->lock);
+}
@@ -0,0 +1,361 @@
+//
+// Local file output, see ffmpegbridge_file.h.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+// (fallocate, and the 64-bit file calls on 32-bit ABIs)
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "libavformat/avio.h"
+#include "libavutil/common.h"
+#include "libavutil/error.h"
+
+#include "ffmpegbridge_file.h"
+#include "ffmpegbridge_latency.h"
+#include "ffmpegbridge_log.h"
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+
+//
+//-- helper functions
+//
+
+// on the file's thread -- reserve space up to an extent past end. The file
+// keeps its size (FALLOC_FL_KEEP_SIZE), so that a recording that's cut
+// short doesn't end in zeroes.
+void _file_preallocate(FFmpegBridgeFile *file, int64_t end) {
+  int64_t to;
+
+  if (file->extent_size <= 0 || end <= file->allocated) return;
+
+  to = FFALIGN(end + file->extent_size, FFMPBR_FILE_ALIGN);
+  if (fallocate64(file->fd, FALLOC_FL_KEEP_SIZE, file->allocated, to - file->allocated) < 0) {
+    if (errno == EOPNOTSUPP || errno == ENOSYS) {
+      LOGI("The filesystem can't preallocate, writing without it");
+    } else {
+      LOGE("ERROR: _file_preallocate -- %s, writing without it", strerror(errno));
+    }
+    file->extent_size = 0;
+    return;
+  }
+  file->stats.preallocated_bytes += to - file->allocated;
+  file->allocated = to;
+}
+
+int _file_pwrite_all(int fd, const uint8_t *data, int size, int64_t offset) {
+  ssize_t n;
+  int done = 0;
+
+  while (done < size) {
+    n = pwrite64(fd, data + done, size - done, offset + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return AVERROR(errno);
+    done += n;
+  }
+  return 0;
+}
+
+// on the file's thread, with the lock held -- waits for a block to be
+// queued, or until the next sync is due
+void _file_wait(FFmpegBridgeFile *file) {
+  struct timespec ts;
+  int64_t wait_us;
+
+  if (!file->unsynced || !file->sync_interval_us) {
+    pthread_cond_wait(&file->wake, &file->lock);
+    return;
+  }
+  wait_us = file->last_sync_us + file->sync_interval_us - ffmpbr_now_us();
+  if (wait_us <= 0) return;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  wait_us += ts.tv_nsec / 1000;
+  ts.tv_sec += wait_us / 1000000;
+  ts.tv_nsec = wait_us % 1000000 * 1000;
+  pthread_cond_timedwait(&file->wake, &file->lock, &ts);
+}
+
+int _file_sync_due(FFmpegBridgeFile *file) {
+  return file->unsynced && file->sync_interval_us &&
+    ffmpbr_now_us() - file->last_sync_us >= file->sync_interval_us;
+}
+
+// with the lock held
+void _file_sync(FFmpegBridgeFile *file) {
+  int64_t t;
+
+  pthread_mutex_unlock(&file->lock);
+  t = ffmpbr_now_us();
+  if (fdatasync(file->fd) < 0) {
+    LOGE("ERROR: _file_sync -- %s", strerror(errno));
+  }
+  file->last_sync_us = ffmpbr_now_us();
+  t = file->last_sync_us - t;
+  pthread_mutex_lock(&file->lock);
+
+  file->unsynced = 0;
+  file->stats.syncs++;
+  if (t > file->stats.max_sync_us) file->stats.max_sync_us = t;
+}
+
+// writes the queued blocks out in order, and syncs in between
+void* _file_thread(void *arg) {
+  FFmpegBridgeFile *file = arg;
+  FFmpegBridgeFileBlock *block;
+  int64_t t;
+  int rc;
+
+  pthread_mutex_lock(&file->lock);
+  file->last_sync_us = ffmpbr_now_us();
+  for (;;) {
+    while (!file->queued && !file->stopping && !_file_sync_due(file)) {
+      _file_wait(file);
+    }
+
+    if (file->queued) {
+      block = &file->blocks[file->head];
+
+      // after a failure, blocks are still taken off the queue (unwritten),
+      // so that the write path never waits on a dead file
+      rc = file->error;
+      pthread_mutex_unlock(&file->lock);
+      t = ffmpbr_now_us();
+      if (rc >= 0) {
+        _file_preallocate(file, block->offset + block->size);
+        rc = _file_pwrite_all(file->fd, block->data, block->size, block->offset);
+        if (rc < 0) {
+          LOGE("ERROR: _file_thread -- couldn't write %d bytes at %lld: %s", block->size,
+            block->offset, av_err2str(rc));
+        }
+      }
+      t = ffmpbr_now_us() - t;
+      pthread_mutex_lock(&file->lock);
+
+      if (rc < 0) file->error = rc;
+      else file->unsynced = 1;
+      file->head = (file->head + 1) % FFMPBR_FILE_BLOCKS;
+      file->queued--;
+      file->stats.blocks++;
+      if (t > file->stats.max_write_us) file->stats.max_write_us = t;
+      pthread_cond_broadcast(&file->done);
+    }
+
+    if (_file_sync_due(file)) {
+      _file_sync(file);
+    }
+
+    if (!file->queued && file->stopping) break;
+  }
+  pthread_mutex_unlock(&file->lock);
+  return NULL;
+}
+
+// queues the block being filled, if there's anything in it, and moves on
+// to the next one
+void _file_queue(FFmpegBridgeFile *file) {
+  if (!file->filling) return;
+
+  pthread_mutex_lock(&file->lock);
+  file->queued++;
+  pthread_cond_signal(&file->wake);
+  pthread_mutex_unlock(&file->lock);
+  file->fill = (file->fill + 1) % FFMPBR_FILE_BLOCKS;
+  file->filling = 0;
+}
+
+// waits, if every block is queued, for the oldest to be written; 0, or the
+// AVERROR a write failed with
+int _file_wait_block(FFmpegBridgeFile *file) {
+  int64_t t;
+  int rc;
+
+  pthread_mutex_lock(&file->lock);
+  if (file->queued == FFMPBR_FILE_BLOCKS) {
+    t = ffmpbr_now_us();
+    while (file->queued == FFMPBR_FILE_BLOCKS) {
+      pthread_cond_wait(&file->done, &file->lock);
+    }
+    t = ffmpbr_now_us() - t;
+    file->stats.stalls++;
+    if (t > file->stats.max_stall_us) file->stats.max_stall_us = t;
+  }
+  rc = file->error;
+  pthread_mutex_unlock(&file->lock);
+  return rc;
+}
+
+
+//
+//-- FFmpegBridgeFile API
+//
+
+int ffmpbr_file_start(FFmpegBridgeFile *file, int fd, int block_size, int64_t extent_size,
+  int64_t sync_interval_us) {
+  void *memory;
+  int i, rc;
+
+  memset(file, 0, sizeof(FFmpegBridgeFile));
+  file->fd = fd;
+  file->block_size = FFALIGN(FFMAX(block_size, FFMPBR_FILE_ALIGN), FFMPBR_FILE_ALIGN);
+  file->extent_size = extent_size > 0 ? FFALIGN(extent_size, FFMPBR_FILE_ALIGN) : 0;
+  file->sync_interval_us = FFMAX(sync_interval_us, 0);
+
+  // page aligned, as the page cache would have it
+  rc = posix_memalign(&memory, FFMPBR_FILE_ALIGN, (size_t)file->block_size * FFMPBR_FILE_BLOCKS);
+  if (rc) {
+    LOGE("ERROR: ffmpbr_file_start -- couldn't allocate the blocks: %d", rc);
+    return AVERROR(rc);
+  }
+  file->memory = memory;
+  for (i = 0; i < FFMPBR_FILE_BLOCKS; i++) {
+    file->blocks[i].data = file->memory + (size_t)file->block_size * i;
+  }
+
+  pthread_mutex_init(&file->lock, NULL);
+  pthread_cond_init(&file->wake, NULL);
+  pthread_cond_init(&file->done, NULL);
+
+  rc = pthread_create(&file->thread, NULL, _file_thread, file);
+  if (rc) {
+    LOGE("ERROR: ffmpbr_file_start -- couldn't start the file thread: %d", rc);
+    pthread_mutex_destroy(&file->lock);
+    pthread_cond_destroy(&file->wake);
+    pthread_cond_destroy(&file->done);
+    free(file->memory);
+    return AVERROR(rc);
+  }
+  return 0;
+}
+
+int ffmpbr_file_write(FFmpegBridgeFile *file, const uint8_t *buf, int size) {
+  FFmpegBridgeFileBlock *block;
+  int n, capacity, rc, left = size;
+
+  while (left > 0) {
+    block = &file->blocks[file->fill];
+    if (!file->filling) {
+      rc = _file_wait_block(file);
+      if (rc < 0) return rc;
+      block->offset = file->position;
+      block->size = 0;
+      file->filling = 1;
+      file->fill_start_us = ffmpbr_now_us();
+    }
+
+    // up to the next block boundary in the file
+    capacity = file->block_size - block->offset % file->block_size;
+    n = FFMIN(left, capacity - block->size);
+    memcpy(block->data + block->size, buf, n);
+    block->size += n;
+    file->position += n;
+    buf += n;
+    left -= n;
+
+    if (block->size == capacity) {
+      _file_queue(file);
+    }
+  }
+  if (file->position > file->size) file->size = file->position;
+
+  // a slow stream shouldn't leave a block in memory for longer than a sync
+  // interval
+  if (file->sync_interval_us && file->filling &&
+    ffmpbr_now_us() - file->fill_start_us >= file->sync_interval_us) {
+    _file_queue(file);
+  }
+
+  pthread_mutex_lock(&file->lock);
+  rc = file->error;
+  pthread_mutex_unlock(&file->lock);
+  return rc < 0 ? rc : size;
+}
+
+int64_t ffmpbr_file_seek(FFmpegBridgeFile *file, int64_t offset, int whence) {
+  switch (whence) {
+    case AVSEEK_SIZE:
+      return file->size;
+    case SEEK_CUR:
+      offset += file->position;
+      break;
+    case SEEK_END:
+      offset += file->size;
+      break;
+    case SEEK_SET:
+      break;
+    default:
+      return AVERROR(EINVAL);
+  }
+  if (offset < 0) return AVERROR(EINVAL);
+
+  // the blocks go out in order, so the one so far only has to be queued
+  // ahead of whatever comes next
+  if (offset != file->position) {
+    _file_queue(file);
+    file->position = offset;
+  }
+  return offset;
+}
+
+int ffmpbr_file_flush(FFmpegBridgeFile *file) {
+  int rc;
+
+  _file_queue(file);
+
+  pthread_mutex_lock(&file->lock);
+  while (file->queued) {
+    pthread_cond_wait(&file->done, &file->lock);
+  }
+  rc = file->error;
+  pthread_mutex_unlock(&file->lock);
+  return rc;
+}
+
+void ffmpbr_file_get_stats(FFmpegBridgeFile *file, FFmpegBridgeFileStats *stats) {
+  pthread_mutex_lock(&file->lock);
+  *stats = file->stats;
+  pthread_mutex_unlock(&file->lock);
+}
+
+int ffmpbr_file_close(FFmpegBridgeFile *file) {
+  int rc;
+
+  _file_queue(file);
+
+  pthread_mutex_lock(&file->lock);
+  file->stopping = 1;
+  pthread_cond_signal(&file->wake);
+  pthread_mutex_unlock(&file->lock);
+  pthread_join(file->thread, NULL);
+  rc = file->error;
+
+  if (rc >= 0 && file->sync_interval_us) {
+    pthread_mutex_lock(&file->lock);
+    file->unsynced = 1;
+    _file_sync(file);
+    pthread_mutex_unlock(&file->lock);
+  }
+
+  // whatever was preallocated past the end stays allocated otherwise
+  if (file->allocated > file->size && ftruncate64(file->fd, file->size) < 0) {
+    LOGE("ERROR: ffmpbr_file_close -- couldn't trim the preallocated space: %s", strerror(errno));
+  }
+
+  close(file->fd);
+  pthread_mutex_destroy(&file->lock);
+  pthread_cond_destroy(&file->wake);
+  pthread_cond_destroy(&file->done);
+  free(file->memory);
+  return rc;
+}
@@ -0,0 +1,202 @@
+//
+// A minimal Enhanced RTMP FLV muxer.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <string.h>
+
+#include "libavutil/intfloat.h"
+
+#include "ffmpegbridge_flv.h"
+#include "ffmpegbridge_log.h"
+
+#define FFMPBR_FLV_TAG_AUDIO 8
+#define FFMPBR_FLV_TAG_VIDEO 9
+#define FFMPBR_FLV_TAG_SCRIPT 18
+#define FFMPBR_FLV_TAG_HEADER_SIZE 11
+
+// AAC, 44kHz, 16 bit, stereo -- AAC always claims these, the real values
+// are in the AudioSpecificConfig
+#define FFMPBR_FLV_AUDIO_AAC 0xaf
+
+// Enhanced RTMP video tag header: IsExHeader, FrameType, then PacketType
+#define FFMPBR_FLV_EX_HEADER 0x80
+#define FFMPBR_FLV_FRAME_KEY (1 << 4)
+#define FFMPBR_FLV_FRAME_INTER (2 << 4)
+#define FFMPBR_FLV_PACKET_SEQUENCE_START 0
+#define FFMPBR_FLV_PACKET_CODED_FRAMES 1
+#define FFMPBR_FLV_PACKET_SEQUENCE_END 2
+#define FFMPBR_FLV_PACKET_CODED_FRAMES_X 3
+
+//
+//-- helper functions
+//
+
+void _flv_put_tag_header(FFmpegBridgeFlv *flv, int type, int size, int64_t ts) {
+  // (nothing reorders the two streams ahead of us, so one may start a
+  // little before the other)
+  ts = FFMAX(ts + flv->delay_ms, 0);
+  avio_w8(flv->pb, type);
+  avio_wb24(flv->pb, size);
+  avio_wb24(flv->pb, ts & 0xffffff);
+  avio_w8(flv->pb, (ts >> 24) & 0x7f);    // TimestampExtended
+  avio_wb24(flv->pb, 0);                  // StreamID
+}
+
+// finishes a tag, and hands it to the sink straight away (see
+// ffmpegbridge_io.h)
+int _flv_end_tag(FFmpegBridgeFlv *flv, int size) {
+  avio_wb32(flv->pb, FFMPBR_FLV_TAG_HEADER_SIZE + size);    // PreviousTagSize
+  avio_flush(flv->pb);
+  return flv->pb->error;
+}
+
+void _flv_put_amf_string(AVIOContext *pb, const char *str) {
+  int len = strlen(str);
+  avio_wb16(pb, len);
+  avio_write(pb, (const unsigned char *)str, len);
+}
+
+void _flv_put_amf_number(AVIOContext *pb, const char *name, double value) {
+  _flv_put_amf_string(pb, name);
+  avio_w8(pb, 0);                         // AMF0 number
+  avio_wb64(pb, av_double2int(value));
+}
+
+void _flv_put_amf_bool(AVIOContext *pb, const char *name, int value) {
+  _flv_put_amf_string(pb, name);
+  avio_w8(pb, 1);                         // AMF0 boolean
+  avio_w8(pb, !!value);
+}
+
+int _flv_write_metadata(FFmpegBridgeFlv *flv, AVCodecContext *video, AVCodecContext *audio,
+  int video_fps) {
+  AVIOContext *body;
+  uint8_t *data;
+  int size, rc;
+
+  rc = avio_open_dyn_buf(&body);
+  if (rc < 0) return rc;
+
+  avio_w8(body, 2);                       // AMF0 string
+  _flv_put_amf_string(body, "onMetaData");
+  avio_w8(body, 8);                       // AMF0 ECMA array
+  avio_wb32(body, 11);
+  _flv_put_amf_number(body, "duration", 0);
+  _flv_put_amf_number(body, "width", video->width);
+  _flv_put_amf_number(body, "height", video->height);
+  _flv_put_amf_number(body, "videodatarate", video->bit_rate / 1024.0);
+  _flv_put_amf_number(body, "framerate", video_fps);
+  _flv_put_amf_number(body, "videocodecid", flv->video_fourcc);
+  _flv_put_amf_number(body, "audiodatarate", audio->bit_rate / 1024.0);
+  _flv_put_amf_number(body, "audiosamplerate", audio->sample_rate);
+  _flv_put_amf_number(body, "audiosamplesize", 16);
+  _flv_put_amf_bool(body, "stereo", audio->channels > 1);
+  _flv_put_amf_number(body, "audiocodecid", 10);
+  _flv_put_amf_string(body, "");
+  avio_w8(body, 9);                       // AMF0 object end
+  size = avio_close_dyn_buf(body, &data);
+
+  _flv_put_tag_header(flv, FFMPBR_FLV_TAG_SCRIPT, size, 0);
+  avio_write(flv->pb, data, size);
+  av_free(data);
+  return _flv_end_tag(flv, size);
+}
+
+int _flv_write_video_tag(FFmpegBridgeFlv *flv, int frame_type, int packet_type, int64_t dts,
+  const uint8_t *data, int size, int cts) {
+  int body_size = 5 + (packet_type == FFMPBR_FLV_PACKET_CODED_FRAMES ? 3 : 0) + size;
+
+  _flv_put_tag_header(flv, FFMPBR_FLV_TAG_VIDEO, body_size, dts);
+  avio_w8(flv->pb, FFMPBR_FLV_EX_HEADER | frame_type | packet_type);
+  avio_wb32(flv->pb, flv->video_fourcc);
+  if (packet_type == FFMPBR_FLV_PACKET_CODED_FRAMES) {
+    avio_wb24(flv->pb, cts & 0xffffff);   // CompositionTime (SI24)
+  }
+  if (size) avio_write(flv->pb, data, size);
+  return _flv_end_tag(flv, body_size);
+}
+
+int _flv_write_audio_tag(FFmpegBridgeFlv *flv, int aac_packet_type, int64_t pts,
+  const uint8_t *data, int size) {
+  _flv_put_tag_header(flv, FFMPBR_FLV_TAG_AUDIO, 2 + size, pts);
+  avio_w8(flv->pb, FFMPBR_FLV_AUDIO_AAC);
+  avio_w8(flv->pb, aac_packet_type);
+  avio_write(flv->pb, data, size);
+  return _flv_end_tag(flv, 2 + size);
+}
+
+void _flv_start(FFmpegBridgeFlv *flv, int64_t ts) {
+  if (flv->started) return;
+  flv->delay_ms = -ts;
+  flv->started = 1;
+}
+
+
+//
+//-- FFmpegBridgeFlv API
+//
+
+int ffmpbr_flv_needs_enhanced(enum AVCodecID video_codec_id) {
+  return video_codec_id == AV_CODEC_ID_HEVC;
+}
+
+int ffmpbr_flv_write_header(FFmpegBridgeFlv *flv, AVIOContext *pb, AVCodecContext *video,
+  AVCodecContext *audio, int video_fps) {
+  int rc;
+
+  memset(flv, 0, sizeof(FFmpegBridgeFlv));
+  flv->pb = pb;
+  if (video->codec_id != AV_CODEC_ID_HEVC) {
+    LOGE("ERROR: ffmpbr_flv_write_header -- no Enhanced RTMP FourCC for codec %d", video->codec_id);
+    return AVERROR(EINVAL);
+  }
+  flv->video_fourcc = FFMPBR_FLV_FOURCC_HEVC;
+  if (!video->extradata_size || !audio->extradata_size) {
+    LOGE("ERROR: ffmpbr_flv_write_header -- missing extradata (video %d, audio %d bytes)",
+      video->extradata_size, audio->extradata_size);
+    return AVERROR(EINVAL);
+  }
+
+  // "FLV", version 1, audio and video, header size, then PreviousTagSize0
+  avio_write(pb, (const unsigned char *)"FLV", 3);
+  avio_w8(pb, 1);
+  avio_w8(pb, 0x05);
+  avio_wb32(pb, 9);
+  avio_wb32(pb, 0);
+
+  rc = _flv_write_metadata(flv, video, audio, video_fps);
+  if (rc < 0) return rc;
+
+  // the sequence headers go out at 0, ahead of everything
+  rc = _flv_write_video_tag(flv, FFMPBR_FLV_FRAME_KEY, FFMPBR_FLV_PACKET_SEQUENCE_START, 0,
+    video->extradata, video->extradata_size, 0);
+  if (rc < 0) return rc;
+  return _flv_write_audio_tag(flv, 0, 0, audio->extradata, audio->extradata_size);
+}
+
+int ffmpbr_flv_write_video(FFmpegBridgeFlv *flv, const uint8_t *data, int size, int64_t dts,
+  int64_t pts, int keyframe) {
+  int cts = pts - dts;
+
+  _flv_start(flv, dts);
+  flv->last_dts = dts;
+
+  // CodedFramesX leaves out the composition time when it's 0, i.e. for
+  // every frame of a stream without B-frames
+  return _flv_write_video_tag(flv, keyframe ? FFMPBR_FLV_FRAME_KEY : FFMPBR_FLV_FRAME_INTER,
+    cts ? FFMPBR_FLV_PACKET_CODED_FRAMES : FFMPBR_FLV_PACKET_CODED_FRAMES_X, dts,
+    data, size, cts);
+}
+
+int ffmpbr_flv_write_audio(FFmpegBridgeFlv *flv, const uint8_t *data, int size, int64_t pts) {
+  _flv_start(flv, pts);
+  return _flv_write_audio_tag(flv, 1, pts, data, size);
+}
+
+int ffmpbr_flv_write_trailer(FFmpegBridgeFlv *flv) {
+  if (!flv->started) return 0;
+  return _flv_write_video_tag(flv, FFMPBR_FLV_FRAME_KEY, FFMPBR_FLV_PACKET_SEQUENCE_END,
+    flv->last_dts, NULL, 0, 0);
+}
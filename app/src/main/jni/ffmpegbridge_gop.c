@@ -0,0 +1,79 @@
+//
+// The GOP cache, see ffmpegbridge_gop.h.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <string.h>
+
+#include "libavutil/mem.h"
+
+#include "ffmpegbridge_gop.h"
+#include "ffmpegbridge_log.h"
+
+//
+//-- helper functions
+//
+
+void _gop_clear(FFmpegBridgeGop *gop, int valid) {
+  gop->data_size = 0;
+  gop->count = 0;
+  gop->valid = valid;
+}
+
+
+//
+//-- FFmpegBridgeGop API
+//
+
+void ffmpbr_gop_init(FFmpegBridgeGop *gop, int max_bytes) {
+  memset(gop, 0, sizeof(FFmpegBridgeGop));
+  gop->max_bytes = max_bytes;
+}
+
+void ffmpbr_gop_add(FFmpegBridgeGop *gop, int stream_index, const uint8_t *data, int size,
+  int64_t pts, int64_t dts, int is_video_keyframe) {
+  FFmpegBridgeGopPacket *packet;
+  uint8_t *buf;
+
+  if (is_video_keyframe) {
+    _gop_clear(gop, 1);
+  }
+  if (!gop->valid) return;
+
+  if (gop->data_size + size > gop->max_bytes) {
+    LOGE("ERROR: ffmpbr_gop_add -- GOP over %d bytes, not cached", gop->max_bytes);
+    _gop_clear(gop, 0);
+    return;
+  }
+
+  buf = av_fast_realloc(gop->data, &gop->data_capacity, gop->data_size + size);
+  if (!buf) {
+    _gop_clear(gop, 0);
+    return;
+  }
+  gop->data = buf;
+  packet = av_fast_realloc(gop->packets, &gop->packets_capacity,
+    (gop->count + 1) * sizeof(FFmpegBridgeGopPacket));
+  if (!packet) {
+    _gop_clear(gop, 0);
+    return;
+  }
+  gop->packets = packet;
+
+  packet = &gop->packets[gop->count++];
+  packet->offset = gop->data_size;
+  packet->size = size;
+  packet->pts = pts;
+  packet->dts = dts;
+  packet->stream_index = stream_index;
+  packet->keyframe = is_video_keyframe;
+  memcpy(gop->data + gop->data_size, data, size);
+  gop->data_size += size;
+}
+
+void ffmpbr_gop_free(FFmpegBridgeGop *gop) {
+  av_free(gop->data);
+  av_free(gop->packets);
+  memset(gop, 0, sizeof(FFmpegBridgeGop));
+}
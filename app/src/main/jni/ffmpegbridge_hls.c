@@ -0,0 +1,226 @@
+//
+// In-memory HLS, see ffmpegbridge_hls.h.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libavutil/mem.h"
+
+#include "ffmpegbridge_hls.h"
+#include "ffmpegbridge_io.h"
+#include "ffmpegbridge_log.h"
+#include "ffmpegbridge_segment.h"
+
+#define FFMPBR_HLS_INIT_NAME "init.mp4"
+
+//
+//-- helper functions
+//
+
+int _hls_append(FFmpegBridgeHlsSegment *segment, const uint8_t *buf, int buf_size) {
+  uint8_t *data;
+
+  if (segment->size + buf_size > segment->capacity) {
+    data = av_fast_realloc(segment->data, (unsigned int *)&segment->capacity,
+      segment->size + buf_size);
+    if (!data) return AVERROR(ENOMEM);
+    segment->data = data;
+  }
+  memcpy(segment->data + segment->size, buf, buf_size);
+  segment->size += buf_size;
+  return buf_size;
+}
+
+int _hls_write(void *opaque, uint8_t *buf, int buf_size) {
+  FFmpegBridgeHls *hls = opaque;
+  int capacity = hls->current->capacity;
+  int rc = _hls_append(hls->current, buf, buf_size);
+
+  hls->stats.buffered_bytes += hls->current->capacity - capacity;
+  if (hls->stats.buffered_bytes > hls->stats.max_buffered_bytes) {
+    hls->stats.max_buffered_bytes = hls->stats.buffered_bytes;
+  }
+  return rc;
+}
+
+void _hls_free_segment(FFmpegBridgeHls *hls, FFmpegBridgeHlsSegment *segment) {
+  if (!segment) return;
+  hls->stats.buffered_bytes -= segment->capacity;
+  av_free(segment->data);
+  av_free(segment);
+}
+
+// a fresh segment, on the buffer of one that left the playlist if there is
+// one
+void _hls_start_segment(FFmpegBridgeHls *hls, int64_t pts) {
+  FFmpegBridgeHlsSegment *segment = hls->spare;
+
+  if (segment) {
+    hls->spare = NULL;
+  } else {
+    segment = av_mallocz(sizeof(FFmpegBridgeHlsSegment));
+  }
+  segment->index = hls->next_index++;
+  segment->size = 0;
+  segment->duration_us = 0;
+  ffmpbr_segment_url(segment->name, sizeof(segment->name), hls->name_pattern, segment->index);
+
+  hls->current = segment;
+  hls->start_pts = pts;
+}
+
+void _hls_write_playlist(FFmpegBridgeHls *hls, int ended) {
+  char *p = hls->playlist, *end = hls->playlist + hls->playlist_capacity;
+  int i;
+
+  // EXTINF durations, rounded, may not go over the target duration
+  p += snprintf(p, end - p, "#EXTM3U\n#EXT-X-VERSION:%d\n#EXT-X-TARGETDURATION:%d\n",
+    hls->cmaf ? 7 : 3, (int)((FFMAX(hls->max_duration_us, hls->target_us) + 999999) / 1000000));
+  p += snprintf(p, end - p, "#EXT-X-MEDIA-SEQUENCE:%d\n",
+    hls->window_count ? hls->window[0]->index : hls->next_index);
+  if (hls->cmaf) {
+    p += snprintf(p, end - p, "#EXT-X-MAP:URI=\"%s\"\n", hls->init.name);
+  }
+  for (i=0; i<hls->window_count; ++i) {
+    p += snprintf(p, end - p, "#EXTINF:%.3f,\n%s\n", hls->window[i]->duration_us / 1e6,
+      hls->window[i]->name);
+  }
+  if (ended) {
+    snprintf(p, end - p, "#EXT-X-ENDLIST\n");
+  }
+}
+
+void _hls_end_segment(FFmpegBridgeHls *hls, int64_t end_pts, int ended) {
+  FFmpegBridgeHlsSegment *segment = hls->current;
+
+  avio_flush(hls->pb);
+  segment->duration_us = end_pts - hls->start_pts;
+  if (segment->duration_us > hls->max_duration_us) hls->max_duration_us = segment->duration_us;
+
+  // the oldest segment leaves the playlist, and its buffer is kept for the
+  // next one
+  if (hls->window_count == hls->list_size) {
+    _hls_free_segment(hls, hls->spare);
+    hls->spare = hls->window[0];
+    memmove(hls->window, hls->window + 1, (hls->window_count - 1) * sizeof(hls->window[0]));
+    hls->window_count--;
+  }
+  hls->window[hls->window_count++] = segment;
+  hls->current = NULL;
+
+  hls->stats.segments++;
+  hls->stats.bytes += segment->size;
+  if (segment->size > hls->stats.max_segment_bytes) hls->stats.max_segment_bytes = segment->size;
+
+  _hls_write_playlist(hls, ended);
+  LOGI("HLS segment %s: %d bytes, %lld ms", segment->name, segment->size,
+    segment->duration_us / 1000);
+  hls->callback(hls->opaque, segment, hls->playlist);
+}
+
+
+//
+//-- FFmpegBridgeHls API
+//
+
+int ffmpbr_hls_init(FFmpegBridgeHls *hls, int cmaf, int segment_ms, int list_size,
+  int64_t frame_duration_us, const char *name_pattern, FFmpegBridgeHlsCallback callback,
+  void *opaque) {
+  uint8_t *buffer;
+
+  memset(hls, 0, sizeof(FFmpegBridgeHls));
+  hls->cmaf = cmaf;
+  hls->target_us = segment_ms * 1000LL;
+  hls->frame_duration_us = frame_duration_us;
+  hls->list_size = av_clip(list_size, 1, FFMPBR_HLS_MAX_LIST);
+  snprintf(hls->name_pattern, sizeof(hls->name_pattern), "%s", name_pattern);
+  snprintf(hls->init.name, sizeof(hls->init.name), "%s", FFMPBR_HLS_INIT_NAME);
+  hls->init.index = FFMPBR_HLS_INIT_SEGMENT;
+  hls->callback = callback;
+  hls->opaque = opaque;
+  hls->start_pts = hls->end_pts = AV_NOPTS_VALUE;
+
+  hls->playlist_capacity = 256 + FFMPBR_HLS_MAX_LIST * (FFMPBR_HLS_MAX_NAME + 32);
+  hls->playlist = av_malloc(hls->playlist_capacity);
+
+  // the header goes into segment 0, until it turns out to be an init
+  // segment
+  _hls_start_segment(hls, AV_NOPTS_VALUE);
+
+  // not seekable, so the mp4 muxer has to be fragmenting
+  buffer = av_malloc(FFMPBR_IO_BUFFER_SIZE);
+  hls->pb = avio_alloc_context(buffer, FFMPBR_IO_BUFFER_SIZE, 1, hls, NULL, _hls_write, NULL);
+  if (!hls->playlist || !hls->current || !hls->pb) {
+    ffmpbr_hls_free(hls);
+    return AVERROR(ENOMEM);
+  }
+  hls->pb->seekable = 0;
+  return 0;
+}
+
+void ffmpbr_hls_header_written(FFmpegBridgeHls *hls) {
+  FFmpegBridgeHlsSegment *segment = hls->current;
+
+  if (!hls->cmaf) return;
+
+  // hand segment 0's buffer over to the init segment as it is
+  avio_flush(hls->pb);
+  hls->init.data = segment->data;
+  hls->init.size = segment->size;
+  hls->init.capacity = segment->capacity;
+  segment->data = NULL;
+  segment->size = segment->capacity = 0;
+
+  _hls_write_playlist(hls, 0);
+  hls->callback(hls->opaque, &hls->init, hls->playlist);
+}
+
+int ffmpbr_hls_video_packet(FFmpegBridgeHls *hls, int64_t pts, int keyframe) {
+  if (hls->end_pts == AV_NOPTS_VALUE || pts + hls->frame_duration_us > hls->end_pts) {
+    hls->end_pts = pts + hls->frame_duration_us;
+  }
+  if (!keyframe) return 0;
+
+  if (hls->start_pts == AV_NOPTS_VALUE) {
+    hls->start_pts = pts;
+    return 0;
+  }
+  return pts - hls->start_pts >= hls->target_us;
+}
+
+void ffmpbr_hls_cut(FFmpegBridgeHls *hls, int64_t pts) {
+  _hls_end_segment(hls, pts, 0);
+  _hls_start_segment(hls, pts);
+}
+
+void ffmpbr_hls_finish(FFmpegBridgeHls *hls) {
+  if (!hls->current) return;
+  avio_flush(hls->pb);
+  if (hls->current->size && hls->start_pts != AV_NOPTS_VALUE) {
+    _hls_end_segment(hls, hls->end_pts, 1);
+  }
+}
+
+void ffmpbr_hls_free(FFmpegBridgeHls *hls) {
+  int i;
+
+  if (hls->pb) {
+    av_free(hls->pb->buffer);
+    av_free(hls->pb);
+  }
+  for (i=0; i<hls->window_count; ++i) {
+    _hls_free_segment(hls, hls->window[i]);
+  }
+  _hls_free_segment(hls, hls->current);
+  _hls_free_segment(hls, hls->spare);
+  av_free(hls->init.data);
+  av_free(hls->playlist);
+  memset(hls, 0, sizeof(FFmpegBridgeHls));
+}
+
+void ffmpbr_hls_get_stats(FFmpegBridgeHls *hls, FFmpegBridgeHlsStats *stats) {
+  *stats = hls->stats;
+}
@@ -0,0 +1,878 @@
+//
+// The AVIO layer between the muxer and the output url.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "libavutil/avstring.h"
+
+#include "ffmpegbridge_file.h"
+#include "ffmpegbridge_io.h"
+#include "ffmpegbridge_log.h"
+#include "ffmpegbridge_pool.h"
+#include "ffmpegbridge_rtmp.h"
+#include "ffmpegbridge_udp.h"
+
+// (Linux 3.12, newer than some NDK headers)
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
+
+// how long the probe waits to finish a TS packet of padding it's started
+#define FFMPBR_IO_PROBE_STALL_MS 1000
+
+// for our own rtmp connection when there's nothing to tune, only pooling
+static const FFmpegBridgeTransport default_transport = { 0, -1, 0, 0 };
+
+//
+//-- helper functions
+//
+
+// 1 for the urls _io_open_fd opens itself: tcp, udp and local files
+int _io_fd_url(const char *url) {
+  return av_strstart(url, "tcp:", NULL) || av_strstart(url, "udp:", NULL) ||
+    av_strstart(url, "file:", NULL) || !strstr(url, "://");
+}
+
+// in event loop mode, files and plain tcp and udp urls are written through
+// our own non-blocking fd; anything else (e.g. rtmp) goes through avio or
+// librtmp, and blocks the loop thread that's writing it, which is why it
+// gets a loop of its own. Inline, udp urls and tcp urls with transport
+// settings get an fd, a blocking one.
+int _io_open_fd(const char *url, const FFmpegBridgeTransport *transport, int nonblocking,
+  int *seekable) {
+  char proto[16], host[256], port_str[16];
+  struct addrinfo hints, *addrs, *addr;
+  int fd = -1, port, rc, err = ECONNREFUSED, is_udp;
+
+  av_url_split(proto, sizeof(proto), NULL, 0, host, sizeof(host), &port, NULL, 0, url);
+  is_udp = !strcmp(proto, "udp");
+
+  if (!strcmp(proto, "tcp") || is_udp) {
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = is_udp ? SOCK_DGRAM : SOCK_STREAM;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    rc = getaddrinfo(host, port_str, &hints, &addrs);
+    if (rc) {
+      LOGE("ERROR: _io_open_fd -- could not resolve %s: %s", host, gai_strerror(rc));
+      return AVERROR(EIO);
+    }
+    for (addr = addrs; addr; addr = addr->ai_next) {
+      fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+      if (fd < 0) continue;
+      if (is_udp) {
+        if (transport && transport->send_buffer > 0 &&
+          setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &transport->send_buffer, sizeof(int)) < 0) {
+          LOGE("ERROR: _io_open_fd -- SO_SNDBUF: %s", strerror(errno));
+        }
+      } else if (transport) {
+        ffmpbr_io_set_socket_options(fd, transport);
+      }
+      // (udp too, so that send() works, and ICMP port unreachables from the
+      // receiver's host come back as ECONNREFUSED)
+      if (!connect(fd, addr->ai_addr, addr->ai_addrlen)) break;
+      err = errno;
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd < 0) {
+      return AVERROR(err);
+    }
+    *seekable = 0;
+  } else if (!strcmp(proto, "file") || !strstr(url, "://")) {
+    av_strstart(url, "file:", &url);
+    fd = open(url, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+      return AVERROR(errno);
+    }
+    *seekable = AVIO_SEEKABLE_NORMAL;
+  } else {
+    return AVERROR(ENOSYS);
+  }
+
+  if (nonblocking) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+  return fd;
+}
+
+int _io_rtmp_write(void *opaque, uint8_t *buf, int buf_size) {
+  return ffmpbr_rtmp_write(opaque, buf, buf_size);
+}
+
+// rtmp through our own librtmp connection, warm from the pool if there's
+// one, wrapped up as the avio sink
+int _io_open_rtmp(FFmpegBridgeIO *io, const char *url, const FFmpegBridgeTransport *transport) {
+  uint8_t *buffer;
+  int rc;
+
+  io->rtmp = ffmpbr_pool_take(url, transport);
+  if (!io->rtmp) {
+    rc = ffmpbr_rtmp_open(&io->rtmp, url, transport);
+    if (rc < 0) return rc;
+  }
+
+  buffer = av_malloc(FFMPBR_IO_BUFFER_SIZE);
+  io->sink = avio_alloc_context(buffer, FFMPBR_IO_BUFFER_SIZE, 1, io->rtmp, NULL, _io_rtmp_write,
+    NULL);
+  io->sink->seekable = 0;
+  return 0;
+}
+
+// counts n bytes sent at now_us towards the send rate windows; idle
+// windows in between count as empty
+void _io_count_send(FFmpegBridgeIO *io, int n, int64_t now_us) {
+  int64_t elapsed;
+
+  if (!io->window_start_us) io->window_start_us = now_us;
+  elapsed = now_us - io->window_start_us;
+  if (elapsed >= FFMPBR_IO_RATE_WINDOW_US) {
+    io->windows += elapsed / FFMPBR_IO_RATE_WINDOW_US;
+    io->window_sum += io->window_bytes;
+    io->window_sum_sq += (double)io->window_bytes * io->window_bytes;
+    if (io->window_bytes > io->window_peak) io->window_peak = io->window_bytes;
+    io->window_start_us += elapsed / FFMPBR_IO_RATE_WINDOW_US * FFMPBR_IO_RATE_WINDOW_US;
+    io->window_bytes = 0;
+  }
+  io->window_bytes += n;
+}
+
+// the socket under the sink, or -1
+int _io_socket(FFmpegBridgeIO *io) {
+  if (io->fd >= 0) return io->fd_is_socket ? io->fd : -1;
+  if (io->rtmp) return RTMP_Socket(io->rtmp->rtmp);
+  return -1;
+}
+
+// libavformat's protocols check this while they wait on the network. The
+// deadline is only ever set and passed on the writing thread inline; with
+// the event loop, the thread waiting for the output to drain cuts it off
+// (see _io_cut_off).
+int _io_interrupted(void *opaque) {
+  FFmpegBridgeIO *io = opaque;
+
+  if (io->loop) return io->interrupted;
+  return io->deadline_us && ffmpbr_now_us() >= io->deadline_us;
+}
+
+// the error an avio sink failed with, or 0; cut off by the deadline (see
+// _io_interrupted), that's a timeout like on a socket of our own
+int _io_avio_error(FFmpegBridgeIO *io) {
+  if (io->sink->error == AVERROR_EXIT) return AVERROR(ETIMEDOUT);
+  return FFMIN(io->sink->error, 0);
+}
+
+// returns the number of bytes written, 0 if the sink would block, or an
+// AVERROR if it failed
+int _io_sink_write(FFmpegBridgeIO *io, uint8_t *data, int size) {
+  ssize_t n;
+  int rc;
+
+  if (io->fd < 0) {
+    avio_write(io->sink, data, size);
+    avio_flush(io->sink);
+    rc = _io_avio_error(io);
+    return rc < 0 ? rc : size;
+  }
+
+  // udp: a datagram's worth per send. With the event loop, datagrams that
+  // queued up behind each other go out together, up to that size.
+  if (io->udp) size = FFMIN(size, FFMPBR_UDP_DATAGRAM_SIZE);
+
+  do {
+    // MSG_NOSIGNAL so that a dropped connection doesn't SIGPIPE the app
+    if (io->fd_is_socket) {
+      n = send(io->fd, data, size, MSG_NOSIGNAL);
+    } else {
+      n = write(io->fd, data, size);
+    }
+  } while (n < 0 && errno == EINTR);
+
+  if (n >= 0) return n;
+  if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+
+  // nothing listening at the other end (yet), which is no reason to stop
+  // sending: the datagram is lost, as it would be on the network
+  if (io->udp && errno == ECONNREFUSED) {
+    io->refused_datagrams++;
+    return size;
+  }
+  return AVERROR(errno);
+}
+
+// inline writes to our own (blocking) fd
+int _io_fd_write_all(FFmpegBridgeIO *io, uint8_t *data, int size) {
+  int n, done = 0;
+
+  while (done < size) {
+    n = _io_sink_write(io, data + done, size - done);
+    if (n < 0) return n;
+
+    // (a blocking socket only comes back with nothing sent once its send
+    // timeout is up, see _io_apply_deadline)
+    if (n == 0) return AVERROR(ETIMEDOUT);
+    done += n;
+  }
+  return size;
+}
+
+// probe padding, see ffmpbr_io_probe
+int _io_probe_rtmp(void *opaque, int size) {
+  FFmpegBridgeIO *io = opaque;
+  return ffmpbr_rtmp_send_padding(io->rtmp, size);
+}
+
+int _io_probe_ts(void *opaque, int size) {
+  FFmpegBridgeIO *io = opaque;
+  uint8_t packets[FFMPBR_PROBE_PIECE_SIZE / 188 * 188];
+  struct pollfd pfd;
+  int i, n, done = 0;
+
+  // null packets (PID 0x1fff), which demuxers drop
+  for (i = 0; i < sizeof(packets); i += 188) {
+    packets[i] = 0x47;
+    packets[i + 1] = 0x1f;
+    packets[i + 2] = 0xff;
+    packets[i + 3] = 0x10;
+    memset(packets + i + 4, 0xff, 184);
+  }
+
+  // whole packets only, or the media after them would be out of sync. The
+  // socket may be non-blocking (event loop mode): between packets, what's
+  // been sent so far is returned, and the probe waits for the socket; a
+  // packet that's partly out has to be finished, but not at any cost.
+  size = FFMIN(size, sizeof(packets)) / 188 * 188;
+  while (done < size) {
+    n = _io_sink_write(io, packets + done, size - done);
+    if (n < 0) return n;
+    if (n == 0) {
+      if (done % 188 == 0) return done;
+      pfd.fd = io->fd;
+      pfd.events = POLLOUT;
+      if (poll(&pfd, 1, FFMPBR_IO_PROBE_STALL_MS) == 0) {
+        LOGE("ERROR: _io_probe_ts -- the connection stalled mid-packet");
+        return AVERROR(ETIMEDOUT);
+      }
+    }
+    done += n;
+  }
+  return size;
+}
+
+void _io_free_queue(FFmpegBridgeIO *io) {
+  FFmpegBridgeIOChunk *chunk;
+
+  while ((chunk = io->queue_head)) {
+    io->queue_head = chunk->next;
+    av_free(chunk);
+  }
+  io->queue_tail = NULL;
+  io->queued = 0;
+}
+
+// event loop mode, with the lock held -- the deadline passed with output
+// still queued (see ffmpbr_io_set_deadline). The loop thread drops the
+// queue once its write comes back, or once the socket drains; shutting the
+// socket down makes either happen straight away, and an avio sink's
+// protocol gives up on its write at its next interrupt check.
+void _io_cut_off(FFmpegBridgeIO *io) {
+  int fd = _io_socket(io);
+
+  LOGE("ERROR: _io_cut_off -- the deadline passed with %lld bytes still queued, dropping them",
+    io->queued);
+  io->error = AVERROR(ETIMEDOUT);
+  io->interrupted = 1;
+  if (fd >= 0) {
+    shutdown(fd, SHUT_RDWR);
+  }
+}
+
+void _io_wait_drained(FFmpegBridgeIO *io) {
+  struct timespec ts;
+  int64_t wait_us;
+
+  pthread_mutex_lock(&io->lock);
+  while (io->scheduled) {
+    if (!io->deadline_us || io->error < 0) {
+      pthread_cond_wait(&io->drained, &io->lock);
+      continue;
+    }
+    wait_us = io->deadline_us - ffmpbr_now_us();
+    if (wait_us <= 0) {
+      _io_cut_off(io);
+      continue;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    wait_us += ts.tv_nsec / 1000;
+    ts.tv_sec += wait_us / 1000000;
+    ts.tv_nsec = wait_us % 1000000 * 1000;
+    pthread_cond_timedwait(&io->drained, &io->lock, &ts);
+  }
+  pthread_mutex_unlock(&io->lock);
+}
+
+// inline, with a deadline -- a blocking send on our own socket waits no
+// longer than what's left of it; AVERROR(ETIMEDOUT) once it's passed
+int _io_apply_deadline(FFmpegBridgeIO *io) {
+  struct timeval timeout;
+  int64_t left = io->deadline_us - ffmpbr_now_us();
+  int fd = _io_socket(io);
+
+  if (left <= 0) return AVERROR(ETIMEDOUT);
+  if (fd >= 0) {
+    timeout.tv_sec = left / 1000000;
+    timeout.tv_usec = left % 1000000;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  }
+  return 0;
+}
+
+// event loop mode -- copy the bytes into the session's queue, and make sure
+// a loop thread will pick them up
+int _io_enqueue(FFmpegBridgeIO *io, uint8_t *buf, int buf_size) {
+  FFmpegBridgeIOChunk *chunk;
+  int n, size = buf_size, schedule = 0, error;
+
+  // udp comes in whole TS packets, which mustn't be split across chunks
+  // (see _io_sink_write)
+  int capacity = io->udp ? FFMPBR_IO_BUFFER_SIZE / FFMPBR_UDP_TS_PACKET_SIZE *
+    FFMPBR_UDP_TS_PACKET_SIZE : FFMPBR_IO_BUFFER_SIZE;
+
+  pthread_mutex_lock(&io->lock);
+  if (io->error < 0) {
+    error = io->error;
+    pthread_mutex_unlock(&io->lock);
+    return error;
+  }
+
+  while (size > 0) {
+    chunk = io->queue_tail;
+    if (!chunk || chunk->size == capacity) {
+      chunk = av_malloc(sizeof(FFmpegBridgeIOChunk));
+      if (!chunk) {
+        // part of buf may be queued already, so the output can't carry on
+        LOGE("ERROR: _io_enqueue -- out of memory with %lld bytes queued", io->queued);
+        io->queued += buf_size - size;
+        io->written += buf_size - size;
+        io->error = AVERROR(ENOMEM);
+        pthread_mutex_unlock(&io->lock);
+        return AVERROR(ENOMEM);
+      }
+      chunk->next = NULL;
+      chunk->size = chunk->offset = 0;
+      if (io->queue_tail) io->queue_tail->next = chunk;
+      else io->queue_head = chunk;
+      io->queue_tail = chunk;
+    }
+    n = FFMIN(size, capacity - chunk->size);
+    memcpy(chunk->data + chunk->size, buf, n);
+    chunk->size += n;
+    buf += n;
+    size -= n;
+  }
+  io->queued += buf_size;
+  io->written += buf_size;
+
+  if (!io->scheduled) {
+    io->scheduled = 1;
+    schedule = 1;
+  }
+  pthread_mutex_unlock(&io->lock);
+
+  if (schedule) {
+    ffmpbr_loop_schedule(io->loop, io);
+  }
+  return buf_size;
+}
+
+// bytes on their way to the sink: queued for the loop, or written inline
+int _io_output(void *opaque, uint8_t *buf, int buf_size) {
+  FFmpegBridgeIO *io = opaque;
+  int rc;
+
+  if (io->loop) {
+    return _io_enqueue(io, buf, buf_size);
+  }
+
+  io->written += buf_size;
+  if (io->deadline_us) {
+    rc = _io_apply_deadline(io);
+    if (rc < 0) return rc;
+  }
+  if (io->file) {
+    rc = ffmpbr_file_write(io->file, buf, buf_size);
+    if (rc < 0) {
+      LOGE("ERROR: _io_output -- %s", av_err2str(rc));
+      return rc;
+    }
+  } else if (io->fd >= 0) {
+    rc = _io_fd_write_all(io, buf, buf_size);
+    if (rc < 0) {
+      LOGE("ERROR: _io_output -- %s", av_err2str(rc));
+      return rc;
+    }
+  } else {
+    avio_write(io->sink, buf, buf_size);
+    avio_flush(io->sink);
+    rc = _io_avio_error(io);
+    if (rc < 0) {
+      LOGE("ERROR: _io_output -- %s", av_err2str(rc));
+      return rc;
+    }
+  }
+
+  io->sent += buf_size;
+  io->last_send_us = ffmpbr_now_us();
+  _io_count_send(io, buf_size, io->last_send_us);
+  if (io->latency) {
+    ffmpbr_latency_sent(io->latency, io->sent, io->last_send_us);
+  }
+  return buf_size;
+}
+
+// from the muxer; udp output is packed into datagrams on the way
+int _io_write(void *opaque, uint8_t *buf, int buf_size) {
+  FFmpegBridgeIO *io = opaque;
+
+  if (io->udp) {
+    return ffmpbr_udp_write(io->udp, buf, buf_size);
+  }
+  return _io_output(io, buf, buf_size);
+}
+
+int64_t _io_seek(void *opaque, int64_t offset, int whence) {
+  FFmpegBridgeIO *io = opaque;
+  struct stat st;
+
+  if (io->file) {
+    return ffmpbr_file_seek(io->file, offset, whence);
+  }
+
+  // seeking has to happen in order with the writes before it
+  if (io->loop) {
+    _io_wait_drained(io);
+  }
+
+  // some muxers (e.g. mp4) go back and patch sizes in the trailer
+  if (io->fd >= 0) {
+    if (whence == AVSEEK_SIZE) {
+      return fstat(io->fd, &st) < 0 ? AVERROR(errno) : st.st_size;
+    }
+    return lseek(io->fd, offset, whence);
+  }
+  if (whence == AVSEEK_SIZE) {
+    return avio_size(io->sink);
+  }
+  return avio_seek(io->sink, offset, whence);
+}
+
+
+//
+//-- FFmpegBridgeIO API
+//
+
+FFmpegBridgeIO* ffmpbr_io_open(const char *url, FFmpegBridgeLatency *latency,
+  const FFmpegBridgeTransport *transport, AVDictionary **options, int *rc) {
+  FFmpegBridgeIO *io;
+  AVIOInterruptCB int_cb;
+  uint8_t *buffer;
+  int seekable = 0, is_udp, duplicate_tables, own_thread, fd;
+
+  io = av_mallocz(sizeof(FFmpegBridgeIO));
+  io->latency = latency;
+  io->fd = -1;
+  is_udp = av_strstart(url, "udp:", NULL);
+  duplicate_tables = transport && transport->udp_duplicate_tables;
+  own_thread = transport && transport->queue_limit > 0;
+
+  // block file output has a thread of its own, and needs neither pacing
+  // nor the event loop
+  if (transport && transport->file_block_size > 0 &&
+    (av_strstart(url, "file:", NULL) || !strstr(url, "://"))) {
+    fd = _io_open_fd(url, NULL, 0, &seekable);
+    if (fd < 0) {
+      *rc = fd;
+      goto fail;
+    }
+    io->file = av_malloc(sizeof(FFmpegBridgeFile));
+    *rc = ffmpbr_file_start(io->file, fd, transport->file_block_size,
+      transport->file_extent_size, transport->file_sync_interval_us);
+    if (*rc < 0) {
+      close(fd);
+      goto fail;
+    }
+    goto opened;
+  }
+
+  if (transport && transport->pace_bit_rate > 0) {
+    io->pacer = av_malloc(sizeof(FFmpegBridgePacer));
+    ffmpbr_pacer_init(io->pacer, transport->pace_bit_rate, transport->pace_burst);
+  }
+  if (!ffmpbr_io_transport_set(transport)) transport = NULL;
+
+  // (a sink that blocks mustn't tie up the shared pool, see ffmpegbridge_loop.h)
+  if (_io_fd_url(url)) {
+    io->loop = ffmpbr_loop_acquire(io->pacer || own_thread ? 1 : 0);
+  } else {
+    io->loop = ffmpbr_loop_acquire_own(io->pacer || own_thread ? 1 : 0);
+  }
+  if (io->loop) {
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->drained, NULL);
+    io->home = ffmpbr_loop_assign_home(io->loop);
+
+    *rc = _io_open_fd(url, transport, 1, &seekable);
+    if (*rc >= 0) {
+      io->fd = *rc;
+      io->fd_is_socket = !seekable;
+    } else if (*rc != AVERROR(ENOSYS)) {
+      goto fail;
+    }
+  } else if ((transport && av_strstart(url, "tcp:", NULL)) || is_udp) {
+    *rc = _io_open_fd(url, transport, 0, &seekable);
+    if (*rc < 0) {
+      goto fail;
+    }
+    io->fd = *rc;
+    io->fd_is_socket = 1;
+  }
+
+  if (is_udp) {
+    io->udp = av_malloc(sizeof(FFmpegBridgeUdp));
+    ffmpbr_udp_init(io->udp, duplicate_tables, _io_output, io);
+  }
+
+  if (io->fd < 0 && ffmpbr_rtmp_is_url(url) && (transport || ffmpbr_pool_enabled())) {
+    *rc = _io_open_rtmp(io, url, transport ? transport : &default_transport);
+    if (*rc < 0) {
+      goto fail;
+    }
+  } else if (io->fd < 0) {
+    // (so that the deadline can cut a write short, see _io_interrupted)
+    int_cb.callback = _io_interrupted;
+    int_cb.opaque = io;
+    *rc = avio_open2(&io->sink, url, AVIO_FLAG_WRITE, &int_cb, options);
+    if (*rc < 0) {
+      goto fail;
+    }
+    seekable = io->sink->seekable;
+  }
+
+opened:
+  *rc = 0;
+
+  // this buffer is owned by pb from here on, and freed in ffmpbr_io_close()
+  buffer = av_malloc(FFMPBR_IO_BUFFER_SIZE);
+  io->pb = avio_alloc_context(buffer, FFMPBR_IO_BUFFER_SIZE, 1, io, NULL, _io_write, _io_seek);
+  io->pb->seekable = seekable;
+
+  return io;
+
+fail:
+  if (io->loop) {
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->drained);
+    ffmpbr_loop_release(io->loop);
+  }
+  av_free(io->pacer);
+  av_free(io->file);
+  av_free(io);
+  return NULL;
+}
+
+int ffmpbr_io_transport_set(const FFmpegBridgeTransport *transport) {
+  return transport && (transport->rtmp_chunk_size > 0 || transport->tcp_nodelay >= 0 ||
+    transport->send_buffer > 0 || transport->notsent_lowat > 0 || transport->own_socket);
+}
+
+void ffmpbr_io_set_socket_options(int fd, const FFmpegBridgeTransport *transport) {
+  if (transport->tcp_nodelay >= 0 &&
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &transport->tcp_nodelay, sizeof(int)) < 0) {
+    LOGE("ERROR: ffmpbr_io_set_socket_options -- TCP_NODELAY: %s", strerror(errno));
+  }
+  if (transport->send_buffer > 0 &&
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &transport->send_buffer, sizeof(int)) < 0) {
+    LOGE("ERROR: ffmpbr_io_set_socket_options -- SO_SNDBUF: %s", strerror(errno));
+  }
+  if (transport->notsent_lowat > 0 &&
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &transport->notsent_lowat, sizeof(int)) < 0) {
+    // (not an error on kernels before 3.12)
+    LOGI("TCP_NOTSENT_LOWAT isn't supported here: %s", strerror(errno));
+  }
+}
+
+int64_t ffmpbr_io_mux_offset(FFmpegBridgeIO *io) {
+  int64_t offset = io->written + (io->pb->buf_ptr - io->pb->buffer);
+
+  if (io->udp) offset += ffmpbr_udp_pending(io->udp);
+  return offset;
+}
+
+int64_t ffmpbr_io_queued(FFmpegBridgeIO *io) {
+  int64_t queued;
+
+  if (!io->loop) return 0;
+
+  pthread_mutex_lock(&io->lock);
+  queued = io->queued;
+  pthread_mutex_unlock(&io->lock);
+  return queued;
+}
+
+int64_t ffmpbr_io_sent(FFmpegBridgeIO *io, int64_t *last_send_us) {
+  int64_t sent;
+
+  if (!io->loop) {
+    *last_send_us = io->last_send_us;
+    return io->sent;
+  }
+
+  pthread_mutex_lock(&io->lock);
+  sent = io->sent;
+  *last_send_us = io->last_send_us;
+  pthread_mutex_unlock(&io->lock);
+  return sent;
+}
+
+void ffmpbr_io_handoff(FFmpegBridgeIO *from, FFmpegBridgeIO *to) {
+  FFmpegBridgeLatency *latency;
+  int64_t base;
+
+  avio_flush(from->pb);
+  if (from->loop) pthread_mutex_lock(&from->lock);
+  latency = from->latency;
+  from->latency = NULL;
+  base = from->written;
+  if (from->loop) pthread_mutex_unlock(&from->lock);
+
+  // whatever is still queued for the old sink only has a file write to go,
+  // so count it as sent
+  if (latency) {
+    ffmpbr_latency_sent(latency, base, ffmpbr_now_us());
+  }
+
+  if (to->loop) pthread_mutex_lock(&to->lock);
+  to->written += base;
+  to->sent += base;
+  to->latency = latency;
+  if (to->loop) pthread_mutex_unlock(&to->lock);
+}
+
+int ffmpbr_io_failed(FFmpegBridgeIO *io) {
+  int error;
+
+  if (io->pb->error < 0 || !io->loop) return FFMIN(io->pb->error, 0);
+
+  pthread_mutex_lock(&io->lock);
+  error = io->error;
+  pthread_mutex_unlock(&io->lock);
+  return error;
+}
+
+void ffmpbr_io_service(FFmpegBridgeIO *io) {
+  FFmpegBridgeIOChunk *chunk;
+  uint8_t *data;
+  int64_t now_us, allowance;
+  int size, n;
+
+  pthread_mutex_lock(&io->lock);
+  while ((chunk = io->queue_head) && io->error >= 0) {
+    if (chunk->offset == chunk->size) {
+      io->queue_head = chunk->next;
+      if (!io->queue_head) io->queue_tail = NULL;
+      av_free(chunk);
+      continue;
+    }
+
+    // the producer only ever appends, so this range is stable
+    data = chunk->data + chunk->offset;
+    size = chunk->size - chunk->offset;
+
+    // paced: send what the bucket allows, and sleep when that's less than
+    // a quantum (or what's left, if less)
+    if (io->pacer) {
+      now_us = ffmpbr_now_us();
+      allowance = ffmpbr_pacer_allowance(io->pacer, now_us);
+      if (allowance < FFMIN(io->queued, FFMPBR_PACER_QUANTUM)) {
+        io->paced_waits++;
+        if (io->queued > io->max_backlog) io->max_backlog = io->queued;
+        now_us += ffmpbr_pacer_wait_us(io->pacer, io->queued, now_us);
+        pthread_mutex_unlock(&io->lock);
+        ffmpbr_loop_wait_until(io->loop, io, now_us);
+        return;
+      }
+      size = FFMIN(size, allowance);
+    }
+    pthread_mutex_unlock(&io->lock);
+    n = _io_sink_write(io, data, size);
+    pthread_mutex_lock(&io->lock);
+
+    if (n < 0) {
+      LOGE("ERROR: ffmpbr_io_service -- %s", av_err2str(n));
+      io->error = n;
+      break;
+    }
+    if (n == 0) {
+      // stay scheduled, and come back once the socket drains
+      io->waiting_writable = 1;
+      pthread_mutex_unlock(&io->lock);
+      ffmpbr_loop_wait_writable(io->loop, io, io->fd);
+      return;
+    }
+
+    if (io->pacer) ffmpbr_pacer_consume(io->pacer, n);
+    chunk->offset += n;
+    io->queued -= n;
+    io->sent += n;
+    io->last_send_us = ffmpbr_now_us();
+    _io_count_send(io, n, io->last_send_us);
+    if (io->latency) {
+      ffmpbr_latency_sent(io->latency, io->sent, io->last_send_us);
+    }
+  }
+
+  if (io->error < 0) {
+    _io_free_queue(io);
+  }
+  io->scheduled = 0;
+  pthread_cond_broadcast(&io->drained);
+  pthread_mutex_unlock(&io->lock);
+}
+
+void ffmpbr_io_get_send_stats(FFmpegBridgeIO *io, FFmpegBridgeSendStats *stats) {
+  FFmpegBridgeFileStats file_stats;
+  struct tcp_info info;
+  socklen_t info_size = sizeof(info);
+  double mean, variance;
+  int fd;
+
+  memset(stats, 0, sizeof(FFmpegBridgeSendStats));
+  if (io->loop) pthread_mutex_lock(&io->lock);
+  stats->bytes = io->sent;
+  if (io->windows) {
+    mean = io->window_sum / io->windows;
+    variance = io->window_sum_sq / io->windows - mean * mean;
+    stats->rate_mean = mean * 8 * 1000000 / FFMPBR_IO_RATE_WINDOW_US;
+    stats->rate_peak = io->window_peak * 8 * 1000000 / FFMPBR_IO_RATE_WINDOW_US;
+    stats->rate_stddev = sqrt(FFMAX(variance, 0)) * 8 * 1000000 / FFMPBR_IO_RATE_WINDOW_US;
+  }
+  stats->paced_waits = io->paced_waits;
+  stats->max_backlog_bytes = io->max_backlog;
+  stats->refused_datagrams = io->refused_datagrams;
+  if (io->loop) pthread_mutex_unlock(&io->lock);
+
+  if (io->file) {
+    ffmpbr_file_get_stats(io->file, &file_stats);
+    stats->file_blocks = file_stats.blocks;
+    stats->file_preallocated_bytes = file_stats.preallocated_bytes;
+    stats->file_stalls = file_stats.stalls;
+    stats->file_max_stall_us = file_stats.max_stall_us;
+    stats->file_max_write_us = file_stats.max_write_us;
+    stats->file_syncs = file_stats.syncs;
+    stats->file_max_sync_us = file_stats.max_sync_us;
+    return;
+  }
+
+  if (io->udp) {
+    stats->datagrams = io->udp->stats.datagrams;
+    stats->duplicate_tables = io->udp->stats.duplicate_tables;
+    return;
+  }
+  fd = _io_socket(io);
+  if (fd >= 0 && getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &info_size) == 0) {
+    stats->retransmits = info.tcpi_total_retrans;
+  }
+}
+
+int ffmpbr_io_probe(FFmpegBridgeIO *io, int is_mpegts, int duration_ms, int64_t max_bit_rate,
+  FFmpegBridgeProbeResult *result) {
+  int fd = _io_socket(io);
+
+  // (udp would only be measuring the local send buffer)
+  if (fd < 0 || io->udp || (!io->rtmp && !is_mpegts)) {
+    return AVERROR(ENOSYS);
+  }
+  return ffmpbr_probe_run(fd, duration_ms, max_bit_rate, io->rtmp ? _io_probe_rtmp : _io_probe_ts,
+    io, result);
+}
+
+void ffmpbr_io_set_deadline(FFmpegBridgeIO *io, int64_t deadline_us) {
+  if (io->pb->seekable) return;
+
+  if (io->loop) pthread_mutex_lock(&io->lock);
+  io->deadline_us = deadline_us;
+  if (io->loop) pthread_mutex_unlock(&io->lock);
+}
+
+int ffmpbr_io_drain(FFmpegBridgeIO *io) {
+  int rc;
+
+  avio_flush(io->pb);
+  if (io->loop) _io_wait_drained(io);
+  if (io->file) {
+    rc = ffmpbr_file_flush(io->file);
+    if (rc < 0) return rc;
+  }
+  return ffmpbr_io_failed(io);
+}
+
+void ffmpbr_io_close(FFmpegBridgeIO *io) {
+  int failed;
+
+  avio_flush(io->pb);
+
+  if (io->loop) _io_wait_drained(io);
+  failed = ffmpbr_io_failed(io) < 0;
+
+  if (io->loop) {
+    if (io->fd >= 0) {
+      ffmpbr_loop_forget(io->loop, io, io->fd);
+    }
+    ffmpbr_loop_release(io->loop);
+    _io_free_queue(io);
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->drained);
+  }
+
+  if (io->file) {
+    ffmpbr_file_close(io->file);
+    av_free(io->file);
+  } else if (io->fd >= 0) {
+    close(io->fd);
+  } else if (io->rtmp) {
+    avio_flush(io->sink);
+    if (io->sink->error < 0) failed = 1;
+    av_free(io->sink->buffer);
+    av_free(io->sink);
+
+    // a connection that's still good may be kept warm for the next session
+    if (failed || ffmpbr_pool_put(io->rtmp) < 0) {
+      ffmpbr_rtmp_close(io->rtmp);
+    }
+  } else {
+    avio_close(io->sink);
+  }
+
+  av_free(io->pb->buffer);
+  av_free(io->pb);
+  av_free(io->pacer);
+  av_free(io->udp);
+  av_free(io);
+}
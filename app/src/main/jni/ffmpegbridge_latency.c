@@ -0,0 +1,144 @@
+//
+// Capture-to-send latency tracking for packets passing through the bridge.
+//
+// Each packet is stamped when it enters the JNI layer, tagged with the muxer
+// byte offset at which it ends once the muxer has written it out, and
+// completed once the AVIO write callback has pushed that offset to the sink.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ffmpegbridge_latency.h"
+
+//
+//-- helper functions
+//
+
+void _latency_push(FFmpegBridgeLatency *lat, FFmpegBridgeLatencyQueue *q,
+  FFmpegBridgeLatencyStamp *stamp) {
+  if (q->count == FFMPBR_LATENCY_MAX_PENDING) {
+    // drop the oldest stamp rather than blocking the write path
+    q->head = (q->head + 1) % FFMPBR_LATENCY_MAX_PENDING;
+    q->count--;
+    lat->dropped_stamps++;
+  }
+  q->stamps[(q->head + q->count) % FFMPBR_LATENCY_MAX_PENDING] = *stamp;
+  q->count++;
+}
+
+FFmpegBridgeLatencyStamp* _latency_peek(FFmpegBridgeLatencyQueue *q) {
+  return q->count ? &q->stamps[q->head] : NULL;
+}
+
+void _latency_pop(FFmpegBridgeLatencyQueue *q) {
+  q->head = (q->head + 1) % FFMPBR_LATENCY_MAX_PENDING;
+  q->count--;
+}
+
+int _latency_compare(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+int64_t _latency_percentile(int64_t *sorted, int count, int percentile) {
+  int index = (count * percentile) / 100;
+  if (index >= count) index = count - 1;
+  return sorted[index];
+}
+
+
+//
+//-- FFmpegBridgeLatency API
+//
+
+int64_t ffmpbr_now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void ffmpbr_latency_init(FFmpegBridgeLatency *lat) {
+  memset(lat, 0, sizeof(FFmpegBridgeLatency));
+  pthread_mutex_init(&lat->lock, NULL);
+}
+
+void ffmpbr_latency_destroy(FFmpegBridgeLatency *lat) {
+  pthread_mutex_destroy(&lat->lock);
+}
+
+void ffmpbr_latency_arrived(FFmpegBridgeLatency *lat, int stream_index, int64_t arrival_us,
+  int64_t capture_us) {
+  FFmpegBridgeLatencyStamp stamp;
+
+  if (stream_index < 0 || stream_index >= FFMPBR_LATENCY_MAX_STREAMS) return;
+
+  stamp.arrival_us = arrival_us;
+  stamp.capture_us = capture_us;
+  stamp.end_offset = 0;
+  pthread_mutex_lock(&lat->lock);
+  _latency_push(lat, &lat->arrived[stream_index], &stamp);
+  pthread_mutex_unlock(&lat->lock);
+}
+
+void ffmpbr_latency_muxed(FFmpegBridgeLatency *lat, int stream_index, int64_t nb_frames,
+  int64_t mux_offset) {
+  FFmpegBridgeLatencyQueue *q;
+  FFmpegBridgeLatencyStamp *stamp;
+
+  if (stream_index < 0 || stream_index >= FFMPBR_LATENCY_MAX_STREAMS) return;
+  q = &lat->arrived[stream_index];
+
+  // every frame the muxer has written since last time now ends at or
+  // before mux_offset
+  pthread_mutex_lock(&lat->lock);
+  while (lat->muxed_frames[stream_index] < nb_frames) {
+    lat->muxed_frames[stream_index]++;
+    stamp = _latency_peek(q);
+    if (!stamp) continue;
+    stamp->end_offset = mux_offset;
+    _latency_push(lat, &lat->muxed, stamp);
+    _latency_pop(q);
+  }
+  pthread_mutex_unlock(&lat->lock);
+}
+
+void ffmpbr_latency_sent(FFmpegBridgeLatency *lat, int64_t sent_offset, int64_t send_us) {
+  FFmpegBridgeLatencyStamp *stamp;
+
+  pthread_mutex_lock(&lat->lock);
+  while ((stamp = _latency_peek(&lat->muxed)) && stamp->end_offset <= sent_offset) {
+    lat->window[lat->window_pos] = send_us - stamp->arrival_us;
+    lat->window_pos = (lat->window_pos + 1) % FFMPBR_LATENCY_WINDOW;
+    if (lat->window_count < FFMPBR_LATENCY_WINDOW) lat->window_count++;
+
+    lat->current_lag_us = send_us - stamp->capture_us;
+    lat->sent_packets++;
+    _latency_pop(&lat->muxed);
+  }
+  pthread_mutex_unlock(&lat->lock);
+}
+
+void ffmpbr_latency_get_stats(FFmpegBridgeLatency *lat, FFmpegBridgeLatencyStats *stats) {
+  int64_t sorted[FFMPBR_LATENCY_WINDOW];
+  int count;
+
+  memset(stats, 0, sizeof(FFmpegBridgeLatencyStats));
+  pthread_mutex_lock(&lat->lock);
+  count = lat->window_count;
+  stats->sent_packets = lat->sent_packets;
+  stats->dropped_stamps = lat->dropped_stamps;
+  stats->current_lag_us = lat->current_lag_us;
+  memcpy(sorted, lat->window, count * sizeof(int64_t));
+  pthread_mutex_unlock(&lat->lock);
+  if (!count) return;
+
+  qsort(sorted, count, sizeof(int64_t), _latency_compare);
+  stats->p50_us = _latency_percentile(sorted, count, 50);
+  stats->p90_us = _latency_percentile(sorted, count, 90);
+  stats->p99_us = _latency_percentile(sorted, count, 99);
+  stats->max_us = sorted[count - 1];
+}
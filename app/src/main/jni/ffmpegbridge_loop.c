@@ -0,0 +1,356 @@
+//
+// A small pool of event loop threads shared by every bridge session in the
+// process.
+//
+// Each session has a home thread, whose epoll set watches the session's fd
+// when a write would block. Sessions with output ready sit in their home
+// thread's ready queue; a thread that runs out of ready sessions of its own
+// steals the oldest ready session from another thread. Sessions waiting
+// to send at a later time (pacing) sleep on their home thread, which
+// bounds its epoll_wait by the soonest of them.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "libavutil/common.h"
+#include "libavutil/mem.h"
+
+#include "ffmpegbridge_io.h"
+#include "ffmpegbridge_latency.h"
+#include "ffmpegbridge_log.h"
+#include "ffmpegbridge_loop.h"
+
+#define FFMPBR_LOOP_MAX_EVENTS 64
+
+static pthread_mutex_t shared_loop_lock = PTHREAD_MUTEX_INITIALIZER;
+static FFmpegBridgeLoop *shared_loop = NULL;
+static int shared_loop_threads = 0;
+
+typedef struct
+{
+  FFmpegBridgeLoop *loop;
+  FFmpegBridgeLoopThread *self;
+} FFmpegBridgeLoopThreadArgs;
+
+//
+//-- helper functions
+//
+
+void _loop_push(FFmpegBridgeLoopThread *t, FFmpegBridgeIO *io) {
+  pthread_mutex_lock(&t->lock);
+  io->next_ready = NULL;
+  if (t->ready_tail) t->ready_tail->next_ready = io;
+  else t->ready_head = io;
+  t->ready_tail = io;
+  t->ready_count++;
+  pthread_mutex_unlock(&t->lock);
+}
+
+FFmpegBridgeIO* _loop_pop(FFmpegBridgeLoopThread *t) {
+  FFmpegBridgeIO *io;
+
+  pthread_mutex_lock(&t->lock);
+  io = t->ready_head;
+  if (io) {
+    t->ready_head = io->next_ready;
+    if (!t->ready_head) t->ready_tail = NULL;
+    t->ready_count--;
+  }
+  pthread_mutex_unlock(&t->lock);
+  return io;
+}
+
+FFmpegBridgeIO* _loop_steal(FFmpegBridgeLoop *loop, FFmpegBridgeLoopThread *self) {
+  FFmpegBridgeIO *io;
+  int i;
+
+  for (i = 1; i < loop->num_threads; ++i) {
+    io = _loop_pop(&loop->threads[(self->index + i) % loop->num_threads]);
+    if (io) return io;
+  }
+  return NULL;
+}
+
+int _loop_stopping(FFmpegBridgeLoopThread *t) {
+  int stopping;
+
+  pthread_mutex_lock(&t->lock);
+  stopping = t->stopping;
+  pthread_mutex_unlock(&t->lock);
+  return stopping;
+}
+
+// moves the sleeping sessions that are due to the ready queue, and returns
+// how long until the next is (for epoll_wait), -1 if none is sleeping
+int _loop_timers(FFmpegBridgeLoopThread *t) {
+  FFmpegBridgeIO *io;
+  int64_t now_us = ffmpbr_now_us();
+  int timeout_ms = -1;
+
+  pthread_mutex_lock(&t->lock);
+  while ((io = t->sleeping_head) && io->wake_us <= now_us) {
+    t->sleeping_head = io->next_sleeping;
+    io->next_ready = NULL;
+    if (t->ready_tail) t->ready_tail->next_ready = io;
+    else t->ready_head = io;
+    t->ready_tail = io;
+    t->ready_count++;
+  }
+  if (io) {
+    timeout_ms = (int)((io->wake_us - now_us + 999) / 1000);
+  }
+  pthread_mutex_unlock(&t->lock);
+  return timeout_ms;
+}
+
+void _loop_wake(FFmpegBridgeLoopThread *t) {
+  uint64_t one = 1;
+  write(t->wake_fd, &one, sizeof(one));
+}
+
+// a session's fd drained enough to be written again
+void _loop_writable(FFmpegBridgeLoopThread *self, FFmpegBridgeIO *io) {
+  int ready;
+
+  pthread_mutex_lock(&io->lock);
+  ready = io->waiting_writable;
+  io->waiting_writable = 0;
+  pthread_mutex_unlock(&io->lock);
+
+  if (ready) {
+    _loop_push(self, io);
+  }
+}
+
+void* _loop_run(void *arg) {
+  FFmpegBridgeLoopThreadArgs *args = arg;
+  FFmpegBridgeLoop *loop = args->loop;
+  FFmpegBridgeLoopThread *self = args->self;
+  struct epoll_event events[FFMPBR_LOOP_MAX_EVENTS];
+  FFmpegBridgeIO *io;
+  uint64_t wakes;
+  int i, n, timeout_ms;
+
+  av_free(args);
+
+  for (;;) {
+    timeout_ms = _loop_timers(self);
+    io = _loop_pop(self);
+    if (!io) io = _loop_steal(loop, self);
+    if (io) {
+      self->busy = 1;
+      ffmpbr_io_service(io);
+      self->busy = 0;
+      continue;
+    }
+
+    if (_loop_stopping(self)) break;
+
+    n = epoll_wait(self->epoll_fd, events, FFMPBR_LOOP_MAX_EVENTS, timeout_ms);
+    for (i = 0; i < n; ++i) {
+      if (!events[i].data.ptr) {
+        read(self->wake_fd, &wakes, sizeof(wakes));
+      } else {
+        _loop_writable(self, events[i].data.ptr);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+FFmpegBridgeLoop* _loop_start(int num_threads) {
+  FFmpegBridgeLoop *loop;
+  FFmpegBridgeLoopThread *t;
+  FFmpegBridgeLoopThreadArgs *args;
+  struct epoll_event ev;
+  int i;
+
+  loop = av_mallocz(sizeof(FFmpegBridgeLoop));
+  loop->threads = av_mallocz(num_threads * sizeof(FFmpegBridgeLoopThread));
+  loop->num_threads = num_threads;
+
+  // threads steal from each other, so set them all up before starting any
+  for (i = 0; i < num_threads; ++i) {
+    t = &loop->threads[i];
+    t->index = i;
+    pthread_mutex_init(&t->lock, NULL);
+    t->epoll_fd = epoll_create(FFMPBR_LOOP_MAX_EVENTS);
+    t->wake_fd = eventfd(0, EFD_NONBLOCK);
+
+    // data.ptr == NULL marks the wake up fd
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, t->wake_fd, &ev);
+  }
+
+  for (i = 0; i < num_threads; ++i) {
+    t = &loop->threads[i];
+    args = av_malloc(sizeof(FFmpegBridgeLoopThreadArgs));
+    args->loop = loop;
+    args->self = t;
+    pthread_create(&t->thread, NULL, _loop_run, args);
+  }
+
+  return loop;
+}
+
+void _loop_stop(FFmpegBridgeLoop *loop) {
+  int i;
+
+  for (i = 0; i < loop->num_threads; ++i) {
+    pthread_mutex_lock(&loop->threads[i].lock);
+    loop->threads[i].stopping = 1;
+    pthread_mutex_unlock(&loop->threads[i].lock);
+    _loop_wake(&loop->threads[i]);
+  }
+  for (i = 0; i < loop->num_threads; ++i) {
+    pthread_join(loop->threads[i].thread, NULL);
+  }
+
+  // (only once they've all exited, as any of them may steal from any other)
+  for (i = 0; i < loop->num_threads; ++i) {
+    close(loop->threads[i].epoll_fd);
+    close(loop->threads[i].wake_fd);
+    pthread_mutex_destroy(&loop->threads[i].lock);
+  }
+
+  av_free(loop->threads);
+  av_free(loop);
+}
+
+
+//
+//-- FFmpegBridgeLoop API
+//
+
+void ffmpbr_loop_set_threads(int num_threads) {
+  pthread_mutex_lock(&shared_loop_lock);
+  shared_loop_threads = num_threads;
+  pthread_mutex_unlock(&shared_loop_lock);
+}
+
+FFmpegBridgeLoop* ffmpbr_loop_acquire(int min_threads) {
+  FFmpegBridgeLoop *loop = NULL;
+
+  pthread_mutex_lock(&shared_loop_lock);
+  if (shared_loop_threads > 0 || min_threads > 0) {
+    if (!shared_loop) {
+      LOGI("Starting %d shared event loop threads", FFMAX(shared_loop_threads, min_threads));
+      shared_loop = _loop_start(FFMAX(shared_loop_threads, min_threads));
+    }
+    shared_loop->refs++;
+    loop = shared_loop;
+  }
+  pthread_mutex_unlock(&shared_loop_lock);
+
+  return loop;
+}
+
+FFmpegBridgeLoop* ffmpbr_loop_acquire_own(int min_threads) {
+  FFmpegBridgeLoop *loop = NULL;
+  int enabled;
+
+  pthread_mutex_lock(&shared_loop_lock);
+  enabled = shared_loop_threads > 0 || min_threads > 0;
+  pthread_mutex_unlock(&shared_loop_lock);
+
+  if (enabled) {
+    loop = _loop_start(1);
+    loop->own = 1;
+    loop->refs = 1;
+  }
+  return loop;
+}
+
+void ffmpbr_loop_release(FFmpegBridgeLoop *loop) {
+  // (without the lock, so that a thread still stuck in its session's write
+  // doesn't hold up every other session's start and end)
+  if (loop->own) {
+    _loop_stop(loop);
+    return;
+  }
+
+  pthread_mutex_lock(&shared_loop_lock);
+  if (--loop->refs == 0) {
+    LOGI("Stopping shared event loop threads");
+    _loop_stop(loop);
+    if (loop == shared_loop) shared_loop = NULL;
+  }
+  pthread_mutex_unlock(&shared_loop_lock);
+}
+
+int ffmpbr_loop_assign_home(FFmpegBridgeLoop *loop) {
+  int home;
+
+  pthread_mutex_lock(&shared_loop_lock);
+  home = loop->next_home;
+  loop->next_home = (loop->next_home + 1) % loop->num_threads;
+  pthread_mutex_unlock(&shared_loop_lock);
+
+  return home;
+}
+
+void ffmpbr_loop_schedule(FFmpegBridgeLoop *loop, FFmpegBridgeIO *io) {
+  FFmpegBridgeLoopThread *home = &loop->threads[io->home], *other;
+  int i;
+
+  _loop_push(home, io);
+  _loop_wake(home);
+
+  // if the home thread is tied up with other sessions, wake an idle thread
+  // so that it can steal this one
+  if (home->busy) {
+    for (i = 1; i < loop->num_threads; ++i) {
+      other = &loop->threads[(io->home + i) % loop->num_threads];
+      if (!other->busy) {
+        _loop_wake(other);
+        break;
+      }
+    }
+  }
+}
+
+void ffmpbr_loop_wait_writable(FFmpegBridgeLoop *loop, FFmpegBridgeIO *io, int fd) {
+  int epoll_fd = loop->threads[io->home].epoll_fd;
+  struct epoll_event ev;
+
+  // one-shot, so that the session is only ever rescheduled once per wait
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLOUT | EPOLLONESHOT;
+  ev.data.ptr = io;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+void ffmpbr_loop_wait_until(FFmpegBridgeLoop *loop, FFmpegBridgeIO *io, int64_t wake_us) {
+  FFmpegBridgeLoopThread *home = &loop->threads[io->home];
+  FFmpegBridgeIO **p;
+
+  pthread_mutex_lock(&home->lock);
+  io->wake_us = wake_us;
+  p = &home->sleeping_head;
+  while (*p && (*p)->wake_us <= wake_us) p = &(*p)->next_sleeping;
+  io->next_sleeping = *p;
+  *p = io;
+  pthread_mutex_unlock(&home->lock);
+
+  // (so that it recomputes its epoll timeout)
+  _loop_wake(home);
+}
+
+void ffmpbr_loop_forget(FFmpegBridgeLoop *loop, FFmpegBridgeIO *io, int fd) {
+  struct epoll_event ev;
+
+  // (a non-NULL event is required by kernels before 2.6.9)
+  epoll_ctl(loop->threads[io->home].epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+}
@@ -0,0 +1,644 @@
+//
+// H.264 and HEVC NAL unit helpers: start code scanning and Annex-B to AVCC
+// conversion.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(FFMPBR_HAVE_NEON) && defined(__arm__)
+#include <cpu-features.h>
+#endif
+
+#include "libavutil/error.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/mem.h"
+
+#include "ffmpegbridge_log.h"
+#include "ffmpegbridge_nal.h"
+
+// an SPS is tiny; anything past this is vui we never read
+#define FFMPBR_NAL_MAX_SPS_RBSP 64
+
+// (an HEVC SPS carries profile/level info for up to 7 sub-layers before the
+// fields we want)
+#define FFMPBR_NAL_MAX_HEVC_SPS_RBSP 160
+
+// hvcC arrays are written in this order
+static const int hevc_param_set_types[] = {
+  FFMPBR_HEVC_NAL_VPS, FFMPBR_HEVC_NAL_SPS, FFMPBR_HEVC_NAL_PPS
+};
+
+typedef struct
+{
+  const uint8_t *data;
+  int size_bits;
+  int pos;
+} FFmpegBridgeBitReader;
+
+static pthread_once_t find_startcode_once = PTHREAD_ONCE_INIT;
+static FFmpegBridgeStartCodeFinder find_startcode_best = ffmpbr_nal_find_startcode_word;
+static const char *find_startcode_best_name = "word";
+
+//
+//-- helper functions
+//
+
+void _nal_pick_startcode_finder() {
+#if defined(__SSE2__)
+  find_startcode_best = ffmpbr_nal_find_startcode_sse2;
+  find_startcode_best_name = "sse2";
+#elif defined(FFMPBR_HAVE_NEON)
+#if defined(__arm__)
+  // not every armv7 device has NEON (e.g. Tegra 2)
+  if (android_getCpuFamily() != ANDROID_CPU_FAMILY_ARM ||
+    !(android_getCpuFeatures() & ANDROID_CPU_ARM_FEATURE_NEON)) {
+    return;
+  }
+#endif
+  find_startcode_best = ffmpbr_nal_find_startcode_neon;
+  find_startcode_best_name = "neon";
+#endif
+}
+
+// writes the units as AVCC (or with 4 byte start codes) into dst, which has
+// room for them all
+void _nal_write_units(uint8_t *dst, FFmpegBridgeNal *nals, int num_nals, int avcc) {
+  int i;
+
+  for (i = 0; i < num_nals; ++i) {
+    AV_WB32(dst, avcc ? nals[i].size : 1);
+    memcpy(dst + 4, nals[i].data, nals[i].size);
+    dst += 4 + nals[i].size;
+  }
+}
+
+int _nal_write(FFmpegBridgeNal *nals, int num_nals, uint8_t **buffer, unsigned int *buffer_size,
+  int avcc) {
+  int total = 0, i;
+
+  for (i = 0; i < num_nals; ++i) {
+    total += 4 + nals[i].size;
+  }
+  if (!total) return 0;
+
+  av_fast_malloc(buffer, buffer_size, total);
+  if (!*buffer) return AVERROR(ENOMEM);
+  _nal_write_units(*buffer, nals, num_nals, avcc);
+  return total;
+}
+
+// reads the next RBSP byte of a unit, skipping emulation prevention bytes;
+// returns -1 at the end
+int _nal_next_rbsp_byte(const uint8_t *data, int size, int *pos, int *zeros) {
+  int b;
+
+  if (*pos < size && *zeros >= 2 && data[*pos] == 3) {
+    (*pos)++;
+    *zeros = 0;
+  }
+  if (*pos >= size) return -1;
+  b = data[(*pos)++];
+  *zeros = b ? 0 : *zeros + 1;
+  return b;
+}
+
+// 1 if every message in the SEI unit is one we can drop (D.1 sei_message())
+int _nal_sei_droppable(FFmpegBridgeNal *nal) {
+  int pos = 1, zeros = 0, type, size, b;
+
+  for (;;) {
+    // rbsp_trailing_bits -- the end of the messages
+    if (nal->size - pos <= 1) return 1;
+
+    type = size = 0;
+    while ((b = _nal_next_rbsp_byte(nal->data, nal->size, &pos, &zeros)) == 0xff) type += 255;
+    if (b < 0) return 0;
+    type += b;
+    while ((b = _nal_next_rbsp_byte(nal->data, nal->size, &pos, &zeros)) == 0xff) size += 255;
+    if (b < 0) return 0;
+    size += b;
+
+    // buffering_period, pic_timing, user_data_unregistered
+    if (type != 0 && type != 1 && type != 5) return 0;
+
+    while (size-- > 0) {
+      if (_nal_next_rbsp_byte(nal->data, nal->size, &pos, &zeros) < 0) return 0;
+    }
+  }
+}
+
+int _nal_same_unit(FFmpegBridgeNal *nal, const uint8_t *unit, int unit_size) {
+  return unit && nal->size == unit_size && !memcmp(nal->data, unit, unit_size);
+}
+
+
+// reading past the end yields zeros, so callers check for overreads once,
+// at the end
+unsigned _nal_read_bits(FFmpegBridgeBitReader *br, int n) {
+  unsigned v = 0;
+
+  while (n--) {
+    v <<= 1;
+    if (br->pos < br->size_bits) {
+      v |= (br->data[br->pos >> 3] >> (7 - (br->pos & 7))) & 1;
+    }
+    br->pos++;
+  }
+  return v;
+}
+
+unsigned _nal_read_ue(FFmpegBridgeBitReader *br) {
+  int zeros = 0;
+
+  while (!_nal_read_bits(br, 1)) {
+    if (++zeros > 31 || br->pos > br->size_bits) return 0;
+  }
+  return ((1u << zeros) - 1) + _nal_read_bits(br, zeros);
+}
+
+int _nal_read_se(FFmpegBridgeBitReader *br) {
+  unsigned v = _nal_read_ue(br);
+  return (v & 1) ? (int)((v + 1) >> 1) : -(int)(v >> 1);
+}
+
+void _nal_skip_scaling_list(FFmpegBridgeBitReader *br, int size) {
+  int last = 8, next = 8, i;
+
+  for (i = 0; i < size && next; ++i) {
+    next = (last + _nal_read_se(br) + 256) % 256;
+    if (next) last = next;
+  }
+}
+
+// strips emulation prevention bytes (the 03 in 00 00 03)
+int _nal_unescape(const uint8_t *src, int size, uint8_t *dst, int dst_size) {
+  int zeros = 0, n = 0, i;
+
+  for (i = 0; i < size && n < dst_size; ++i) {
+    if (zeros >= 2 && src[i] == 3) {
+      zeros = 0;
+      continue;
+    }
+    zeros = src[i] ? 0 : zeros + 1;
+    dst[n++] = src[i];
+  }
+  return n;
+}
+
+
+//
+//-- start code kernels
+//
+
+const uint8_t* ffmpbr_nal_find_startcode_c(const uint8_t *p, const uint8_t *end) {
+  for (; p + 2 < end; ++p) {
+    if (p[0] == 0 && p[1] == 0 && p[2] == 1) return p;
+  }
+  return end;
+}
+
+const uint8_t* ffmpbr_nal_find_startcode_word(const uint8_t *p, const uint8_t *end) {
+  const uint8_t *a = p + 4 - ((intptr_t)p & 3);
+  uint32_t x;
+
+  for (; p < a && p + 2 < end; ++p) {
+    if (p[0] == 0 && p[1] == 0 && p[2] == 1) return p;
+  }
+
+  // skip 4 aligned bytes at a time while none of them is zero; any start
+  // code beginning in them has a zero at p[1] or p[3]
+  for (; p + 6 <= end; p += 4) {
+    x = AV_RN32A(p);
+    if ((x - 0x01010101) & (~x) & 0x80808080) {
+      if (p[1] == 0) {
+        if (p[0] == 0 && p[2] == 1) return p;
+        if (p[2] == 0 && p[3] == 1) return p + 1;
+      }
+      if (p[3] == 0) {
+        if (p[2] == 0 && p[4] == 1) return p + 2;
+        if (p[4] == 0 && p[5] == 1) return p + 3;
+      }
+    }
+  }
+
+  return ffmpbr_nal_find_startcode_c(p, end);
+}
+
+#if defined(__SSE2__)
+const uint8_t* ffmpbr_nal_find_startcode_sse2(const uint8_t *p, const uint8_t *end) {
+  const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+  __m128i a, b, c;
+  int mask;
+
+  // match 00 00 01 at all 16 positions at once, using three overlapping
+  // loads, so that start codes straddling blocks aren't missed
+  for (; p + 18 <= end; p += 16) {
+    a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), zero);
+    b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 1)), zero);
+    c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 2)), one);
+    mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), c));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return ffmpbr_nal_find_startcode_c(p, end);
+}
+#endif
+
+
+//
+//-- FFmpegBridgeNal API
+//
+
+const uint8_t* ffmpbr_nal_find_startcode(const uint8_t *p, const uint8_t *end) {
+  pthread_once(&find_startcode_once, _nal_pick_startcode_finder);
+  return find_startcode_best(p, end);
+}
+
+const char* ffmpbr_nal_find_startcode_name() {
+  pthread_once(&find_startcode_once, _nal_pick_startcode_finder);
+  return find_startcode_best_name;
+}
+
+int ffmpbr_nal_is_annexb(const uint8_t *data, int size) {
+  if (size >= 3 && !data[0] && !data[1] && data[2] == 1) return 1;
+  if (size >= 4 && !data[0] && !data[1] && !data[2] && data[3] == 1) return 1;
+  return 0;
+}
+
+int ffmpbr_nal_split(uint8_t *data, int size, FFmpegBridgeNal *nals, int max_nals) {
+  const uint8_t *end = data + size, *start, *next;
+  uint8_t *prev_end = data;
+  int num_nals = 0;
+
+  pthread_once(&find_startcode_once, _nal_pick_startcode_finder);
+
+  start = find_startcode_best(data, end);
+  while (start < end) {
+    start += 3;
+    next = find_startcode_best(start, end);
+
+    // zero bytes before the next start code are trailing_zero_8bits (or the
+    // first byte of a 4 byte start code), not part of this unit
+    while (next > start && !next[-1]) --next;
+    if (next > start) {
+      if (num_nals == max_nals) return -1;
+      nals[num_nals].data = (uint8_t *)start;
+      nals[num_nals].size = next - start;
+      nals[num_nals].prefix = start - prev_end;
+      prev_end = (uint8_t *)next;
+      num_nals++;
+    }
+
+    start = find_startcode_best(next, end);
+  }
+
+  return num_nals;
+}
+
+int ffmpbr_nal_filter(FFmpegBridgeNal *nals, int num_nals, int flags,
+  FFmpegBridgeParamSets *param_sets, FFmpegBridgeNalFilterStats *stats) {
+  int kept = 0, drop, i;
+
+  for (i = 0; i < num_nals; ++i) {
+    stats->video_bytes += nals[i].prefix + nals[i].size;
+
+    switch (FFMPBR_NAL_TYPE(&nals[i])) {
+    case FFMPBR_NAL_FILLER:
+      drop = (flags & FFMPBR_NAL_FILTER_FILLER) != 0;
+      stats->filler_units += drop;
+      break;
+    case FFMPBR_NAL_AUD:
+      drop = (flags & FFMPBR_NAL_FILTER_AUD) != 0;
+      stats->aud_units += drop;
+      break;
+    case FFMPBR_NAL_SEI:
+      drop = (flags & FFMPBR_NAL_FILTER_SEI) && _nal_sei_droppable(&nals[i]);
+      stats->sei_units += drop;
+      break;
+    case FFMPBR_NAL_SPS:
+      drop = (flags & FFMPBR_NAL_FILTER_PARAM_SETS) &&
+        _nal_same_unit(&nals[i], param_sets->sps, param_sets->sps_size);
+      stats->param_set_units += drop;
+      break;
+    case FFMPBR_NAL_PPS:
+      drop = (flags & FFMPBR_NAL_FILTER_PARAM_SETS) &&
+        _nal_same_unit(&nals[i], param_sets->pps, param_sets->pps_size);
+      stats->param_set_units += drop;
+      break;
+    default:
+      drop = 0;
+    }
+
+    if (drop) {
+      stats->saved_bytes += 4 + nals[i].size;
+    } else {
+      nals[kept++] = nals[i];
+    }
+  }
+
+  return kept;
+}
+
+int ffmpbr_nal_write_annexb(FFmpegBridgeNal *nals, int num_nals, uint8_t **buffer,
+  unsigned int *buffer_size) {
+  return _nal_write(nals, num_nals, buffer, buffer_size, 0);
+}
+
+int ffmpbr_nal_write_avcc(FFmpegBridgeNal *nals, int num_nals, uint8_t **buffer,
+  unsigned int *buffer_size) {
+  return _nal_write(nals, num_nals, buffer, buffer_size, 1);
+}
+
+int ffmpbr_nal_annexb_to_avcc(uint8_t *data, int size, uint8_t **buffer,
+  unsigned int *buffer_size) {
+  FFmpegBridgeNal nals[FFMPBR_NAL_MAX_UNITS];
+  int num_nals;
+
+  num_nals = ffmpbr_nal_split(data, size, nals, FFMPBR_NAL_MAX_UNITS);
+  if (num_nals < 0) {
+    LOGE("ERROR: ffmpbr_nal_annexb_to_avcc -- more than %d NAL units in one packet",
+      FFMPBR_NAL_MAX_UNITS);
+    return AVERROR_INVALIDDATA;
+  }
+  return ffmpbr_nal_write_avcc(nals, num_nals, buffer, buffer_size);
+}
+
+int ffmpbr_nal_build_avcc_extradata(uint8_t *data, int size, uint8_t **out, int *out_size) {
+  FFmpegBridgeNal nals[FFMPBR_NAL_MAX_UNITS];
+  FFmpegBridgeNal *sps = NULL;
+  uint8_t *p;
+  int num_nals, num_sps = 0, num_pps = 0, total = 7, i;
+
+  num_nals = ffmpbr_nal_split(data, size, nals, FFMPBR_NAL_MAX_UNITS);
+  for (i = 0; i < num_nals; ++i) {
+    if (FFMPBR_NAL_TYPE(&nals[i]) == FFMPBR_NAL_SPS) {
+      if (!sps) sps = &nals[i];
+      num_sps++;
+      total += 2 + nals[i].size;
+    } else if (FFMPBR_NAL_TYPE(&nals[i]) == FFMPBR_NAL_PPS) {
+      num_pps++;
+      total += 2 + nals[i].size;
+    }
+  }
+  if (!sps || sps->size < 4 || !num_pps || num_sps > 31 || num_pps > 255) {
+    LOGE("ERROR: ffmpbr_nal_build_avcc_extradata -- need an SPS and a PPS (got %d and %d)",
+      num_sps, num_pps);
+    return AVERROR_INVALIDDATA;
+  }
+
+  p = *out = av_malloc(total);
+  if (!p) return AVERROR(ENOMEM);
+
+  // AVCDecoderConfigurationRecord, ISO/IEC 14496-15 5.2.4.1
+  *p++ = 1;                   // configurationVersion
+  *p++ = sps->data[1];        // AVCProfileIndication
+  *p++ = sps->data[2];        // profile_compatibility
+  *p++ = sps->data[3];        // AVCLevelIndication
+  *p++ = 0xfc | 3;            // lengthSizeMinusOne (4 byte lengths)
+  *p++ = 0xe0 | num_sps;
+  for (i = 0; i < num_nals; ++i) {
+    if (FFMPBR_NAL_TYPE(&nals[i]) != FFMPBR_NAL_SPS) continue;
+    AV_WB16(p, nals[i].size);
+    memcpy(p + 2, nals[i].data, nals[i].size);
+    p += 2 + nals[i].size;
+  }
+  *p++ = num_pps;
+  for (i = 0; i < num_nals; ++i) {
+    if (FFMPBR_NAL_TYPE(&nals[i]) != FFMPBR_NAL_PPS) continue;
+    AV_WB16(p, nals[i].size);
+    memcpy(p + 2, nals[i].data, nals[i].size);
+    p += 2 + nals[i].size;
+  }
+  *out_size = total;
+
+  return 0;
+}
+
+int ffmpbr_nal_parse_sps(const uint8_t *data, int size, FFmpegBridgeSps *sps) {
+  uint8_t rbsp[FFMPBR_NAL_MAX_SPS_RBSP];
+  FFmpegBridgeBitReader br;
+  int chroma_format_idc = 1, separate_colour_plane = 0, frame_mbs_only;
+  int width_mbs, height_map_units, crop_x, crop_y, i, n;
+  unsigned crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+
+  if (size < 4 || (data[0] & 0x1f) != FFMPBR_NAL_SPS) return AVERROR_INVALIDDATA;
+
+  // (skipping the NAL header)
+  br.data = rbsp;
+  br.size_bits = 8 * _nal_unescape(data + 1, size - 1, rbsp, sizeof(rbsp));
+  br.pos = 0;
+
+  // 7.3.2.1.1 seq_parameter_set_data()
+  sps->profile_idc = _nal_read_bits(&br, 8);
+  _nal_read_bits(&br, 8);                      // constraint flags
+  sps->level_idc = _nal_read_bits(&br, 8);
+  _nal_read_ue(&br);                           // seq_parameter_set_id
+
+  switch (sps->profile_idc) {
+  case 100: case 110: case 122: case 244: case 44:
+  case 83: case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+    chroma_format_idc = _nal_read_ue(&br);
+    if (chroma_format_idc == 3) separate_colour_plane = _nal_read_bits(&br, 1);
+    _nal_read_ue(&br);                         // bit_depth_luma_minus8
+    _nal_read_ue(&br);                         // bit_depth_chroma_minus8
+    _nal_read_bits(&br, 1);                    // qpprime_y_zero_transform_bypass_flag
+    if (_nal_read_bits(&br, 1)) {              // seq_scaling_matrix_present_flag
+      for (i = 0; i < (chroma_format_idc != 3 ? 8 : 12); ++i) {
+        if (_nal_read_bits(&br, 1)) _nal_skip_scaling_list(&br, i < 6 ? 16 : 64);
+      }
+    }
+    break;
+  }
+
+  _nal_read_ue(&br);                           // log2_max_frame_num_minus4
+  switch (_nal_read_ue(&br)) {                 // pic_order_cnt_type
+  case 0:
+    _nal_read_ue(&br);                         // log2_max_pic_order_cnt_lsb_minus4
+    break;
+  case 1:
+    _nal_read_bits(&br, 1);                    // delta_pic_order_always_zero_flag
+    _nal_read_se(&br);                         // offset_for_non_ref_pic
+    _nal_read_se(&br);                         // offset_for_top_to_bottom_field
+    n = _nal_read_ue(&br);
+    if (n > 255) return AVERROR_INVALIDDATA;
+    for (i = 0; i < n; ++i) _nal_read_se(&br);
+    break;
+  }
+  _nal_read_ue(&br);                           // max_num_ref_frames
+  _nal_read_bits(&br, 1);                      // gaps_in_frame_num_value_allowed_flag
+  width_mbs = _nal_read_ue(&br) + 1;
+  height_map_units = _nal_read_ue(&br) + 1;
+  frame_mbs_only = _nal_read_bits(&br, 1);
+  if (!frame_mbs_only) _nal_read_bits(&br, 1); // mb_adaptive_frame_field_flag
+  _nal_read_bits(&br, 1);                      // direct_8x8_inference_flag
+  if (_nal_read_bits(&br, 1)) {                // frame_cropping_flag
+    crop_left = _nal_read_ue(&br);
+    crop_right = _nal_read_ue(&br);
+    crop_top = _nal_read_ue(&br);
+    crop_bottom = _nal_read_ue(&br);
+  }
+  if (br.pos > br.size_bits) return AVERROR_INVALIDDATA;
+
+  // crop units, table 6-1
+  if (separate_colour_plane || !chroma_format_idc) {
+    crop_x = 1;
+    crop_y = 2 - frame_mbs_only;
+  } else {
+    crop_x = chroma_format_idc == 3 ? 1 : 2;
+    crop_y = (chroma_format_idc == 1 ? 2 : 1) * (2 - frame_mbs_only);
+  }
+
+  sps->width = width_mbs * 16 - crop_x * (crop_left + crop_right);
+  sps->height = (2 - frame_mbs_only) * height_map_units * 16 - crop_y * (crop_top + crop_bottom);
+  if (sps->width <= 0 || sps->height <= 0) return AVERROR_INVALIDDATA;
+
+  return 0;
+}
+
+int ffmpbr_nal_build_hvcc_extradata(uint8_t *data, int size, uint8_t **out, int *out_size) {
+  FFmpegBridgeNal nals[FFMPBR_NAL_MAX_UNITS];
+  FFmpegBridgeHevcSps sps;
+  FFmpegBridgeNal *first_sps = NULL;
+  uint8_t *p;
+  int counts[3] = { 0, 0, 0 };
+  int num_nals, total = 23, i, j;
+
+  num_nals = ffmpbr_nal_split(data, size, nals, FFMPBR_NAL_MAX_UNITS);
+  for (i = 0; i < num_nals; ++i) {
+    if (nals[i].size < 2) continue;
+    for (j = 0; j < 3; ++j) {
+      if (FFMPBR_HEVC_NAL_TYPE(&nals[i]) != hevc_param_set_types[j]) continue;
+      if (j == 1 && !first_sps) first_sps = &nals[i];
+      counts[j]++;
+      total += 2 + nals[i].size;
+    }
+  }
+  if (!counts[0] || !counts[1] || !counts[2]) {
+    LOGE("ERROR: ffmpbr_nal_build_hvcc_extradata -- need a VPS, SPS and PPS (got %d, %d and %d)",
+      counts[0], counts[1], counts[2]);
+    return AVERROR_INVALIDDATA;
+  }
+  if (ffmpbr_nal_parse_hevc_sps(first_sps->data, first_sps->size, &sps) < 0) {
+    LOGE("ERROR: ffmpbr_nal_build_hvcc_extradata -- could not parse the SPS");
+    return AVERROR_INVALIDDATA;
+  }
+  total += 3 * 3;
+
+  p = *out = av_malloc(total);
+  if (!p) return AVERROR(ENOMEM);
+
+  // HEVCDecoderConfigurationRecord, ISO/IEC 14496-15 8.3.3.1
+  *p++ = 1;                                   // configurationVersion
+  *p++ = sps.profile_space << 6 | sps.tier_flag << 5 | sps.profile_idc;
+  AV_WB32(p, sps.profile_compatibility_flags);
+  memcpy(p + 4, sps.constraint_indicator_flags, 6);
+  p += 10;
+  *p++ = sps.level_idc;
+  AV_WB16(p, 0xf000);                         // min_spatial_segmentation_idc (unknown)
+  p += 2;
+  *p++ = 0xfc;                                // parallelismType (unknown)
+  *p++ = 0xfc | sps.chroma_format_idc;
+  *p++ = 0xf8 | (sps.bit_depth_luma - 8);
+  *p++ = 0xf8 | (sps.bit_depth_chroma - 8);
+  AV_WB16(p, 0);                              // avgFrameRate (unspecified)
+  p += 2;
+  // constantFrameRate 0, numTemporalLayers, temporalIdNested, and
+  // lengthSizeMinusOne (4 byte lengths)
+  *p++ = sps.max_sub_layers << 3 | sps.temporal_id_nesting << 2 | 3;
+  *p++ = 3;                                   // numOfArrays
+
+  // array_completeness is 0, as encoders may repeat parameter sets in-band
+  for (j = 0; j < 3; ++j) {
+    *p++ = hevc_param_set_types[j];
+    AV_WB16(p, counts[j]);
+    p += 2;
+    for (i = 0; i < num_nals; ++i) {
+      if (nals[i].size < 2 || FFMPBR_HEVC_NAL_TYPE(&nals[i]) != hevc_param_set_types[j]) continue;
+      AV_WB16(p, nals[i].size);
+      memcpy(p + 2, nals[i].data, nals[i].size);
+      p += 2 + nals[i].size;
+    }
+  }
+  *out_size = total;
+
+  return 0;
+}
+
+int ffmpbr_nal_parse_hevc_sps(const uint8_t *data, int size, FFmpegBridgeHevcSps *sps) {
+  uint8_t rbsp[FFMPBR_NAL_MAX_HEVC_SPS_RBSP];
+  FFmpegBridgeBitReader br;
+  int sub_layer_profile_present[8], sub_layer_level_present[8];
+  int separate_colour_plane = 0, sub_width = 1, sub_height = 1, i;
+  unsigned crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+
+  if (size < 4 || ((data[0] >> 1) & 0x3f) != FFMPBR_HEVC_NAL_SPS) return AVERROR_INVALIDDATA;
+
+  // (skipping the two byte NAL header)
+  br.data = rbsp;
+  br.size_bits = 8 * _nal_unescape(data + 2, size - 2, rbsp, sizeof(rbsp));
+  br.pos = 0;
+
+  // 7.3.2.2.1 seq_parameter_set_rbsp()
+  _nal_read_bits(&br, 4);                      // sps_video_parameter_set_id
+  sps->max_sub_layers = _nal_read_bits(&br, 3) + 1;
+  sps->temporal_id_nesting = _nal_read_bits(&br, 1);
+
+  // 7.3.3 profile_tier_level(1, sps_max_sub_layers_minus1)
+  sps->profile_space = _nal_read_bits(&br, 2);
+  sps->tier_flag = _nal_read_bits(&br, 1);
+  sps->profile_idc = _nal_read_bits(&br, 5);
+  sps->profile_compatibility_flags = _nal_read_bits(&br, 32);
+  for (i = 0; i < 6; ++i) {
+    sps->constraint_indicator_flags[i] = _nal_read_bits(&br, 8);
+  }
+  sps->level_idc = _nal_read_bits(&br, 8);
+  for (i = 0; i < sps->max_sub_layers - 1; ++i) {
+    sub_layer_profile_present[i] = _nal_read_bits(&br, 1);
+    sub_layer_level_present[i] = _nal_read_bits(&br, 1);
+  }
+  if (sps->max_sub_layers > 1) {
+    for (i = sps->max_sub_layers - 1; i < 8; ++i) _nal_read_bits(&br, 2);
+  }
+  for (i = 0; i < sps->max_sub_layers - 1; ++i) {
+    if (sub_layer_profile_present[i]) {
+      _nal_read_bits(&br, 32);
+      _nal_read_bits(&br, 32);
+      _nal_read_bits(&br, 24);
+    }
+    if (sub_layer_level_present[i]) _nal_read_bits(&br, 8);
+  }
+
+  _nal_read_ue(&br);                           // sps_seq_parameter_set_id
+  sps->chroma_format_idc = _nal_read_ue(&br);
+  if (sps->chroma_format_idc > 3) return AVERROR_INVALIDDATA;
+  if (sps->chroma_format_idc == 3) separate_colour_plane = _nal_read_bits(&br, 1);
+  sps->width = _nal_read_ue(&br);
+  sps->height = _nal_read_ue(&br);
+  if (_nal_read_bits(&br, 1)) {                // conformance_window_flag
+    crop_left = _nal_read_ue(&br);
+    crop_right = _nal_read_ue(&br);
+    crop_top = _nal_read_ue(&br);
+    crop_bottom = _nal_read_ue(&br);
+  }
+  sps->bit_depth_luma = _nal_read_ue(&br) + 8;
+  sps->bit_depth_chroma = _nal_read_ue(&br) + 8;
+  if (br.pos > br.size_bits || sps->bit_depth_luma > 16 || sps->bit_depth_chroma > 16) {
+    return AVERROR_INVALIDDATA;
+  }
+
+  // conformance window units, table 6-1
+  if (!separate_colour_plane && sps->chroma_format_idc) {
+    sub_width = sps->chroma_format_idc == 3 ? 1 : 2;
+    sub_height = sps->chroma_format_idc == 1 ? 2 : 1;
+  }
+  sps->width -= sub_width * (crop_left + crop_right);
+  sps->height -= sub_height * (crop_top + crop_bottom);
+  if (sps->width <= 0 || sps->height <= 0) return AVERROR_INVALIDDATA;
+
+  return 0;
+}
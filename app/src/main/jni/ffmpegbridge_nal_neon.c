@@ -0,0 +1,29 @@
+//
+// NEON start code scanner. This file is only built for ABIs that can have
+// NEON, and on armv7 is only called once the cpu has been checked for it.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <arm_neon.h>
+
+#include "ffmpegbridge_nal.h"
+
+const uint8_t* ffmpbr_nal_find_startcode_neon(const uint8_t *p, const uint8_t *end) {
+  const uint8x16_t zero = vdupq_n_u8(0), one = vdupq_n_u8(1);
+  uint8x16_t m;
+  uint8x8_t folded;
+
+  // match 00 00 01 at all 16 positions at once, using three overlapping
+  // loads, so that start codes straddling blocks aren't missed
+  for (; p + 18 <= end; p += 16) {
+    m = vandq_u8(vandq_u8(vceqq_u8(vld1q_u8(p), zero), vceqq_u8(vld1q_u8(p + 1), zero)),
+      vceqq_u8(vld1q_u8(p + 2), one));
+    folded = vorr_u8(vget_low_u8(m), vget_high_u8(m));
+    if (vget_lane_u64(vreinterpret_u64_u8(folded), 0)) {
+      // there's no movemask, so let the scalar scan find which position
+      return ffmpbr_nal_find_startcode_c(p, p + 18);
+    }
+  }
+  return ffmpbr_nal_find_startcode_c(p, end);
+}
@@ -0,0 +1,52 @@
+//
+// Output pacing, see ffmpegbridge_pacer.h.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include "libavutil/common.h"
+
+#include "ffmpegbridge_pacer.h"
+
+//
+//-- FFmpegBridgePacer API
+//
+
+void ffmpbr_pacer_init(FFmpegBridgePacer *pacer, int64_t bit_rate, int64_t burst_bytes) {
+  pacer->rate = FFMAX(bit_rate / 8, 1);
+  pacer->burst = FFMAX(burst_bytes, FFMPBR_PACER_QUANTUM);
+
+  // (starting full, so that the header goes straight out)
+  pacer->tokens = pacer->burst;
+  pacer->last_us = -1;
+}
+
+int64_t ffmpbr_pacer_allowance(FFmpegBridgePacer *pacer, int64_t now_us) {
+  int64_t refill;
+
+  if (pacer->last_us < 0) pacer->last_us = now_us;
+  refill = (now_us - pacer->last_us) * pacer->rate / 1000000;
+  if (refill <= 0) return pacer->tokens;
+
+  if (pacer->tokens + refill >= pacer->burst) {
+    pacer->tokens = pacer->burst;
+    pacer->last_us = now_us;
+  } else {
+    // (only moving the clock on by what was credited, so that frequent
+    // calls don't round the rate down)
+    pacer->tokens += refill;
+    pacer->last_us += refill * 1000000 / pacer->rate;
+  }
+  return pacer->tokens;
+}
+
+void ffmpbr_pacer_consume(FFmpegBridgePacer *pacer, int n) {
+  pacer->tokens -= n;
+}
+
+int64_t ffmpbr_pacer_wait_us(FFmpegBridgePacer *pacer, int size, int64_t now_us) {
+  int64_t need = FFMIN(FFMIN(size, FFMPBR_PACER_QUANTUM), pacer->burst) - pacer->tokens;
+
+  if (need <= 0) return 0;
+  return FFMAX((need * 1000000 + pacer->rate - 1) / pacer->rate - (now_us - pacer->last_us), 1);
+}
@@ -0,0 +1,198 @@
+//
+// Warm RTMP connections, see ffmpegbridge_pool.h.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "libavutil/common.h"
+
+#include "ffmpegbridge_latency.h"
+#include "ffmpegbridge_log.h"
+#include "ffmpegbridge_pool.h"
+
+typedef struct
+{
+  FFmpegBridgeRtmp *rtmp;
+  int64_t expires_us;
+} FFmpegBridgePoolEntry;
+
+// idle connections, oldest first, and the thread watching them
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static FFmpegBridgePoolEntry pool[FFMPBR_POOL_MAX_CONNECTIONS];
+static int pool_count = 0;
+static int pool_grace_ms = 0;
+static int pool_watching = 0;
+static FFmpegBridgePoolStats pool_stats;
+
+//
+//-- helper functions
+//
+
+// takes entry i out of the pool, locked
+FFmpegBridgeRtmp* _pool_remove(int i) {
+  FFmpegBridgeRtmp *rtmp = pool[i].rtmp;
+
+  memmove(pool + i, pool + i + 1, (pool_count - i - 1) * sizeof(FFmpegBridgePoolEntry));
+  pool_count--;
+  return rtmp;
+}
+
+int _pool_find(FFmpegBridgeRtmp *rtmp) {
+  int i;
+
+  for (i = 0; i < pool_count; ++i) {
+    if (pool[i].rtmp == rtmp) return i;
+  }
+  return -1;
+}
+
+// the watcher: services idle connections as the server sends something,
+// and closes the ones that are done, until there are none left
+void* _pool_watch(void *arg) {
+  struct pollfd fds[FFMPBR_POOL_MAX_CONNECTIONS];
+  FFmpegBridgeRtmp *polled[FFMPBR_POOL_MAX_CONNECTIONS];
+  int64_t now_us, timeout_us;
+  int i, j, count;
+
+  pthread_mutex_lock(&pool_lock);
+  while (pool_count) {
+    now_us = ffmpbr_now_us();
+    timeout_us = FFMPBR_POOL_POLL_MS * 1000LL;
+    for (i = 0; i < pool_count; ) {
+      if (pool[i].expires_us <= now_us) {
+        ffmpbr_rtmp_close(_pool_remove(i));
+        pool_stats.expired++;
+        continue;
+      }
+      timeout_us = FFMIN(timeout_us, pool[i].expires_us - now_us);
+      fds[i].fd = RTMP_Socket(pool[i].rtmp->rtmp);
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+      polled[i] = pool[i].rtmp;
+      ++i;
+    }
+    count = pool_count;
+    if (!count) break;
+
+    pthread_mutex_unlock(&pool_lock);
+    poll(fds, count, (timeout_us + 999) / 1000);
+    pthread_mutex_lock(&pool_lock);
+
+    // (connections taken in the meantime are their session's now)
+    for (i = 0; i < count; ++i) {
+      if (!fds[i].revents || (j = _pool_find(polled[i])) < 0) continue;
+      if (ffmpbr_rtmp_service(pool[j].rtmp) < 0) {
+        LOGI("An idle connection to %s was closed by the server", pool[j].rtmp->url);
+        ffmpbr_rtmp_close(_pool_remove(j));
+        pool_stats.failed++;
+      }
+    }
+  }
+  pool_watching = 0;
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+
+//
+//-- FFmpegBridgePool API
+//
+
+void ffmpbr_pool_set_grace(int grace_ms) {
+  pthread_mutex_lock(&pool_lock);
+  pool_grace_ms = FFMAX(grace_ms, 0);
+  if (!pool_grace_ms) {
+    while (pool_count) {
+      ffmpbr_rtmp_close(_pool_remove(0));
+      pool_stats.expired++;
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+int ffmpbr_pool_enabled() {
+  int enabled;
+
+  pthread_mutex_lock(&pool_lock);
+  enabled = pool_grace_ms > 0;
+  pthread_mutex_unlock(&pool_lock);
+  return enabled;
+}
+
+FFmpegBridgeRtmp* ffmpbr_pool_take(const char *url, const FFmpegBridgeTransport *transport) {
+  FFmpegBridgeRtmp *rtmp = NULL;
+  int i;
+
+  pthread_mutex_lock(&pool_lock);
+  if (!pool_grace_ms) {
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+  }
+  // the most recently kept, as it's the least likely to have timed out
+  for (i = pool_count - 1; i >= 0; --i) {
+    if (!strcmp(pool[i].rtmp->url, url)) {
+      rtmp = _pool_remove(i);
+      break;
+    }
+  }
+  if (!rtmp) pool_stats.missed++;
+  pthread_mutex_unlock(&pool_lock);
+  if (!rtmp) return NULL;
+
+  // (a round trip or two, so not under the lock)
+  if (ffmpbr_rtmp_republish(rtmp, transport) < 0) {
+    ffmpbr_rtmp_close(rtmp);
+    pthread_mutex_lock(&pool_lock);
+    pool_stats.failed++;
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  pool_stats.reused++;
+  pthread_mutex_unlock(&pool_lock);
+  LOGI("Publishing to %s on a warm connection", url);
+  return rtmp;
+}
+
+int ffmpbr_pool_put(FFmpegBridgeRtmp *rtmp) {
+  pthread_t thread;
+  int rc;
+
+  if (!ffmpbr_pool_enabled()) return AVERROR(ENOSYS);
+
+  rc = ffmpbr_rtmp_unpublish(rtmp);
+  if (rc < 0) return rc;
+
+  pthread_mutex_lock(&pool_lock);
+  if (!pool_grace_ms) {
+    pthread_mutex_unlock(&pool_lock);
+    return AVERROR(ENOSYS);
+  }
+  if (pool_count == FFMPBR_POOL_MAX_CONNECTIONS) {
+    ffmpbr_rtmp_close(_pool_remove(0));
+    pool_stats.evicted++;
+  }
+  pool[pool_count].rtmp = rtmp;
+  pool[pool_count].expires_us = ffmpbr_now_us() + pool_grace_ms * 1000LL;
+  pool_count++;
+  pool_stats.kept++;
+
+  if (!pool_watching && !pthread_create(&thread, NULL, _pool_watch, NULL)) {
+    pthread_detach(thread);
+    pool_watching = 1;
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return 0;
+}
+
+void ffmpbr_pool_get_stats(FFmpegBridgePoolStats *stats) {
+  pthread_mutex_lock(&pool_lock);
+  *stats = pool_stats;
+  stats->idle = pool_count;
+  pthread_mutex_unlock(&pool_lock);
+}
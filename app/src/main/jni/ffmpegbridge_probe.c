@@ -0,0 +1,156 @@
+//
+// Bandwidth preflight, see ffmpegbridge_probe.h.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+
+#include "libavutil/common.h"
+#include "libavutil/error.h"
+
+#include "ffmpegbridge_latency.h"
+#include "ffmpegbridge_log.h"
+#include "ffmpegbridge_pacer.h"
+#include "ffmpegbridge_probe.h"
+
+// the least increase in acknowledged bytes taken as an ack arriving
+#define FFMPBR_PROBE_MIN_STEP 1024
+
+//
+//-- helper functions
+//
+
+// bytes sent so far that the receiver has acknowledged
+int64_t _probe_acked(int fd, int64_t sent) {
+  int unacked = 0;
+
+  if (ioctl(fd, SIOCOUTQ, &unacked) < 0) return sent;
+  return sent - unacked;
+}
+
+// how much can be sent without blocking: the send buffer's free room (its
+// size counts bookkeeping as well, about as much again as the data)
+int _probe_room(int fd, int64_t unacked) {
+  socklen_t size = sizeof(int);
+  int sndbuf;
+
+  if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &size) < 0) return FFMPBR_PROBE_PIECE_SIZE;
+  return av_clip(sndbuf / 2 - unacked, 0, FFMPBR_PROBE_PIECE_SIZE);
+}
+
+// how much may be left unacknowledged: enough to keep the link busy at the
+// rate it's delivering at so far, for a round trip and FFMPBR_PROBE_QUEUE_US
+int64_t _probe_max_unacked(int fd, int64_t acked, int64_t elapsed_us) {
+  struct tcp_info info;
+  socklen_t info_size = sizeof(info);
+  int64_t rtt_us = 0;
+
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &info_size) == 0) rtt_us = info.tcpi_rtt;
+  return FFMAX(2 * FFMPBR_PROBE_PIECE_SIZE,
+    acked * (rtt_us + FFMPBR_PROBE_QUEUE_US) / FFMAX(elapsed_us, 1));
+}
+
+
+//
+//-- FFmpegBridgeProbe API
+//
+
+int ffmpbr_probe_run(int fd, int duration_ms, int64_t max_bit_rate, FFmpegBridgeProbeSend send,
+  void *opaque, FFmpegBridgeProbeResult *result) {
+  FFmpegBridgePacer pacer;
+  struct pollfd pfd;
+  struct tcp_info info;
+  socklen_t info_size = sizeof(info);
+  int64_t start_us, half_us, end_us, now_us, allowance, acked;
+  int64_t base_us = -1, base_acked = 0, last_us = 0, last_acked = 0;
+  int size, n;
+
+  memset(result, 0, sizeof(FFmpegBridgeProbeResult));
+  ffmpbr_pacer_init(&pacer, max_bit_rate, FFMPBR_PROBE_PIECE_SIZE);
+  start_us = ffmpbr_now_us();
+  half_us = start_us + duration_ms * 500LL;
+  end_us = start_us + duration_ms * 1000LL;
+
+  while ((now_us = ffmpbr_now_us()) < end_us) {
+    // acks come in steps (as the receiver's window opens), so the rate is
+    // measured from the first step past half way to the last. (sent counts
+    // what the padding carries, not the protocol's headers around it, so
+    // acked wobbles by a few bytes as pieces go out; those aren't steps.)
+    acked = _probe_acked(fd, result->bytes_sent);
+    if (acked >= last_acked + FFMPBR_PROBE_MIN_STEP) {
+      if (base_us < 0 && now_us >= half_us) {
+        base_us = now_us;
+        base_acked = acked;
+      }
+      last_us = now_us;
+      last_acked = acked;
+    }
+
+    // padding still queued when the probe ends holds up the stream, so
+    // don't queue up more than the link is taking
+    if (result->bytes_sent - acked > _probe_max_unacked(fd, acked, now_us - start_us)) {
+      poll(NULL, 0, 1);
+      continue;
+    }
+
+    // (a send that blocks would hide the acks coming in meanwhile)
+    size = _probe_room(fd, result->bytes_sent - acked);
+    if (size < FFMPBR_PROBE_MIN_PIECE_SIZE) {
+      poll(NULL, 0, 1);
+      continue;
+    }
+
+    allowance = ffmpbr_pacer_allowance(&pacer, now_us);
+    if (allowance < size) {
+      poll(NULL, 0, av_clip(ffmpbr_pacer_wait_us(&pacer, size, now_us) / 1000, 1, 5));
+      continue;
+    }
+
+    n = send(opaque, size);
+    if (n < 0) {
+      LOGE("ERROR: ffmpbr_probe_run -- %s", av_err2str(n));
+      return n;
+    }
+    if (n == 0) {
+      // the link is the limit, wait for it to drain
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      poll(&pfd, 1, 5);
+      continue;
+    }
+    ffmpbr_pacer_consume(&pacer, n);
+    result->bytes_sent += n;
+  }
+
+  result->duration_us = now_us - start_us;
+  result->bytes_acked = _probe_acked(fd, result->bytes_sent);
+
+  if (base_us >= 0 && last_us > base_us) {
+    result->throughput = (last_acked - base_acked) * 8 * 1000000 / (last_us - base_us);
+  } else {
+    // too few steps in the second half, e.g. when the link is so slow that
+    // what's buffered on the way takes most of the probe to clear: make do
+    // with the average over the whole probe
+    result->throughput = result->bytes_acked * 8 * 1000000 / FFMAX(result->duration_us, 1);
+  }
+  // (within an eighth of the cap, the cap is what held it back)
+  result->capped = result->throughput * 8 >= max_bit_rate * 7;
+
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &info_size) == 0) {
+    result->rtt_us = info.tcpi_rtt;
+    result->rtt_var_us = info.tcpi_rttvar;
+  }
+
+  LOGI("Probe: %lld bytes sent, %lld acked in %lld ms, %lld kbit/s%s, rtt %lld us",
+    result->bytes_sent, result->bytes_acked, result->duration_us / 1000,
+    result->throughput / 1000, result->capped ? " (capped)" : "", result->rtt_us);
+  return 0;
+}
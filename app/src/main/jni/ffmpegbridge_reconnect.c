@@ -0,0 +1,169 @@
+//
+// Reconnecting to an ingest in the background, see ffmpegbridge_reconnect.h.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <string.h>
+
+#include "libavutil/error.h"
+#include "libavutil/mem.h"
+
+#include "ffmpegbridge_latency.h"
+#include "ffmpegbridge_log.h"
+#include "ffmpegbridge_reconnect.h"
+
+//
+//-- helper functions
+//
+
+void _reconnect_free(FFmpegBridgeReconnect *rc) {
+  int i;
+
+  if (rc->ready) ffmpbr_io_close(rc->ready);
+  for (i=0; i<rc->url_count; ++i) {
+    av_free(rc->urls[i]);
+  }
+  av_free(rc->urls);
+  av_dict_free(&rc->options);
+  pthread_mutex_destroy(&rc->lock);
+  pthread_cond_destroy(&rc->wake);
+  av_free(rc);
+}
+
+// tries the urls in turn after from, returning the first connection made
+FFmpegBridgeIO* _reconnect_try(FFmpegBridgeReconnect *rc, int from, int *index) {
+  FFmpegBridgeIO *io;
+  AVDictionary *options;
+  int64_t t;
+  int err, i;
+
+  for (i=1; i<=rc->url_count; ++i) {
+    *index = (from + i) % rc->url_count;
+    options = NULL;
+    av_dict_copy(&options, rc->options, 0);
+    t = ffmpbr_now_us();
+    io = ffmpbr_io_open(rc->urls[*index], NULL, &rc->transport, &options, &err);
+    t = ffmpbr_now_us() - t;
+    av_dict_free(&options);
+    if (io) {
+      LOGI("Connected to %s in the background in %lld us", rc->urls[*index], t);
+      return io;
+    }
+
+    LOGE("ERROR: _reconnect_try -- couldn't open %s: %s", rc->urls[*index], av_err2str(err));
+    pthread_mutex_lock(&rc->lock);
+    rc->failed_attempts++;
+    pthread_mutex_unlock(&rc->lock);
+  }
+  return NULL;
+}
+
+void* _reconnect_thread(void *arg) {
+  FFmpegBridgeReconnect *rc = arg;
+  FFmpegBridgeIO *io;
+  int from, index;
+
+  pthread_mutex_lock(&rc->lock);
+  for (;;) {
+    while (!rc->stopping && !rc->wanted) {
+      pthread_cond_wait(&rc->wake, &rc->lock);
+    }
+    if (rc->stopping) break;
+
+    from = rc->from;
+    rc->wanted = 0;
+    rc->trying = 1;
+    pthread_mutex_unlock(&rc->lock);
+
+    io = _reconnect_try(rc, from, &index);
+
+    pthread_mutex_lock(&rc->lock);
+    rc->trying = 0;
+    rc->ready = io;
+    rc->ready_index = index;
+    rc->gave_up = !io;
+  }
+  pthread_mutex_unlock(&rc->lock);
+
+  // (stopped, so nobody else has it any more; see ffmpbr_reconnect_stop)
+  _reconnect_free(rc);
+  return NULL;
+}
+
+
+//
+//-- FFmpegBridgeReconnect API
+//
+
+FFmpegBridgeReconnect* ffmpbr_reconnect_start(char **urls, int url_count,
+  AVDictionary *options, const FFmpegBridgeTransport *transport) {
+  FFmpegBridgeReconnect *rc = av_mallocz(sizeof(FFmpegBridgeReconnect));
+  int err, i;
+
+  rc->urls = av_mallocz(url_count * sizeof(char *));
+  for (i=0; i<url_count; ++i) {
+    rc->urls[i] = av_strdup(urls[i]);
+  }
+  rc->url_count = url_count;
+  av_dict_copy(&rc->options, options, 0);
+  rc->transport = *transport;
+  pthread_mutex_init(&rc->lock, NULL);
+  pthread_cond_init(&rc->wake, NULL);
+
+  err = pthread_create(&rc->thread, NULL, _reconnect_thread, rc);
+  if (err) {
+    LOGE("ERROR: ffmpbr_reconnect_start -- couldn't start the reconnect thread: %d", err);
+    _reconnect_free(rc);
+    return NULL;
+  }
+  pthread_detach(rc->thread);
+  return rc;
+}
+
+void ffmpbr_reconnect_request(FFmpegBridgeReconnect *rc, int index) {
+  pthread_mutex_lock(&rc->lock);
+  if (!rc->wanted && !rc->trying && !rc->ready) {
+    rc->wanted = 1;
+    rc->from = index;
+    rc->gave_up = 0;
+    pthread_cond_signal(&rc->wake);
+  }
+  pthread_mutex_unlock(&rc->lock);
+}
+
+FFmpegBridgeIO* ffmpbr_reconnect_take(FFmpegBridgeReconnect *rc, int *index) {
+  FFmpegBridgeIO *io;
+
+  pthread_mutex_lock(&rc->lock);
+  io = rc->ready;
+  *index = rc->ready_index;
+  rc->ready = NULL;
+  pthread_mutex_unlock(&rc->lock);
+  return io;
+}
+
+int ffmpbr_reconnect_gave_up(FFmpegBridgeReconnect *rc) {
+  int gave_up;
+
+  pthread_mutex_lock(&rc->lock);
+  gave_up = rc->gave_up;
+  pthread_mutex_unlock(&rc->lock);
+  return gave_up;
+}
+
+int64_t ffmpbr_reconnect_failed_attempts(FFmpegBridgeReconnect *rc) {
+  int64_t failed_attempts;
+
+  pthread_mutex_lock(&rc->lock);
+  failed_attempts = rc->failed_attempts;
+  pthread_mutex_unlock(&rc->lock);
+  return failed_attempts;
+}
+
+void ffmpbr_reconnect_stop(FFmpegBridgeReconnect *rc) {
+  pthread_mutex_lock(&rc->lock);
+  rc->stopping = 1;
+  pthread_cond_signal(&rc->wake);
+  pthread_mutex_unlock(&rc->lock);
+}
@@ -0,0 +1,249 @@
+//
+// RTMP publishing through librtmp, see ffmpegbridge_rtmp.h.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "libavutil/avstring.h"
+#include "libavutil/common.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/mem.h"
+
+#include "ffmpegbridge_log.h"
+#include "ffmpegbridge_rtmp.h"
+
+// the flv file header, PreviousTagSize0 included, and a tag header
+#define FFMPBR_RTMP_FLV_HEADER_SIZE 13
+#define FFMPBR_RTMP_TAG_HEADER_SIZE 11
+
+//
+//-- helper functions
+//
+
+// tells the server our chunks will be size bytes from here on, and has
+// librtmp cut them that way
+int _rtmp_set_chunk_size(RTMP *r, int size) {
+  RTMPPacket packet;
+  char buf[RTMP_MAX_HEADER_SIZE + 4];
+
+  memset(&packet, 0, sizeof(packet));
+  packet.m_nChannel = 0x02;
+  packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+  packet.m_packetType = RTMP_PACKET_TYPE_CHUNK_SIZE;
+  packet.m_body = buf + RTMP_MAX_HEADER_SIZE;
+  packet.m_nBodySize = 4;
+  AV_WB32(packet.m_body, size);
+
+  if (!RTMP_SendPacket(r, &packet, FALSE)) {
+    return AVERROR(EIO);
+  }
+  r->m_outChunkSize = size;
+  return 0;
+}
+
+// (only the media goes out in bigger chunks, once the stream is published)
+int _rtmp_apply_chunk_size(RTMP *r, const FFmpegBridgeTransport *transport) {
+  int chunk_size, rc;
+
+  if (transport->rtmp_chunk_size <= 0) return 0;
+  chunk_size = av_clip(transport->rtmp_chunk_size, FFMPBR_RTMP_MIN_CHUNK_SIZE,
+    FFMPBR_RTMP_MAX_CHUNK_SIZE);
+  if (chunk_size == r->m_outChunkSize) return 0;
+
+  rc = _rtmp_set_chunk_size(r, chunk_size);
+  if (rc < 0) return rc;
+  LOGI("Publishing with %d byte chunks", chunk_size);
+  return 0;
+}
+
+
+//
+//-- FFmpegBridgeRtmp API
+//
+
+int ffmpbr_rtmp_is_url(const char *url) {
+  static const char *protos[] = { "rtmp:", "rtmpt:", "rtmps:", "rtmpe:", "rtmpte:", NULL };
+  int i;
+
+  for (i = 0; protos[i]; ++i) {
+    if (av_strstart(url, protos[i], NULL)) return 1;
+  }
+  return 0;
+}
+
+int ffmpbr_rtmp_open(FFmpegBridgeRtmp **rtmp, const char *url,
+  const FFmpegBridgeTransport *transport) {
+  FFmpegBridgeRtmp *r = av_mallocz(sizeof(FFmpegBridgeRtmp));
+  int rc = AVERROR(EIO);
+
+  if (!r) return AVERROR(ENOMEM);
+  av_strlcpy(r->url, url, sizeof(r->url));
+  r->header_left = FFMPBR_RTMP_FLV_HEADER_SIZE;
+  r->rtmp = RTMP_Alloc();
+  RTMP_Init(r->rtmp);
+  if (!RTMP_SetupURL(r->rtmp, r->url)) {
+    LOGE("ERROR: ffmpbr_rtmp_open -- can't parse %s", url);
+    rc = AVERROR(EINVAL);
+    goto fail;
+  }
+  RTMP_EnableWrite(r->rtmp);
+
+  if (!RTMP_Connect(r->rtmp, NULL)) {
+    LOGE("ERROR: ffmpbr_rtmp_open -- couldn't connect to %s", url);
+    goto fail;
+  }
+  ffmpbr_io_set_socket_options(RTMP_Socket(r->rtmp), transport);
+
+  if (!RTMP_ConnectStream(r->rtmp, 0)) {
+    LOGE("ERROR: ffmpbr_rtmp_open -- the server didn't accept the stream");
+    goto fail;
+  }
+
+  rc = _rtmp_apply_chunk_size(r->rtmp, transport);
+  if (rc < 0) {
+    LOGE("ERROR: ffmpbr_rtmp_open -- couldn't set the chunk size");
+    goto fail;
+  }
+
+  *rtmp = r;
+  return 0;
+
+fail:
+  RTMP_Close(r->rtmp);
+  RTMP_Free(r->rtmp);
+  av_free(r);
+  return rc;
+}
+
+int ffmpbr_rtmp_write(FFmpegBridgeRtmp *rtmp, const uint8_t *buf, int buf_size) {
+  const uint8_t *end = buf + buf_size;
+  uint8_t *tag;
+  int need, n;
+
+  n = FFMIN(rtmp->header_left, buf_size);
+  rtmp->header_left -= n;
+  buf += n;
+
+  while (buf < end) {
+    // the tag header, then its body and PreviousTagSize
+    need = FFMPBR_RTMP_TAG_HEADER_SIZE;
+    if (rtmp->tag_size >= need) need += AV_RB24(rtmp->tag + 1) + 4;
+
+    n = FFMIN(need - rtmp->tag_size, end - buf);
+    tag = av_fast_realloc(rtmp->tag, &rtmp->tag_capacity, rtmp->tag_size + n);
+    if (!tag) return AVERROR(ENOMEM);
+    rtmp->tag = tag;
+    memcpy(rtmp->tag + rtmp->tag_size, buf, n);
+    rtmp->tag_size += n;
+    buf += n;
+
+    if (rtmp->tag_size < need || need == FFMPBR_RTMP_TAG_HEADER_SIZE) continue;
+    if (RTMP_Write(rtmp->rtmp, (const char *)rtmp->tag, rtmp->tag_size) <= 0) {
+      return AVERROR(EIO);
+    }
+    rtmp->tag_size = 0;
+  }
+  return buf_size;
+}
+
+int ffmpbr_rtmp_send_padding(FFmpegBridgeRtmp *rtmp, int size) {
+  static const AVal name = AVC("_probe");
+  RTMPPacket packet;
+  uint8_t *buf;
+  char *p, *end;
+  int padding;
+
+  // (the tag buffer is free until the header comes through)
+  size = FFMAX(size, 64);
+  buf = av_fast_realloc(rtmp->tag, &rtmp->tag_capacity, RTMP_MAX_HEADER_SIZE + size);
+  if (!buf) return AVERROR(ENOMEM);
+  rtmp->tag = buf;
+
+  memset(&packet, 0, sizeof(packet));
+  packet.m_nChannel = 0x03;
+  packet.m_headerType = RTMP_PACKET_SIZE_MEDIUM;
+  packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
+  packet.m_body = (char *)buf + RTMP_MAX_HEADER_SIZE;
+  p = packet.m_body;
+  end = p + size;
+
+  // "_probe", transaction 0 (no reply wanted), null, and a long string
+  p = AMF_EncodeString(p, end, &name);
+  p = AMF_EncodeNumber(p, end, 0);
+  *p++ = AMF_NULL;
+  padding = end - p - 5;
+  *p++ = AMF_LONG_STRING;
+  AV_WB32(p, padding);
+  memset(p + 4, 'x', padding);
+  packet.m_nBodySize = size;
+
+  if (!RTMP_SendPacket(rtmp->rtmp, &packet, FALSE)) {
+    return AVERROR(EIO);
+  }
+  return size;
+}
+
+int ffmpbr_rtmp_unpublish(FFmpegBridgeRtmp *rtmp) {
+  // (a tag cut off halfway would garble the next stream)
+  if (rtmp->tag_size || !RTMP_IsConnected(rtmp->rtmp)) {
+    return AVERROR(EIO);
+  }
+  RTMP_DeleteStream(rtmp->rtmp);
+  rtmp->header_left = FFMPBR_RTMP_FLV_HEADER_SIZE;
+  return RTMP_IsConnected(rtmp->rtmp) ? 0 : AVERROR(EIO);
+}
+
+int ffmpbr_rtmp_republish(FFmpegBridgeRtmp *rtmp, const FFmpegBridgeTransport *transport) {
+  int rc;
+
+  ffmpbr_io_set_socket_options(RTMP_Socket(rtmp->rtmp), transport);
+
+  // createStream, and publish once it's answered; RTMP_ConnectStream
+  // handles the replies, and anything else the server sent in between
+  if (!RTMP_SendCreateStream(rtmp->rtmp) || !RTMP_ConnectStream(rtmp->rtmp, 0)) {
+    LOGE("ERROR: ffmpbr_rtmp_republish -- the server didn't accept the stream");
+    return AVERROR(EIO);
+  }
+  rc = _rtmp_apply_chunk_size(rtmp->rtmp, transport);
+  if (rc < 0) {
+    LOGE("ERROR: ffmpbr_rtmp_republish -- couldn't set the chunk size");
+  }
+  return rc;
+}
+
+int ffmpbr_rtmp_service(FFmpegBridgeRtmp *rtmp) {
+  RTMP *r = rtmp->rtmp;
+  RTMPPacket packet;
+  char c;
+  ssize_t n;
+
+  // whatever librtmp has buffered, then whatever the socket has
+  do {
+    if (!r->m_sb.sb_size) {
+      n = recv(RTMP_Socket(r), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+      if (n == 0) return AVERROR_EOF;
+      if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : AVERROR(errno);
+    }
+
+    memset(&packet, 0, sizeof(packet));
+    do {
+      if (!RTMP_ReadPacket(r, &packet)) return AVERROR(EIO);
+    } while (!RTMPPacket_IsReady(&packet));
+    RTMP_ClientPacket(r, &packet);
+    RTMPPacket_Free(&packet);
+  } while (RTMP_IsConnected(r) && r->m_sb.sb_size > 0);
+
+  return RTMP_IsConnected(r) ? 0 : AVERROR_EOF;
+}
+
+void ffmpbr_rtmp_close(FFmpegBridgeRtmp *rtmp) {
+  RTMP_Close(rtmp->rtmp);
+  RTMP_Free(rtmp->rtmp);
+  av_free(rtmp->tag);
+  av_free(rtmp);
+}
@@ -0,0 +1,213 @@
+//
+// Segmented recording, see ffmpegbridge_segment.h.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libavutil/mem.h"
+
+#include "ffmpegbridge_latency.h"
+#include "ffmpegbridge_log.h"
+#include "ffmpegbridge_segment.h"
+
+//
+//-- helper functions
+//
+
+int _segment_compare(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+FFmpegBridgeSegment* _segment_pop_retired(FFmpegBridgeSegmenter *seg) {
+  FFmpegBridgeSegment *segment = seg->retired_head;
+
+  if (segment) {
+    seg->retired_head = segment->next;
+    if (!seg->retired_head) seg->retired_tail = NULL;
+  }
+  return segment;
+}
+
+// opens and closes segments. Opening comes first, as the write path may be
+// waiting on the next segment; trailers can wait.
+void* _segment_thread(void *arg) {
+  FFmpegBridgeSegmenter *seg = arg;
+  FFmpegBridgeSegment *segment;
+  int64_t t;
+  int rc;
+
+  pthread_mutex_lock(&seg->lock);
+  for (;;) {
+    while (!seg->stopping && !seg->retired_head && !(seg->want_ready && !seg->ready)) {
+      pthread_cond_wait(&seg->wake, &seg->lock);
+    }
+
+    if (seg->want_ready && !seg->ready && !seg->stopping) {
+      seg->want_ready = 0;
+      segment = av_mallocz(sizeof(FFmpegBridgeSegment));
+      segment->index = seg->next_index;
+      pthread_mutex_unlock(&seg->lock);
+
+      t = ffmpbr_now_us();
+      rc = seg->open(seg->opaque, segment);
+      t = ffmpbr_now_us() - t;
+
+      pthread_mutex_lock(&seg->lock);
+      if (rc < 0) {
+        // the write path asks again at its next keyframe
+        LOGE("ERROR: _segment_thread -- couldn't open segment %d (%s): %s", segment->index,
+          segment->url, av_err2str(rc));
+        av_free(segment);
+        continue;
+      }
+      LOGI("Opened segment %d (%s) ahead of time in %lld us", segment->index, segment->url, t);
+      seg->next_index++;
+      seg->ready = segment;
+      if (t > seg->stats.max_open_us) seg->stats.max_open_us = t;
+      continue;
+    }
+
+    if ((segment = _segment_pop_retired(seg))) {
+      pthread_mutex_unlock(&seg->lock);
+      t = ffmpbr_now_us();
+      seg->close(seg->opaque, segment, 1);
+      t = ffmpbr_now_us() - t;
+      LOGI("Closed segment %d (%s) in %lld us", segment->index, segment->url, t);
+      av_free(segment);
+
+      pthread_mutex_lock(&seg->lock);
+      seg->stats.closed_segments++;
+      if (t > seg->stats.max_close_us) seg->stats.max_close_us = t;
+      continue;
+    }
+
+    // stopping, with everything closed
+    break;
+  }
+  pthread_mutex_unlock(&seg->lock);
+  return NULL;
+}
+
+
+//
+//-- FFmpegBridgeSegmenter API
+//
+
+void ffmpbr_segment_url(char *buf, int buf_size, const char *url_pattern, int index) {
+  const char *ext, *slash;
+
+  if (av_get_frame_filename(buf, buf_size, url_pattern, index) == 0) return;
+
+  ext = strrchr(url_pattern, '.');
+  slash = strrchr(url_pattern, '/');
+  if (!ext || (slash && ext < slash)) ext = url_pattern + strlen(url_pattern);
+  snprintf(buf, buf_size, "%.*s-%03d%s", (int)(ext - url_pattern), url_pattern, index, ext);
+}
+
+int ffmpbr_segmenter_start(FFmpegBridgeSegmenter *seg, int duration_ms, int first_index,
+  FFmpegBridgeSegmentOpen open, FFmpegBridgeSegmentClose close, void *opaque) {
+  int rc;
+
+  memset(seg, 0, sizeof(FFmpegBridgeSegmenter));
+  seg->duration_us = duration_ms * 1000LL;
+  seg->open = open;
+  seg->close = close;
+  seg->opaque = opaque;
+  seg->next_index = first_index + 1;
+  seg->want_ready = 1;
+  seg->stats.segments = 1;
+  pthread_mutex_init(&seg->lock, NULL);
+  pthread_cond_init(&seg->wake, NULL);
+
+  rc = pthread_create(&seg->thread, NULL, _segment_thread, seg);
+  if (rc) {
+    LOGE("ERROR: ffmpbr_segmenter_start -- couldn't start the segment thread: %d", rc);
+    pthread_mutex_destroy(&seg->lock);
+    pthread_cond_destroy(&seg->wake);
+    return AVERROR(rc);
+  }
+  seg->started = 1;
+  return 0;
+}
+
+int ffmpbr_segmenter_due(FFmpegBridgeSegmenter *seg, int64_t start_pts, int64_t pts) {
+  return seg->started && pts - start_pts >= seg->duration_us;
+}
+
+FFmpegBridgeSegment* ffmpbr_segmenter_take(FFmpegBridgeSegmenter *seg) {
+  FFmpegBridgeSegment *segment;
+
+  pthread_mutex_lock(&seg->lock);
+  segment = seg->ready;
+  seg->ready = NULL;
+  if (!segment) {
+    seg->stats.late_rotations++;
+    seg->want_ready = 1;
+    pthread_cond_signal(&seg->wake);
+  }
+  pthread_mutex_unlock(&seg->lock);
+  return segment;
+}
+
+void ffmpbr_segmenter_retire(FFmpegBridgeSegmenter *seg, FFmpegBridgeSegment *segment,
+  int64_t rotation_us) {
+  pthread_mutex_lock(&seg->lock);
+  segment->next = NULL;
+  if (seg->retired_tail) seg->retired_tail->next = segment;
+  else seg->retired_head = segment;
+  seg->retired_tail = segment;
+  seg->want_ready = 1;
+
+  seg->stats.segments++;
+  seg->window[seg->window_pos] = rotation_us;
+  seg->window_pos = (seg->window_pos + 1) % FFMPBR_SEGMENT_WINDOW;
+  if (seg->window_count < FFMPBR_SEGMENT_WINDOW) seg->window_count++;
+  if (rotation_us > seg->stats.rotation_max_us) seg->stats.rotation_max_us = rotation_us;
+
+  pthread_cond_signal(&seg->wake);
+  pthread_mutex_unlock(&seg->lock);
+}
+
+void ffmpbr_segmenter_stop(FFmpegBridgeSegmenter *seg) {
+  if (!seg->started) return;
+
+  pthread_mutex_lock(&seg->lock);
+  seg->stopping = 1;
+  pthread_cond_signal(&seg->wake);
+  pthread_mutex_unlock(&seg->lock);
+  pthread_join(seg->thread, NULL);
+  seg->started = 0;
+
+  // the segment opened for a rotation that never came
+  if (seg->ready) {
+    seg->close(seg->opaque, seg->ready, 0);
+    av_free(seg->ready);
+    seg->ready = NULL;
+  }
+  pthread_mutex_destroy(&seg->lock);
+  pthread_cond_destroy(&seg->wake);
+}
+
+void ffmpbr_segmenter_get_stats(FFmpegBridgeSegmenter *seg, FFmpegBridgeSegmentStats *stats) {
+  int64_t sorted[FFMPBR_SEGMENT_WINDOW];
+  int count;
+
+  memset(stats, 0, sizeof(FFmpegBridgeSegmentStats));
+  if (!seg->started) return;
+
+  pthread_mutex_lock(&seg->lock);
+  *stats = seg->stats;
+  count = seg->window_count;
+  memcpy(sorted, seg->window, count * sizeof(int64_t));
+  pthread_mutex_unlock(&seg->lock);
+
+  if (!count) return;
+  qsort(sorted, count, sizeof(int64_t), _segment_compare);
+  stats->rotation_p50_us = sorted[FFMIN(count * 50 / 100, count - 1)];
+  stats->rotation_p90_us = sorted[FFMIN(count * 90 / 100, count - 1)];
+}
@@ -0,0 +1,217 @@
+//
+// Timestamp handling between the device's presentation timestamps and the
+// muxer.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ffmpegbridge_log.h"
+#include "ffmpegbridge_timestamp.h"
+
+// the two device clocks are taken to be the same clock if the streams'
+// first pts are this close, once the difference in arrival is allowed for
+#define FFMPBR_TS_SAME_CLOCK_US 1000000
+
+//
+//-- helper functions
+//
+
+void _ts_track_skew(FFmpegBridgeStreamClock *clock, int64_t skew_us, int64_t arrival_us) {
+  if (arrival_us - clock->window_start_us < FFMPBR_TS_SKEW_WINDOW_US) {
+    if (skew_us > clock->window_max_skew_us) clock->window_max_skew_us = skew_us;
+    return;
+  }
+
+  // packets only ever arrive late, so the largest skew in a window is the
+  // one least disturbed by encoder and scheduling delays
+  if (!clock->has_skew) {
+    clock->skew_us = clock->window_max_skew_us;
+    clock->has_skew = 1;
+  } else {
+    clock->skew_us += (clock->window_max_skew_us - clock->skew_us) / 4;
+  }
+  clock->window_start_us = arrival_us;
+  clock->window_max_skew_us = skew_us;
+}
+
+void _ts_update_drift(FFmpegBridgeTimestamps *ts, int64_t arrival_us) {
+  FFmpegBridgeStreamClock *video = &ts->streams[FFMPBR_TS_VIDEO];
+  FFmpegBridgeStreamClock *audio = &ts->streams[FFMPBR_TS_AUDIO];
+  int64_t target, step, max_step;
+
+  if (!video->has_skew || !audio->has_skew) return;
+
+  // whatever offset the streams start with is the intended a/v sync, only
+  // changes to it are drift
+  if (!ts->has_baseline) {
+    ts->baseline_us = video->skew_us - audio->skew_us;
+    ts->has_baseline = 1;
+    ts->last_slew_arrival_us = arrival_us;
+  }
+  ts->drift_us = video->skew_us - audio->skew_us - ts->baseline_us;
+
+  // slew towards cancelling the drift, slowly enough not to be noticed
+  target = -ts->drift_us;
+  max_step = (arrival_us - ts->last_slew_arrival_us) * FFMPBR_TS_MAX_SLEW_US_PER_S / 1000000;
+  step = target - ts->correction_us;
+  if (step > max_step) step = max_step;
+  if (step < -max_step) step = -max_step;
+  ts->correction_us += step;
+  ts->last_slew_arrival_us = arrival_us;
+}
+
+// a first order loop that follows the nominal frame cadence, pulled towards
+// the capture timestamps
+int64_t _ts_smooth_video(FFmpegBridgeTimestamps *ts, FFmpegBridgeStreamClock *clock, int64_t raw) {
+  int64_t expected, error, delta, out;
+
+  if (clock->last_out_pts == INT64_MIN) return raw;
+
+  delta = raw - clock->last_raw_pts;
+  if (delta > 0 && delta <= FFMPBR_TS_RESYNC_FRAMES * ts->frame_duration_us) {
+    ts->frame_duration_us += (delta - ts->frame_duration_us) / 16;
+  }
+
+  expected = clock->last_out_pts + ts->frame_duration_us;
+  error = raw - expected;
+  if (llabs(error) > FFMPBR_TS_RESYNC_FRAMES * ts->frame_duration_us) {
+    ts->resyncs++;
+    return raw;
+  }
+
+  out = expected + error / 8;
+  ts->jitter_us += (llabs(raw - out) - ts->jitter_us) / 16;
+  return out;
+}
+
+
+//
+//-- FFmpegBridgeTimestamps API
+//
+
+void ffmpbr_timestamps_init(FFmpegBridgeTimestamps *ts, int smooth_video,
+  int64_t nominal_frame_duration_us, int64_t lead_us) {
+  int i;
+
+  memset(ts, 0, sizeof(FFmpegBridgeTimestamps));
+  ts->smooth_video = smooth_video;
+  ts->frame_duration_us = nominal_frame_duration_us > 0 ? nominal_frame_duration_us : 33333;
+  ts->lead_us = lead_us;
+  for (i = 0; i < 2; ++i) {
+    ts->streams[i].last_out_pts = INT64_MIN;
+  }
+}
+
+int64_t ffmpbr_timestamps_next(FFmpegBridgeTimestamps *ts, int stream, int64_t pts,
+  int64_t arrival_us) {
+  FFmpegBridgeStreamClock *clock = &ts->streams[stream];
+  FFmpegBridgeStreamClock *other = &ts->streams[!stream];
+  int64_t elapsed_us, rebased, out;
+
+  if (!ts->started) {
+    ts->first_arrival_us = arrival_us;
+    ts->started = 1;
+  }
+  elapsed_us = arrival_us - ts->first_arrival_us;
+
+  if (!clock->started) {
+    // place the stream by its pts if both streams seem to share a clock
+    // (as they do when both come from System.nanoTime()), otherwise by
+    // when it arrived
+    clock->offset = ts->lead_us + elapsed_us - pts;
+    if (other->started &&
+      llabs((pts + other->offset) - (ts->lead_us + elapsed_us)) < FFMPBR_TS_SAME_CLOCK_US) {
+      clock->offset = other->offset;
+    }
+    clock->window_start_us = arrival_us;
+    clock->window_max_skew_us = INT64_MIN;
+    clock->started = 1;
+  }
+
+  rebased = pts + clock->offset;
+  _ts_track_skew(clock, rebased - (ts->lead_us + elapsed_us), arrival_us);
+
+  if (stream == FFMPBR_TS_VIDEO) {
+    _ts_update_drift(ts, arrival_us);
+    out = rebased + ts->correction_us;
+    if (ts->smooth_video) {
+      out = _ts_smooth_video(ts, clock, out);
+    }
+  } else {
+    out = rebased;
+  }
+  clock->last_raw_pts = rebased + (stream == FFMPBR_TS_VIDEO ? ts->correction_us : 0);
+
+  // reordered (B-frame) video is kept in order by its dts instead
+  if ((stream == FFMPBR_TS_AUDIO || ts->smooth_video) && out <= clock->last_out_pts) {
+    out = clock->last_out_pts + 1;
+    ts->monotonic_fixes++;
+  }
+  clock->last_out_pts = out;
+
+  return out;
+}
+
+void ffmpbr_timestamps_get_stats(FFmpegBridgeTimestamps *ts, FFmpegBridgeTimestampStats *stats) {
+  stats->drift_us = ts->drift_us;
+  stats->correction_us = ts->correction_us;
+  stats->video_jitter_us = ts->jitter_us;
+  stats->monotonic_fixes = ts->monotonic_fixes;
+  stats->resyncs = ts->resyncs;
+}
+
+
+//
+//-- FFmpegBridgeDtsGenerator API
+//
+
+void ffmpbr_dts_init(FFmpegBridgeDtsGenerator *gen, int depth, int64_t frame_duration) {
+  memset(gen, 0, sizeof(FFmpegBridgeDtsGenerator));
+  if (depth < 0) depth = 0;
+  if (depth > FFMPBR_MAX_REORDER_DEPTH) {
+    LOGE("ERROR: ffmpbr_dts_init -- reorder depth %d is more than %d", depth, FFMPBR_MAX_REORDER_DEPTH);
+    depth = FFMPBR_MAX_REORDER_DEPTH;
+  }
+  gen->depth = depth;
+  gen->frame_duration = frame_duration > 0 ? frame_duration : 1;
+}
+
+int64_t ffmpbr_dts_next(FFmpegBridgeDtsGenerator *gen, int64_t pts) {
+  int64_t dts, tmp;
+  int i;
+
+  if (!gen->depth) return pts;
+
+  // the first frames decode a frame duration apart, leading up to the
+  // first pts, so that there's room for depth frames to be reordered
+  if (!gen->started) {
+    for (i = 1; i <= gen->depth; ++i) {
+      gen->window[i] = pts - (gen->depth - i + 1) * gen->frame_duration;
+    }
+    gen->last_dts = gen->window[1] - 1;
+    gen->started = 1;
+  }
+
+  // with frames reordered by at most depth, the smallest pts in the window
+  // (which then drops out of it) is a valid dts for this frame
+  gen->window[0] = pts;
+  for (i = 0; i < gen->depth && gen->window[i] > gen->window[i + 1]; ++i) {
+    tmp = gen->window[i];
+    gen->window[i] = gen->window[i + 1];
+    gen->window[i + 1] = tmp;
+  }
+  dts = gen->window[0];
+
+  if (dts <= gen->last_dts) {
+    dts = gen->last_dts + 1;
+  }
+  if (dts > pts) {
+    LOGE("ERROR: ffmpbr_dts_next -- pts %lld reordered more than %d frames", pts, gen->depth);
+  }
+  gen->last_dts = dts;
+
+  return dts;
+}
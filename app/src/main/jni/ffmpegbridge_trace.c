@@ -0,0 +1,138 @@
+//
+// Optional begin/end trace sections, emitted to systrace/Perfetto through
+// ATrace and/or to a Chrome trace (JSON) file.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include "ffmpegbridge_trace.h"
+
+#ifdef FFMPBR_ENABLE_TRACE
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "ffmpegbridge_latency.h"
+#include "ffmpegbridge_log.h"
+
+volatile int ffmpbr_trace_enabled = 0;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_json = NULL;
+static int trace_json_events = 0;
+
+#ifdef __ANDROID__
+// ATrace_* only exists in libandroid from API 23, so look it up at runtime
+// and fall back to writing the ftrace marker directly on older devices
+static void (*atrace_begin_section)(const char *) = NULL;
+static void (*atrace_end_section)(void) = NULL;
+static int trace_marker_fd = -1;
+#endif
+
+//
+//-- helper functions
+//
+
+#ifdef __ANDROID__
+void _trace_init_atrace() {
+  void *libandroid;
+
+  if (atrace_begin_section || trace_marker_fd >= 0) return;
+
+  libandroid = dlopen("libandroid.so", RTLD_NOW | RTLD_LOCAL);
+  if (libandroid) {
+    atrace_begin_section = dlsym(libandroid, "ATrace_beginSection");
+    atrace_end_section = dlsym(libandroid, "ATrace_endSection");
+  }
+  if (!atrace_begin_section || !atrace_end_section) {
+    atrace_begin_section = NULL;
+    atrace_end_section = NULL;
+    trace_marker_fd = open("/sys/kernel/debug/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+    if (trace_marker_fd < 0) {
+      LOGE("_trace_init_atrace -- no ATrace and no trace_marker, systrace output disabled");
+    }
+  }
+}
+
+void _trace_atrace(const char *name, int is_begin) {
+  char buf[128];
+  int len;
+
+  if (atrace_begin_section) {
+    if (is_begin) atrace_begin_section(name);
+    else atrace_end_section();
+  } else if (trace_marker_fd >= 0) {
+    if (is_begin) len = snprintf(buf, sizeof(buf), "B|%d|%s", getpid(), name);
+    else len = snprintf(buf, sizeof(buf), "E");
+    write(trace_marker_fd, buf, len);
+  }
+}
+#endif
+
+void _trace_json_event(const char *name, char phase) {
+  int64_t ts = ffmpbr_now_us();
+
+  pthread_mutex_lock(&trace_lock);
+  if (trace_json) {
+    fprintf(trace_json, "%s{\"name\":\"%s\",\"cat\":\"ffmpegbridge\",\"ph\":\"%c\","
+      "\"ts\":%lld,\"pid\":%d,\"tid\":%d}\n",
+      trace_json_events++ ? "," : "", name, phase,
+      (long long)ts, (int)getpid(), (int)syscall(SYS_gettid));
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+
+//
+//-- tracing API
+//
+
+void ffmpbr_trace_enable(int enabled, const char *json_path) {
+  pthread_mutex_lock(&trace_lock);
+
+  // always finish the previous file, so that it's valid JSON
+  if (trace_json) {
+    fprintf(trace_json, "]\n");
+    fclose(trace_json);
+    trace_json = NULL;
+  }
+
+  if (enabled && json_path) {
+    trace_json = fopen(json_path, "w");
+    if (trace_json) {
+      fprintf(trace_json, "[\n");
+      trace_json_events = 0;
+    } else {
+      LOGE("ffmpbr_trace_enable -- could not open trace file %s", json_path);
+    }
+  }
+#ifdef __ANDROID__
+  if (enabled) _trace_init_atrace();
+#endif
+
+  ffmpbr_trace_enabled = enabled;
+  pthread_mutex_unlock(&trace_lock);
+
+  LOGI("tracing %s", enabled ? "enabled" : "disabled");
+}
+
+void ffmpbr_trace_begin(const char *name) {
+#ifdef __ANDROID__
+  _trace_atrace(name, 1);
+#endif
+  _trace_json_event(name, 'B');
+}
+
+void ffmpbr_trace_end(const char *name) {
+#ifdef __ANDROID__
+  _trace_atrace(name, 0);
+#endif
+  _trace_json_event(name, 'E');
+}
+
+#endif
@@ -0,0 +1,139 @@
+//
+// MPEG-TS over UDP, see ffmpegbridge_udp.h.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <string.h>
+
+#include "libavutil/common.h"
+
+#include "ffmpegbridge_log.h"
+#include "ffmpegbridge_udp.h"
+
+#define FFMPBR_UDP_PAT_PID 0x0000
+
+//
+//-- helper functions
+//
+
+int _udp_pid(const uint8_t *packet) {
+  return (packet[1] & 0x1f) << 8 | packet[2];
+}
+
+// the PID of the first program's PMT, from a packet starting a PAT
+// section, or -1
+int _udp_parse_pat(const uint8_t *packet) {
+  const uint8_t *p = packet + 4, *end = packet + FFMPBR_UDP_TS_PACKET_SIZE, *section_end;
+  int section_length;
+
+  if (!(packet[1] & 0x40)) return -1;
+  if (packet[3] & 0x20) p += 1 + p[0];
+  if (p >= end) return -1;
+  p += 1 + p[0];
+  if (p + 8 > end || p[0] != 0x00) return -1;
+
+  // table_id, section_length, transport_stream_id, version, section numbers,
+  // then program_number/PID pairs up to the CRC
+  section_length = (p[1] & 0x0f) << 8 | p[2];
+  section_end = FFMIN(p + 3 + section_length - 4, end);
+  for (p += 8; p + 4 <= section_end; p += 4) {
+    // (program 0 is the network PID)
+    if (p[0] || p[1]) return (p[2] & 0x1f) << 8 | p[3];
+  }
+  return -1;
+}
+
+int _udp_send_datagram(FFmpegBridgeUdp *udp) {
+  int rc;
+
+  if (!udp->datagram_size) return 0;
+  rc = udp->send(udp->opaque, udp->datagram, udp->datagram_size);
+  udp->datagram_size = 0;
+  if (rc < 0) return rc;
+  udp->stats.datagrams++;
+  return 0;
+}
+
+int _udp_add(FFmpegBridgeUdp *udp, const uint8_t *packet) {
+  memcpy(udp->datagram + udp->datagram_size, packet, FFMPBR_UDP_TS_PACKET_SIZE);
+  udp->datagram_size += FFMPBR_UDP_TS_PACKET_SIZE;
+  return udp->datagram_size == FFMPBR_UDP_DATAGRAM_SIZE ? _udp_send_datagram(udp) : 0;
+}
+
+// a whole TS packet from the muxer
+int _udp_packet(FFmpegBridgeUdp *udp, const uint8_t *packet) {
+  int pid = _udp_pid(packet), pmt_pid, i, rc;
+
+  // the last datagram's table packets lead this one, so a duplicate always
+  // comes straight after its original on that PID
+  if (!udp->datagram_size) {
+    for (i = 0; i < udp->duplicate_count; ++i) {
+      rc = _udp_add(udp, udp->duplicates[i]);
+      if (rc < 0) return rc;
+    }
+    udp->stats.duplicate_tables += udp->duplicate_count;
+    udp->duplicate_count = 0;
+  }
+
+  if (pid == FFMPBR_UDP_PAT_PID) {
+    pmt_pid = _udp_parse_pat(packet);
+    if (pmt_pid >= 0 && pmt_pid != udp->pmt_pid) {
+      LOGI("MPEG-TS over UDP: PMT on PID 0x%04x", pmt_pid);
+      udp->pmt_pid = pmt_pid;
+    }
+  }
+  if (udp->duplicate_tables && (pid == FFMPBR_UDP_PAT_PID || pid == udp->pmt_pid)) {
+    // a newer version of a table in the same datagram takes the older
+    // one's place, which would be out of order after it
+    for (i = 0; i < udp->duplicate_count && _udp_pid(udp->duplicates[i]) != pid; ++i);
+    if (i < FFMPBR_UDP_MAX_DUPLICATES) {
+      memcpy(udp->duplicates[i], packet, FFMPBR_UDP_TS_PACKET_SIZE);
+      if (i == udp->duplicate_count) udp->duplicate_count++;
+    }
+  }
+  return _udp_add(udp, packet);
+}
+
+
+//
+//-- FFmpegBridgeUdp API
+//
+
+void ffmpbr_udp_init(FFmpegBridgeUdp *udp, int duplicate_tables, FFmpegBridgeUdpSend send,
+  void *opaque) {
+  memset(udp, 0, sizeof(FFmpegBridgeUdp));
+  udp->duplicate_tables = duplicate_tables;
+  udp->pmt_pid = -1;
+  udp->send = send;
+  udp->opaque = opaque;
+}
+
+int ffmpbr_udp_write(FFmpegBridgeUdp *udp, const uint8_t *buf, int size) {
+  const uint8_t *end = buf + size;
+  int n, rc;
+
+  while (buf < end) {
+    if (udp->packet_size || end - buf < FFMPBR_UDP_TS_PACKET_SIZE) {
+      n = FFMIN(FFMPBR_UDP_TS_PACKET_SIZE - udp->packet_size, end - buf);
+      memcpy(udp->packet + udp->packet_size, buf, n);
+      udp->packet_size += n;
+      buf += n;
+      if (udp->packet_size < FFMPBR_UDP_TS_PACKET_SIZE) break;
+      udp->packet_size = 0;
+      rc = _udp_packet(udp, udp->packet);
+    } else {
+      rc = _udp_packet(udp, buf);
+      buf += FFMPBR_UDP_TS_PACKET_SIZE;
+    }
+    if (rc < 0) return rc;
+  }
+
+  // (short, rather than holding the end of this media packet back)
+  rc = _udp_send_datagram(udp);
+  return rc < 0 ? rc : size;
+}
+
+int ffmpbr_udp_pending(FFmpegBridgeUdp *udp) {
+  return udp->packet_size;
+}
@@ -34,27 +34,155 @@ JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_setVideoCodecExtra
 /*
  * Class:     io_cine_ffmpegbridge_FFmpegBridge
  * Method:    writeHeader
- * Signature: ()V
+ * Signature: ()I
  */
-JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_writeHeader
+JNIEXPORT jint JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_writeHeader
   (JNIEnv *, jobject);
 
 /*
  * Class:     io_cine_ffmpegbridge_FFmpegBridge
  * Method:    writePacket
- * Signature: (Ljava/nio/ByteBuffer;ILII)V
+ * Signature: (Ljava/nio/ByteBuffer;IJII)I
  */
-JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_writePacket
+JNIEXPORT jint JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_writePacket
 (JNIEnv *, jobject, jobject, jint, jlong, jint, jint);
 
 /*
  * Class:     io_cine_ffmpegbridge_FFmpegBridge
- * Method:    finalize
- * Signature: ()V
+ * Method:    getLatencyStats
+ * Signature: (Lio/cine/ffmpegbridge/FFmpegBridge/LatencyStats;)V
  */
-JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_finalize
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getLatencyStats
+  (JNIEnv *, jobject, jobject);
+
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    getNalFilterStats
+ * Signature: (Lio/cine/ffmpegbridge/FFmpegBridge/NalFilterStats;)V
+ */
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getNalFilterStats
+  (JNIEnv *, jobject, jobject);
+
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    getTimestampStats
+ * Signature: (Lio/cine/ffmpegbridge/FFmpegBridge/TimestampStats;)V
+ */
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getTimestampStats
+  (JNIEnv *, jobject, jobject);
+
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    getSegmentStats
+ * Signature: (Lio/cine/ffmpegbridge/FFmpegBridge/SegmentStats;)V
+ */
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getSegmentStats
+  (JNIEnv *, jobject, jobject);
+
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    getHlsStats
+ * Signature: (Lio/cine/ffmpegbridge/FFmpegBridge/HlsStats;)V
+ */
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getHlsStats
+  (JNIEnv *, jobject, jobject);
+
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    saveDvr
+ * Signature: (Ljava/lang/String;)I
+ */
+JNIEXPORT jint JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_saveDvr
+  (JNIEnv *, jobject, jstring);
+
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    getDvrStats
+ * Signature: (Lio/cine/ffmpegbridge/FFmpegBridge/DvrStats;)V
+ */
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getDvrStats
+  (JNIEnv *, jobject, jobject);
+
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    getSendStats
+ * Signature: (Lio/cine/ffmpegbridge/FFmpegBridge/SendStats;)V
+ */
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getSendStats
+  (JNIEnv *, jobject, jobject);
+
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    getFailoverStats
+ * Signature: (Lio/cine/ffmpegbridge/FFmpegBridge/FailoverStats;)V
+ */
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getFailoverStats
+  (JNIEnv *, jobject, jobject);
+
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    getKeyframeStats
+ * Signature: (Lio/cine/ffmpegbridge/FFmpegBridge/KeyframeStats;)V
+ */
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getKeyframeStats
+  (JNIEnv *, jobject, jobject);
+
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    probeBandwidth
+ * Signature: (ILio/cine/ffmpegbridge/FFmpegBridge/ProbeResult;)I
+ */
+JNIEXPORT jint JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_probeBandwidth
+  (JNIEnv *, jobject, jint, jobject);
+
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    setTracing
+ * Signature: (ZLjava/lang/String;)V
+ */
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_setTracing
+  (JNIEnv *, jobject, jboolean, jstring);
+
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    setSharedIoThreads
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_setSharedIoThreads
+  (JNIEnv *, jclass, jint);
+
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    setConnectionPoolGrace
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_setConnectionPoolGrace
+  (JNIEnv *, jclass, jint);
+
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    getConnectionPoolStats
+ * Signature: (Lio/cine/ffmpegbridge/FFmpegBridge/ConnectionPoolStats;)V
+ */
+JNIEXPORT void JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_getConnectionPoolStats
+  (JNIEnv *, jclass, jobject);
+
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    finalizeSync
+ * Signature: ()I
+ */
+JNIEXPORT jint JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_finalizeSync
   (JNIEnv *, jobject);
 
+/*
+ * Class:     io_cine_ffmpegbridge_FFmpegBridge
+ * Method:    finalizeAsync
+ * Signature: (IZ)I
+ */
+JNIEXPORT jint JNICALL Java_io_cine_ffmpegbridge_FFmpegBridge_finalizeAsync
+  (JNIEnv *, jobject, jint, jboolean);
+
 #ifdef __cplusplus
 }
 #endif
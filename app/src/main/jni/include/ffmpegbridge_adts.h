@@ -0,0 +1,34 @@
+//
+// AAC ADTS header parsing, for configuring the audio stream from the
+// bitstream itself.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_ADTS_H
+#define FFMPEGBRIDGE_ADTS_H
+
+#include <stdint.h>
+
+#define FFMPBR_ADTS_HEADER_SIZE 7
+
+typedef struct
+{
+  int object_type;        // e.g. 2 for AAC LC
+  int sample_rate_index;
+  int sample_rate;
+  int channel_config;
+  int header_size;        // 7, or 9 with a CRC
+  int frame_length;       // including the header
+} FFmpegBridgeAdts;
+
+// returns <0 if data doesn't start with a valid ADTS header
+int ffmpbr_adts_parse(const uint8_t *data, int size, FFmpegBridgeAdts *adts);
+
+// the 2 byte AudioSpecificConfig matching an ADTS header
+void ffmpbr_adts_audio_specific_config(FFmpegBridgeAdts *adts, uint8_t config[2]);
+
+// the sample rate index for sample_rate, or <0 if it has none
+int ffmpbr_adts_sample_rate_index(int sample_rate);
+
+#endif
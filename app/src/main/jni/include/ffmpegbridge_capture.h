@@ -0,0 +1,98 @@
+//
+// Session capture: an append-only binary record of everything that was fed
+// into the bridge, which can be replayed later to reproduce a session.
+//
+// File layout: the 8 byte magic "FBRCAP01", followed by records of
+//
+//   u8  type            FFMPBR_CAPTURE_*
+//   u8  flags           FFMPBR_CAPTURE_FLAG_*
+//   u16 reserved
+//   u32 size            payload size
+//   i64 pts             device pts (microseconds)
+//   i64 arrival_us      monotonic time the bridge received it
+//   u8  payload[size]
+//
+// All integers are little-endian.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_CAPTURE_H
+#define FFMPEGBRIDGE_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define FFMPBR_CAPTURE_MAGIC "FBRCAP01"
+#define FFMPBR_CAPTURE_MAGIC_SIZE 8
+#define FFMPBR_CAPTURE_RECORD_HEADER_SIZE 24
+
+// record types
+#define FFMPBR_CAPTURE_CONFIG 1
+#define FFMPBR_CAPTURE_AUDIO_EXTRADATA 2
+#define FFMPBR_CAPTURE_VIDEO_EXTRADATA 3
+#define FFMPBR_CAPTURE_HEADER 4
+#define FFMPBR_CAPTURE_PACKET 5
+
+// record flags
+#define FFMPBR_CAPTURE_FLAG_VIDEO 0x01
+#define FFMPBR_CAPTURE_FLAG_KEYFRAME 0x02
+
+// the payload of a FFMPBR_CAPTURE_CONFIG record: seven i32s followed by the
+// nul-terminated output format name
+#define FFMPBR_CAPTURE_CONFIG_FIELDS 7
+
+typedef struct
+{
+  char output_fmt_name[32];
+  int video_width;
+  int video_height;
+  int video_fps;
+  int video_bit_rate;
+  int audio_sample_rate;
+  int audio_num_channels;
+  int audio_bit_rate;
+} FFmpegBridgeCaptureConfig;
+
+typedef struct
+{
+  int type;
+  int flags;
+  int64_t pts;
+  int64_t arrival_us;
+  uint8_t *data;
+  int size;
+} FFmpegBridgeCaptureRecord;
+
+typedef struct
+{
+  FILE *file;
+  int64_t bytes_written;
+} FFmpegBridgeCapture;
+
+typedef struct
+{
+  int fd;
+  uint8_t *base;
+  size_t size;
+  size_t pos;
+} FFmpegBridgeCaptureReader;
+
+// writing (from the bridge)
+FFmpegBridgeCapture* ffmpbr_capture_open(const char *path, FFmpegBridgeCaptureConfig *config);
+void ffmpbr_capture_write(FFmpegBridgeCapture *cap, int type, int flags, int64_t pts,
+  int64_t arrival_us, const uint8_t *data, int size);
+void ffmpbr_capture_close(FFmpegBridgeCapture *cap);
+
+// reading (from the replay tool). The capture is mapped copy-on-write, so
+// record data can be handed to the bridge as it is.
+int ffmpbr_capture_reader_open(FFmpegBridgeCaptureReader *reader, const char *path);
+int ffmpbr_capture_read_config(FFmpegBridgeCaptureRecord *record,
+  FFmpegBridgeCaptureConfig *config);
+// returns 1 if a record was read, 0 at the end of the capture, <0 if the
+// capture is truncated or corrupt
+int ffmpbr_capture_next(FFmpegBridgeCaptureReader *reader, FFmpegBridgeCaptureRecord *record);
+void ffmpbr_capture_reader_rewind(FFmpegBridgeCaptureReader *reader);
+void ffmpbr_capture_reader_close(FFmpegBridgeCaptureReader *reader);
+
+#endif
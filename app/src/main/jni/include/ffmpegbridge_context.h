@@ -4,8 +4,106 @@
 // Copyright (c) 2014, cine.io. All rights reserved.
 //
 
+#ifndef FFMPEGBRIDGE_CONTEXT_H
+#define FFMPEGBRIDGE_CONTEXT_H
+
 #include "libavcodec/avcodec.h"
 #include "libavformat/avformat.h"
+#include "ffmpegbridge_capture.h"
+#include "ffmpegbridge_dispatch.h"
+#include "ffmpegbridge_dvr.h"
+#include "ffmpegbridge_flv.h"
+#include "ffmpegbridge_gop.h"
+#include "ffmpegbridge_hls.h"
+#include "ffmpegbridge_io.h"
+#include "ffmpegbridge_latency.h"
+#include "ffmpegbridge_nal.h"
+#include "ffmpegbridge_reconnect.h"
+#include "ffmpegbridge_segment.h"
+#include "ffmpegbridge_timestamp.h"
+
+// output urls starting with this aren't opened; the output stays in memory
+// (see ffmpbr_set_hls_callback)
+#define FFMPBR_MEMORY_URL "mem:"
+
+// output_url and its backups (see ffmpbr_set_backup_urls)
+#define FFMPBR_MAX_INGEST_URLS 8
+
+// the GOP cache holds at most this many seconds at the configured bit rates
+#define FFMPBR_GOP_CACHE_SECONDS 10
+
+// what ffmpbr_write_packet (and ffmpbr_write_header) did
+#define FFMPBR_WRITE_OK 0             // muxed, and all of it handed to the sink
+#define FFMPBR_WRITE_QUEUED 1         // muxed, and waiting for the event loop to send it
+#define FFMPBR_WRITE_WOULD_BLOCK 2    // turned away, the output is backed up (see below)
+#define FFMPBR_WRITE_DROPPED 3        // not muxed: before the header, filtered out, or invalid
+#define FFMPBR_WRITE_DISCONNECTED 4   // the output has failed (and no backup url could be reached)
+
+// why the bridge asks for a keyframe (see ffmpbr_set_keyframe_callback)
+#define FFMPBR_KEYFRAME_FOR_START 1         // the header waits for an IDR (auto config)
+#define FFMPBR_KEYFRAME_FOR_BACKPRESSURE 2  // video was turned away, and there's room again
+#define FFMPBR_KEYFRAME_FOR_FAILOVER 3      // the ingest is down, and the next keyframe is needed to
+                                            // start the next one with (or to retry the urls)
+
+// asks the encoder for a keyframe, with one of the reasons above
+typedef void (*FFmpegBridgeKeyframeCallback)(void *opaque, int reason);
+
+typedef struct
+{
+  // the ingest in use: 0 for output_url, then the backups in order
+  int ingest_index;
+
+  // 1 from the ingest failing until the next one is under way, with
+  // packets dropped in between; they're tried again at every keyframe
+  // while none can be reached
+  int down;
+  int64_t dropped_packets;
+
+  int64_t failovers;
+  int64_t failed_attempts;
+  int64_t replayed_packets;
+
+  // the last failure: when it was noticed (ffmpbr_now_us), and how long it
+  // took from there to have the header and the GOP cache out on the next
+  // ingest; and the longest such switch
+  int64_t last_failure_us;
+  int64_t last_failover_us;
+  int64_t max_failover_us;
+} FFmpegBridgeFailoverStats;
+
+typedef struct
+{
+  // keyframes asked for, and requests held back for coming too soon after
+  // the last one
+  int64_t requests;
+  int64_t suppressed;
+
+  // how long it took from the first request to a keyframe coming in: the
+  // last time, and the longest
+  int64_t last_wait_us;
+  int64_t max_wait_us;
+} FFmpegBridgeKeyframeStats;
+
+typedef struct
+{
+  // 0, or the error the output failed with
+  int status;
+
+  // 1 if finalizing ran past the deadline, and 1 if the output still
+  // queued then was dropped for it (see ffmpbr_finalize_async)
+  int late;
+  int cut_off;
+
+  // bytes muxed that never reached the sink
+  int64_t unsent_bytes;
+
+  // from ffmpbr_finalize_async being called to everything being freed
+  int64_t duration_us;
+} FFmpegBridgeFinalizeResult;
+
+// the outcome of ffmpbr_finalize_async, on its background thread
+typedef void (*FFmpegBridgeFinalizeCallback)(void *opaque,
+  const FFmpegBridgeFinalizeResult *result);
 
 typedef struct
 {
@@ -14,6 +112,7 @@ typedef struct
   char *output_url;
   AVFormatContext *output_fmt_ctx;
   AVRational *device_time_base;
+  FFmpegBridgeIO *io;
 
   // for convenience
   int video_stream_index;
@@ -30,6 +129,28 @@ typedef struct
   int video_height;
   int video_fps;
   int video_bit_rate;
+  FFmpegBridgeDtsGenerator video_dts;
+
+  // 1 once the video extradata has been converted to avcC (or hvcC), after
+  // which Annex-B packets are converted to match
+  int video_avcc;
+
+  // where video packets are converted (or rewritten without the units the
+  // NAL filter drops), kept from one packet to the next; the caller's
+  // buffer is never written to
+  uint8_t *video_scratch;
+  unsigned int video_scratch_size;
+
+  // 1 if the video goes out through our own Enhanced RTMP flv muxer, as
+  // libavformat's can't carry the codec (see ffmpegbridge_flv.h)
+  int enhanced_flv;
+  FFmpegBridgeFlv flv;
+
+  // the SPS/PPS in the video extradata, and which NAL units to strip
+  // (FFMPBR_NAL_FILTER_*) before muxing
+  FFmpegBridgeParamSets video_param_sets;
+  int nal_filter;
+  FFmpegBridgeNalFilterStats nal_filter_stats;
 
   // audio config
   enum AVCodecID audio_codec_id;
@@ -37,6 +158,83 @@ typedef struct
   int audio_sample_rate;
   int audio_num_channels;
   int audio_bit_rate;
+
+  // > 0 to write mp4 as fragments of at most this many ms (see
+  // ffmpbr_set_mp4_fragmentation)
+  int mp4_fragment_ms;
+
+  // segmented recording (see ffmpbr_set_segmenting). output_fmt_ctx and io
+  // are always the current segment's; the segment thread builds new ones
+  // from segment_codecs, a copy of the streams' configuration.
+  int segment_ms;
+  FFmpegBridgeSegment *segment;
+  FFmpegBridgeSegmenter segmenter;
+  AVCodecContext *segment_codecs[FFMPBR_LATENCY_MAX_STREAMS];
+  int64_t segment_frames_base[FFMPBR_LATENCY_MAX_STREAMS];
+
+  // in-memory HLS output (see ffmpbr_set_hls_callback)
+  int hls_list_size;
+  FFmpegBridgeHlsCallback hls_callback;
+  void *hls_opaque;
+  FFmpegBridgeHls *hls;
+
+  // optional -- the last few seconds, for instant replay (see
+  // ffmpbr_set_dvr)
+  FFmpegBridgeDvr *dvr;
+
+  // for opening the output (see ffmpbr_set_output_option and
+  // ffmpbr_set_transport)
+  AVDictionary *output_options;
+  FFmpegBridgeTransport transport;
+
+  // backpressure (see ffmpbr_set_write_queue_limit): 1 from a video packet
+  // being turned away until a keyframe gets through
+  int video_blocked;
+
+  // keyframe requests (see ffmpbr_set_keyframe_callback): the reason for
+  // one to make once the packet is written, when the last one was made,
+  // and since when a keyframe has been waited for (0 if it isn't)
+  FFmpegBridgeKeyframeCallback keyframe_callback;
+  void *keyframe_opaque;
+  FFmpegBridgeDispatch *keyframe_dispatch;
+  int64_t keyframe_interval_us;
+  int keyframe_reason;
+  int64_t keyframe_requested_us;
+  int64_t keyframe_wanted_us;
+  FFmpegBridgeKeyframeStats keyframe_stats;
+
+  // ingest failover (see ffmpbr_set_backup_urls): output_url and its
+  // backups, the output options as they were before the protocol took its
+  // own out (each new connection gets a copy), the current GOP to start
+  // the next ingest with, and the thread that connects to it
+  char *ingest_urls[FFMPBR_MAX_INGEST_URLS];
+  int ingest_url_count;
+  AVDictionary *ingest_options;
+  FFmpegBridgeGop *gop;
+  FFmpegBridgeReconnect *reconnect;
+  FFmpegBridgeFailoverStats failover_stats;
+
+  // rebasing, smoothing and drift correction of the device timestamps
+  // (see ffmpbr_set_timestamp_normalization)
+  int normalize_timestamps;
+  FFmpegBridgeTimestamps timestamps;
+
+  // capture-to-send latency of the packets we've written
+  FFmpegBridgeLatency latency;
+
+  // optional -- a record of everything fed into the bridge, for replay
+  FFmpegBridgeCapture *capture;
+
+  // configuration picked up from the bitstream (see ffmpbr_set_auto_config)
+  int auto_config;
+  int header_written;
+  uint8_t *auto_sps;
+  int auto_sps_size;
+  uint8_t *auto_pps;
+  int auto_pps_size;
+  uint8_t auto_audio_config[8];
+  int auto_audio_config_size;
+  int64_t auto_dropped_packets;
 } FFmpegBridgeContext;
 
 
@@ -51,14 +249,198 @@ FFmpegBridgeContext* ffmpbr_init(
   int audio_num_channels,
   int audio_bit_rate);
 
+// start recording this session to capture_path, see ffmpegbridge_capture.h
+int ffmpbr_start_capture(FFmpegBridgeContext *br_ctx, const char *capture_path);
+
+// "h264" (the default) or "hevc". Has to be set before the extradata. HEVC
+// into flv is packaged as Enhanced RTMP.
+void ffmpbr_set_video_codec(FFmpegBridgeContext *br_ctx, const char *codec_name);
+
+// with auto config on, the extradata, video dimensions and keyframe flags
+// come from the packets themselves: SPS/PPS and IDR units in the video,
+// and ADTS headers (or MediaCodec's codec config buffer) in the audio.
+// Setting extradata and writing the header become optional; if they're
+// left out, packets are dropped until the first IDR, which the header is
+// written just ahead of. H.264 only: with any other video codec it's
+// refused (or turned off again, if the codec is set afterwards).
+void ffmpbr_set_auto_config(FFmpegBridgeContext *br_ctx, int enabled);
+
+// the number of frames the video encoder may reorder (i.e. B-frames), so
+// that decode timestamps can be derived from the pts. 0 (the default)
+// means no reordering, where dts = pts.
+void ffmpbr_set_video_reorder_depth(FFmpegBridgeContext *br_ctx, int depth);
+
+// with normalization on, both streams are rebased to start together at 0,
+// kept monotonic, and the video is smoothed (without B-frames) and slowly
+// slewed to follow the audio clock if the two drift apart. Otherwise the
+// device timestamps are muxed as they are.
+void ffmpbr_set_timestamp_normalization(FFmpegBridgeContext *br_ctx, int enabled);
+
+// flags is a combination of FFMPBR_NAL_FILTER_*. AUD and parameter set
+// removal only apply to formats that carry the parameter sets out of band
+// (i.e. once the video has been converted to AVCC); MPEG-TS needs both.
+void ffmpbr_set_nal_filter(FFmpegBridgeContext *br_ctx, int flags);
+
+// with fragment_ms > 0, mp4 (and the other mov based formats) is written
+// as an empty moov followed by moof/mdat fragments, cut at every keyframe
+// and at least every fragment_ms. The muxer then only holds on to the
+// current fragment's sample index, finalizing doesn't have to write out an
+// index of the whole recording, and a file cut short is still playable up
+// to its last complete fragment. 0 (the default) writes a single moov when
+// finalizing.
+void ffmpbr_set_mp4_fragmentation(FFmpegBridgeContext *br_ctx, int fragment_ms);
+
+// with segment_ms > 0, the recording is split into files of about
+// segment_ms each, every one starting at a keyframe and with timestamps
+// starting from 0 (except the first, which keeps the session's). output_url
+// becomes the pattern for their names: a printf style %d is replaced with
+// the segment number (rec-%03d.mp4), otherwise it goes ahead of the
+// extension (rec.mp4 becomes rec-000.mp4, rec-001.mp4, ...). A segment is
+// complete once ffmpbr_get_segment_stats counts it as closed. Local files
+// only, and not with Enhanced RTMP flv. Has to be set before the header.
+void ffmpbr_set_segmenting(FFmpegBridgeContext *br_ctx, int segment_ms);
+
+// for an output url of mem:<segment name pattern>, e.g. mem:seg-%d.ts,
+// with mpegts (HLS) or mp4 (CMAF) as the output format: nothing is opened,
+// and once segmenting is set up as well (see ffmpbr_set_segmenting) the
+// segments are collected in memory and handed to callback with a playlist
+// of the last list_size of them (see ffmpegbridge_hls.h). Has to be set
+// before ffmpbr_set_segmenting.
+void ffmpbr_set_hls_callback(FFmpegBridgeContext *br_ctx, int list_size,
+  FFmpegBridgeHlsCallback callback, void *opaque);
+
+// keeps the last duration_ms of packets in memory, in a slab sized from
+// the configured bit rates, so that ffmpbr_save_dvr can write them out
+// (see ffmpegbridge_dvr.h). 0 (the default) keeps nothing.
+void ffmpbr_set_dvr(FFmpegBridgeContext *br_ctx, int duration_ms);
+
+// saves the last duration_ms to path (mp4 or flv, going by the extension)
+// on a background thread, without holding up the live output; the save is
+// done once ffmpbr_get_dvr_stats stops reporting it as saving. <0 if it
+// couldn't be started, e.g. AVERROR(EBUSY) while an earlier one is running.
+int ffmpbr_save_dvr(FFmpegBridgeContext *br_ctx, const char *path);
+
+// options for the output's protocol and muxer, as they'd be given to the
+// ffmpeg command line (e.g. "rw_timeout", "flvflags" or "movflags"). The
+// protocol takes what it knows when the output is opened, the muxer what's
+// left, and the muxer's take precedence over the bridge's own settings;
+// anything neither knows is logged. Has to be set before the header.
+void ffmpbr_set_output_option(FFmpegBridgeContext *br_ctx, const char *key, const char *value);
+
+// RTMP chunk size and socket options for rtmp and tcp outputs, see
+// FFmpegBridgeTransport (its pacing settings are ignored, see
+// ffmpbr_set_pacing). Has to be set before the header.
+void ffmpbr_set_transport(FFmpegBridgeContext *br_ctx, const FFmpegBridgeTransport *transport);
+
+// with rate_percent > 0, the output goes out at no more than rate_percent
+// of the configured video + audio bit rate, with bursts of up to burst_ms
+// at that rate after a quiet spell, so that keyframes are spread out rather
+// than sent in one go (see ffmpegbridge_pacer.h). Pacing happens after
+// muxing, so audio queues behind a keyframe being paced; the headroom above
+// 100% is what keeps that short: a keyframe of k bytes holds the audio up
+// by at most about (k - burst) / rate. 0 (the default) sends everything as
+// soon as it's muxed. Has to be set before the header.
+void ffmpbr_set_pacing(FFmpegBridgeContext *br_ctx, int rate_percent, int burst_ms);
+
+// with limit_ms > 0, writing a packet never waits for the output: it's
+// muxed and queued for the event loop (which is started for it in inline
+// mode), and while more than limit_ms worth at the configured bit rates is
+// queued, packets are turned away unmuxed with FFMPBR_WRITE_WOULD_BLOCK.
+// Once a video packet is, so is the rest of its GOP, up to the next
+// keyframe that fits, which the bridge asks for (see
+// ffmpbr_set_keyframe_callback) as soon as there's room for one. With
+// pacing, leave room for a keyframe being paced out. 0 (the default)
+// queues without limit in event loop mode, and writes inline otherwise.
+// Has to be set before the header.
+void ffmpbr_set_write_queue_limit(FFmpegBridgeContext *br_ctx, int limit_ms);
+
+// with block_kb > 0, a local file output (and every segment of a
+// segmented recording) is written in blocks of block_kb from a thread of
+// its own, which preallocates preallocate_mb at a time ahead of the writes
+// (0 not to) and fdatasync()s every sync_ms (0 to leave it to the kernel),
+// so that neither the filesystem nor syncing holds up writing packets (see
+// ffmpegbridge_file.h). Up to FFMPBR_FILE_BLOCKS blocks are buffered. 0
+// (the default) writes inline, or from the event loop. Has to be set
+// before the header.
+void ffmpbr_set_file_output(FFmpegBridgeContext *br_ctx, int block_kb, int preallocate_mb,
+  int sync_ms);
+
+// callback is called for a keyframe whenever the bridge would otherwise
+// have to wait for the encoder's next scheduled one: before the header
+// with auto config, after video was turned away for backpressure, and
+// while no ingest can be reached. It's posted once the packet that
+// prompted it is written, and called on the dispatch thread (see
+// ffmpegbridge_dispatch.h), so that the thread writing never waits on it;
+// at most once every min_interval_ms, requests in between are only
+// counted. NULL (the default) asks for none.
+void ffmpbr_set_keyframe_callback(FFmpegBridgeContext *br_ctx, int min_interval_ms,
+  FFmpegBridgeKeyframeCallback callback, void *opaque);
+
+// urls to fall back on, in order, when the output (the ingest) fails: the
+// bridge reconnects to the next one that works (going back to output_url
+// after the last) with the same output options and transport settings, and
+// sends the header and the packets since the last keyframe again, so that
+// the encoder carries on undisturbed. The new connection is made on a
+// thread of the session's own (see ffmpegbridge_reconnect.h), so the
+// thread writing isn't held up by it; a failed write through a dead
+// connection is noticed quickly, but a stalled one only after the
+// protocol's own timeout (e.g. the rw_timeout output option). Packets are
+// dropped until the new connection is made, and if the GOP cache has no
+// keyframe by then (it outgrew FFMPBR_GOP_CACHE_SECONDS), until the next
+// keyframe, which is asked for. If none of the urls can be reached,
+// they're tried again at every keyframe. Live
+// outputs only, not with segmenting or in-memory output. Has to be set
+// before the header.
+void ffmpbr_set_backup_urls(FFmpegBridgeContext *br_ctx, const char **urls, int count);
+
+// measures the connection for duration_ms, before anything is sent, with
+// padding the server ignores (see ffmpegbridge_probe.h), and recommends a
+// video bit rate to start the encoder at: what's left of about 3/4 of the
+// measured throughput after the audio, at most the configured video bit
+// rate. Opens the output, which stays open for the stream, so transport
+// and output options have to be set before it. rtmp, and mpegts over tcp,
+// only; AVERROR(ENOSYS) otherwise.
+int ffmpbr_probe_bandwidth(FFmpegBridgeContext *br_ctx, int duration_ms,
+  FFmpegBridgeProbeResult *result);
+
 void ffmpbr_set_audio_codec_extradata(FFmpegBridgeContext *br_ctx, const int8_t *codec_extradata,
   int codec_extradata_size);
 void ffmpbr_set_video_codec_extradata(FFmpegBridgeContext *br_ctx, const int8_t *codec_extradata,
   int codec_extradata_size);
 
-void ffmpbr_write_header(FFmpegBridgeContext *br_ctx);
+// FFMPBR_WRITE_OK (or QUEUED) once the header is written, QUEUED if it
+// waits for the first IDR (see ffmpbr_set_auto_config), or DISCONNECTED if
+// the output couldn't be opened or written to
+int ffmpbr_write_header(FFmpegBridgeContext *br_ctx);
+
+// returns an FFMPBR_WRITE_* status
+int ffmpbr_write_packet(FFmpegBridgeContext *br_ctx, uint8_t *data, int data_size, long pts,
+    int is_video, int is_video_keyframe, int64_t arrival_us);
+
+void ffmpbr_get_latency_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeLatencyStats *stats);
+void ffmpbr_get_nal_filter_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeNalFilterStats *stats);
+void ffmpbr_get_timestamp_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeTimestampStats *stats);
+void ffmpbr_get_segment_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeSegmentStats *stats);
+void ffmpbr_get_hls_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeHlsStats *stats);
+void ffmpbr_get_dvr_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeDvrStats *stats);
+void ffmpbr_get_send_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeSendStats *stats);
+void ffmpbr_get_failover_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeFailoverStats *stats);
+void ffmpbr_get_keyframe_stats(FFmpegBridgeContext *br_ctx, FFmpegBridgeKeyframeStats *stats);
+
+// writes out the trailer, closes the output and frees br_ctx; 0, or the
+// error the output failed with (AVERROR(EINVAL) without a br_ctx)
+int ffmpbr_finalize(FFmpegBridgeContext *br_ctx);
 
-void ffmpbr_write_packet(FFmpegBridgeContext *br_ctx, uint8_t *data, int data_size, long pts,
-    int is_video, int is_video_keyframe);
+// ffmpbr_finalize on a background thread, so that the caller isn't held up
+// while the output drains. Queued output gets until deadline_ms from now
+// to reach the sink; with cut_off, whatever is left then is dropped and
+// the output closed (see ffmpbr_io_set_deadline), otherwise finalizing
+// carries on and is only reported as late. callback gets the outcome once
+// everything is freed. br_ctx can't be used after this call. <0 if the
+// thread couldn't be started, in which case it's all done on the caller's
+// thread instead, callback included; AVERROR(EINVAL) without a br_ctx, in
+// which case there's nothing to do and callback is never called.
+int ffmpbr_finalize_async(FFmpegBridgeContext *br_ctx, int deadline_ms, int cut_off,
+  FFmpegBridgeFinalizeCallback callback, void *opaque);
 
-void ffmpbr_finalize(FFmpegBridgeContext *br_ctx);
+#endif
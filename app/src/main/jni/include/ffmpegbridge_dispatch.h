@@ -0,0 +1,68 @@
+//
+// A thread for calls out of the bridge that shouldn't hold up the thread
+// writing packets. Asking the encoder for a keyframe is a call into Java,
+// which takes as long as the app's listener does, and may block on a lock
+// the app holds elsewhere.
+//
+// Calls run one at a time, in the order they were posted, on a single
+// thread shared by every session in the process, which is started for the
+// first session that needs it and stopped after the last. Each call is
+// posted on behalf of an owner (the session), which forgets its calls
+// before it goes away.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_DISPATCH_H
+#define FFMPEGBRIDGE_DISPATCH_H
+
+#include <pthread.h>
+
+// calls that can wait to run at once; posting more fails
+#define FFMPBR_DISPATCH_QUEUE_SIZE 32
+
+typedef void (*FFmpegBridgeDispatchFunc)(void *opaque, int arg);
+
+typedef struct
+{
+  // NULL once the owner has forgotten it
+  void *owner;
+  FFmpegBridgeDispatchFunc func;
+  void *opaque;
+  int arg;
+} FFmpegBridgeDispatchCall;
+
+typedef struct
+{
+  pthread_t thread;
+  int refs;
+
+  // guards everything below; the queued calls run from calls[head] on,
+  // and running is the owner of the call under way, if any
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  FFmpegBridgeDispatchCall calls[FFMPBR_DISPATCH_QUEUE_SIZE];
+  int head;
+  int count;
+  void *running;
+  int stopping;
+
+  // stopped from one of its own calls, so the thread frees it as it exits
+  int detached;
+} FFmpegBridgeDispatch;
+
+// returns the shared dispatch thread, starting it if necessary
+FFmpegBridgeDispatch* ffmpbr_dispatch_acquire(void);
+void ffmpbr_dispatch_release(FFmpegBridgeDispatch *dispatch);
+
+// queues func(opaque, arg) on behalf of owner; 0, or AVERROR(EAGAIN) if
+// the queue is full
+int ffmpbr_dispatch_post(FFmpegBridgeDispatch *dispatch, void *owner,
+  FFmpegBridgeDispatchFunc func, void *opaque, int arg);
+
+// drops owner's queued calls, and waits for one under way to return
+// (unless that's the caller)
+void ffmpbr_dispatch_forget(FFmpegBridgeDispatch *dispatch, void *owner);
+
+#endif
@@ -0,0 +1,120 @@
+//
+// Instant replay: the last few seconds of encoded packets, kept in memory
+// alongside the live output and saved to an mp4 or flv file on demand.
+//
+// Packets are copied into a single slab allocated up front (sized from the
+// configured bit rates), and indexed in a table allocated alongside it, so
+// recording never allocates. The oldest packets are dropped a whole GOP at
+// a time, so that the ring always starts at a keyframe.
+//
+// A save muxes straight out of the slab on a background thread. While it
+// runs the packets it has yet to write are pinned: the ring grows into the
+// slab's headroom instead of dropping them, and if even that runs out it
+// stops recording until the save is done and starts over at the next
+// keyframe. The live output is never held up either way.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_DVR_H
+#define FFMPEGBRIDGE_DVR_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+
+#define FFMPBR_DVR_MAX_STREAMS 2
+#define FFMPBR_DVR_MAX_PATH 1024
+
+typedef struct
+{
+  int offset;
+  int size;
+  int64_t pts;
+  int64_t dts;
+  uint8_t stream_index;
+  uint8_t keyframe;
+} FFmpegBridgeDvrPacket;
+
+typedef struct
+{
+  int64_t slab_bytes;
+  int64_t buffered_bytes;
+  int64_t buffered_us;
+
+  // packets dropped from the ring before they were duration_ms old, for
+  // lack of room in the slab, and ones not recorded at all because a save
+  // had the slab pinned
+  int64_t early_drops;
+  int64_t pinned_drops;
+
+  int64_t saves;
+  int64_t failed_saves;
+  int saving;
+
+  // the last completed save: media duration, size and time taken
+  int64_t last_save_media_us;
+  int64_t last_save_bytes;
+  int64_t last_save_us;
+} FFmpegBridgeDvrStats;
+
+typedef struct
+{
+  int64_t duration_us;
+
+  // packet data, written at head and wrapping back to 0 when a packet
+  // doesn't fit before the end
+  uint8_t *slab;
+  int slab_size;
+  int head;
+
+  // packet sequence numbers first_seq up to next_seq are in the ring, at
+  // packets[seq % max_packets]; keys holds the keyframes among them
+  FFmpegBridgeDvrPacket *packets;
+  int max_packets;
+  int64_t first_seq;
+  int64_t next_seq;
+  int64_t *keys;
+  int key_first;
+  int key_count;
+  int64_t buffered_bytes;
+
+  // 1 after packets went unrecorded, until the ring restarts at a keyframe
+  int resync;
+
+  // guards the ring against the save thread, which reads packets from
+  // pin_seq up to save_end_seq out of the slab without holding it
+  pthread_mutex_t lock;
+  pthread_t save_thread;
+  int save_started;
+  int64_t pin_seq;
+  int64_t save_end_seq;
+  AVFormatContext *save_fmt_ctx;
+  char save_path[FFMPBR_DVR_MAX_PATH];
+
+  FFmpegBridgeDvrStats stats;
+} FFmpegBridgeDvr;
+
+// sizes the slab for duration_ms at bit_rate (all streams together), with
+// headroom for encoder overshoot, the GOP trimming and saves in progress;
+// max_packet_rate is packets per second, all streams together
+int ffmpbr_dvr_init(FFmpegBridgeDvr *dvr, int duration_ms, int64_t bit_rate, int max_packet_rate);
+
+// copies a packet into the ring, timestamps in device time (microseconds)
+void ffmpbr_dvr_record(FFmpegBridgeDvr *dvr, int stream_index, const uint8_t *data, int size,
+  int64_t pts, int64_t dts, int keyframe);
+
+// starts saving what's in the ring to path (mp4 or flv, going by the
+// extension) on a background thread, with streams configured like codecs.
+// AVERROR(EBUSY) if a save is still running.
+int ffmpbr_dvr_save(FFmpegBridgeDvr *dvr, const char *path, AVCodecContext **codecs,
+  int nb_streams);
+
+// waits for a save in progress, then frees everything
+void ffmpbr_dvr_free(FFmpegBridgeDvr *dvr);
+
+void ffmpbr_dvr_get_stats(FFmpegBridgeDvr *dvr, FFmpegBridgeDvrStats *stats);
+
+#endif
@@ -0,0 +1,115 @@
+//
+// Local file output for long recordings. Writing the muxer's output
+// straight to the file, a flush at a time, leaves the write path at the
+// mercy of the filesystem: every so often a write() stalls for tens or
+// hundreds of milliseconds while the kernel allocates blocks or writes back
+// dirty pages, and fsync()ing to make the recording durable makes that
+// worse.
+//
+// Instead the output is copied into a ring of large blocks, and a thread of
+// the file's own writes each block out with one pwrite(). Blocks start at
+// multiples of the block size in the file (after a seek, the first block
+// only runs up to the next one), so every write covers whole pages. Ahead
+// of the writes, the thread reserves space in large extents with
+// fallocate(), and every sync interval it fdatasync()s what it's written.
+// The write path only waits if every block is still queued for the disk.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_FILE_H
+#define FFMPEGBRIDGE_FILE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// blocks in the ring, and what their size and the extents are rounded up to
+#define FFMPBR_FILE_BLOCKS 8
+#define FFMPBR_FILE_ALIGN 4096
+
+typedef struct
+{
+  int64_t blocks;
+  int64_t preallocated_bytes;
+
+  // writes that had to wait for a block to come free, and the longest wait
+  int64_t stalls;
+  int64_t max_stall_us;
+
+  // on the file's thread: the longest pwrite(), and the fdatasync()s
+  int64_t max_write_us;
+  int64_t syncs;
+  int64_t max_sync_us;
+} FFmpegBridgeFileStats;
+
+typedef struct
+{
+  uint8_t *data;
+  int64_t offset;
+  int size;
+} FFmpegBridgeFileBlock;
+
+typedef struct
+{
+  int fd;
+  int block_size;
+  int64_t extent_size;
+  int64_t sync_interval_us;
+
+  pthread_t thread;
+
+  // the write path fills blocks[fill] without the lock (filling once it's
+  // taken the block, which it only does when it's no longer queued), and
+  // takes the lock to queue it behind the others
+  uint8_t *memory;
+  FFmpegBridgeFileBlock blocks[FFMPBR_FILE_BLOCKS];
+  int fill;
+  int filling;
+  int64_t fill_start_us;
+
+  // where the next byte goes, and the end of the furthest byte written
+  int64_t position;
+  int64_t size;
+
+  // guards everything below; the queued blocks run from blocks[head] up
+  // to the one being filled
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  int head;
+  int queued;
+  int stopping;
+  int error;
+
+  // owned by the file's thread
+  int64_t allocated;
+  int64_t last_sync_us;
+  int unsynced;
+
+  FFmpegBridgeFileStats stats;
+} FFmpegBridgeFile;
+
+// takes over fd, a file opened for writing. block_size and extent_size
+// are in bytes (extent_size 0 not to preallocate), and sync_interval_us 0
+// never to sync (the kernel writes back in its own time).
+int ffmpbr_file_start(FFmpegBridgeFile *file, int fd, int block_size, int64_t extent_size,
+  int64_t sync_interval_us);
+
+// copies buf into the ring; size on success, or the AVERROR a write on the
+// file's thread failed with
+int ffmpbr_file_write(FFmpegBridgeFile *file, const uint8_t *buf, int size);
+
+// as lseek(), plus AVSEEK_SIZE
+int64_t ffmpbr_file_seek(FFmpegBridgeFile *file, int64_t offset, int whence);
+
+// queues what's in the ring so far and waits for it to be written; 0, or
+// the AVERROR a write failed with
+int ffmpbr_file_flush(FFmpegBridgeFile *file);
+
+void ffmpbr_file_get_stats(FFmpegBridgeFile *file, FFmpegBridgeFileStats *stats);
+
+// flushes, syncs (with a sync interval), gives back the space preallocated
+// past the end, and closes the file; as ffmpbr_file_flush
+int ffmpbr_file_close(FFmpegBridgeFile *file);
+
+#endif
@@ -0,0 +1,56 @@
+//
+// A minimal FLV muxer for video codecs the bundled libavformat's flv muxer
+// doesn't know, packaged as Enhanced RTMP (v1) describes: video tags carry
+// an extended header with the codec's FourCC, instead of the legacy 4 bit
+// codec id. Audio is AAC, exactly as in legacy FLV.
+//
+// The output is a plain FLV byte stream, so it works for files, and for
+// rtmp urls through libavformat's rtmp protocol (which takes an FLV stream
+// and sends each tag as an RTMP message).
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_FLV_H
+#define FFMPEGBRIDGE_FLV_H
+
+#include <stdint.h>
+
+#include "libavformat/avformat.h"
+
+// Enhanced RTMP video FourCCs
+#define FFMPBR_FLV_FOURCC_HEVC MKBETAG('h', 'v', 'c', '1')
+
+typedef struct
+{
+  AVIOContext *pb;
+  uint32_t video_fourcc;
+
+  // added to every timestamp so that the first one is 0, as libavformat's
+  // flv muxer does
+  int started;
+  int64_t delay_ms;
+
+  int64_t last_dts;
+} FFmpegBridgeFlv;
+
+// 1 if the video codec needs this muxer to go into flv
+int ffmpbr_flv_needs_enhanced(enum AVCodecID video_codec_id);
+
+// writes the FLV header, onMetaData, and the video and audio sequence
+// headers from each stream's extradata (an HEVCDecoderConfigurationRecord
+// and an AudioSpecificConfig)
+int ffmpbr_flv_write_header(FFmpegBridgeFlv *flv, AVIOContext *pb, AVCodecContext *video,
+  AVCodecContext *audio, int video_fps);
+
+// data is a length prefixed access unit; timestamps are in milliseconds
+int ffmpbr_flv_write_video(FFmpegBridgeFlv *flv, const uint8_t *data, int size, int64_t dts,
+  int64_t pts, int keyframe);
+
+// data is a raw AAC frame (no ADTS header)
+int ffmpbr_flv_write_audio(FFmpegBridgeFlv *flv, const uint8_t *data, int size, int64_t pts);
+
+// ends the video sequence
+int ffmpbr_flv_write_trailer(FFmpegBridgeFlv *flv);
+
+#endif
@@ -0,0 +1,54 @@
+//
+// A copy of the current GOP: every packet since the last video keyframe,
+// already filtered for the muxer, so that a new output can be started
+// mid-stream (see ffmpbr_set_backup_urls) with something a player can
+// decode straight away, instead of waiting for the encoder's next keyframe.
+//
+// Packet data goes into one buffer that's reused from GOP to GOP, so after
+// the first few GOPs nothing is allocated. A GOP that outgrows max_bytes is
+// dropped, and the cache stays empty until the next keyframe.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_GOP_H
+#define FFMPEGBRIDGE_GOP_H
+
+#include <stdint.h>
+
+typedef struct
+{
+  int offset;
+  int size;
+  int64_t pts;
+  int64_t dts;
+  uint8_t stream_index;
+  uint8_t keyframe;
+} FFmpegBridgeGopPacket;
+
+typedef struct
+{
+  // packets[i]'s data is at data + packets[i].offset, until the next add
+  uint8_t *data;
+  unsigned int data_capacity;
+  int data_size;
+  int max_bytes;
+
+  FFmpegBridgeGopPacket *packets;
+  unsigned int packets_capacity;
+  int count;
+
+  // 1 from a video keyframe on, 0 while waiting for one
+  int valid;
+} FFmpegBridgeGop;
+
+void ffmpbr_gop_init(FFmpegBridgeGop *gop, int max_bytes);
+
+// copies a packet in, timestamps in device time (microseconds); a video
+// keyframe starts the GOP over
+void ffmpbr_gop_add(FFmpegBridgeGop *gop, int stream_index, const uint8_t *data, int size,
+  int64_t pts, int64_t dts, int is_video_keyframe);
+
+void ffmpbr_gop_free(FFmpegBridgeGop *gop);
+
+#endif
@@ -0,0 +1,111 @@
+//
+// In-memory HLS: the muxer's output (MPEG-TS, or fragmented mp4 for CMAF)
+// is cut into segments at keyframes, each segment collected in a memory
+// buffer, and handed over together with an updated media playlist. Nothing
+// touches the disk; what happens to the segments (upload, serving) is up
+// to the callback.
+//
+// Segment buffers stay valid until their segment drops out of the
+// playlist, list_size segments later, after which they're reused for new
+// segments -- so memory is bounded by the playlist window.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_HLS_H
+#define FFMPEGBRIDGE_HLS_H
+
+#include <stdint.h>
+
+#include "libavformat/avformat.h"
+
+#define FFMPBR_HLS_MAX_LIST 32
+#define FFMPBR_HLS_MAX_NAME 256
+
+// the index given to the CMAF init segment (ftyp and moov)
+#define FFMPBR_HLS_INIT_SEGMENT -1
+
+typedef struct
+{
+  int index;
+  char name[FFMPBR_HLS_MAX_NAME];
+  int64_t duration_us;
+
+  uint8_t *data;
+  int size;
+  int capacity;
+} FFmpegBridgeHlsSegment;
+
+// called as each segment completes (and once for the init segment, in CMAF
+// mode), with the media playlist that now lists it
+typedef void (*FFmpegBridgeHlsCallback)(void *opaque, FFmpegBridgeHlsSegment *segment,
+  const char *playlist);
+
+typedef struct
+{
+  int64_t segments;
+  int64_t bytes;
+  int64_t max_segment_bytes;
+
+  // memory held in segment buffers, now and at most
+  int64_t buffered_bytes;
+  int64_t max_buffered_bytes;
+} FFmpegBridgeHlsStats;
+
+typedef struct
+{
+  // the muxer writes into pb, which appends to current
+  AVIOContext *pb;
+
+  int cmaf;
+  int64_t target_us;
+  int64_t frame_duration_us;
+  int list_size;
+  char name_pattern[FFMPBR_HLS_MAX_NAME];
+  FFmpegBridgeHlsCallback callback;
+  void *opaque;
+
+  FFmpegBridgeHlsSegment init;
+  FFmpegBridgeHlsSegment *current;
+  int64_t start_pts;
+  int64_t end_pts;
+  int next_index;
+
+  // the segments in the playlist, oldest first, and buffers to reuse
+  FFmpegBridgeHlsSegment *window[FFMPBR_HLS_MAX_LIST];
+  int window_count;
+  FFmpegBridgeHlsSegment *spare;
+  int64_t max_duration_us;
+
+  char *playlist;
+  int playlist_capacity;
+
+  FFmpegBridgeHlsStats stats;
+} FFmpegBridgeHls;
+
+// name_pattern names the segments in the playlist, with a printf style %d
+// for the segment number (see ffmpbr_segment_url). cmaf is 1 for
+// fragmented mp4 segments, 0 for MPEG-TS.
+int ffmpbr_hls_init(FFmpegBridgeHls *hls, int cmaf, int segment_ms, int list_size,
+  int64_t frame_duration_us, const char *name_pattern, FFmpegBridgeHlsCallback callback,
+  void *opaque);
+
+// the muxer header is out; in CMAF mode it becomes the init segment
+void ffmpbr_hls_header_written(FFmpegBridgeHls *hls);
+
+// called for every video packet, before it's muxed; 1 if it's a keyframe
+// that should start a new segment
+int ffmpbr_hls_video_packet(FFmpegBridgeHls *hls, int64_t pts, int keyframe);
+
+// ends the current segment at pts, where the caller has flushed the muxer
+// up to, and starts the next
+void ffmpbr_hls_cut(FFmpegBridgeHls *hls, int64_t pts);
+
+// ends the last segment, once the trailer is out, and closes the playlist
+void ffmpbr_hls_finish(FFmpegBridgeHls *hls);
+
+void ffmpbr_hls_free(FFmpegBridgeHls *hls);
+
+void ffmpbr_hls_get_stats(FFmpegBridgeHls *hls, FFmpegBridgeHlsStats *stats);
+
+#endif
@@ -0,0 +1,259 @@
+//
+// The AVIO layer between the muxer and the output url. The muxer writes into
+// our own AVIOContext so that we can observe (and later shape) every byte on
+// its way to the real sink.
+//
+// By default bytes are written to the sink inline, on the thread that called
+// into the bridge. When the shared event loop is enabled (see
+// ffmpegbridge_loop.h) they are queued instead, and written out by a loop
+// thread: one of the shared pool's for our own fds, or one of the session's
+// own for sinks that block (rtmp, and anything else through avio). Local files can have a thread of their own instead (see
+// ffmpegbridge_file.h).
+//
+// The queue has no bound of its own: behind a stalled sink it grows until
+// memory runs out, and the output fails with AVERROR(ENOMEM). Set
+// FFmpegBridgeTransport.queue_limit to have packets turned away first.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_IO_H
+#define FFMPEGBRIDGE_IO_H
+
+#include <pthread.h>
+
+#include "libavformat/avformat.h"
+#include "ffmpegbridge_file.h"
+#include "ffmpegbridge_latency.h"
+#include "ffmpegbridge_loop.h"
+#include "ffmpegbridge_pacer.h"
+#include "ffmpegbridge_probe.h"
+#include "ffmpegbridge_udp.h"
+
+#define FFMPBR_IO_BUFFER_SIZE 32768
+
+// transport tuning for rtmp, tcp and udp outputs; 0 (-1 for tcp_nodelay) leaves
+// the system's or librtmp's default. With any of it set, rtmp goes through
+// our own librtmp connection (see ffmpegbridge_rtmp.h) rather than
+// libavformat's, and tcp through our own socket, so that the settings can
+// be applied. rtmp also does while connections are pooled (see
+// ffmpegbridge_pool.h).
+typedef struct
+{
+  // outgoing RTMP chunk size, announced to the server right after connecting
+  int rtmp_chunk_size;
+
+  // 1 to send small writes straight away, 0 to let Nagle coalesce them
+  // (librtmp turns it on by itself)
+  int tcp_nodelay;
+
+  // SO_SNDBUF, and TCP_NOTSENT_LOWAT (how much unsent data the kernel
+  // queues before reporting the socket as writable), in bytes
+  int send_buffer;
+  int notsent_lowat;
+
+  // > 0 to pace the output at this many bits per second, letting up to
+  // pace_burst bytes go at once after a quiet spell (see
+  // ffmpegbridge_pacer.h). Paced output is always written from the event
+  // loop, which is started for it in inline mode.
+  int64_t pace_bit_rate;
+  int pace_burst;
+
+  // 1 to go through our own connection even with nothing else set, so
+  // that the socket can be measured (see ffmpbr_io_probe)
+  int own_socket;
+
+  // udp only (which always has a socket of its own) -- 1 to send every
+  // PAT and PMT packet twice (see ffmpegbridge_udp.h)
+  int udp_duplicate_tables;
+
+  // > 0 so that the caller is never held up by the sink: the output is
+  // written from the event loop (started for it in inline mode, as for
+  // pacing), and the context turns packets away while more than this many
+  // bytes are queued (see ffmpbr_set_write_queue_limit)
+  int64_t queue_limit;
+
+  // local files only -- > 0 to write through blocks of this many bytes on
+  // a thread of the file's own (see ffmpegbridge_file.h), rather than
+  // inline or from the event loop, preallocating file_extent_size bytes at
+  // a time (0 not to) and syncing every file_sync_interval_us (0 never to).
+  // Bytes count as sent once they're in a block.
+  int file_block_size;
+  int64_t file_extent_size;
+  int64_t file_sync_interval_us;
+} FFmpegBridgeTransport;
+
+// the send rate is measured over windows of this length
+#define FFMPBR_IO_RATE_WINDOW_US 100000
+
+typedef struct
+{
+  int64_t bytes;
+
+  // the send rate over FFMPBR_IO_RATE_WINDOW_US windows, in bits per
+  // second: mean, highest, and standard deviation
+  int64_t rate_mean;
+  int64_t rate_peak;
+  int64_t rate_stddev;
+
+  // pacing only -- how often sending had to wait for the bucket, and the
+  // most output queued up when it did
+  int64_t paced_waits;
+  int64_t max_backlog_bytes;
+
+  // tcp (and our own rtmp connection) only -- segments the kernel has
+  // retransmitted, from TCP_INFO
+  int64_t retransmits;
+
+  // udp only -- datagrams packed, table packets sent twice, and datagrams
+  // the receiver's host refused (nothing was listening)
+  int64_t datagrams;
+  int64_t duplicate_tables;
+  int64_t refused_datagrams;
+
+  // block file output only -- see FFmpegBridgeFileStats
+  int64_t file_blocks;
+  int64_t file_preallocated_bytes;
+  int64_t file_stalls;
+  int64_t file_max_stall_us;
+  int64_t file_max_write_us;
+  int64_t file_syncs;
+  int64_t file_max_sync_us;
+} FFmpegBridgeSendStats;
+
+typedef struct FFmpegBridgeIOChunk
+{
+  struct FFmpegBridgeIOChunk *next;
+  int size;
+  int offset;
+  uint8_t data[FFMPBR_IO_BUFFER_SIZE];
+} FFmpegBridgeIOChunk;
+
+typedef struct FFmpegBridgeIO
+{
+  // the muxer writes into pb, which forwards to either an avio sink, or
+  // (in event loop mode, for files and tcp) a non-blocking fd of our own
+  AVIOContext *pb;
+  AVIOContext *sink;
+  int fd;
+  int fd_is_socket;
+
+  // our own librtmp connection behind sink, if any
+  struct FFmpegBridgeRtmp *rtmp;
+
+  // udp only -- packs the muxer's output into datagrams on its way to fd
+  FFmpegBridgeUdp *udp;
+  int64_t refused_datagrams;
+
+  // block file output (see FFmpegBridgeTransport.file_block_size), which
+  // takes the place of fd and sink
+  FFmpegBridgeFile *file;
+
+  // total bytes accepted from the muxer, and total bytes handed to the sink
+  int64_t written;
+  int64_t sent;
+  int64_t last_send_us;
+
+  // optional -- notified as bytes reach the sink
+  FFmpegBridgeLatency *latency;
+
+  // optional -- paces the output, event loop mode only
+  FFmpegBridgePacer *pacer;
+
+  // the send rate windows so far, and the current one
+  int64_t window_start_us;
+  int64_t window_bytes;
+  int64_t windows;
+  int64_t window_peak;
+  double window_sum;
+  double window_sum_sq;
+  int64_t paced_waits;
+  int64_t max_backlog;
+
+  // 0, or when (ffmpbr_now_us) to stop waiting for the sink, see
+  // ffmpbr_io_set_deadline; guarded by lock in event loop mode
+  int64_t deadline_us;
+
+  // event loop mode -- set once the deadline has cut the output off, to
+  // interrupt a write to an avio sink under way on a loop thread
+  volatile int interrupted;
+
+  // event loop mode only -- everything below is guarded by lock
+  FFmpegBridgeLoop *loop;
+  pthread_mutex_t lock;
+  pthread_cond_t drained;
+  FFmpegBridgeIOChunk *queue_head;
+  FFmpegBridgeIOChunk *queue_tail;
+  int64_t queued;
+  int scheduled;
+  int waiting_writable;
+  int error;
+
+  // owned by the loop
+  int home;
+  struct FFmpegBridgeIO *next_ready;
+  struct FFmpegBridgeIO *next_sleeping;
+  int64_t wake_us;
+} FFmpegBridgeIO;
+
+// transport and options may be NULL. avio options (for libavformat's
+// protocols) are taken out of options as they're used.
+FFmpegBridgeIO* ffmpbr_io_open(const char *url, FFmpegBridgeLatency *latency,
+  const FFmpegBridgeTransport *transport, AVDictionary **options, int *rc);
+
+// 1 if any of the socket or RTMP settings in transport are set, which need
+// a connection of our own (pacing works with any sink)
+int ffmpbr_io_transport_set(const FFmpegBridgeTransport *transport);
+
+// applies the socket options in transport to fd
+void ffmpbr_io_set_socket_options(int fd, const FFmpegBridgeTransport *transport);
+
+// the number of bytes the muxer has produced so far, including anything
+// still sitting in pb's buffer
+int64_t ffmpbr_io_mux_offset(FFmpegBridgeIO *io);
+
+// event loop mode -- the number of bytes waiting for the sink (0 inline)
+int64_t ffmpbr_io_queued(FFmpegBridgeIO *io);
+
+// the number of bytes that have reached the sink, and when the last did
+int64_t ffmpbr_io_sent(FFmpegBridgeIO *io, int64_t *last_send_us);
+
+// for when the muxer moves on from one output to the next (segmented
+// recording): to carries on from from's byte offsets, and takes over
+// reporting sent bytes to the latency tracker
+void ffmpbr_io_handoff(FFmpegBridgeIO *from, FFmpegBridgeIO *to);
+
+// the error the sink failed with, or 0 while it's fine. Inline, that's
+// what the muxer got back from the last write; with the event loop, a
+// write that failed on a loop thread.
+int ffmpbr_io_failed(FFmpegBridgeIO *io);
+
+// event loop mode only -- write out as much queued output as the sink will
+// take without blocking, called from a loop thread
+void ffmpbr_io_service(FFmpegBridgeIO *io);
+
+void ffmpbr_io_get_send_stats(FFmpegBridgeIO *io, FFmpegBridgeSendStats *stats);
+
+// measures the connection with padding the receiver ignores, before
+// anything else is written: an RTMP command no server acts on, or MPEG-TS
+// null packets (is_mpegts) over tcp. AVERROR(ENOSYS) for other outputs, or
+// ones not on a socket of our own (see FFmpegBridgeTransport.own_socket).
+int ffmpbr_io_probe(FFmpegBridgeIO *io, int is_mpegts, int duration_ms, int64_t max_bit_rate,
+  FFmpegBridgeProbeResult *result);
+
+// from deadline_us (ffmpbr_now_us time) on, the sink isn't waited for:
+// whatever is still queued is dropped, and writes fail with
+// AVERROR(ETIMEDOUT) rather than block. A send already under way is cut
+// short too: on a socket of our own (tcp, udp, and our own rtmp
+// connections) straight away, and through libavformat's protocols once
+// they next check for an interrupt (every 100 ms or so while they wait on
+// the network). Files (seekable outputs) are always written out in full.
+void ffmpbr_io_set_deadline(FFmpegBridgeIO *io, int64_t deadline_us);
+
+// flushes pb and waits for everything to reach the sink (or for the
+// deadline); the error the sink failed with, or 0
+int ffmpbr_io_drain(FFmpegBridgeIO *io);
+
+void ffmpbr_io_close(FFmpegBridgeIO *io);
+
+#endif
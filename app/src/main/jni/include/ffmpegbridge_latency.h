@@ -0,0 +1,93 @@
+//
+// Capture-to-send latency tracking for packets passing through the bridge.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_LATENCY_H
+#define FFMPEGBRIDGE_LATENCY_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// number of recent latency samples kept for the rolling distribution
+#define FFMPBR_LATENCY_WINDOW 512
+
+// max number of packets that can be in flight between writePacket and the
+// socket; older stamps are dropped (and counted) if this overflows
+#define FFMPBR_LATENCY_MAX_PENDING 256
+
+#define FFMPBR_LATENCY_MAX_STREAMS 2
+
+typedef struct
+{
+  int64_t arrival_us;   // monotonic time the packet entered the JNI layer
+  int64_t capture_us;   // device pts (MediaCodec presentationTimeUs)
+  int64_t end_offset;   // muxer byte offset at which this packet ends
+} FFmpegBridgeLatencyStamp;
+
+typedef struct
+{
+  FFmpegBridgeLatencyStamp stamps[FFMPBR_LATENCY_MAX_PENDING];
+  int head;
+  int count;
+} FFmpegBridgeLatencyQueue;
+
+typedef struct
+{
+  // guards everything below; packets arrive on the caller's thread, but
+  // stats are read from whichever thread Java asks on
+  pthread_mutex_t lock;
+
+  // packets handed to the muxer, but not yet muxed (one queue per stream,
+  // since the interleaver only preserves per-stream ordering)
+  FFmpegBridgeLatencyQueue arrived[FFMPBR_LATENCY_MAX_STREAMS];
+  int64_t muxed_frames[FFMPBR_LATENCY_MAX_STREAMS];
+
+  // packets muxed into the output buffer, but not yet written to the sink
+  FFmpegBridgeLatencyQueue muxed;
+
+  // rolling window of arrival-to-send latencies, in microseconds
+  int64_t window[FFMPBR_LATENCY_WINDOW];
+  int window_pos;
+  int window_count;
+
+  // the end-to-end lag (send time - capture time) of the last sent packet
+  int64_t current_lag_us;
+  int64_t sent_packets;
+  int64_t dropped_stamps;
+} FFmpegBridgeLatency;
+
+typedef struct
+{
+  int64_t sent_packets;
+  int64_t dropped_stamps;
+  int64_t p50_us;
+  int64_t p90_us;
+  int64_t p99_us;
+  int64_t max_us;
+  int64_t current_lag_us;
+} FFmpegBridgeLatencyStats;
+
+// the monotonic clock used for every latency timestamp; this is the same
+// clock as System.nanoTime() on Android
+int64_t ffmpbr_now_us();
+
+void ffmpbr_latency_init(FFmpegBridgeLatency *lat);
+void ffmpbr_latency_destroy(FFmpegBridgeLatency *lat);
+
+// a packet for stream_index entered the bridge
+void ffmpbr_latency_arrived(FFmpegBridgeLatency *lat, int stream_index, int64_t arrival_us,
+  int64_t capture_us);
+
+// the muxer has now written nb_frames packets of stream_index, and its
+// output ends at mux_offset bytes
+void ffmpbr_latency_muxed(FFmpegBridgeLatency *lat, int stream_index, int64_t nb_frames,
+  int64_t mux_offset);
+
+// the first sent_offset bytes of muxer output have been handed to the sink
+void ffmpbr_latency_sent(FFmpegBridgeLatency *lat, int64_t sent_offset, int64_t send_us);
+
+void ffmpbr_latency_get_stats(FFmpegBridgeLatency *lat, FFmpegBridgeLatencyStats *stats);
+
+#endif
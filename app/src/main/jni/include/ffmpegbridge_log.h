@@ -4,6 +4,8 @@
 // Copyright (c) 2014, cine.io. All rights reserved.
 //
 
+#if defined(__ANDROID__)
+
 #include <android/log.h>
 
 // android logging helpers
@@ -11,3 +13,14 @@
 #define LOGD(...)  __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
 #define LOGI(...)  __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
 #define LOGE(...)  __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+#else
+
+// host builds of the plain C parts (see jni/tools)
+#include <stdio.h>
+
+#define LOGD(...)
+#define LOGI(...)  (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define LOGE(...)  (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+
+#endif
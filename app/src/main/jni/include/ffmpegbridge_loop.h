@@ -0,0 +1,83 @@
+//
+// A small pool of event loop threads shared by every bridge session in the
+// process. Sessions hand their muxed output to the pool instead of writing
+// it on the caller's thread; loop threads write it out without blocking on
+// any one session, and idle threads steal ready sessions from busy ones.
+//
+// That only holds for sessions written through a non-blocking fd of our
+// own. A sink that can only be written blocking (rtmp, and anything else
+// through avio) would hold a pool thread for as long as its ingest stalls,
+// and with it every session waiting behind it, so those sessions get a
+// loop of their own instead: a single thread, used the same way.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_LOOP_H
+#define FFMPEGBRIDGE_LOOP_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+struct FFmpegBridgeIO;
+
+typedef struct
+{
+  pthread_t thread;
+  int index;
+  int epoll_fd;
+  int wake_fd;
+
+  // only a hint for who to wake up, so it's read without locking
+  volatile int busy;
+
+  // sessions with output ready to be written, in FIFO order
+  pthread_mutex_t lock;
+  int stopping;
+  struct FFmpegBridgeIO *ready_head;
+  struct FFmpegBridgeIO *ready_tail;
+  int ready_count;
+
+  // sessions waiting for a time (pacing), soonest first
+  struct FFmpegBridgeIO *sleeping_head;
+} FFmpegBridgeLoopThread;
+
+typedef struct
+{
+  FFmpegBridgeLoopThread *threads;
+  int num_threads;
+  int next_home;
+  int refs;
+
+  // 1 for a session's own loop, see ffmpbr_loop_acquire_own
+  int own;
+} FFmpegBridgeLoop;
+
+// the number of loop threads sessions opened from now on will share; 0 (the
+// default) writes each session inline on the thread that calls the bridge
+void ffmpbr_loop_set_threads(int num_threads);
+
+// returns the shared pool (starting it if necessary), or NULL in inline mode.
+// With min_threads > 0 there's a pool even in inline mode, of that many
+// threads if it has to be started.
+FFmpegBridgeLoop* ffmpbr_loop_acquire(int min_threads);
+
+// the same, but a loop of one thread for a single session rather than the
+// shared pool (NULL whenever ffmpbr_loop_acquire would be)
+FFmpegBridgeLoop* ffmpbr_loop_acquire_own(int min_threads);
+void ffmpbr_loop_release(FFmpegBridgeLoop *loop);
+
+// pick the loop thread that owns a new session
+int ffmpbr_loop_assign_home(FFmpegBridgeLoop *loop);
+
+// queue a session whose output is ready to be written
+void ffmpbr_loop_schedule(FFmpegBridgeLoop *loop, struct FFmpegBridgeIO *io);
+
+// reschedule the session once fd becomes writable again
+void ffmpbr_loop_wait_writable(FFmpegBridgeLoop *loop, struct FFmpegBridgeIO *io, int fd);
+
+// reschedule the session at wake_us (ffmpbr_now_us time)
+void ffmpbr_loop_wait_until(FFmpegBridgeLoop *loop, struct FFmpegBridgeIO *io, int64_t wake_us);
+void ffmpbr_loop_forget(FFmpegBridgeLoop *loop, struct FFmpegBridgeIO *io, int fd);
+
+#endif
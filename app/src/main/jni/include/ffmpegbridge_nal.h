@@ -0,0 +1,167 @@
+//
+// H.264 and HEVC NAL unit helpers: a vectorized Annex-B start code scanner,
+// and conversion from Annex-B (start code delimited) to AVCC (length
+// prefixed) framing, which is what FLV and MP4 carry. Framing is the same
+// for both codecs; only the NAL header and parameter sets differ.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_NAL_H
+#define FFMPEGBRIDGE_NAL_H
+
+#include <stdint.h>
+
+// more NAL units than this in one packet is treated as a broken packet
+#define FFMPBR_NAL_MAX_UNITS 256
+
+// nal_unit_type values we care about
+#define FFMPBR_NAL_SLICE 1
+#define FFMPBR_NAL_IDR 5
+#define FFMPBR_NAL_SEI 6
+#define FFMPBR_NAL_SPS 7
+#define FFMPBR_NAL_PPS 8
+#define FFMPBR_NAL_AUD 9
+#define FFMPBR_NAL_FILLER 12
+
+#define FFMPBR_NAL_TYPE(nal) ((nal)->data[0] & 0x1f)
+
+// HEVC nal_unit_type values we care about (H.265 table 7-1), from the first
+// byte of its two byte header
+#define FFMPBR_HEVC_NAL_VPS 32
+#define FFMPBR_HEVC_NAL_SPS 33
+#define FFMPBR_HEVC_NAL_PPS 34
+
+#define FFMPBR_HEVC_NAL_TYPE(nal) (((nal)->data[0] >> 1) & 0x3f)
+
+typedef struct
+{
+  uint8_t *data;
+  int size;
+  // bytes between the end of the previous unit (or the start of the
+  // packet) and data, i.e. the start code plus any zero padding
+  int prefix;
+} FFmpegBridgeNal;
+
+// the parts of a sequence parameter set the bridge needs
+typedef struct
+{
+  int profile_idc;
+  int level_idc;
+  int width;
+  int height;
+} FFmpegBridgeSps;
+
+// the parts of an HEVC sequence parameter set that go into its
+// HEVCDecoderConfigurationRecord, and the picture size
+typedef struct
+{
+  int profile_space;
+  int tier_flag;
+  int profile_idc;
+  uint32_t profile_compatibility_flags;
+  uint8_t constraint_indicator_flags[6];
+  int level_idc;
+  int max_sub_layers;
+  int temporal_id_nesting;
+  int chroma_format_idc;
+  int bit_depth_luma;
+  int bit_depth_chroma;
+  int width;
+  int height;
+} FFmpegBridgeHevcSps;
+
+// what ffmpbr_nal_filter() removes
+#define FFMPBR_NAL_FILTER_FILLER 0x01       // filler data
+#define FFMPBR_NAL_FILTER_AUD 0x02          // access unit delimiters
+#define FFMPBR_NAL_FILTER_SEI 0x04          // SEI that players ignore (see below)
+#define FFMPBR_NAL_FILTER_PARAM_SETS 0x08   // in-band SPS/PPS identical to the extradata's
+#define FFMPBR_NAL_FILTER_ALL 0x0f
+
+// the SPS and PPS a stream was configured with
+typedef struct
+{
+  uint8_t *sps;
+  int sps_size;
+  uint8_t *pps;
+  int pps_size;
+} FFmpegBridgeParamSets;
+
+typedef struct
+{
+  int64_t video_bytes;      // video packet bytes seen by the filter
+  int64_t saved_bytes;      // bytes removed, counting a 4 byte start code/length per unit
+  int64_t filler_units;
+  int64_t aud_units;
+  int64_t sei_units;
+  int64_t param_set_units;
+} FFmpegBridgeNalFilterStats;
+
+// returns a pointer to the first 00 00 01 at or after p, or end
+typedef const uint8_t* (*FFmpegBridgeStartCodeFinder)(const uint8_t *p, const uint8_t *end);
+
+// the individual kernels, exposed for benchmarking
+const uint8_t* ffmpbr_nal_find_startcode_c(const uint8_t *p, const uint8_t *end);
+const uint8_t* ffmpbr_nal_find_startcode_word(const uint8_t *p, const uint8_t *end);
+#if defined(__SSE2__)
+const uint8_t* ffmpbr_nal_find_startcode_sse2(const uint8_t *p, const uint8_t *end);
+#endif
+#if defined(FFMPBR_HAVE_NEON)
+const uint8_t* ffmpbr_nal_find_startcode_neon(const uint8_t *p, const uint8_t *end);
+#endif
+
+// the fastest kernel this cpu supports
+const uint8_t* ffmpbr_nal_find_startcode(const uint8_t *p, const uint8_t *end);
+const char* ffmpbr_nal_find_startcode_name();
+
+// 1 if data starts with an Annex-B start code
+int ffmpbr_nal_is_annexb(const uint8_t *data, int size);
+
+// splits an Annex-B buffer into its NAL units, returning how many there
+// are, or <0 if there are more than max_nals
+int ffmpbr_nal_split(uint8_t *data, int size, FFmpegBridgeNal *nals, int max_nals);
+
+// drops the units flags asks for from nals, returning how many are left.
+// Nothing is copied; the kept units are written out afterwards with
+// ffmpbr_nal_write_annexb() or ffmpbr_nal_write_avcc().
+//
+// SEI units are only dropped when every message in them is one players
+// have no use for in FLV/MP4: buffering period, picture timing and
+// unregistered user data (encoder version strings). Anything else, such as
+// closed captions or recovery points, keeps the whole unit.
+int ffmpbr_nal_filter(FFmpegBridgeNal *nals, int num_nals, int flags,
+  FFmpegBridgeParamSets *param_sets, FFmpegBridgeNalFilterStats *stats);
+
+// writes the given units of an Annex-B buffer back out as Annex-B with 4
+// byte start codes -- see ffmpbr_nal_write_avcc()
+int ffmpbr_nal_write_annexb(FFmpegBridgeNal *nals, int num_nals, uint8_t **buffer,
+  unsigned int *buffer_size);
+
+// writes the given units of an Annex-B buffer as AVCC with 4 byte lengths,
+// into *buffer (*buffer_size bytes, grown with av_fast_malloc() as needed),
+// which the caller owns and can keep for the next packet. The Annex-B
+// buffer is only read. Returns the number of bytes written, or an AVERROR.
+int ffmpbr_nal_write_avcc(FFmpegBridgeNal *nals, int num_nals, uint8_t **buffer,
+  unsigned int *buffer_size);
+
+// ffmpbr_nal_split() followed by ffmpbr_nal_write_avcc()
+int ffmpbr_nal_annexb_to_avcc(uint8_t *data, int size, uint8_t **buffer,
+  unsigned int *buffer_size);
+
+// builds an AVCDecoderConfigurationRecord from Annex-B SPS/PPS extradata,
+// into a new buffer for the caller to av_free()
+int ffmpbr_nal_build_avcc_extradata(uint8_t *data, int size, uint8_t **out, int *out_size);
+
+// parses an SPS unit (starting at its NAL header), returning <0 if it's
+// truncated or malformed
+int ffmpbr_nal_parse_sps(const uint8_t *data, int size, FFmpegBridgeSps *sps);
+
+// builds an HEVCDecoderConfigurationRecord (hvcC) from Annex-B VPS/SPS/PPS
+// extradata, into a new buffer for the caller to av_free(). Units are
+// written with 4 byte lengths, as ffmpbr_nal_write_avcc() produces them.
+int ffmpbr_nal_build_hvcc_extradata(uint8_t *data, int size, uint8_t **out, int *out_size);
+
+// the HEVC counterpart of ffmpbr_nal_parse_sps()
+int ffmpbr_nal_parse_hevc_sps(const uint8_t *data, int size, FFmpegBridgeHevcSps *sps);
+
+#endif
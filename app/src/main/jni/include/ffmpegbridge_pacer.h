@@ -0,0 +1,43 @@
+//
+// A token bucket for pacing the output: bytes go out at no more than a set
+// rate, with a burst allowance on top, so that a keyframe many times the
+// size of the frames around it is spread over time rather than written to
+// the network in one go (where it can overflow a cellular link's queue).
+//
+// The bucket only does the arithmetic; the IO layer asks it how much may
+// go now, and waits for the rest on its event loop thread (see
+// ffmpegbridge_io.h).
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_PACER_H
+#define FFMPEGBRIDGE_PACER_H
+
+#include <stdint.h>
+
+// the least worth waking up for, unless less than this is queued
+#define FFMPBR_PACER_QUANTUM 4096
+
+typedef struct
+{
+  // bytes per second, and the most that may build up while idle
+  int64_t rate;
+  int64_t burst;
+
+  int64_t tokens;
+  int64_t last_us;
+} FFmpegBridgePacer;
+
+void ffmpbr_pacer_init(FFmpegBridgePacer *pacer, int64_t bit_rate, int64_t burst_bytes);
+
+// how many bytes may be sent at now_us
+int64_t ffmpbr_pacer_allowance(FFmpegBridgePacer *pacer, int64_t now_us);
+
+// n bytes were sent
+void ffmpbr_pacer_consume(FFmpegBridgePacer *pacer, int n);
+
+// how long from now_us until size bytes (or a quantum, if less) may go
+int64_t ffmpbr_pacer_wait_us(FFmpegBridgePacer *pacer, int size, int64_t now_us);
+
+#endif
@@ -0,0 +1,66 @@
+//
+// Warm RTMP connections, shared by every bridge session in the process.
+// When a session that published through our own librtmp connection (see
+// ffmpegbridge_rtmp.h) ends cleanly, its stream is unpublished but the
+// connection is kept open for a grace period. A session that starts
+// publishing to the same url in that time takes it over, and skips DNS,
+// the TCP and RTMP handshakes and the connect command: only createStream
+// and publish go over the wire.
+//
+// Idle connections are watched by a thread of their own while there are
+// any, which answers the server's pings, and closes them when their grace
+// period runs out or the server hangs up.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_POOL_H
+#define FFMPEGBRIDGE_POOL_H
+
+#include <stdint.h>
+
+#include "ffmpegbridge_io.h"
+#include "ffmpegbridge_rtmp.h"
+
+#define FFMPBR_POOL_MAX_CONNECTIONS 8
+
+// idle connections are checked on at least this often
+#define FFMPBR_POOL_POLL_MS 250
+
+typedef struct
+{
+  // idle connections right now
+  int idle;
+
+  // sessions whose connection was kept, and sessions that started on one
+  int64_t kept;
+  int64_t reused;
+
+  // sessions that found no connection to their url
+  int64_t missed;
+
+  // idle connections closed: the grace period ran out, the pool was full,
+  // or the server hung up or wouldn't take the new stream
+  int64_t expired;
+  int64_t evicted;
+  int64_t failed;
+} FFmpegBridgePoolStats;
+
+// how long idle connections are kept, for sessions ending from now on; 0
+// (the default) closes connections as sessions end, and any idle ones now
+void ffmpbr_pool_set_grace(int grace_ms);
+
+// 1 if connections are being kept
+int ffmpbr_pool_enabled();
+
+// an idle connection to exactly url, publishing again with transport
+// applied, or NULL if there's none (or it couldn't publish)
+FFmpegBridgeRtmp* ffmpbr_pool_take(const char *url, const FFmpegBridgeTransport *transport);
+
+// unpublishes rtmp and keeps it for the grace period; an AVERROR if it
+// wasn't kept, and is still the caller's to close
+int ffmpbr_pool_put(FFmpegBridgeRtmp *rtmp);
+
+void ffmpbr_pool_get_stats(FFmpegBridgePoolStats *stats);
+
+#endif
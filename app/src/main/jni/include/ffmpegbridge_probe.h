@@ -0,0 +1,59 @@
+//
+// Bandwidth preflight: before the stream starts, padding that the receiver
+// ignores is sent over the output's connection for a moment, to measure
+// what the path actually delivers and its round trip time.
+//
+// Throughput is what the receiver acknowledged (bytes sent, less what the
+// kernel still holds unacknowledged, SIOCOUTQ) over the second half of the
+// probe, once TCP has ramped up; the RTT is the kernel's smoothed estimate
+// (TCP_INFO). Sending is capped by a token bucket, so that a fast link
+// isn't flooded just to find out it's fast enough, and by how much is
+// still unacknowledged, so that the padding left over at the end clears
+// within about a round trip and FFMPBR_PROBE_QUEUE_US rather than holding
+// up the start of the stream.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_PROBE_H
+#define FFMPEGBRIDGE_PROBE_H
+
+#include <stdint.h>
+
+// padding is sent in pieces of up to this size, smaller when the send
+// buffer has less room (never below the minimum)
+#define FFMPBR_PROBE_PIECE_SIZE 16384
+#define FFMPBR_PROBE_MIN_PIECE_SIZE 2048
+
+// how far ahead of the link padding may be queued, beyond a round trip
+#define FFMPBR_PROBE_QUEUE_US 100000
+
+// sends about size bytes of padding however the output's protocol allows;
+// the number of bytes sent, 0 if the socket would block, or an AVERROR
+typedef int (*FFmpegBridgeProbeSend)(void *opaque, int size);
+
+typedef struct
+{
+  int64_t duration_us;
+  int64_t bytes_sent;
+  int64_t bytes_acked;
+
+  // acknowledged bits per second, and 1 if that's the cap rather than
+  // what the link can do
+  int64_t throughput;
+  int capped;
+
+  int64_t rtt_us;
+  int64_t rtt_var_us;
+
+  // filled in by the caller (see ffmpbr_probe_bandwidth): the video bit
+  // rate to start at
+  int64_t recommended_bit_rate;
+} FFmpegBridgeProbeResult;
+
+// probes the connection on fd for duration_ms, sending no faster than
+// max_bit_rate
+int ffmpbr_probe_run(int fd, int duration_ms, int64_t max_bit_rate, FFmpegBridgeProbeSend send,
+  void *opaque, FFmpegBridgeProbeResult *result);
+
+#endif
@@ -0,0 +1,76 @@
+//
+// Reconnecting to an ingest in the background (see ffmpbr_set_backup_urls).
+// When the ingest fails, a thread of the session's own goes through the
+// urls for one that takes a connection, while the write path carries on
+// caching the GOP; all the write path does once it's made is swap the
+// connection in, write the header and send the GOP again.
+//
+// Stopping doesn't wait for a connection attempt under way, which can take
+// as long as the protocol's own timeouts: the thread is left to close
+// whatever it gets and free everything when the attempt returns.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_RECONNECT_H
+#define FFMPEGBRIDGE_RECONNECT_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "libavutil/dict.h"
+#include "ffmpegbridge_io.h"
+
+typedef struct
+{
+  // copies, so that the thread can outlive the session
+  char **urls;
+  int url_count;
+  AVDictionary *options;
+  FFmpegBridgeTransport transport;
+
+  pthread_t thread;
+
+  // guards everything below; the write path only ever holds it briefly
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int stopping;
+
+  // an attempt was asked for, starting after url index from; trying is 1
+  // while one is under way
+  int wanted;
+  int from;
+  int trying;
+
+  // what the last attempt came to: a connection to urls[ready_index] not
+  // yet taken, or none at all (gave_up)
+  FFmpegBridgeIO *ready;
+  int ready_index;
+  int gave_up;
+
+  int64_t failed_attempts;
+} FFmpegBridgeReconnect;
+
+// starts the thread, with urls and options as they are now; NULL if it
+// couldn't be started
+FFmpegBridgeReconnect* ffmpbr_reconnect_start(char **urls, int url_count,
+  AVDictionary *options, const FFmpegBridgeTransport *transport);
+
+// asks for a connection to the first url after index that takes one,
+// wrapping around so that index itself is tried last. Does nothing while
+// an attempt is under way, or its connection hasn't been taken yet.
+void ffmpbr_reconnect_request(FFmpegBridgeReconnect *rc, int index);
+
+// the connection once it's made, and *index its url; NULL otherwise.
+// Never blocks.
+FFmpegBridgeIO* ffmpbr_reconnect_take(FFmpegBridgeReconnect *rc, int *index);
+
+// 1 if the last attempt reached none of the urls, until the next request
+int ffmpbr_reconnect_gave_up(FFmpegBridgeReconnect *rc);
+
+// connections that couldn't be made so far
+int64_t ffmpbr_reconnect_failed_attempts(FFmpegBridgeReconnect *rc);
+
+void ffmpbr_reconnect_stop(FFmpegBridgeReconnect *rc);
+
+#endif
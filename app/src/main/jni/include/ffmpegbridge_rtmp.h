@@ -0,0 +1,71 @@
+//
+// RTMP publishing through our own librtmp connection, for when the
+// transport needs tuning that libavformat's librtmp protocol doesn't expose:
+// the outgoing chunk size and socket options. It's fed the flv byte stream,
+// just like libavformat's protocol would be, and hands it to librtmp a
+// whole tag at a time (RTMP_Write can't take a tag header split across
+// writes, or the file header on its own).
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_RTMP_H
+#define FFMPEGBRIDGE_RTMP_H
+
+#include <stdint.h>
+
+#include "librtmp/rtmp.h"
+#include "ffmpegbridge_io.h"
+
+#define FFMPBR_RTMP_MAX_URL 2048
+
+// the range servers accept for the chunk size
+#define FFMPBR_RTMP_MIN_CHUNK_SIZE 128
+#define FFMPBR_RTMP_MAX_CHUNK_SIZE 65536
+
+typedef struct FFmpegBridgeRtmp
+{
+  RTMP *rtmp;
+
+  // librtmp keeps pointers into the url it was set up with
+  char url[FFMPBR_RTMP_MAX_URL];
+
+  // the flv file header still to skip, and the tag being put together
+  int header_left;
+  uint8_t *tag;
+  int tag_size;
+  unsigned int tag_capacity;
+} FFmpegBridgeRtmp;
+
+// 1 for the urls librtmp handles (rtmp, rtmpt, rtmps, rtmpe, rtmpte)
+int ffmpbr_rtmp_is_url(const char *url);
+
+// connects and starts publishing, with transport applied. Options for
+// librtmp go in the url, after a space, e.g. "rtmp://host/app/key live=1".
+int ffmpbr_rtmp_open(FFmpegBridgeRtmp **rtmp, const char *url,
+  const FFmpegBridgeTransport *transport);
+
+// writes flv, in any pieces; buf_size on success, or an AVERROR
+int ffmpbr_rtmp_write(FFmpegBridgeRtmp *rtmp, const uint8_t *buf, int buf_size);
+
+// sends an RTMP message of about size bytes that servers ignore (an AMF
+// command nothing answers to), for measuring the connection before the
+// stream starts; size on success, or an AVERROR
+int ffmpbr_rtmp_send_padding(FFmpegBridgeRtmp *rtmp, int size);
+
+// ends the stream (FCUnpublish and deleteStream) but keeps the connection
+// open, for ffmpbr_rtmp_republish to start another on it later
+int ffmpbr_rtmp_unpublish(FFmpegBridgeRtmp *rtmp);
+
+// publishes again, to the same url, on a connection that was unpublished:
+// only createStream and publish go over the wire. Takes flv from the file
+// header on, like a fresh connection.
+int ffmpbr_rtmp_republish(FFmpegBridgeRtmp *rtmp, const FFmpegBridgeTransport *transport);
+
+// handles anything the server sent an unpublished connection (pings,
+// status); 0 if it's still up, or an AVERROR if the server hung up
+int ffmpbr_rtmp_service(FFmpegBridgeRtmp *rtmp);
+
+void ffmpbr_rtmp_close(FFmpegBridgeRtmp *rtmp);
+
+#endif
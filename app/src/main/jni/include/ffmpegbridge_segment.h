@@ -0,0 +1,119 @@
+//
+// Segmented recording: the output is split into consecutive files, each
+// starting at a keyframe. A background thread opens the next segment ahead
+// of time (file creation and the muxer header) and closes finished ones
+// (the muxer trailer), so that all the write path does at a rotation is
+// swap one muxer for the other.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_SEGMENT_H
+#define FFMPEGBRIDGE_SEGMENT_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "libavformat/avformat.h"
+#include "ffmpegbridge_io.h"
+
+// number of recent rotations kept for the latency distribution
+#define FFMPBR_SEGMENT_WINDOW 128
+
+#define FFMPBR_SEGMENT_MAX_URL 1024
+
+typedef struct FFmpegBridgeSegment
+{
+  int index;
+  char url[FFMPBR_SEGMENT_MAX_URL];
+  AVFormatContext *fmt_ctx;
+  FFmpegBridgeIO *io;
+
+  // the pts of the keyframe the segment starts at, and what's taken off
+  // every timestamp in it (both in device time)
+  int64_t start_pts;
+  int64_t ts_offset;
+
+  struct FFmpegBridgeSegment *next;
+} FFmpegBridgeSegment;
+
+// called on the segment thread. open fills in fmt_ctx and io, and writes
+// the header; close writes the trailer and frees them, and removes the
+// file as well if the segment was never used.
+typedef int (*FFmpegBridgeSegmentOpen)(void *opaque, FFmpegBridgeSegment *segment);
+typedef void (*FFmpegBridgeSegmentClose)(void *opaque, FFmpegBridgeSegment *segment, int used);
+
+typedef struct
+{
+  int64_t segments;
+  int64_t closed_segments;
+
+  // keyframes past the target duration where the next segment wasn't
+  // open yet, so the current one carried on to the next keyframe
+  int64_t late_rotations;
+
+  // time spent in the write path switching segments
+  int64_t rotation_p50_us;
+  int64_t rotation_p90_us;
+  int64_t rotation_max_us;
+
+  // time the segment thread spent opening and closing segments
+  int64_t max_open_us;
+  int64_t max_close_us;
+} FFmpegBridgeSegmentStats;
+
+typedef struct
+{
+  int64_t duration_us;
+  FFmpegBridgeSegmentOpen open;
+  FFmpegBridgeSegmentClose close;
+  void *opaque;
+
+  pthread_t thread;
+  int started;
+
+  // guards everything below; the write path only ever holds it briefly
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int stopping;
+  int next_index;
+  int want_ready;
+  FFmpegBridgeSegment *ready;
+  FFmpegBridgeSegment *retired_head;
+  FFmpegBridgeSegment *retired_tail;
+
+  FFmpegBridgeSegmentStats stats;
+  int64_t window[FFMPBR_SEGMENT_WINDOW];
+  int window_pos;
+  int window_count;
+} FFmpegBridgeSegmenter;
+
+// the url of segment index: url_pattern with a printf style %d filled in
+// (e.g. rec-%03d.mp4), or with -index added ahead of the extension if it
+// has none
+void ffmpbr_segment_url(char *buf, int buf_size, const char *url_pattern, int index);
+
+// starts the segment thread, which opens segment first_index + 1 straight
+// away; the caller opened segment first_index itself
+int ffmpbr_segmenter_start(FFmpegBridgeSegmenter *seg, int duration_ms, int first_index,
+  FFmpegBridgeSegmentOpen open, FFmpegBridgeSegmentClose close, void *opaque);
+
+// 1 if a keyframe at pts should start a new segment, given the current
+// segment started at start_pts
+int ffmpbr_segmenter_due(FFmpegBridgeSegmenter *seg, int64_t start_pts, int64_t pts);
+
+// the next segment, if it's open yet (NULL otherwise). Never blocks.
+FFmpegBridgeSegment* ffmpbr_segmenter_take(FFmpegBridgeSegmenter *seg);
+
+// hands a finished segment to the segment thread to close, and asks for
+// the one after the next to be opened. rotation_us is how long the write
+// path spent on the rotation.
+void ffmpbr_segmenter_retire(FFmpegBridgeSegmenter *seg, FFmpegBridgeSegment *segment,
+  int64_t rotation_us);
+
+// closes everything still pending, then stops the segment thread
+void ffmpbr_segmenter_stop(FFmpegBridgeSegmenter *seg);
+
+void ffmpbr_segmenter_get_stats(FFmpegBridgeSegmenter *seg, FFmpegBridgeSegmentStats *stats);
+
+#endif
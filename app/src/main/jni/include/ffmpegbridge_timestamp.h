@@ -0,0 +1,117 @@
+//
+// Timestamp handling between the device's presentation timestamps and the
+// muxer.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_TIMESTAMP_H
+#define FFMPEGBRIDGE_TIMESTAMP_H
+
+#include <stdint.h>
+
+// the most B-frames an encoder may hold back (H.264 allows up to 16)
+#define FFMPBR_MAX_REORDER_DEPTH 16
+
+// derives decode timestamps from the pts of packets arriving in decode
+// order, for encoders that reorder frames (B-frames)
+typedef struct
+{
+  int depth;
+  int64_t frame_duration;
+
+  // the depth + 1 largest pts seen so far, ascending
+  int64_t window[FFMPBR_MAX_REORDER_DEPTH + 1];
+  int started;
+  int64_t last_dts;
+} FFmpegBridgeDtsGenerator;
+
+// depth is the encoder's reorder depth (0 for no B-frames, in which case
+// dts = pts); frame_duration is the nominal frame duration in pts units,
+// used to lead into the first frames
+void ffmpbr_dts_init(FFmpegBridgeDtsGenerator *gen, int depth, int64_t frame_duration);
+
+// the dts for the next packet in decode order. DTS is strictly increasing
+// and, as long as the encoder stays within depth, never later than pts;
+// pts - dts is the composition time offset FLV and MP4 carry.
+int64_t ffmpbr_dts_next(FFmpegBridgeDtsGenerator *gen, int64_t pts);
+
+#define FFMPBR_TS_VIDEO 0
+#define FFMPBR_TS_AUDIO 1
+
+// each stream's clock is compared with the arrival clock over windows this
+// long; the earliest arrival in a window is the least delayed one
+#define FFMPBR_TS_SKEW_WINDOW_US 1000000
+
+// the most the video is slewed by to correct drift, in us per second
+#define FFMPBR_TS_MAX_SLEW_US_PER_S 2000
+
+// video frames this far (in frame durations) from where they're expected
+// are a gap -- a dropped frame or a pause -- rather than jitter
+#define FFMPBR_TS_RESYNC_FRAMES 3
+
+typedef struct
+{
+  int started;
+  int64_t offset;             // device pts + offset = rebased pts
+  int64_t last_raw_pts;
+  int64_t last_out_pts;
+
+  // how far ahead of the arrival clock this stream's clock is
+  int64_t window_start_us;
+  int64_t window_max_skew_us;
+  int has_skew;
+  int64_t skew_us;
+} FFmpegBridgeStreamClock;
+
+// rebases the audio and video timestamps to a common zero, keeps them
+// monotonic, smooths capture jitter out of the video, and slowly slews the
+// video to follow the audio when their device clocks drift apart. The
+// audio timestamps are otherwise left alone, as players slave to them.
+typedef struct
+{
+  int smooth_video;
+  int64_t lead_us;
+
+  int started;
+  int64_t first_arrival_us;
+  FFmpegBridgeStreamClock streams[2];
+
+  // video jitter smoothing
+  int64_t frame_duration_us;
+
+  // drift between the two clocks, relative to where they started, and the
+  // correction currently applied to the video
+  int has_baseline;
+  int64_t baseline_us;
+  int64_t drift_us;
+  int64_t correction_us;
+  int64_t last_slew_arrival_us;
+
+  int64_t jitter_us;
+  int64_t monotonic_fixes;
+  int64_t resyncs;
+} FFmpegBridgeTimestamps;
+
+typedef struct
+{
+  int64_t drift_us;           // video clock minus audio clock, since the start
+  int64_t correction_us;      // currently applied to the video
+  int64_t video_jitter_us;    // average jitter smoothed out of the video
+  int64_t monotonic_fixes;    // timestamps pushed forward to keep order
+  int64_t resyncs;            // video gaps too large to smooth over
+} FFmpegBridgeTimestampStats;
+
+// smooth_video should be off when the video has B-frames, as its pts
+// aren't in order then; lead_us is added to every timestamp, to leave room
+// for the first frames' decode timestamps
+void ffmpbr_timestamps_init(FFmpegBridgeTimestamps *ts, int smooth_video,
+  int64_t nominal_frame_duration_us, int64_t lead_us);
+
+// maps a packet's device pts (us) to the rebased, corrected pts (us)
+int64_t ffmpbr_timestamps_next(FFmpegBridgeTimestamps *ts, int stream, int64_t pts,
+  int64_t arrival_us);
+
+void ffmpbr_timestamps_get_stats(FFmpegBridgeTimestamps *ts, FFmpegBridgeTimestampStats *stats);
+
+#endif
@@ -0,0 +1,42 @@
+//
+// Optional begin/end trace sections, emitted to systrace/Perfetto through
+// ATrace and/or to a Chrome trace (JSON) file.
+//
+// Tracing is compiled out unless the library is built with
+// FFMPBR_TRACE=1 (which defines FFMPBR_ENABLE_TRACE), in which case it can
+// be switched on and off at runtime with ffmpbr_trace_enable().
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_TRACE_H
+#define FFMPEGBRIDGE_TRACE_H
+
+#ifdef FFMPBR_ENABLE_TRACE
+
+extern volatile int ffmpbr_trace_enabled;
+
+// json_path may be NULL to emit only through ATrace
+void ffmpbr_trace_enable(int enabled, const char *json_path);
+void ffmpbr_trace_begin(const char *name);
+void ffmpbr_trace_end(const char *name);
+
+// a section named name, whose tag declares a local: whether tracing was
+// on as it began. The matching FFMPBR_TRACE_END (same tag, in the same
+// scope) only ends it if it was begun, so that switching tracing on or off
+// in between leaves neither half of a section on its own (ATrace would
+// take an end with no begin as the end of whatever section is open).
+#define FFMPBR_TRACE_BEGIN(tag, name) \
+  int _trace_##tag = ffmpbr_trace_enabled; \
+  if (_trace_##tag) ffmpbr_trace_begin(name)
+#define FFMPBR_TRACE_END(tag, name) \
+  do { if (_trace_##tag) ffmpbr_trace_end(name); } while (0)
+
+#else
+
+#define FFMPBR_TRACE_BEGIN(tag, name) do {} while (0)
+#define FFMPBR_TRACE_END(tag, name) do {} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+//
+// MPEG-TS over UDP: packs the muxer's TS packets into datagrams of up to
+// seven (1316 bytes, which fits a 1500 byte MTU with room for the IP and
+// UDP headers), never splitting a TS packet across two, so that losing a
+// datagram only loses the packets in it. The muxer flushes after every
+// media packet, and the last datagram of each write goes out short rather
+// than waiting for the next packet to fill it; only a TS packet the avio
+// buffer cut in two waits, for the rest of it.
+//
+// Optionally every PAT and PMT packet goes out a second time, at the start
+// of the next datagram: an MPEG-TS duplicate packet (same continuity
+// counter, straight after the original on its PID), which demuxers drop if
+// they already have the original. Losing any one datagram then doesn't
+// lose the tables, and a receiver that joins mid-stream doesn't have to
+// wait for the next ones -- redundancy without FEC.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#ifndef FFMPEGBRIDGE_UDP_H
+#define FFMPEGBRIDGE_UDP_H
+
+#include <stdint.h>
+
+#define FFMPBR_UDP_TS_PACKET_SIZE 188
+#define FFMPBR_UDP_TS_PER_DATAGRAM 7
+#define FFMPBR_UDP_DATAGRAM_SIZE (FFMPBR_UDP_TS_PACKET_SIZE * FFMPBR_UDP_TS_PER_DATAGRAM)
+
+// the PAT and the PMT
+#define FFMPBR_UDP_MAX_DUPLICATES 2
+
+// sends one datagram; size on success, or an AVERROR
+typedef int (*FFmpegBridgeUdpSend)(void *opaque, uint8_t *datagram, int size);
+
+typedef struct
+{
+  int64_t datagrams;
+  int64_t duplicate_tables;
+} FFmpegBridgeUdpStats;
+
+typedef struct
+{
+  int duplicate_tables;
+
+  // from the PAT, -1 until one has gone by
+  int pmt_pid;
+
+  // the TS packet coming in, if a write ended partway through it
+  uint8_t packet[FFMPBR_UDP_TS_PACKET_SIZE];
+  int packet_size;
+
+  // the datagram being filled, and the table packets to send again at the
+  // start of the next one (the next write's, at the latest)
+  uint8_t datagram[FFMPBR_UDP_DATAGRAM_SIZE];
+  int datagram_size;
+  uint8_t duplicates[FFMPBR_UDP_MAX_DUPLICATES][FFMPBR_UDP_TS_PACKET_SIZE];
+  int duplicate_count;
+
+  FFmpegBridgeUdpSend send;
+  void *opaque;
+
+  FFmpegBridgeUdpStats stats;
+} FFmpegBridgeUdp;
+
+void ffmpbr_udp_init(FFmpegBridgeUdp *udp, int duplicate_tables, FFmpegBridgeUdpSend send,
+  void *opaque);
+
+// takes TS from the muxer, in any pieces, and sends the whole packets in
+// it; size on success, or the AVERROR a send failed with
+int ffmpbr_udp_write(FFmpegBridgeUdp *udp, const uint8_t *buf, int size);
+
+// the number of bytes of a TS packet waiting for the rest of it
+int ffmpbr_udp_pending(FFmpegBridgeUdp *udp);
+
+#endif
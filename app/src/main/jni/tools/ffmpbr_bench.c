@@ -0,0 +1,272 @@
+//
+// Micro-benchmarks for the bridge's hot per-packet paths, run on a device
+// through adb shell.
+//
+// usage: ffmpbr_bench [-s frame_kb] [-d seconds] [-b kbps] [-l media_seconds]
+//
+//   -s  size of the synthetic keyframe, in KB (default 256)
+//   -d  how long to run each benchmark for, in seconds (default 1)
+//   -b  video bit rate for the in-memory HLS benchmarks, 1080p30 with a 2s
+//       GOP and 2s segments (default 6000)
+//   -l  length of the media pushed through them, in seconds (default 120)
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libavutil/mem.h"
+
+#include "ffmpegbridge_context.h"
+#include "ffmpegbridge_latency.h"
+#include "ffmpegbridge_nal.h"
+
+// slices per synthetic keyframe, as a multi-slice encoder would produce
+#define BENCH_SLICES 4
+
+// the in-memory HLS setup: 1080p30, a keyframe every 2s, 2s segments and a
+// 6 segment playlist, with 128kbps AAC-LC alongside
+#define BENCH_HLS_FPS 30
+#define BENCH_HLS_GOP 60
+#define BENCH_HLS_SEGMENT_MS 2000
+#define BENCH_HLS_LIST_SIZE 6
+#define BENCH_HLS_AUDIO_FRAME 372
+
+typedef struct
+{
+  int frame_size;
+  int64_t duration_us;
+  int video_kbps;
+  int media_seconds;
+} BenchOptions;
+
+typedef struct
+{
+  int segments;
+  int64_t bytes;
+} BenchHlsOutput;
+
+// a plausible baseline SPS/PPS, and AAC-LC 44.1kHz mono
+static const uint8_t bench_video_extradata[] = {
+  0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x80, 0x1f, 0xda, 0x01, 0x40, 0x16, 0xe8, 0x06, 0xd0,
+  0xa1, 0x35, 0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x06, 0xe2
+};
+static const uint8_t bench_audio_extradata[] = { 0x12, 0x08 };
+
+void _usage() {
+  fprintf(stderr, "usage: ffmpbr_bench [-s frame_kb] [-d seconds] [-b kbps] [-l media_seconds]\n");
+  exit(1);
+}
+
+long _rss_kb() {
+  FILE *f = fopen("/proc/self/statm", "r");
+  long pages = 0, resident = 0;
+
+  if (!f) return 0;
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// an IDR access unit as MediaCodec emits it -- SPS, PPS, then slices, all
+// with 4 byte start codes, and slice data that (like real emulation
+// prevented data) never contains 00 00 0x
+int _make_keyframe(uint8_t *frame, int size) {
+  static const uint8_t sps[] = { 0, 0, 0, 1, 0x67, 0x42, 0x80, 0x1f, 0xda, 0x01, 0x40, 0x16, 0xe8 };
+  static const uint8_t pps[] = { 0, 0, 0, 1, 0x68, 0xce, 0x06, 0xe2 };
+  int pos = 0, slice_size, i, j;
+
+  memcpy(frame + pos, sps, sizeof(sps));
+  pos += sizeof(sps);
+  memcpy(frame + pos, pps, sizeof(pps));
+  pos += sizeof(pps);
+
+  slice_size = (size - pos) / BENCH_SLICES;
+  for (i = 0; i < BENCH_SLICES; ++i) {
+    frame[pos++] = 0;
+    frame[pos++] = 0;
+    frame[pos++] = 0;
+    frame[pos++] = 1;
+    frame[pos++] = 0x65;
+    for (j = 5; j < slice_size; ++j) {
+      frame[pos] = rand() & 0xff;
+      if (frame[pos] <= 3 && pos >= 2 && !frame[pos - 1] && !frame[pos - 2]) frame[pos] = 3;
+      pos++;
+    }
+    // rbsp_stop_one_bit, so the slice doesn't end in a zero byte
+    frame[pos - 1] = 0x80;
+  }
+
+  return pos;
+}
+
+void _bench_scanner(const char *name, FFmpegBridgeStartCodeFinder find, uint8_t *frame,
+  int size, BenchOptions *opts) {
+  const uint8_t *p, *end = frame + size;
+  int64_t start_us, elapsed_us, bytes = 0;
+  int found = 0;
+
+  start_us = ffmpbr_now_us();
+  do {
+    for (p = find(frame, end), found = 0; p < end; p = find(p + 3, end)) {
+      found++;
+    }
+    bytes += size;
+    elapsed_us = ffmpbr_now_us() - start_us;
+  } while (elapsed_us < opts->duration_us);
+
+  printf("scan    %-6s %9.1f MB/s  (%d start codes per frame)\n", name,
+    bytes / (double)elapsed_us, found);
+}
+
+void _bench_convert(uint8_t *frame, int size, BenchOptions *opts) {
+  uint8_t *out = NULL;
+  unsigned int out_size = 0;
+  int64_t start_us, elapsed_us, bytes = 0;
+  int rc = 0;
+
+  start_us = ffmpbr_now_us();
+  do {
+    rc = ffmpbr_nal_annexb_to_avcc(frame, size, &out, &out_size);
+    if (rc < 0) {
+      fprintf(stderr, "conversion failed\n");
+      break;
+    }
+    bytes += size;
+    elapsed_us = ffmpbr_now_us() - start_us;
+  } while (elapsed_us < opts->duration_us);
+
+  printf("avcc    %-6s %9.1f MB/s\n", ffmpbr_nal_find_startcode_name(),
+    bytes / (double)elapsed_us);
+  av_free(out);
+}
+
+// a non-IDR frame: a single slice, start code first
+int _make_frame(uint8_t *frame, int size) {
+  int pos;
+
+  memcpy(frame, "\0\0\0\1\x41", 5);
+  for (pos = 5; pos < size; ++pos) {
+    frame[pos] = rand() & 0xff;
+    if (frame[pos] <= 3 && !frame[pos - 1] && !frame[pos - 2]) frame[pos] = 3;
+  }
+  frame[size - 1] = 0x80;
+  return size;
+}
+
+void _on_bench_segment(void *opaque, FFmpegBridgeHlsSegment *segment, const char *playlist) {
+  BenchHlsOutput *output = opaque;
+
+  output->segments++;
+  output->bytes += segment->size;
+}
+
+// pushes media_seconds of 1080p video and AAC through an in-memory HLS
+// session as fast as it goes. Every frame is written straight out of a
+// template, which the bridge only reads.
+void _bench_hls(const char *format, const char *url, BenchOptions *opts) {
+  FFmpegBridgeContext *br_ctx;
+  FFmpegBridgeHlsStats stats;
+  BenchHlsOutput output = { 0, 0 };
+  int frame_bytes = opts->video_kbps * 1000 / 8 / BENCH_HLS_FPS;
+  int p_size = frame_bytes * 3 / 4;
+  int key_size = frame_bytes * BENCH_HLS_GOP - p_size * (BENCH_HLS_GOP - 1);
+  int64_t frames = (int64_t)opts->media_seconds * BENCH_HLS_FPS, video = 0, audio = 0;
+  int64_t video_pts, audio_pts, start_us, elapsed_us, finalize_us;
+  uint8_t *key_frame = av_malloc(key_size), *p_frame = av_malloc(p_size);
+  uint8_t audio_frame[BENCH_HLS_AUDIO_FRAME];
+  long start_rss = _rss_kb(), peak_rss = start_rss, rss;
+
+  _make_keyframe(key_frame, key_size);
+  _make_frame(p_frame, p_size);
+  memset(audio_frame, 0x21, sizeof(audio_frame));
+
+  br_ctx = ffmpbr_init(format, url, 1920, 1080, BENCH_HLS_FPS, opts->video_kbps * 1000,
+    44100, 1, 128000);
+  ffmpbr_set_video_reorder_depth(br_ctx, 0);
+  ffmpbr_set_hls_callback(br_ctx, BENCH_HLS_LIST_SIZE, _on_bench_segment, &output);
+  ffmpbr_set_segmenting(br_ctx, BENCH_HLS_SEGMENT_MS);
+  ffmpbr_set_video_codec_extradata(br_ctx, (int8_t *)bench_video_extradata,
+    sizeof(bench_video_extradata));
+  ffmpbr_set_audio_codec_extradata(br_ctx, (int8_t *)bench_audio_extradata,
+    sizeof(bench_audio_extradata));
+  ffmpbr_write_header(br_ctx);
+
+  start_us = ffmpbr_now_us();
+  while (video < frames) {
+    video_pts = video * 1000000 / BENCH_HLS_FPS;
+    audio_pts = audio * 1024 * 1000000 / 44100;
+    if (audio_pts < video_pts) {
+      ffmpbr_write_packet(br_ctx, audio_frame, sizeof(audio_frame), (long)audio_pts, 0, 0, ffmpbr_now_us());
+      audio++;
+    } else if (video % BENCH_HLS_GOP == 0) {
+      ffmpbr_write_packet(br_ctx, key_frame, key_size, (long)video_pts, 1, 1, ffmpbr_now_us());
+      video++;
+    } else {
+      ffmpbr_write_packet(br_ctx, p_frame, p_size, (long)video_pts, 1, 0, ffmpbr_now_us());
+      video++;
+    }
+
+    if (video % BENCH_HLS_FPS == 0 && (rss = _rss_kb()) > peak_rss) peak_rss = rss;
+  }
+  elapsed_us = ffmpbr_now_us() - start_us;
+
+  ffmpbr_get_hls_stats(br_ctx, &stats);
+  finalize_us = ffmpbr_now_us();
+  ffmpbr_finalize(br_ctx);
+  finalize_us = ffmpbr_now_us() - finalize_us;
+
+  printf("hls     %-6s %9.1f MB/s  (%.0fx realtime at %d kbps, %d segments, finalize %lld us)\n",
+    format, output.bytes / (double)elapsed_us,
+    opts->media_seconds * 1e6 / elapsed_us, opts->video_kbps, output.segments, finalize_us);
+  printf("        %-6s %9lld KB    buffered at most (%lld KB largest segment), rss +%ld KB\n",
+    "", stats.max_buffered_bytes / 1024, stats.max_segment_bytes / 1024, peak_rss - start_rss);
+
+  av_free(key_frame);
+  av_free(p_frame);
+}
+
+int main(int argc, char **argv) {
+  BenchOptions opts = { 256 * 1024, 1000000, 6000, 120 };
+  uint8_t *frame;
+  int size, c;
+
+  while ((c = getopt(argc, argv, "s:d:b:l:")) != -1) {
+    switch (c) {
+    case 's': opts.frame_size = atoi(optarg) * 1024; break;
+    case 'd': opts.duration_us = atoi(optarg) * 1000000LL; break;
+    case 'b': opts.video_kbps = atoi(optarg); break;
+    case 'l': opts.media_seconds = atoi(optarg); break;
+    default: _usage();
+    }
+  }
+  if (opts.frame_size < 1024 || opts.duration_us <= 0 || opts.video_kbps < 100 ||
+    opts.media_seconds <= 0) {
+    _usage();
+  }
+
+  frame = av_malloc(opts.frame_size);
+  size = _make_keyframe(frame, opts.frame_size);
+
+  _bench_scanner("c", ffmpbr_nal_find_startcode_c, frame, size, &opts);
+  _bench_scanner("word", ffmpbr_nal_find_startcode_word, frame, size, &opts);
+#if defined(__SSE2__)
+  _bench_scanner("sse2", ffmpbr_nal_find_startcode_sse2, frame, size, &opts);
+#endif
+#if defined(FFMPBR_HAVE_NEON)
+  // (only when the cpu has it)
+  if (!strcmp(ffmpbr_nal_find_startcode_name(), "neon")) {
+    _bench_scanner("neon", ffmpbr_nal_find_startcode_neon, frame, size, &opts);
+  }
+#endif
+  _bench_convert(frame, size, &opts);
+
+  _bench_hls("mpegts", "mem:bench-%d.ts", &opts);
+  _bench_hls("mp4", "mem:bench-%d.m4s", &opts);
+
+  av_free(frame);
+  return 0;
+}
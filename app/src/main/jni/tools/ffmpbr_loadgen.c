@@ -0,0 +1,1014 @@
+//
+// Load generator: runs N bridge sessions concurrently, each on its own
+// thread, and reports how throughput, write latency, CPU and memory scale
+// as N grows.
+//
+// usage: ffmpbr_loadgen [-s n1,n2,...] [-d seconds] [-m] [-c capture]
+//                       [-o null|tcp|rtmp|<directory>] [-e threads] [-v h264|hevc]
+//                       [-k chunk_size] [-p percent] [-r kbit/s] [-b ms] [-f seconds]
+//                       [-w ms] [-l ms] [-q ms]
+//
+//   -s  comma separated list of session counts to run (default 1,2,4,8)
+//   -d  seconds of media each session writes (default 10)
+//   -m  write as fast as possible instead of in real time
+//   -c  replay this capture in every session instead of synthetic packets
+//   -o  where sessions write to: /dev/null, a built-in loopback TCP server
+//       that discards everything it receives, or one flv file per session
+//       in the given directory (default null). rtmp is the same server
+//       speaking just enough RTMP to accept a publish, and reports the
+//       share of the received messages spent on chunk headers.
+//   -e  write through this many shared event loop threads, rather than
+//       inline on each session's thread (with -o rtmp, each session has a
+//       loop thread of its own instead, see ffmpegbridge_loop.h)
+//   -v  the video codec of the synthetic stream, or of the capture (default
+//       h264)
+//   -k  with -o rtmp, publish through the bridge's own librtmp connection
+//       with this outgoing chunk size (default: libavformat's, at 128)
+//   -p  pace each session's output at this percentage of its bit rate
+//   -r  with -o tcp or rtmp, shape each connection to this many kbit/s: the
+//       server reads no faster, through a small receive buffer, so that
+//       bursts back up into the sender as they would on a slow link
+//   -b  with -o rtmp, probe each session's bandwidth for this many ms before
+//       its header, and report what was measured and the video bit rate
+//       recommended
+//   -f  with -o tcp or rtmp, give each session a second stand-in server as
+//       its backup ingest, and kill the first one this many seconds into
+//       every run; reports how long sessions took to notice, and then to
+//       have the header and the GOP so far out on the backup
+//   -w  keep sessions' RTMP connections warm for this many ms after they
+//       finish (see ffmpegbridge_pool.h), for the next run's sessions to
+//       start on; run the same session count more than once to see it
+//   -l  with -o rtmp, have the server wait this many ms before each reply
+//       during the handshake and to commands, standing in for the round
+//       trip to a distant ingest (TCP's own handshake stays at loopback's)
+//   -q  turn packets away while more than this many ms of each session's
+//       output is queued (see ffmpbr_set_write_queue_limit), and report
+//       the share of packets that were, and the longest any write took;
+//       with -r below the stream's bit rate, the link stands in for a
+//       stalled ingest
+//
+//   With -o rtmp each run also reports how long sessions took to start:
+//   from ffmpbr_init until their first packet was written.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "libavutil/intfloat.h"
+#include "libavutil/intreadwrite.h"
+
+#include "ffmpegbridge_capture.h"
+#include "ffmpegbridge_context.h"
+#include "ffmpegbridge_pool.h"
+
+#define LOADGEN_MAX_RUNS 16
+#define LOADGEN_MAX_CONNECTIONS 1024
+
+typedef struct
+{
+  int session_counts[LOADGEN_MAX_RUNS];
+  int num_runs;
+  int duration_s;
+  int max_speed;
+  const char *capture_path;
+  const char *output;
+  int loop_threads;
+  const char *video_codec;
+  int rtmp_chunk_size;
+  int pacing_percent;
+  int link_kbit_rate;
+  int probe_ms;
+  int failover_s;
+  int pool_grace_ms;
+  int reply_delay_ms;
+  int write_queue_ms;
+} LoadgenOptions;
+
+typedef struct
+{
+  // a synthetic stream, or the packets of a capture
+  FFmpegBridgeCaptureConfig config;
+  uint8_t *video_extradata;
+  int video_extradata_size;
+  uint8_t *audio_extradata;
+  int audio_extradata_size;
+  FFmpegBridgeCaptureReader *capture;
+} LoadgenSource;
+
+typedef struct
+{
+  int index;
+  LoadgenOptions *opts;
+  LoadgenSource *source;
+  FFmpegBridgeContext *br_ctx;
+  pthread_t thread;
+
+  int64_t packets;
+  int64_t bytes;
+  int64_t cpu_us;
+  FFmpegBridgeSendStats send_stats;
+  int64_t latency_p99_us;
+  FFmpegBridgeProbeResult probe;
+  FFmpegBridgeFailoverStats failover;
+  int64_t open_us;
+  int64_t statuses[FFMPBR_WRITE_DISCONNECTED + 1];
+  int64_t *write_us;
+  int write_count;
+  int write_capacity;
+} LoadgenSession;
+
+// the loopback stand-in server
+typedef struct
+{
+  int listen_fd;
+  int port;
+  int rtmp;
+  int link_kbit_rate;
+  int reply_delay_ms;
+  volatile int64_t bytes_received;
+
+  // rtmp only -- message payload, and the chunk headers around it
+  volatile int64_t rtmp_message_bytes;
+  volatile int64_t rtmp_header_bytes;
+
+  // the open connections, for killing the server (-f)
+  pthread_mutex_t lock;
+  int fds[LOADGEN_MAX_CONNECTIONS];
+  int num_fds;
+} LoadgenServer;
+
+// one connection to it, read through the link's token bucket if shaped
+typedef struct
+{
+  LoadgenServer *server;
+  int fd;
+  int shaped;
+  FFmpegBridgePacer link;
+} LoadgenConnection;
+
+#define LOADGEN_RTMP_SIG_SIZE 1536
+#define LOADGEN_RTMP_CHUNK_SIZE 128
+#define LOADGEN_RTMP_CHANNELS 64
+
+// one chunk stream of an RTMP connection, and the message coming in on it
+typedef struct
+{
+  uint32_t timestamp;
+  int extended;
+  int length;
+  int type;
+  uint8_t *data;
+  int capacity;
+  int received;
+} LoadgenRtmpChannel;
+
+// a plausible 1280x720 baseline SPS/PPS, and AAC-LC 44.1kHz mono
+static const uint8_t synthetic_video_extradata[] = {
+  0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x80, 0x1f, 0xda, 0x01, 0x40, 0x16, 0xe8, 0x06, 0xd0,
+  0xa1, 0x35, 0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x06, 0xe2
+};
+static const uint8_t synthetic_audio_extradata[] = { 0x12, 0x08 };
+
+// a 1280x720 Main profile VPS/SPS/PPS
+static const uint8_t synthetic_hevc_extradata[] = {
+  0x00, 0x00, 0x00, 0x01, 0x40, 0x01, 0x0c, 0x01, 0xff, 0xff, 0x01, 0x60, 0x00, 0x00, 0x03,
+  0x00, 0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x5d, 0x97, 0x02, 0x40, 0x00, 0x00,
+  0x00, 0x01, 0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00, 0x03,
+  0x00, 0x00, 0x03, 0x00, 0x5d, 0xa0, 0x02, 0x80, 0x80, 0x2d, 0x16, 0x59, 0x7b, 0x93, 0x6b,
+  0x20, 0x00, 0x00, 0x00, 0x01, 0x44, 0x01, 0xc0, 0x71, 0x81, 0x12
+};
+
+void _usage() {
+  fprintf(stderr, "usage: ffmpbr_loadgen [-s n1,n2,...] [-d seconds] [-m] [-c capture] "
+    "[-o null|tcp|rtmp|<directory>] [-e threads] [-v h264|hevc] [-k chunk_size] [-p percent] "
+    "[-r kbit/s] [-b ms] [-f seconds] [-w ms] [-l ms] [-q ms]\n");
+  exit(1);
+}
+
+int64_t _thread_cpu_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int _thread_count() {
+  char line[128];
+  int threads = 0;
+  FILE *f = fopen("/proc/self/status", "r");
+  if (!f) return 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "Threads: %d", &threads) == 1) break;
+  }
+  fclose(f);
+  return threads;
+}
+
+int64_t _context_switches() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+int64_t _resident_bytes() {
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f) return 0;
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(f);
+  return (int64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+void _sleep_until(int64_t deadline_us) {
+  struct timespec ts;
+  int64_t remaining = deadline_us - ffmpbr_now_us();
+
+  if (remaining <= 0) return;
+  ts.tv_sec = remaining / 1000000;
+  ts.tv_nsec = (remaining % 1000000) * 1000;
+  nanosleep(&ts, NULL);
+}
+
+int _compare_int64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+int64_t _percentile(int64_t *values, int count, int percentile) {
+  int index;
+  if (!count) return 0;
+  qsort(values, count, sizeof(int64_t), _compare_int64);
+  index = (count * percentile) / 100;
+  return values[index < count ? index : count - 1];
+}
+
+
+//
+//-- loopback stand-in server
+//
+
+// reads what's there, up to size, but no faster than the link rate
+ssize_t _conn_read(LoadgenConnection *conn, uint8_t *buf, int size) {
+  int64_t now_us, allowance;
+  ssize_t n;
+
+  while (conn->shaped) {
+    now_us = ffmpbr_now_us();
+    allowance = ffmpbr_pacer_allowance(&conn->link, now_us);
+    if (allowance >= FFMIN(size, FFMPBR_PACER_QUANTUM)) {
+      size = FFMIN(size, allowance);
+      break;
+    }
+    _sleep_until(now_us + ffmpbr_pacer_wait_us(&conn->link, size, now_us));
+  }
+
+  n = read(conn->fd, buf, size);
+  if (n > 0) {
+    if (conn->shaped) ffmpbr_pacer_consume(&conn->link, n);
+    __sync_fetch_and_add(&conn->server->bytes_received, n);
+  }
+  return n;
+}
+
+int _read_fully(LoadgenConnection *conn, uint8_t *buf, int size) {
+  ssize_t n;
+  int done = 0;
+
+  while (done < size) {
+    n = _conn_read(conn, buf + done, size - done);
+    if (n <= 0) return -1;
+    done += n;
+  }
+  return 0;
+}
+
+int _write_fully(int fd, const uint8_t *buf, int size) {
+  ssize_t n;
+  int done = 0;
+
+  while (done < size) {
+    n = write(fd, buf + done, size - done);
+    if (n <= 0) return -1;
+    done += n;
+  }
+  return 0;
+}
+
+uint8_t* _amf_string(uint8_t *p, const char *str) {
+  int len = strlen(str);
+  *p++ = 0x02;
+  AV_WB16(p, len);
+  memcpy(p + 2, str, len);
+  return p + 2 + len;
+}
+
+uint8_t* _amf_number(uint8_t *p, double number) {
+  *p++ = 0x00;
+  AV_WB64(p, av_double2int(number));
+  return p + 8;
+}
+
+// an object of string properties, from pairs of key and value
+uint8_t* _amf_object(uint8_t *p, const char **pairs) {
+  int len;
+
+  *p++ = 0x03;
+  for (; *pairs; pairs += 2) {
+    len = strlen(pairs[0]);
+    AV_WB16(p, len);
+    memcpy(p + 2, pairs[0], len);
+    p = _amf_string(p + 2 + len, pairs[1]);
+  }
+  AV_WB24(p, 0x000009);
+  return p + 3;
+}
+
+// a command message on chunk stream 3, in 128 byte chunks
+int _rtmp_send_command(int fd, const uint8_t *body, int size) {
+  uint8_t buf[4096], *p = buf;
+  int offset;
+
+  *p++ = 0x03;
+  AV_WB24(p, 0);
+  AV_WB24(p + 3, size);
+  p[6] = 20;
+  AV_WL32(p + 7, 0);
+  p += 11;
+  for (offset = 0; offset < size; offset += LOADGEN_RTMP_CHUNK_SIZE) {
+    if (offset) *p++ = 0xc3;
+    memcpy(p, body + offset, FFMIN(size - offset, LOADGEN_RTMP_CHUNK_SIZE));
+    p += FFMIN(size - offset, LOADGEN_RTMP_CHUNK_SIZE);
+  }
+  return _write_fully(fd, buf, p - buf);
+}
+
+// answers the commands a publishing client waits on: connect, createStream
+// and publish. Anything else (e.g. the bridge's bandwidth probe, or
+// deleteStream) is ignored, as a real server would.
+int _rtmp_command(LoadgenServer *server, int fd, const uint8_t *body, int size) {
+  static const char *connected[] = { "level", "status", "code", "NetConnection.Connect.Success",
+    NULL };
+  static const char *publishing[] = { "level", "status", "code", "NetStream.Publish.Start",
+    NULL };
+  char name[64];
+  uint8_t reply[512], *p = reply;
+  double txn;
+  int len;
+
+  if (size < 3 || body[0] != 0x02) return 0;
+  len = AV_RB16(body + 1);
+  if (3 + len + 9 > size || len >= sizeof(name) || body[3 + len] != 0x00) return 0;
+  memcpy(name, body + 3, len);
+  name[len] = 0;
+  txn = av_int2double(AV_RB64(body + 3 + len + 1));
+
+  if (!strcmp(name, "connect")) {
+    p = _amf_string(p, "_result");
+    p = _amf_number(p, txn);
+    *p++ = 0x05;
+    p = _amf_object(p, connected);
+  } else if (!strcmp(name, "createStream")) {
+    p = _amf_string(p, "_result");
+    p = _amf_number(p, txn);
+    *p++ = 0x05;
+    p = _amf_number(p, 1);
+  } else if (!strcmp(name, "publish")) {
+    p = _amf_string(p, "onStatus");
+    p = _amf_number(p, 0);
+    *p++ = 0x05;
+    p = _amf_object(p, publishing);
+  } else {
+    return 0;
+  }
+  if (server->reply_delay_ms) usleep(server->reply_delay_ms * 1000);
+  return _rtmp_send_command(fd, reply, p - reply);
+}
+
+// the simple handshake, then chunks until the client hangs up
+void _rtmp_serve(LoadgenConnection *conn) {
+  LoadgenServer *server = conn->server;
+  int fd = conn->fd;
+  LoadgenRtmpChannel channels[LOADGEN_RTMP_CHANNELS], *ch;
+  uint8_t c1[1 + LOADGEN_RTMP_SIG_SIZE], s[1 + 2 * LOADGEN_RTMP_SIG_SIZE], hdr[16];
+  int chunk_size = LOADGEN_RTMP_CHUNK_SIZE, fmt, csid, header_size, size;
+
+  memset(channels, 0, sizeof(channels));
+  if (_read_fully(conn, c1, sizeof(c1)) < 0) return;
+  memset(s, 0, sizeof(s));
+  s[0] = 3;
+  memcpy(s + 1 + LOADGEN_RTMP_SIG_SIZE, c1 + 1, LOADGEN_RTMP_SIG_SIZE);
+  if (server->reply_delay_ms) usleep(server->reply_delay_ms * 1000);
+  if (_write_fully(fd, s, sizeof(s)) < 0 ||
+      _read_fully(conn, c1, LOADGEN_RTMP_SIG_SIZE) < 0) return;
+
+  for (;;) {
+    if (_read_fully(conn, hdr, 1) < 0) break;
+    fmt = hdr[0] >> 6;
+    csid = hdr[0] & 0x3f;
+    header_size = 1;
+    if (csid < 2) {
+      if (_read_fully(conn, hdr + 1, csid + 1) < 0) break;
+      header_size += csid + 1;
+      csid = 64 + hdr[1] + (csid ? hdr[2] * 256 : 0);
+    }
+    ch = &channels[csid % LOADGEN_RTMP_CHANNELS];
+
+    size = fmt == 0 ? 11 : fmt == 1 ? 7 : fmt == 2 ? 3 : 0;
+    if (size && _read_fully(conn, hdr, size) < 0) break;
+    header_size += size;
+    if (fmt < 3) {
+      ch->timestamp = AV_RB24(hdr);
+      ch->extended = ch->timestamp == 0xffffff;
+    }
+    if (fmt < 2) {
+      ch->length = AV_RB24(hdr + 3);
+      ch->type = hdr[6];
+    }
+    if (ch->extended) {
+      if (_read_fully(conn, hdr, 4) < 0) break;
+      header_size += 4;
+    }
+
+    if (ch->length > ch->capacity) {
+      ch->capacity = ch->length;
+      ch->data = realloc(ch->data, ch->capacity);
+    }
+    size = FFMIN(chunk_size, ch->length - ch->received);
+    if (_read_fully(conn, ch->data + ch->received, size) < 0) break;
+    ch->received += size;
+    __sync_fetch_and_add(&server->rtmp_header_bytes, header_size);
+    if (ch->received < ch->length) continue;
+
+    ch->received = 0;
+    __sync_fetch_and_add(&server->rtmp_message_bytes, ch->length);
+    if (ch->type == 1 && ch->length >= 4) {
+      chunk_size = AV_RB32(ch->data) & 0x7fffffff;
+    } else if (ch->type == 20 && _rtmp_command(server, fd, ch->data, ch->length) < 0) {
+      break;
+    }
+  }
+
+  for (csid = 0; csid < LOADGEN_RTMP_CHANNELS; ++csid) free(channels[csid].data);
+}
+
+void* _server_connection(void *arg) {
+  LoadgenConnection *conn = arg;
+  uint8_t buf[65536];
+  int i;
+
+  // shaped with the bridge's own token bucket
+  if (conn->server->link_kbit_rate) {
+    conn->shaped = 1;
+    ffmpbr_pacer_init(&conn->link, conn->server->link_kbit_rate * 1000LL, FFMPBR_PACER_QUANTUM);
+  }
+  if (conn->server->rtmp) {
+    _rtmp_serve(conn);
+  } else {
+    while (_conn_read(conn, buf, sizeof(buf)) > 0);
+  }
+
+  pthread_mutex_lock(&conn->server->lock);
+  for (i = 0; i < conn->server->num_fds; ++i) {
+    if (conn->server->fds[i] == conn->fd) {
+      conn->server->fds[i] = conn->server->fds[--conn->server->num_fds];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&conn->server->lock);
+  close(conn->fd);
+  free(conn);
+  return NULL;
+}
+
+void* _server_accept(void *arg) {
+  LoadgenServer *server = arg;
+  LoadgenConnection *conn;
+  pthread_t thread;
+  int fd;
+
+  while ((fd = accept(server->listen_fd, NULL, NULL)) >= 0) {
+    conn = calloc(1, sizeof(LoadgenConnection));
+    conn->server = server;
+    conn->fd = fd;
+    pthread_mutex_lock(&server->lock);
+    if (server->num_fds < LOADGEN_MAX_CONNECTIONS) server->fds[server->num_fds++] = fd;
+    pthread_mutex_unlock(&server->lock);
+    pthread_create(&thread, NULL, _server_connection, conn);
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+int _server_start(LoadgenServer *server, int rtmp, int link_kbit_rate, int reply_delay_ms) {
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  pthread_t thread;
+  int rcvbuf = 16384, mss = 1400;
+
+  memset(server, 0, sizeof(LoadgenServer));
+  pthread_mutex_init(&server->lock, NULL);
+  server->rtmp = rtmp;
+  server->link_kbit_rate = link_kbit_rate;
+  server->reply_delay_ms = reply_delay_ms;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  // (accepted connections inherit them.) Loopback's segments are 64K, so
+  // a small receive window would open in steps of half of it; a real link's
+  // segments are more like this.
+  if (link_kbit_rate) {
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(server->listen_fd, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss));
+  }
+  if (server->listen_fd < 0 ||
+      bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(server->listen_fd, 1024) < 0 ||
+      getsockname(server->listen_fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+    fprintf(stderr, "could not start loopback server: %s\n", strerror(errno));
+    return -1;
+  }
+  server->port = ntohs(addr.sin_port);
+
+  pthread_create(&thread, NULL, _server_accept, server);
+  pthread_detach(thread);
+  return 0;
+}
+
+// -f: the server dies -- it stops listening, and resets every connection
+void _server_kill(LoadgenServer *server) {
+  struct linger linger = { 1, 0 };
+  int i;
+
+  shutdown(server->listen_fd, SHUT_RDWR);
+  pthread_mutex_lock(&server->lock);
+  for (i = 0; i < server->num_fds; ++i) {
+    setsockopt(server->fds[i], SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    shutdown(server->fds[i], SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&server->lock);
+}
+
+// back up again on a new port, for the next run, once the old connections
+// are gone
+int _server_restart(LoadgenServer *server) {
+  for (;;) {
+    pthread_mutex_lock(&server->lock);
+    if (!server->num_fds) break;
+    pthread_mutex_unlock(&server->lock);
+    usleep(10000);
+  }
+  pthread_mutex_unlock(&server->lock);
+  pthread_mutex_destroy(&server->lock);
+  close(server->listen_fd);
+  return _server_start(server, server->rtmp, server->link_kbit_rate, server->reply_delay_ms);
+}
+
+void _server_url(char *url, int url_size, const char *output, LoadgenServer *server, int index) {
+  if (!strcmp(output, "tcp")) {
+    snprintf(url, url_size, "tcp://127.0.0.1:%d", server->port);
+  } else {
+    snprintf(url, url_size, "rtmp://127.0.0.1:%d/live/session-%d", server->port, index);
+  }
+}
+
+
+//
+//-- sessions
+//
+
+void _record_write(LoadgenSession *session, int64_t write_us, int size) {
+  if (session->write_count == session->write_capacity) {
+    session->write_capacity = session->write_capacity ? session->write_capacity * 2 : 4096;
+    session->write_us = realloc(session->write_us, session->write_capacity * sizeof(int64_t));
+  }
+  session->write_us[session->write_count++] = write_us;
+  session->packets++;
+  session->bytes += size;
+}
+
+void _write(LoadgenSession *session, uint8_t *data, int size, int64_t pts, int is_video,
+  int is_keyframe) {
+  int64_t t = ffmpbr_now_us();
+  session->statuses[ffmpbr_write_packet(session->br_ctx, data, size, (long)pts, is_video,
+    is_keyframe, t)]++;
+  _record_write(session, ffmpbr_now_us() - t, size);
+}
+
+void _run_synthetic(LoadgenSession *session, int64_t start_us) {
+  FFmpegBridgeCaptureConfig *config = &session->source->config;
+  int64_t duration_us = (int64_t)session->opts->duration_s * 1000000;
+  int64_t video_pts = 0, audio_pts = 0;
+  int64_t video_frame_us = 1000000 / config->video_fps;
+  int64_t audio_frame_us = 1024 * 1000000LL / config->audio_sample_rate;
+  int gop = config->video_fps * 2, frame = 0;
+  int p_frame_size = config->video_bit_rate / 8 / config->video_fps;
+  int audio_frame_size = config->audio_bit_rate / 8 * audio_frame_us / 1000000;
+  int video_buffer_size = p_frame_size * 10;
+  uint8_t *video = malloc(video_buffer_size), *audio = malloc(audio_frame_size);
+  int hevc = !strcmp(session->opts->video_codec, "hevc");
+  int size, is_keyframe;
+
+  // payload contents don't matter to the bridge, only the NAL header does
+  memset(video, 0x5a, video_buffer_size);
+  memset(audio, 0x21, audio_frame_size);
+  video[0] = video[1] = video[2] = 0x00;
+  video[3] = 0x01;
+
+  while (video_pts < duration_us || audio_pts < duration_us) {
+    if (video_pts <= audio_pts) {
+      if (!session->opts->max_speed) _sleep_until(start_us + video_pts);
+      is_keyframe = (frame++ % gop) == 0;
+      size = is_keyframe ? video_buffer_size : p_frame_size;
+      if (hevc) {
+        // IDR_W_RADL or TRAIL_R
+        video[4] = is_keyframe ? 0x26 : 0x02;
+        video[5] = 0x01;
+      } else {
+        video[4] = is_keyframe ? 0x65 : 0x41;
+      }
+      _write(session, video, size, video_pts, 1, is_keyframe);
+      video_pts += video_frame_us;
+    } else {
+      if (!session->opts->max_speed) _sleep_until(start_us + audio_pts);
+      _write(session, audio, audio_frame_size, audio_pts, 0, 0);
+      audio_pts += audio_frame_us;
+    }
+  }
+
+  free(video);
+  free(audio);
+}
+
+void _run_capture(LoadgenSession *session, int64_t start_us) {
+  FFmpegBridgeCaptureReader reader = *session->source->capture;
+  FFmpegBridgeCaptureRecord record;
+  int64_t first_arrival_us = -1;
+
+  ffmpbr_capture_reader_rewind(&reader);
+  while (ffmpbr_capture_next(&reader, &record) > 0) {
+    if (record.type != FFMPBR_CAPTURE_PACKET) continue;
+    if (first_arrival_us < 0) first_arrival_us = record.arrival_us;
+    if (!session->opts->max_speed) _sleep_until(start_us + record.arrival_us - first_arrival_us);
+
+    // (every session writes straight out of the shared mapping, which the
+    // bridge only reads)
+    _write(session, record.data, record.size, record.pts, record.flags & FFMPBR_CAPTURE_FLAG_VIDEO,
+      record.flags & FFMPBR_CAPTURE_FLAG_KEYFRAME);
+  }
+}
+
+void* _session_thread(void *arg) {
+  LoadgenSession *session = arg;
+  int64_t cpu_start = _thread_cpu_us(), start_us = ffmpbr_now_us();
+
+  if (session->source->capture) {
+    _run_capture(session, start_us);
+  } else {
+    _run_synthetic(session, start_us);
+  }
+
+  session->cpu_us = _thread_cpu_us() - cpu_start;
+  if (session->opts->pacing_percent || session->opts->link_kbit_rate) {
+    FFmpegBridgeLatencyStats latency;
+    ffmpbr_get_send_stats(session->br_ctx, &session->send_stats);
+    ffmpbr_get_latency_stats(session->br_ctx, &latency);
+    session->latency_p99_us = latency.p99_us;
+  }
+  ffmpbr_get_failover_stats(session->br_ctx, &session->failover);
+  return NULL;
+}
+
+void _session_open(LoadgenSession *session, LoadgenServer *server, LoadgenServer *backup) {
+  FFmpegBridgeCaptureConfig *config = &session->source->config;
+  const char *output = session->opts->output;
+  char url[512], backup_url[512];
+  const char *backup_urls[1] = { backup_url };
+  int64_t start_us = ffmpbr_now_us();
+
+  if (!strcmp(output, "null")) {
+    snprintf(url, sizeof(url), "/dev/null");
+  } else if (!strcmp(output, "tcp") || !strcmp(output, "rtmp")) {
+    _server_url(url, sizeof(url), output, server, session->index);
+  } else {
+    snprintf(url, sizeof(url), "%s/session-%d.flv", output, session->index);
+  }
+
+  session->br_ctx = ffmpbr_init(config->output_fmt_name, url,
+    config->video_width, config->video_height, config->video_fps, config->video_bit_rate,
+    config->audio_sample_rate, config->audio_num_channels, config->audio_bit_rate);
+  ffmpbr_set_video_codec(session->br_ctx, session->opts->video_codec);
+  if (session->opts->rtmp_chunk_size) {
+    FFmpegBridgeTransport transport = { session->opts->rtmp_chunk_size, -1, 0, 0 };
+    ffmpbr_set_transport(session->br_ctx, &transport);
+  }
+  if (session->opts->pacing_percent) {
+    ffmpbr_set_pacing(session->br_ctx, session->opts->pacing_percent, 50);
+  }
+  if (session->opts->write_queue_ms) {
+    ffmpbr_set_write_queue_limit(session->br_ctx, session->opts->write_queue_ms);
+  }
+  if (backup->port) {
+    _server_url(backup_url, sizeof(backup_url), output, backup, session->index);
+    ffmpbr_set_backup_urls(session->br_ctx, backup_urls, 1);
+  }
+  if (session->opts->probe_ms &&
+      ffmpbr_probe_bandwidth(session->br_ctx, session->opts->probe_ms, &session->probe) < 0) {
+    fprintf(stderr, "session %d: the bandwidth probe failed\n", session->index);
+  }
+  ffmpbr_set_video_codec_extradata(session->br_ctx, (int8_t *)session->source->video_extradata,
+    session->source->video_extradata_size);
+  ffmpbr_set_audio_codec_extradata(session->br_ctx, (int8_t *)session->source->audio_extradata,
+    session->source->audio_extradata_size);
+  ffmpbr_write_header(session->br_ctx);
+  session->open_us = ffmpbr_now_us() - start_us;
+}
+
+int _load_source(LoadgenOptions *opts, LoadgenSource *source, FFmpegBridgeCaptureReader *reader) {
+  FFmpegBridgeCaptureRecord record;
+  int rc;
+
+  memset(source, 0, sizeof(LoadgenSource));
+  if (!opts->capture_path) {
+    snprintf(source->config.output_fmt_name, sizeof(source->config.output_fmt_name), "flv");
+    source->config.video_width = 1280;
+    source->config.video_height = 720;
+    source->config.video_fps = 30;
+    source->config.video_bit_rate = 1500000;
+    source->config.audio_sample_rate = 44100;
+    source->config.audio_num_channels = 1;
+    source->config.audio_bit_rate = 128000;
+    if (!strcmp(opts->video_codec, "hevc")) {
+      source->video_extradata = (uint8_t *)synthetic_hevc_extradata;
+      source->video_extradata_size = sizeof(synthetic_hevc_extradata);
+    } else {
+      source->video_extradata = (uint8_t *)synthetic_video_extradata;
+      source->video_extradata_size = sizeof(synthetic_video_extradata);
+    }
+    source->audio_extradata = (uint8_t *)synthetic_audio_extradata;
+    source->audio_extradata_size = sizeof(synthetic_audio_extradata);
+    return 0;
+  }
+
+  rc = ffmpbr_capture_reader_open(reader, opts->capture_path);
+  if (rc < 0) {
+    fprintf(stderr, "could not open capture %s: %s\n", opts->capture_path, av_err2str(rc));
+    return rc;
+  }
+  source->capture = reader;
+  while (ffmpbr_capture_next(reader, &record) > 0) {
+    if (record.type == FFMPBR_CAPTURE_CONFIG) {
+      ffmpbr_capture_read_config(&record, &source->config);
+    } else if (record.type == FFMPBR_CAPTURE_VIDEO_EXTRADATA) {
+      source->video_extradata = record.data;
+      source->video_extradata_size = record.size;
+    } else if (record.type == FFMPBR_CAPTURE_AUDIO_EXTRADATA) {
+      source->audio_extradata = record.data;
+      source->audio_extradata_size = record.size;
+    }
+  }
+  // flv is what the stand-in server and the file sink expect
+  snprintf(source->config.output_fmt_name, sizeof(source->config.output_fmt_name), "flv");
+  return 0;
+}
+
+void _run(LoadgenOptions *opts, LoadgenSource *source, LoadgenServer *server,
+  LoadgenServer *backup, int num_sessions) {
+  LoadgenSession *sessions = calloc(num_sessions, sizeof(LoadgenSession));
+  int64_t rss_before, rss_open, start_us, elapsed_us, bytes = 0, cpu_us = 0;
+  int64_t *p99s = calloc(num_sessions, sizeof(int64_t));
+  int64_t server_bytes_before = server->bytes_received + backup->bytes_received;
+  int64_t message_bytes_before = server->rtmp_message_bytes;
+  int64_t header_bytes_before = server->rtmp_header_bytes;
+  int64_t *burstiness = calloc(num_sessions, sizeof(int64_t));
+  int64_t *latency_p99s = calloc(num_sessions, sizeof(int64_t));
+  int64_t *probe_rates = calloc(num_sessions, sizeof(int64_t));
+  int64_t *probe_rtts = calloc(num_sessions, sizeof(int64_t));
+  int64_t *probe_recommended = calloc(num_sessions, sizeof(int64_t));
+  int64_t *detect_us = calloc(num_sessions, sizeof(int64_t));
+  int64_t *failover_us = calloc(num_sessions, sizeof(int64_t));
+  int64_t *start_us_all = calloc(num_sessions, sizeof(int64_t));
+  int64_t *write_max_us = calloc(num_sessions, sizeof(int64_t));
+  int64_t packets = 0, turned_away = 0;
+  FFmpegBridgePoolStats pool_before, pool_after;
+  int64_t switches_before, retransmits = 0, kill_us = 0;
+  int i, threads;
+
+  rss_before = _resident_bytes();
+  ffmpbr_pool_get_stats(&pool_before);
+
+  // libavformat's global init isn't thread safe, so open sessions serially
+  for (i = 0; i < num_sessions; ++i) {
+    sessions[i].index = i;
+    sessions[i].opts = opts;
+    sessions[i].source = source;
+    _session_open(&sessions[i], server, backup);
+  }
+  rss_open = _resident_bytes();
+
+  switches_before = _context_switches();
+  start_us = ffmpbr_now_us();
+  for (i = 0; i < num_sessions; ++i) {
+    pthread_create(&sessions[i].thread, NULL, _session_thread, &sessions[i]);
+  }
+  threads = _thread_count();
+  if (opts->failover_s) {
+    _sleep_until(start_us + opts->failover_s * 1000000LL);
+    kill_us = ffmpbr_now_us();
+    _server_kill(server);
+  }
+  for (i = 0; i < num_sessions; ++i) {
+    pthread_join(sessions[i].thread, NULL);
+  }
+  elapsed_us = ffmpbr_now_us() - start_us;
+
+  for (i = 0; i < num_sessions; ++i) {
+    bytes += sessions[i].bytes;
+    cpu_us += sessions[i].cpu_us;
+
+    // (the first write, before _percentile sorts them)
+    start_us_all[i] = sessions[i].open_us + (sessions[i].write_count ? sessions[i].write_us[0] : 0);
+    p99s[i] = _percentile(sessions[i].write_us, sessions[i].write_count, 99);
+    write_max_us[i] = _percentile(sessions[i].write_us, sessions[i].write_count, 100);
+    packets += sessions[i].packets;
+    turned_away += sessions[i].statuses[FFMPBR_WRITE_WOULD_BLOCK];
+
+    // (peak over mean send rate, in hundredths)
+    burstiness[i] = sessions[i].send_stats.rate_peak * 100 /
+      FFMAX(sessions[i].send_stats.rate_mean, 1);
+    latency_p99s[i] = sessions[i].latency_p99_us;
+    retransmits += sessions[i].send_stats.retransmits;
+    probe_rates[i] = sessions[i].probe.throughput;
+    probe_rtts[i] = sessions[i].probe.rtt_us;
+    probe_recommended[i] = sessions[i].probe.recommended_bit_rate;
+
+    // (sessions that never noticed count as taking the whole run)
+    if (sessions[i].failover.failovers) {
+      detect_us[i] = sessions[i].failover.last_failure_us - kill_us;
+      failover_us[i] = sessions[i].failover.last_failover_us;
+    } else {
+      detect_us[i] = failover_us[i] = elapsed_us;
+    }
+  }
+
+  printf("%8d %8d %12lld %12.2f %12lld %12lld %12.2f %12lld %12lld",
+    num_sessions, threads, (long long)(_context_switches() - switches_before),
+    bytes * 8.0 / FFMAX(elapsed_us, 1),
+    (long long)_percentile(p99s, num_sessions, 50),
+    (long long)p99s[num_sessions - 1],
+    cpu_us * 100.0 / FFMAX(elapsed_us, 1) / num_sessions,
+    (long long)((rss_open - rss_before) / 1024 / num_sessions),
+    (long long)((_resident_bytes() - rss_before) / 1024 / num_sessions));
+  for (i = 0; i < num_sessions; ++i) {
+    ffmpbr_finalize(sessions[i].br_ctx);
+    free(sessions[i].write_us);
+  }
+
+  // (once the connections are closed, and everything sent has arrived)
+  if (server->port) {
+    printf(" %12.2f", (server->bytes_received + backup->bytes_received - server_bytes_before) *
+      8.0 / FFMAX(elapsed_us, 1));
+  }
+  if (server->rtmp) {
+    printf(" %12.3f", (server->rtmp_header_bytes - header_bytes_before) * 100.0 /
+      FFMAX(server->rtmp_message_bytes - message_bytes_before, 1));
+  }
+  if (opts->pacing_percent || opts->link_kbit_rate) {
+    printf(" %12.2f %12.1f %12lld", _percentile(burstiness, num_sessions, 50) / 100.0,
+      _percentile(latency_p99s, num_sessions, 50) / 1000.0, (long long)retransmits);
+  }
+  if (opts->probe_ms) {
+    printf(" %12.2f %12.2f %12.2f", _percentile(probe_rates, num_sessions, 50) / 1e6,
+      _percentile(probe_rtts, num_sessions, 50) / 1000.0,
+      _percentile(probe_recommended, num_sessions, 50) / 1e6);
+  }
+  if (server->rtmp) {
+    ffmpbr_pool_get_stats(&pool_after);
+    printf(" %12.1f %12.1f %12lld", _percentile(start_us_all, num_sessions, 50) / 1000.0,
+      _percentile(start_us_all, num_sessions, 100) / 1000.0,
+      (long long)(pool_after.reused - pool_before.reused));
+  }
+  if (opts->failover_s) {
+    printf(" %12.1f %12.1f %12.1f", _percentile(detect_us, num_sessions, 50) / 1000.0,
+      _percentile(failover_us, num_sessions, 50) / 1000.0,
+      _percentile(failover_us, num_sessions, 100) / 1000.0);
+    _server_restart(server);
+  }
+  if (opts->write_queue_ms) {
+    printf(" %12.2f %12.1f", turned_away * 100.0 / FFMAX(packets, 1),
+      _percentile(write_max_us, num_sessions, 100) / 1000.0);
+  }
+  printf("\n");
+  free(sessions);
+  free(p99s);
+  free(burstiness);
+  free(latency_p99s);
+  free(probe_rates);
+  free(probe_rtts);
+  free(probe_recommended);
+  free(detect_us);
+  free(failover_us);
+  free(start_us_all);
+  free(write_max_us);
+}
+
+
+int main(int argc, char **argv) {
+  LoadgenOptions opts;
+  LoadgenSource source;
+  LoadgenServer server, backup;
+  FFmpegBridgeCaptureReader reader;
+  char *token;
+  int c, i;
+
+  memset(&opts, 0, sizeof(opts));
+  memset(&server, 0, sizeof(server));
+  memset(&backup, 0, sizeof(backup));
+  opts.duration_s = 10;
+  opts.output = "null";
+  opts.video_codec = "h264";
+
+  while ((c = getopt(argc, argv, "s:d:mc:o:e:v:k:p:r:b:f:w:l:q:")) != -1) {
+    switch (c) {
+    case 's':
+      for (token = strtok(optarg, ","); token && opts.num_runs < LOADGEN_MAX_RUNS;
+           token = strtok(NULL, ",")) {
+        opts.session_counts[opts.num_runs++] = atoi(token);
+      }
+      break;
+    case 'd': opts.duration_s = atoi(optarg); break;
+    case 'm': opts.max_speed = 1; break;
+    case 'c': opts.capture_path = optarg; break;
+    case 'o': opts.output = optarg; break;
+    case 'e': opts.loop_threads = atoi(optarg); break;
+    case 'v': opts.video_codec = optarg; break;
+    case 'k': opts.rtmp_chunk_size = atoi(optarg); break;
+    case 'p': opts.pacing_percent = atoi(optarg); break;
+    case 'r': opts.link_kbit_rate = atoi(optarg); break;
+    case 'b': opts.probe_ms = atoi(optarg); break;
+    case 'f': opts.failover_s = atoi(optarg); break;
+    case 'w': opts.pool_grace_ms = atoi(optarg); break;
+    case 'l': opts.reply_delay_ms = atoi(optarg); break;
+    case 'q': opts.write_queue_ms = atoi(optarg); break;
+    default: _usage();
+    }
+  }
+  if (optind != argc || opts.duration_s < 1) _usage();
+  if (!opts.num_runs) {
+    for (i = 0; i < 4; ++i) opts.session_counts[opts.num_runs++] = 1 << i;
+  }
+  for (i = 0; i < opts.num_runs; ++i) {
+    if (opts.session_counts[i] < 1) _usage();
+  }
+
+  if (_load_source(&opts, &source, &reader) < 0) return 1;
+
+  // a killed server shouldn't take us down with it (Android apps ignore
+  // SIGPIPE already; librtmp doesn't send with MSG_NOSIGNAL)
+  signal(SIGPIPE, SIG_IGN);
+  ffmpbr_loop_set_threads(opts.loop_threads);
+  ffmpbr_pool_set_grace(opts.pool_grace_ms);
+  if ((!strcmp(opts.output, "tcp") || !strcmp(opts.output, "rtmp")) &&
+      _server_start(&server, !strcmp(opts.output, "rtmp"), opts.link_kbit_rate,
+        opts.reply_delay_ms) < 0) return 1;
+  if (opts.failover_s && server.port &&
+      _server_start(&backup, server.rtmp, opts.link_kbit_rate, opts.reply_delay_ms) < 0) return 1;
+
+  printf("%ld cpus, %s packets, %s, ", sysconf(_SC_NPROCESSORS_ONLN),
+    opts.capture_path ? opts.capture_path : "synthetic",
+    opts.max_speed ? "max speed" : "real time");
+  if (opts.loop_threads) {
+    printf("%d shared event loop threads\n", opts.loop_threads);
+  } else {
+    printf("inline writes\n");
+  }
+  printf("%8s %8s %12s %12s %12s %12s %12s %12s %12s%s%s%s%s%s%s%s\n",
+    "sessions", "threads", "ctx switches", "Mbit/s", "p99 med us", "p99 max us", "cpu%/sess", "KB/sess open",
+    "KB/sess end", server.port ? "   server Mb/s" : "", server.rtmp ? "  chunk hdr %" : "",
+    opts.pacing_percent || opts.link_kbit_rate ? "    peak/mean   lat p99 ms      retrans" : "",
+    opts.probe_ms ? " probe Mbit/s probe rtt ms  rec. Mbit/s" : "",
+    server.rtmp ? " start med ms start max ms  warm starts" : "",
+    backup.port ? "    detect ms    switch ms   switch max" : "",
+    opts.write_queue_ms ? " turned away% write max ms" : "");
+
+  for (i = 0; i < opts.num_runs; ++i) {
+    _run(&opts, &source, &server, &backup, opts.session_counts[i]);
+  }
+
+  if (source.capture) ffmpbr_capture_reader_close(&reader);
+  return 0;
+}
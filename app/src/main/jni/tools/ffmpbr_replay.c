@@ -0,0 +1,304 @@
+//
+// Replays a session capture (see ffmpegbridge_capture.h) through the bridge,
+// either at the pace it was recorded at or as fast as possible.
+//
+// usage: ffmpbr_replay [-m] [-a] [-t] [-F nal_filter] [-r reorder_depth]
+//                      [-v video_codec] [-M fragment_ms] [-S segment_ms] [-n loops]
+//                      [-f format] [-o output_url] capture
+//
+//   -m  replay at maximum speed instead of real time
+//   -a  turn on auto config (see ffmpbr_set_auto_config), as the session
+//       being replayed may have had it on
+//   -t  normalize timestamps (see ffmpbr_set_timestamp_normalization),
+//       reporting the drift and jitter corrected
+//   -F  NAL filter flags (see FFMPBR_NAL_FILTER_*), reporting the savings
+//   -r  the video encoder's reorder depth, for captures with B-frames
+//   -v  the captured video codec, h264 (default) or hevc
+//   -M  write mp4 as fragments of at most fragment_ms (see
+//       ffmpbr_set_mp4_fragmentation)
+//   -S  split the recording into segments of segment_ms (see
+//       ffmpbr_set_segmenting), reporting rotation latency; output_url
+//       names the segments, e.g. /sdcard/rec-%03d.mp4
+//   -n  replay the capture this many times back to back (default 1)
+//   -f  override the captured output format name
+//   -o  output url (default /dev/null)
+//
+// Along with throughput, it reports how long finalizing took and how the
+// process's resident memory grew, which is what to compare when replaying
+// a long recording (-n) into mp4 with and without -M.
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libavutil/avstring.h"
+
+#include "ffmpegbridge_capture.h"
+#include "ffmpegbridge_context.h"
+
+typedef struct
+{
+  int max_speed;
+  int auto_config;
+  int normalize_timestamps;
+  int nal_filter;
+  int reorder_depth;
+  const char *video_codec;
+  int mp4_fragment_ms;
+  int segment_ms;
+  int loops;
+  const char *output_fmt_name;
+  const char *output_url;
+  const char *capture_path;
+} ReplayOptions;
+
+typedef struct
+{
+  int64_t packets;
+  int64_t bytes;
+  int64_t elapsed_us;
+  int64_t max_write_us;
+  int64_t total_write_us;
+  int64_t first_pts;
+  int64_t last_pts;
+  int64_t finalize_us;
+  long start_rss_kb;
+  long peak_rss_kb;
+  long end_rss_kb;
+  FFmpegBridgeNalFilterStats nal_filter;
+  FFmpegBridgeTimestampStats timestamps;
+  FFmpegBridgeSegmentStats segments;
+} ReplayStats;
+
+void _usage() {
+  fprintf(stderr, "usage: ffmpbr_replay [-m] [-a] [-t] [-F nal_filter] [-r reorder_depth]\n"
+    "                     [-v video_codec] [-M fragment_ms] [-S segment_ms] [-n loops]\n"
+    "                     [-f format] [-o output_url] capture\n");
+  exit(1);
+}
+
+void _sleep_until(int64_t deadline_us) {
+  struct timespec ts;
+  int64_t remaining = deadline_us - ffmpbr_now_us();
+
+  if (remaining <= 0) return;
+  ts.tv_sec = remaining / 1000000;
+  ts.tv_nsec = (remaining % 1000000) * 1000;
+  nanosleep(&ts, NULL);
+}
+
+// resident set size, from /proc
+long _rss_kb() {
+  FILE *f = fopen("/proc/self/statm", "r");
+  long pages = 0, resident = 0;
+
+  if (!f) return 0;
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void _sample_rss(ReplayStats *stats) {
+  long rss = _rss_kb();
+  if (rss > stats->peak_rss_kb) stats->peak_rss_kb = rss;
+}
+
+int _replay(FFmpegBridgeCaptureReader *reader, ReplayOptions *opts, ReplayStats *stats) {
+  FFmpegBridgeCaptureRecord record;
+  FFmpegBridgeCaptureConfig config;
+  FFmpegBridgeContext *br_ctx = NULL;
+  int64_t first_arrival_us = -1, start_us = 0, pts_offset = 0, last_pts = 0, t;
+  int loop, rc;
+
+  for (loop = 0; loop < opts->loops; ++loop) {
+    ffmpbr_capture_reader_rewind(reader);
+
+    while ((rc = ffmpbr_capture_next(reader, &record)) > 0) {
+      switch (record.type) {
+      case FFMPBR_CAPTURE_CONFIG:
+        if (br_ctx) break;
+        if (ffmpbr_capture_read_config(&record, &config) < 0) {
+          fprintf(stderr, "corrupt config record\n");
+          return -1;
+        }
+        if (opts->output_fmt_name) {
+          av_strlcpy(config.output_fmt_name, opts->output_fmt_name, sizeof(config.output_fmt_name));
+        }
+        br_ctx = ffmpbr_init(config.output_fmt_name, opts->output_url,
+          config.video_width, config.video_height, config.video_fps, config.video_bit_rate,
+          config.audio_sample_rate, config.audio_num_channels, config.audio_bit_rate);
+        if (opts->video_codec) {
+          ffmpbr_set_video_codec(br_ctx, opts->video_codec);
+        }
+        ffmpbr_set_auto_config(br_ctx, opts->auto_config);
+        ffmpbr_set_timestamp_normalization(br_ctx, opts->normalize_timestamps);
+        ffmpbr_set_nal_filter(br_ctx, opts->nal_filter);
+        ffmpbr_set_video_reorder_depth(br_ctx, opts->reorder_depth);
+        ffmpbr_set_mp4_fragmentation(br_ctx, opts->mp4_fragment_ms);
+        ffmpbr_set_segmenting(br_ctx, opts->segment_ms);
+        stats->start_rss_kb = _rss_kb();
+        break;
+
+      // later loops reuse the extradata and header from the first one
+      case FFMPBR_CAPTURE_AUDIO_EXTRADATA:
+        if (br_ctx && loop == 0) {
+          ffmpbr_set_audio_codec_extradata(br_ctx, (int8_t *)record.data, record.size);
+        }
+        break;
+      case FFMPBR_CAPTURE_VIDEO_EXTRADATA:
+        if (br_ctx && loop == 0) {
+          ffmpbr_set_video_codec_extradata(br_ctx, (int8_t *)record.data, record.size);
+        }
+        break;
+      case FFMPBR_CAPTURE_HEADER:
+        if (br_ctx && loop == 0) {
+          ffmpbr_write_header(br_ctx);
+        }
+        break;
+
+      case FFMPBR_CAPTURE_PACKET:
+        if (!br_ctx) break;
+        if (first_arrival_us < 0) {
+          first_arrival_us = record.arrival_us;
+          start_us = ffmpbr_now_us();
+        }
+        if (!opts->max_speed) {
+          _sleep_until(start_us + (record.arrival_us - first_arrival_us));
+        }
+
+        t = ffmpbr_now_us();
+        ffmpbr_write_packet(br_ctx, record.data, record.size, (long)(record.pts + pts_offset),
+          record.flags & FFMPBR_CAPTURE_FLAG_VIDEO, record.flags & FFMPBR_CAPTURE_FLAG_KEYFRAME, t);
+        t = ffmpbr_now_us() - t;
+
+        stats->packets++;
+        stats->bytes += record.size;
+        stats->total_write_us += t;
+        if (t > stats->max_write_us) stats->max_write_us = t;
+        if (record.pts + pts_offset > last_pts) last_pts = record.pts + pts_offset;
+        if (stats->packets == 1) stats->first_pts = record.pts;
+        if (stats->packets % 1000 == 0) _sample_rss(stats);
+        break;
+      }
+    }
+    if (rc < 0) {
+      fprintf(stderr, "capture is truncated, replayed up to the last complete record\n");
+    }
+
+    // keep timestamps monotonic across loops, and keep real-time pacing
+    // going from where the last loop left off
+    pts_offset = last_pts + 1;
+    if (first_arrival_us >= 0) {
+      start_us = ffmpbr_now_us();
+      first_arrival_us = -1;
+    }
+  }
+
+  if (!br_ctx) {
+    fprintf(stderr, "capture has no config record\n");
+    return -1;
+  }
+  stats->last_pts = last_pts;
+  ffmpbr_get_nal_filter_stats(br_ctx, &stats->nal_filter);
+  ffmpbr_get_timestamp_stats(br_ctx, &stats->timestamps);
+  ffmpbr_get_segment_stats(br_ctx, &stats->segments);
+  _sample_rss(stats);
+  stats->end_rss_kb = _rss_kb();
+
+  t = ffmpbr_now_us();
+  ffmpbr_finalize(br_ctx);
+  stats->finalize_us = ffmpbr_now_us() - t;
+  return 0;
+}
+
+
+int main(int argc, char **argv) {
+  FFmpegBridgeCaptureReader reader;
+  ReplayOptions opts;
+  ReplayStats stats;
+  int64_t start_us;
+  double media_min;
+  int c, rc;
+
+  memset(&opts, 0, sizeof(opts));
+  memset(&stats, 0, sizeof(stats));
+  opts.loops = 1;
+  opts.output_url = "/dev/null";
+
+  while ((c = getopt(argc, argv, "matF:r:v:M:S:n:f:o:")) != -1) {
+    switch (c) {
+    case 'm': opts.max_speed = 1; break;
+    case 'a': opts.auto_config = 1; break;
+    case 't': opts.normalize_timestamps = 1; break;
+    case 'F': opts.nal_filter = strtol(optarg, NULL, 0); break;
+    case 'r': opts.reorder_depth = atoi(optarg); break;
+    case 'v': opts.video_codec = optarg; break;
+    case 'M': opts.mp4_fragment_ms = atoi(optarg); break;
+    case 'S': opts.segment_ms = atoi(optarg); break;
+    case 'n': opts.loops = atoi(optarg); break;
+    case 'f': opts.output_fmt_name = optarg; break;
+    case 'o': opts.output_url = optarg; break;
+    default: _usage();
+    }
+  }
+  if (optind != argc - 1 || opts.loops < 1) _usage();
+  opts.capture_path = argv[optind];
+
+  rc = ffmpbr_capture_reader_open(&reader, opts.capture_path);
+  if (rc < 0) {
+    fprintf(stderr, "could not open capture %s: %s\n", opts.capture_path, av_err2str(rc));
+    return 1;
+  }
+
+  start_us = ffmpbr_now_us();
+  rc = _replay(&reader, &opts, &stats);
+  stats.elapsed_us = ffmpbr_now_us() - start_us;
+  ffmpbr_capture_reader_close(&reader);
+  if (rc < 0) return 1;
+
+  printf("packets:        %lld\n", (long long)stats.packets);
+  printf("bytes:          %lld\n", (long long)stats.bytes);
+  printf("elapsed:        %.3f s\n", stats.elapsed_us / 1e6);
+  printf("throughput:     %.2f Mbit/s, %.1f packets/s\n",
+    stats.bytes * 8.0 / FFMAX(stats.elapsed_us, 1),
+    stats.packets * 1e6 / FFMAX(stats.elapsed_us, 1));
+  printf("write latency:  avg %lld us, max %lld us\n",
+    (long long)(stats.total_write_us / FFMAX(stats.packets, 1)),
+    (long long)stats.max_write_us);
+  printf("finalize:       %.1f ms\n", stats.finalize_us / 1e3);
+  printf("memory:         rss %ld KB at start, %ld KB peak, %ld KB before finalize\n",
+    stats.start_rss_kb, stats.peak_rss_kb, stats.end_rss_kb);
+  if (opts.nal_filter) {
+    media_min = (stats.last_pts - stats.first_pts) / 60e6;
+    printf("nal filter:     saved %lld of %lld video bytes (%.2f%%), %.1f KB per minute\n",
+      (long long)stats.nal_filter.saved_bytes, (long long)stats.nal_filter.video_bytes,
+      100.0 * stats.nal_filter.saved_bytes / FFMAX(stats.nal_filter.video_bytes, 1),
+      media_min > 0 ? stats.nal_filter.saved_bytes / 1024.0 / media_min : 0.0);
+    printf("                %lld filler, %lld aud, %lld sei, %lld sps/pps units\n",
+      (long long)stats.nal_filter.filler_units, (long long)stats.nal_filter.aud_units,
+      (long long)stats.nal_filter.sei_units, (long long)stats.nal_filter.param_set_units);
+  }
+  if (opts.normalize_timestamps) {
+    printf("timestamps:     drift %lld us, correction %lld us, video jitter %lld us\n",
+      (long long)stats.timestamps.drift_us, (long long)stats.timestamps.correction_us,
+      (long long)stats.timestamps.video_jitter_us);
+    printf("                %lld monotonic fixes, %lld resyncs\n",
+      (long long)stats.timestamps.monotonic_fixes, (long long)stats.timestamps.resyncs);
+  }
+  if (opts.segment_ms) {
+    printf("segments:       %lld, %lld closed before finalize, %lld late rotations\n",
+      (long long)stats.segments.segments, (long long)stats.segments.closed_segments,
+      (long long)stats.segments.late_rotations);
+    printf("                rotation p50 %lld us, p90 %lld us, max %lld us\n",
+      (long long)stats.segments.rotation_p50_us, (long long)stats.segments.rotation_p90_us,
+      (long long)stats.segments.rotation_max_us);
+    printf("                open max %lld us, close max %lld us (segment thread)\n",
+      (long long)stats.segments.max_open_us, (long long)stats.segments.max_close_us);
+  }
+  return 0;
+}
@@ -0,0 +1,359 @@
+//
+// Stalled sink test: checks that with a write queue limit (see
+// ffmpbr_set_write_queue_limit) the producer is never held up by the
+// output, and is told what's going on instead.
+//
+// A session publishes flv in real time to a loopback tcp server that
+// accepts the connection and then never reads from it, so the output backs
+// up. After a while the server resets the connection. The test fails (and
+// exits 1) unless
+//
+//   - no ffmpbr_write_packet call takes longer than the bound,
+//   - while the sink is only stalled, packets are turned away with
+//     WOULD_BLOCK once the output backs up (never DISCONNECTED), and only
+//     accepted again once some of it has drained (into the kernel's socket
+//     buffers, which fill up early on),
+//   - DISCONNECTED is reported within the notice bound after the reset,
+//     and for every packet from then on.
+//
+// usage: ffmpbr_stalltest [-q ms] [-t ms] [-n ms] [-s seconds] [-v h264|hevc]
+//
+//   -q  the session's write queue limit (default 500)
+//   -t  the longest any ffmpbr_write_packet may take, in ms (default 20)
+//   -n  how soon after the reset DISCONNECTED has to show up, in ms
+//       (default 1000)
+//   -s  how long the sink stalls before the reset, in seconds (default 3)
+//   -v  the video codec of the synthetic stream (default h264)
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "ffmpegbridge_context.h"
+
+// the stream: loadgen's synthetic one, 1.5 Mbit/s of 720p30 video with a
+// 2s GOP, and 128 kbit/s of AAC-LC
+#define STALL_FPS 30
+#define STALL_VIDEO_BIT_RATE 1500000
+#define STALL_AUDIO_BIT_RATE 128000
+#define STALL_SAMPLE_RATE 44100
+
+// how long packets are written for after the reset
+#define STALL_AFTER_RESET_US 1000000
+
+// small socket buffers on both ends, so that the stall reaches the queue
+// within a few packets rather than after megabytes of kernel buffering
+#define STALL_SOCKET_BUFFER 16384
+
+typedef struct
+{
+  int queue_limit_ms;
+  int64_t max_write_us;
+  int64_t max_notice_us;
+  int stall_s;
+  const char *video_codec;
+} StallOptions;
+
+// what the test saw; times are since the first packet, -1 for never
+typedef struct
+{
+  int64_t packets;
+  int64_t statuses[FFMPBR_WRITE_DISCONNECTED + 1];
+  int64_t longest_write_us;
+  int64_t first_would_block_us;
+  int64_t reset_us;
+  int64_t disconnected_us;
+
+  // bytes sent as of the last WOULD_BLOCK, while there's been one since
+  // the last packet accepted
+  int64_t blocked_sent;
+  int blocked;
+
+  int failures;
+} StallResult;
+
+static const uint8_t stall_video_extradata[] = {
+  0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x80, 0x1f, 0xda, 0x01, 0x40, 0x16, 0xe8, 0x06, 0xd0,
+  0xa1, 0x35, 0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x06, 0xe2
+};
+static const uint8_t stall_audio_extradata[] = { 0x12, 0x08 };
+
+// a 1280x720 Main profile VPS/SPS/PPS
+static const uint8_t stall_hevc_extradata[] = {
+  0x00, 0x00, 0x00, 0x01, 0x40, 0x01, 0x0c, 0x01, 0xff, 0xff, 0x01, 0x60, 0x00, 0x00, 0x03,
+  0x00, 0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x5d, 0x97, 0x02, 0x40, 0x00, 0x00,
+  0x00, 0x01, 0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00, 0x03,
+  0x00, 0x00, 0x03, 0x00, 0x5d, 0xa0, 0x02, 0x80, 0x80, 0x2d, 0x16, 0x59, 0x7b, 0x93, 0x6b,
+  0x20, 0x00, 0x00, 0x00, 0x01, 0x44, 0x01, 0xc0, 0x71, 0x81, 0x12
+};
+
+static const char *status_names[] = { "OK", "QUEUED", "WOULD_BLOCK", "DROPPED", "DISCONNECTED" };
+
+void _usage() {
+  fprintf(stderr, "usage: ffmpbr_stalltest [-q ms] [-t ms] [-n ms] [-s seconds] [-v h264|hevc]\n");
+  exit(1);
+}
+
+void _sleep_until(int64_t deadline_us) {
+  struct timespec ts;
+  int64_t remaining = deadline_us - ffmpbr_now_us();
+
+  if (remaining <= 0) return;
+  ts.tv_sec = remaining / 1000000;
+  ts.tv_nsec = (remaining % 1000000) * 1000;
+  nanosleep(&ts, NULL);
+}
+
+void _fail(StallResult *result, int64_t at_us, const char *what) {
+  // (only the first few, as one broken expectation tends to repeat)
+  if (result->failures++ < 10) {
+    printf("FAIL at %lld ms: %s\n", (long long)(at_us / 1000), what);
+  }
+}
+
+// a loopback server that takes one connection and never reads from it
+int _server_listen(int *port) {
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  int fd, rcvbuf = STALL_SOCKET_BUFFER;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  // (accepted connections inherit it)
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0 ||
+      getsockname(fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+    close(fd);
+    return -1;
+  }
+  *port = ntohs(addr.sin_port);
+  return fd;
+}
+
+// resets the connection, as an ingest that goes away does
+void _server_reset(int fd) {
+  struct linger linger = { 1, 0 };
+
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  close(fd);
+}
+
+FFmpegBridgeContext* _session_open(const char *url, StallOptions *opts) {
+  FFmpegBridgeContext *br_ctx;
+  FFmpegBridgeTransport transport = { 0, -1, STALL_SOCKET_BUFFER, 0 };
+  int hevc = !strcmp(opts->video_codec, "hevc");
+  int status;
+
+  br_ctx = ffmpbr_init("flv", url, 1280, 720, STALL_FPS, STALL_VIDEO_BIT_RATE,
+    STALL_SAMPLE_RATE, 1, STALL_AUDIO_BIT_RATE);
+  ffmpbr_set_video_codec(br_ctx, opts->video_codec);
+  ffmpbr_set_transport(br_ctx, &transport);
+  ffmpbr_set_write_queue_limit(br_ctx, opts->queue_limit_ms);
+  ffmpbr_set_video_codec_extradata(br_ctx,
+    (int8_t *)(hevc ? stall_hevc_extradata : stall_video_extradata),
+    hevc ? sizeof(stall_hevc_extradata) : sizeof(stall_video_extradata));
+  ffmpbr_set_audio_codec_extradata(br_ctx, (int8_t *)stall_audio_extradata,
+    sizeof(stall_audio_extradata));
+
+  status = ffmpbr_write_header(br_ctx);
+  if (status != FFMPBR_WRITE_OK && status != FFMPBR_WRITE_QUEUED) {
+    printf("FAIL: the header wasn't written (%s)\n", status_names[status]);
+    ffmpbr_finalize(br_ctx);
+    return NULL;
+  }
+  return br_ctx;
+}
+
+// checks one write against what the sink is doing at the time
+void _check_write(FFmpegBridgeContext *br_ctx, StallResult *result, StallOptions *opts,
+  int status, int64_t write_us, int64_t at_us, int64_t reset_us) {
+  FFmpegBridgeSendStats stats;
+  char what[128];
+
+  result->packets++;
+  result->statuses[status]++;
+  if (write_us > result->longest_write_us) result->longest_write_us = write_us;
+
+  if (write_us > opts->max_write_us) {
+    snprintf(what, sizeof(what), "a write took %lld us (%s)", (long long)write_us,
+      status_names[status]);
+    _fail(result, at_us, what);
+  }
+  if (status == FFMPBR_WRITE_DROPPED) {
+    _fail(result, at_us, "a packet was DROPPED");
+  }
+
+  if (reset_us < 0) {
+    // stalled, but still connected
+    ffmpbr_get_send_stats(br_ctx, &stats);
+    if (status == FFMPBR_WRITE_DISCONNECTED) {
+      _fail(result, at_us, "DISCONNECTED before the connection was reset");
+    } else if (status == FFMPBR_WRITE_WOULD_BLOCK) {
+      if (result->first_would_block_us < 0) result->first_would_block_us = at_us;
+      result->blocked_sent = stats.bytes;
+      result->blocked = 1;
+    } else if (result->blocked && stats.bytes == result->blocked_sent) {
+      snprintf(what, sizeof(what), "%s after WOULD_BLOCK, with nothing drained since",
+        status_names[status]);
+      _fail(result, at_us, what);
+    } else {
+      result->blocked = 0;
+    }
+  } else if (status == FFMPBR_WRITE_DISCONNECTED) {
+    if (result->disconnected_us < 0) result->disconnected_us = at_us;
+  } else if (result->disconnected_us >= 0) {
+    snprintf(what, sizeof(what), "%s after DISCONNECTED", status_names[status]);
+    _fail(result, at_us, what);
+  }
+}
+
+void _run(FFmpegBridgeContext *br_ctx, int conn_fd, StallOptions *opts, StallResult *result) {
+  int64_t duration_us = opts->stall_s * 1000000LL + STALL_AFTER_RESET_US;
+  int64_t video_pts = 0, audio_pts = 0, reset_us = -1, start_us, t, write_us;
+  int64_t video_frame_us = 1000000 / STALL_FPS;
+  int64_t audio_frame_us = 1024 * 1000000LL / STALL_SAMPLE_RATE;
+  int gop = STALL_FPS * 2, frame = 0, p_frame_size = STALL_VIDEO_BIT_RATE / 8 / STALL_FPS;
+  int audio_frame_size = STALL_AUDIO_BIT_RATE / 8 * audio_frame_us / 1000000;
+  int video_buffer_size = p_frame_size * 10;
+  uint8_t *video = malloc(video_buffer_size), *audio = malloc(audio_frame_size);
+  int hevc = !strcmp(opts->video_codec, "hevc");
+  int size, is_keyframe, status;
+
+  // payload contents don't matter to the bridge, only the NAL header does
+  memset(video, 0x5a, video_buffer_size);
+  memset(audio, 0x21, audio_frame_size);
+  video[0] = video[1] = video[2] = 0x00;
+  video[3] = 0x01;
+
+  start_us = ffmpbr_now_us();
+  while (video_pts < duration_us || audio_pts < duration_us) {
+    if (reset_us < 0 && video_pts >= opts->stall_s * 1000000LL) {
+      _server_reset(conn_fd);
+      reset_us = result->reset_us = ffmpbr_now_us() - start_us;
+    }
+
+    if (video_pts <= audio_pts) {
+      _sleep_until(start_us + video_pts);
+      is_keyframe = (frame++ % gop) == 0;
+      size = is_keyframe ? video_buffer_size : p_frame_size;
+      if (hevc) {
+        // IDR_W_RADL or TRAIL_R
+        video[4] = is_keyframe ? 0x26 : 0x02;
+        video[5] = 0x01;
+      } else {
+        video[4] = is_keyframe ? 0x65 : 0x41;
+      }
+      t = ffmpbr_now_us();
+      status = ffmpbr_write_packet(br_ctx, video, size, (long)video_pts, 1, is_keyframe, t);
+      write_us = ffmpbr_now_us() - t;
+      _check_write(br_ctx, result, opts, status, write_us, t - start_us, reset_us);
+      video_pts += video_frame_us;
+    } else {
+      _sleep_until(start_us + audio_pts);
+      t = ffmpbr_now_us();
+      status = ffmpbr_write_packet(br_ctx, audio, audio_frame_size, (long)audio_pts, 0, 0, t);
+      write_us = ffmpbr_now_us() - t;
+      _check_write(br_ctx, result, opts, status, write_us, t - start_us, reset_us);
+      audio_pts += audio_frame_us;
+    }
+  }
+
+  if (!result->statuses[FFMPBR_WRITE_OK] && !result->statuses[FFMPBR_WRITE_QUEUED]) {
+    _fail(result, 0, "no packet was ever accepted");
+  }
+  if (result->first_would_block_us < 0) {
+    _fail(result, reset_us, "the stalled sink never turned a packet away with WOULD_BLOCK");
+  }
+  if (result->disconnected_us < 0) {
+    _fail(result, ffmpbr_now_us() - start_us, "DISCONNECTED never showed up after the reset");
+  } else if (result->disconnected_us - reset_us > opts->max_notice_us) {
+    _fail(result, result->disconnected_us, "DISCONNECTED showed up too late after the reset");
+  }
+
+  free(video);
+  free(audio);
+}
+
+int main(int argc, char **argv) {
+  StallOptions opts = { 500, 20000, 1000000, 3, "h264" };
+  StallResult result;
+  FFmpegBridgeContext *br_ctx;
+  char url[64];
+  int listen_fd, conn_fd, port, c, i;
+  int64_t finalize_us;
+
+  while ((c = getopt(argc, argv, "q:t:n:s:v:")) != -1) {
+    switch (c) {
+    case 'q': opts.queue_limit_ms = atoi(optarg); break;
+    case 't': opts.max_write_us = atoi(optarg) * 1000LL; break;
+    case 'n': opts.max_notice_us = atoi(optarg) * 1000LL; break;
+    case 's': opts.stall_s = atoi(optarg); break;
+    case 'v': opts.video_codec = optarg; break;
+    default: _usage();
+    }
+  }
+  if (optind != argc || opts.queue_limit_ms <= 0 || opts.max_write_us <= 0 ||
+    opts.max_notice_us <= 0 || opts.stall_s < 1) {
+    _usage();
+  }
+
+  // (the reset shouldn't take us down with it; Android apps ignore SIGPIPE
+  // already)
+  signal(SIGPIPE, SIG_IGN);
+
+  listen_fd = _server_listen(&port);
+  if (listen_fd < 0) {
+    fprintf(stderr, "could not start loopback server: %s\n", strerror(errno));
+    return 1;
+  }
+  snprintf(url, sizeof(url), "tcp://127.0.0.1:%d", port);
+
+  br_ctx = _session_open(url, &opts);
+  if (!br_ctx) return 1;
+  conn_fd = accept(listen_fd, NULL, NULL);
+  close(listen_fd);
+  if (conn_fd < 0) {
+    fprintf(stderr, "could not accept the session's connection: %s\n", strerror(errno));
+    return 1;
+  }
+
+  memset(&result, 0, sizeof(result));
+  result.first_would_block_us = result.reset_us = result.disconnected_us = -1;
+  _run(br_ctx, conn_fd, &opts, &result);
+
+  finalize_us = ffmpbr_now_us();
+  ffmpbr_finalize(br_ctx);
+  finalize_us = ffmpbr_now_us() - finalize_us;
+
+  printf("%lld packets:", (long long)result.packets);
+  for (i = 0; i <= FFMPBR_WRITE_DISCONNECTED; ++i) {
+    printf(" %s %lld", status_names[i], (long long)result.statuses[i]);
+  }
+  printf("\nlongest write %.1f ms (bound %.1f), WOULD_BLOCK from %lld ms, "
+    "DISCONNECTED %lld ms after the reset (bound %lld), finalize %.1f ms\n",
+    result.longest_write_us / 1000.0, opts.max_write_us / 1000.0,
+    (long long)(result.first_would_block_us >= 0 ? result.first_would_block_us / 1000 : -1),
+    (long long)(result.disconnected_us >= 0 ? (result.disconnected_us - result.reset_us) / 1000 : -1),
+    (long long)(opts.max_notice_us / 1000), finalize_us / 1000.0);
+
+  if (result.failures) {
+    printf("FAILED (%d)\n", result.failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
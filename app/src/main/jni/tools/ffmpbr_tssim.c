@@ -0,0 +1,203 @@
+//
+// Runs the timestamp normalization (see ffmpegbridge_timestamp.h) against
+// synthetic streams: an audio clock that drifts from the video clock,
+// jittery video capture timestamps, and bursty arrival from the encoders.
+//
+// usage: ffmpbr_tssim [-p audio_ppm] [-j jitter_ms] [-d minutes]
+//                     [-b reorder_depth]
+//
+//   -p  how much faster the audio clock runs than the video clock, in parts
+//       per million (default 100, i.e. 6ms a minute)
+//   -j  the most video capture timestamps are off by, in ms (default 8)
+//   -d  how many minutes of media to simulate (default 30)
+//   -b  the video encoder's reorder depth, which turns smoothing off
+//
+// It only needs the timestamp code, so it also builds on the host:
+//
+//   cc -Iinclude tools/ffmpbr_tssim.c ffmpegbridge_timestamp.c -o ffmpbr_tssim
+//
+// Copyright (c) 2014, cine.io. All rights reserved.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ffmpegbridge_timestamp.h"
+
+#define SIM_VIDEO_FRAME_US 33333
+#define SIM_AUDIO_FRAME_US 23220
+#define SIM_REPORT_US (60 * 1000000LL)
+
+// the a/v offset the streams start out with is averaged over this many
+// video frames, as any one of them is off by its capture jitter
+#define SIM_BASE_FRAMES 30
+
+typedef struct
+{
+  double audio_ppm;
+  int64_t jitter_us;
+  int64_t duration_us;
+  int reorder_depth;
+} SimOptions;
+
+typedef struct
+{
+  // where the video lands relative to the audio, compared with the start
+  int base_frames;
+  double base_av_us;
+  double av_error_us;
+  double max_av_error_us;
+
+  // frame to frame irregularity of the muxed video timestamps
+  int64_t last_video_out;
+  double delta_error_sum;
+  int64_t deltas;
+} SimStats;
+
+void _usage() {
+  fprintf(stderr, "usage: ffmpbr_tssim [-p audio_ppm] [-j jitter_ms] [-d minutes]\n"
+    "                    [-b reorder_depth]\n");
+  exit(1);
+}
+
+// deterministic, so that runs can be compared
+uint32_t _rand(uint32_t *state) {
+  *state = *state * 1664525 + 1013904223;
+  return *state >> 8;
+}
+
+int64_t _rand_range(uint32_t *state, int64_t lo, int64_t hi) {
+  return lo + (int64_t)(_rand(state) % (uint32_t)(hi - lo + 1));
+}
+
+// the encoders' output delay, with the occasional stall that then arrives
+// in a burst
+int64_t _encoder_delay(uint32_t *state, int64_t lo, int64_t hi) {
+  if (_rand(state) % 200 == 0) return hi + 150000;
+  return _rand_range(state, lo, hi);
+}
+
+void _print_stats(SimStats *stats, FFmpegBridgeTimestamps *ts, int64_t now_us) {
+  FFmpegBridgeTimestampStats ts_stats;
+
+  ffmpbr_timestamps_get_stats(ts, &ts_stats);
+  printf("%6.1f min  drift %6lld us  correction %6lld us  a/v error %6.0f us (max %6.0f)"
+    "  jitter %5lld us\n", now_us / 60e6,
+    (long long)ts_stats.drift_us, (long long)ts_stats.correction_us,
+    stats->av_error_us, stats->max_av_error_us, (long long)ts_stats.video_jitter_us);
+}
+
+void _simulate(SimOptions *opts, int normalize, SimStats *stats, FFmpegBridgeTimestamps *ts) {
+  FFmpegBridgeDtsGenerator dts;
+  uint32_t seed = 1;
+  double audio_rate = 1.0 + opts->audio_ppm / 1e6;
+  int64_t video_real_us = 0, audio_real_us = 0, audio_frames = 0, next_report_us = SIM_REPORT_US;
+  int64_t video_arrival_us = 0, audio_arrival_us = 0, real_us, pts, out, arrival_us;
+  int is_video;
+
+  memset(stats, 0, sizeof(SimStats));
+  ffmpbr_dts_init(&dts, opts->reorder_depth, SIM_VIDEO_FRAME_US);
+  ffmpbr_timestamps_init(ts, opts->reorder_depth == 0, SIM_VIDEO_FRAME_US,
+    opts->reorder_depth * SIM_VIDEO_FRAME_US);
+
+  // both device clocks start out reading the same (boot time based) value
+  while (video_real_us < opts->duration_us) {
+    is_video = video_real_us <= audio_real_us;
+
+    if (is_video) {
+      real_us = video_real_us;
+      pts = 5000000000LL + real_us + _rand_range(&seed, -opts->jitter_us, opts->jitter_us);
+      arrival_us = real_us + _encoder_delay(&seed, 30000, 60000);
+
+      // (encoders hand packets back in order)
+      if (arrival_us < video_arrival_us) arrival_us = video_arrival_us;
+      video_arrival_us = arrival_us;
+      video_real_us += SIM_VIDEO_FRAME_US;
+    } else {
+      // audio pts count samples, so they run at the audio clock's rate
+      real_us = audio_real_us;
+      pts = 5000000000LL + audio_frames * SIM_AUDIO_FRAME_US;
+      arrival_us = real_us + _encoder_delay(&seed, 5000, 25000);
+      if (arrival_us < audio_arrival_us) arrival_us = audio_arrival_us;
+      audio_arrival_us = arrival_us;
+      audio_frames++;
+      audio_real_us = llround(audio_frames * SIM_AUDIO_FRAME_US / audio_rate);
+    }
+
+    out = normalize ? ffmpbr_timestamps_next(ts, is_video ? FFMPBR_TS_VIDEO : FFMPBR_TS_AUDIO,
+      pts, arrival_us) : pts;
+    if (!is_video) continue;
+
+    ffmpbr_dts_next(&dts, out);
+
+    // players slave the video to the audio, which reaches real time
+    // real_us at audio pts real_us * audio_rate
+    if (stats->base_frames < SIM_BASE_FRAMES) {
+      stats->base_frames++;
+      stats->base_av_us += (out - real_us * audio_rate - stats->base_av_us) / stats->base_frames;
+    }
+    stats->av_error_us = out - real_us * audio_rate - stats->base_av_us;
+    if (fabs(stats->av_error_us) > stats->max_av_error_us) {
+      stats->max_av_error_us = fabs(stats->av_error_us);
+    }
+
+    if (stats->last_video_out) {
+      stats->delta_error_sum += llabs(out - stats->last_video_out - SIM_VIDEO_FRAME_US);
+      stats->deltas++;
+    }
+    stats->last_video_out = out;
+
+    if (normalize && real_us >= next_report_us) {
+      _print_stats(stats, ts, real_us);
+      next_report_us += SIM_REPORT_US;
+    }
+  }
+}
+
+
+int main(int argc, char **argv) {
+  FFmpegBridgeTimestamps ts;
+  FFmpegBridgeTimestampStats ts_stats;
+  SimOptions opts;
+  SimStats raw, normalized;
+  int c;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.audio_ppm = 100;
+  opts.jitter_us = 8000;
+  opts.duration_us = 30 * SIM_REPORT_US;
+
+  while ((c = getopt(argc, argv, "p:j:d:b:")) != -1) {
+    switch (c) {
+    case 'p': opts.audio_ppm = atof(optarg); break;
+    case 'j': opts.jitter_us = atoi(optarg) * 1000LL; break;
+    case 'd': opts.duration_us = atoi(optarg) * SIM_REPORT_US; break;
+    case 'b': opts.reorder_depth = atoi(optarg); break;
+    default: _usage();
+    }
+  }
+  if (optind != argc || opts.duration_us <= 0 ||
+    opts.reorder_depth < 0 || opts.reorder_depth > FFMPBR_MAX_REORDER_DEPTH) _usage();
+  if (opts.reorder_depth) {
+    // reordered pts aren't evenly spaced, so only report on the drift
+    opts.jitter_us = 0;
+  }
+
+  _simulate(&opts, 0, &raw, &ts);
+  _simulate(&opts, 1, &normalized, &ts);
+  ffmpbr_timestamps_get_stats(&ts, &ts_stats);
+
+  printf("\n");
+  printf("                 a/v error (final / max)    frame delta error (avg)\n");
+  printf("device pts:      %7.0f / %7.0f us        %7.0f us\n",
+    raw.av_error_us, raw.max_av_error_us, raw.delta_error_sum / (raw.deltas ? raw.deltas : 1));
+  printf("normalized:      %7.0f / %7.0f us        %7.0f us\n",
+    normalized.av_error_us, normalized.max_av_error_us,
+    normalized.delta_error_sum / (normalized.deltas ? normalized.deltas : 1));
+  printf("%lld monotonic fixes, %lld resyncs\n",
+    (long long)ts_stats.monotonic_fixes, (long long)ts_stats.resyncs);
+  return 0;
+}